@@ -0,0 +1,37 @@
+#ifndef CHANGES_H
+#define CHANGES_H
+
+/*
+ * A sparse view of a tree: the paths of some entries below the root, as a
+ * tree of their components, and what is to be sent for each of them.  It is
+ * written out as the records of the root directory that lead to these
+ * entries only, for the change sets of --watch, for --files-from and for
+ * the shards of --shard.
+ */
+
+#define CHANGE_ENTRY   1 // the entry is sent as it is now, or removed if it no longer exists
+#define CHANGE_REPLACE 2 // the receiver removes whatever it has at that path first
+#define CHANGE_TREE    4 // a directory is sent with all its contents
+#define CHANGE_WRITABLE 8 // a directory that only leads to entries is sent writable by its owner
+
+/*
+ * Nodes without CHANGE_ENTRY only lead to entries below them.
+ */
+struct change_node {
+    char *name;
+    int flags;                      // CHANGE_* bits
+    struct change_node *children;
+    struct change_node *next;
+};
+
+struct transplant_ctx;
+
+struct change_node *change_walk(struct change_node *node, char *rel, int length, int create);
+int change_mark(struct change_node *root, char *rel, int flags);
+struct change_node *change_detach(struct change_node *root, char *rel);
+int change_attach(struct change_node *root, char *rel, struct change_node *node);
+void change_free(struct change_node *node);
+int change_emit(struct transplant_ctx *ctx, struct change_node *root, int depth);
+int serialize_file_list(struct transplant_ctx *ctx);
+
+#endif /* CHANGES_H */
@@ -0,0 +1,35 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Chunked encoding of file contents (opt-in with --chunk-size).
+ *
+ * Instead of one FILE_DATA record whose size is taken from stat() before the
+ * file is read, the contents are sent as a sequence of FILE_CHUNK records
+ * followed by one FILE_END record:
+ *
+ *   FILE_CHUNK (type 7): header, 8-byte offset of the data in the file,
+ *                        4-byte CRC-32 of the data, then the data
+ *   FILE_END   (type 8): header, 8-byte final length of the file
+ *
+ * The file is read until end of file, so a file that grows or shrinks while
+ * it is read (a live log, say) is captured as it was at that moment instead
+ * of failing.  Every chunk is self-describing: it is checked on its own and
+ * written at its offset with pwrite(), so chunks need not arrive in order.
+ */
+
+#define FILE_CHUNK_TYPE 7
+#define FILE_END_TYPE 8
+#define CHUNK_HEADER_SIZE (16 + 8 + 4)
+#define CHUNK_MAX_SIZE (64 * 1024 * 1024)
+
+struct transplant_ctx;
+
+uint32_t chunk_crc32(uint32_t crc, const char *data, size_t length);
+int serialize_file_chunks(struct transplant_ctx *ctx, int depth);
+int deserialize_file_chunks(struct transplant_ctx *ctx, int depth, int type, int permissions);
+
+#endif /* CHUNK_H */
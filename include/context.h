@@ -0,0 +1,165 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "transplant.h"
+#include "filter.h"
+#include "metadata.h"
+
+struct signature_set;
+struct fanout;
+struct journal;
+struct shard;
+struct change_node;
+struct salvage_input;
+
+/*
+ * The state of one transfer.  This is the internal definition behind the
+ * opaque struct transplant_ctx of transplant.h; the global variables declared
+ * in global.h are the storage of one particular context, see global_context().
+ */
+
+/* Size of the buffers between the record parser/writer and the source/sink. */
+#define IO_BUF_SIZE (64 * 1024)
+
+/* Size of data_buf, used to move file contents in blocks rather than a byte at a time. */
+#define DATA_BUF_SIZE (128 * 1024)
+
+struct transplant_ctx {
+    int options;                // TRANSPLANT_* bits
+
+    /*
+     * Pathname of the current file or directory (PATH_MAX bytes) and its length,
+     * not including the terminating null byte.
+     */
+    char *path_buf;
+    int path_length;
+    char *name_buf;             // pathname component read from the input (NAME_MAX bytes)
+    char *link_buf;             // target of the current symbolic link (PATH_MAX bytes)
+    char *data_buf;             // file contents in transit (DATA_BUF_SIZE bytes)
+    int owns_buffers;           // the four buffers above were allocated by transplant_new()
+
+    transplant_read_fn read;    // source of serialized data
+    void *read_arg;
+    transplant_write_fn write;  // sink for serialized data
+    void *write_arg;
+
+    char *in_buf;               // bytes read from the source and not consumed yet
+    char *in_storage;           // IO_BUF_SIZE bytes; in_buf points elsewhere only for a memory source
+    size_t in_pos;
+    size_t in_len;
+    uint64_t in_base;           // offset in the serialized data of the first byte of in_buf
+    char *out_buf;              // bytes written by the serializer and not yet given to the sink
+    size_t out_len;
+
+    int scan_threads;           // worker threads for the scan phase of serialization
+    uint64_t direct_io_min_size;// files at least this large use O_DIRECT (0: never)
+    char *direct_buf;           // aligned buffer for O_DIRECT, allocated on first use
+    struct filter_set filters;  // --exclude/--include rules
+    size_t pipeline_mem;        // memory for the buffers of the I/O thread (0: no pipelining)
+    char *copy_target;          // destination directory of copy mode (-s -d), set by validargs
+    size_t chunk_size;          // file contents are sent as chunks of this size (0: one FILE_DATA record)
+    char *chunk_buf;            // chunk_size bytes, allocated on first use
+    char *compare_buf;          // DATA_BUF_SIZE bytes for --verify, allocated on first use
+    struct signature_set *signatures; // old tree to send deltas against (--delta), or NULL
+    int root_length;            // length of the root of the tree in path_buf, during serialize
+    int watch_debounce_ms;      // --watch: quiet time before a change set is written
+    char *files_from;           // serialize only the entries listed in this file (NULL: the whole tree)
+    struct fanout *fanout;      // more directories to deserialize into (NULL: only path_buf)
+    struct entry_times entry_times; // from the TIMES record before the current DIRECTORY_ENTRY
+    int entry_has_times;
+    struct dir_metadata *dir_metadata; // by depth, for the directories being restored
+    int dir_metadata_count;
+    int durability;             // TRANSPLANT_DURABILITY_*
+    char *temp_path;            // name the current file is written under, if not path_buf (PATH_MAX bytes)
+    int temp_open;              // whether the current file is written under temp_path
+    unsigned temp_count;        // files written under a temporary name so far, to make the names unique
+    struct journal *journal;    // checkpoint journal of deserialization (NULL: none)
+    struct shard *shards;       // outputs of sharded serialization (NULL: the sink only)
+    struct change_node *selection; // serialize only the entries marked in this tree (NULL: the whole tree)
+    char *shm_path;             // socket to exchange a shared-memory ring on (NULL: the source or sink)
+    size_t shm_size;            // size of that ring, when deserializing
+    int wire_version;           // WIRE_V1 or WIRE_V2, of the transmission being written or read (see wire.h)
+    int wire_depth;             // version 2: depth of the last record header
+    uint64_t record_size;       // version 2: size of the record whose header was read last
+    char *wire_names;           // version 2: by depth, the previous entry name of each directory (NAME_MAX bytes each)
+    int wire_names_count;
+    uint64_t salvage_mark;      // --salvage: offset just after the last record parsed, where a scan starts
+    uint64_t salvage_skipped;   // --salvage: bytes of input skipped so far
+    unsigned salvage_regions;   // --salvage: damaged regions of input gone past so far
+    unsigned salvage_damaged;   // --salvage: entries whose contents ran into the next record, left damaged
+    struct salvage_input *salvage_input; // --salvage from a source that cannot seek: keeps what was read since salvage_mark
+};
+
+int tp_ctx_init(struct transplant_ctx *ctx, char *path_storage, char *name_storage,
+                char *link_storage, char *data_storage);
+void tp_ctx_destroy(struct transplant_ctx *ctx);
+struct transplant_ctx *global_context();
+
+int tp_fill(struct transplant_ctx *ctx);
+int tp_read(struct transplant_ctx *ctx, char *buf, size_t count);
+int tp_skip(struct transplant_ctx *ctx, uint64_t count);
+int tp_flush(struct transplant_ctx *ctx);
+int tp_write(struct transplant_ctx *ctx, char *buf, size_t count);
+
+/*
+ * Copy count bytes; the compiler builtin is used because <string.h> is off limits.
+ */
+#define tp_copy(dest, src, count) __builtin_memcpy((dest), (src), (count))
+
+/*
+ * @brief  The offset in the serialized data of the next byte to be read.
+ */
+static inline uint64_t tp_offset(struct transplant_ctx *ctx) {
+    return ctx->in_base + ctx->in_pos;
+}
+
+/*
+ * @brief  Read one byte of serialized data.
+ * @return The byte, as an unsigned char converted to int, or EOF at end of input
+ * or on error.
+ */
+static inline int tp_getc(struct transplant_ctx *ctx) {
+    if (ctx->in_pos < ctx->in_len) {
+        return (unsigned char)*(ctx->in_buf + ctx->in_pos++);
+    }
+    return tp_fill(ctx);
+}
+
+/*
+ * @brief  Write one byte of serialized data.
+ * @return The byte written, or EOF on error.
+ */
+static inline int tp_putc(struct transplant_ctx *ctx, int c) {
+    if (ctx->out_len == IO_BUF_SIZE && tp_flush(ctx) == -1) {
+        return EOF;
+    }
+    *(ctx->out_buf + ctx->out_len++) = c;
+    return (unsigned char)c;
+}
+
+int len_string(char *str);
+int arg_equals(char *arg, char *flag);
+
+int tp_path_init(struct transplant_ctx *ctx, char *name);
+int tp_path_push(struct transplant_ctx *ctx, char *name);
+int tp_path_pop(struct transplant_ctx *ctx);
+int tp_serialize(struct transplant_ctx *ctx);
+int tp_deserialize(struct transplant_ctx *ctx);
+int tp_serialize_directory(struct transplant_ctx *ctx, int depth);
+int tp_serialize_file(struct transplant_ctx *ctx, int depth, off_t size);
+int tp_serialize_symlink(struct transplant_ctx *ctx, int depth, off_t size);
+int tp_deserialize_directory(struct transplant_ctx *ctx, int depth);
+int tp_deserialize_file(struct transplant_ctx *ctx, int depth);
+int tp_deserialize_symlink(struct transplant_ctx *ctx, int depth);
+int tp_write_record_header(struct transplant_ctx *ctx, unsigned char type, int depth, uint64_t size);
+int tp_write_directory_entry(struct transplant_ctx *ctx, int depth, char *name, struct stat *stat_buf);
+int tp_create_file(struct transplant_ctx *ctx, int permissions);
+int tp_copy_file_data(int in, int out, uint64_t size, char *buf, char *name);
+int debug_getchar(struct transplant_ctx *ctx);
+int check_while_condition(struct transplant_ctx *ctx, int depth);
+
+#endif /* CONTEXT_H */
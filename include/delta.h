@@ -0,0 +1,76 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Delta transfer against a previous version of the tree, in the manner of rsync.
+ *
+ * The receiver describes what it already has with a signature, made by
+ * serializing the old tree with --signature: it is an ordinary serialized
+ * stream in which the contents of each file are replaced by one SIGNATURE
+ * record (type 9) holding, for every block of the file, a rolling weak
+ * checksum and a strong 128-bit hash:
+ *
+ *   SIGNATURE (type 9): header, 4-byte block size, 8-byte file size, then
+ *                       per block a 4-byte weak checksum and a 16-byte hash
+ *
+ * Serializing the new tree with --delta SIGNATURE then sends every file that
+ * has a signature at the same relative path as a sequence of
+ *
+ *   DELTA_COPY    (type 10): header, 8-byte offset, 8-byte length of a range
+ *                            of the old file to copy
+ *   DELTA_LITERAL (type 11): header, then bytes that are not in the old file
+ *
+ * terminated by a FILE_END record (type 8, see chunk.h).  Deserializing with
+ * -c over a copy of the old tree rebuilds each such file from the old file and
+ * the literals, in a temporary file that then replaces it.
+ */
+
+#define SIGNATURE_TYPE 9
+#define DELTA_COPY_TYPE 10
+#define DELTA_LITERAL_TYPE 11
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_LITERAL_MAX (1024 * 1024) // longest run of literal data in one record
+
+struct transplant_ctx;
+
+struct block_sig {
+    uint32_t weak;
+    uint64_t strong1;
+    uint64_t strong2;
+};
+
+/*
+ * Signature of one file of the old tree.
+ */
+struct file_sig {
+    struct file_sig *next;     // next file in the same hash bucket
+    char *path;                // relative to the root of the tree
+    uint32_t block_size;
+    uint64_t file_size;
+    uint64_t count;            // number of blocks, the last one possibly short
+    struct block_sig *blocks;
+};
+
+/*
+ * The signatures of a whole tree, looked up by relative path.
+ */
+struct signature_set {
+    struct file_sig **buckets;
+    size_t bucket_count;
+    size_t file_count;
+};
+
+uint32_t delta_block_size(uint64_t file_size);
+int serialize_file_signature(struct transplant_ctx *ctx, int depth, uint64_t size);
+int serialize_file_delta(struct transplant_ctx *ctx, int depth, struct file_sig *sig, uint64_t size);
+int deserialize_file_delta(struct transplant_ctx *ctx, int depth, int type, int permissions);
+struct signature_set *signature_load(char *path);
+struct file_sig *signature_find(struct signature_set *set, char *path);
+void signature_free(struct signature_set *set);
+
+#endif /* DELTA_H */
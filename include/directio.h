@@ -0,0 +1,23 @@
+#ifndef DIRECTIO_H
+#define DIRECTIO_H
+
+#include <stdint.h>
+
+/*
+ * Direct I/O for very large files.
+ *
+ * Files of at least the direct_io_min_size of the context are read (serialization) or
+ * written (deserialization) with O_DIRECT, bypassing the page cache, through
+ * a buffer aligned to DIRECT_IO_ALIGN that is allocated once per context.
+ * The serialized stream is the same whether or not direct I/O is used.
+ */
+
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_BUF_SIZE (4 * 1024 * 1024)
+
+struct transplant_ctx;
+
+int serialize_file_direct(struct transplant_ctx *ctx, uint64_t size);
+int deserialize_file_direct(struct transplant_ctx *ctx, int fd, uint64_t size);
+
+#endif /* DIRECTIO_H */
@@ -0,0 +1,39 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+/*
+ * How restored files are made to survive a crash (--durability).
+ *
+ *   none      files are closed and left to the kernel to write back, as ever
+ *   batched   the filesystem is synced once with syncfs() at the
+ *             END_OF_DIRECTORY of the root, i.e. once per transmission, and
+ *             writeback of a large file is started window by window while it
+ *             is written, without waiting for it
+ *   per-file  every file is written under a temporary name in its directory,
+ *             fsync()ed and renamed into place, and every directory is
+ *             fsync()ed at its END_OF_DIRECTORY: a file is either complete or
+ *             absent.
+ *
+ * Batched mode costs about what a sync(1) after a restore in mode none does:
+ * small files are left for syncfs() to write back together, as starting
+ * writeback of each one as it was closed made restores of many small files
+ * slower.  tests/bench_durability.sh compares the three modes.
+ *
+ * Replicas (-p DIR -p DIR) are made durable in the same way by their threads.
+ *
+ * Whatever the mode, a file sent as a delta is rebuilt under a temporary
+ * name (durability_temp_path()) and renamed over its old version.
+ */
+
+struct transplant_ctx;
+
+int durability_parse(char *name);
+char *durability_temp_path(struct transplant_ctx *ctx);
+char *durability_temp_name(struct transplant_ctx *ctx, char *path);
+char *durability_create_path(struct transplant_ctx *ctx);
+int durability_close_path(struct transplant_ctx *ctx, int fd, char *temp, char *path);
+int durability_close(struct transplant_ctx *ctx, int fd);
+void durability_abandon(struct transplant_ctx *ctx, int fd);
+int durability_directory(struct transplant_ctx *ctx, int root);
+
+#endif /* DURABILITY_H */
@@ -0,0 +1,62 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Deserializing into several target directories (-d -p DIR -p DIR ...).
+ *
+ * The stream is parsed once and restored into the first target as usual.
+ * Every entry completed there is queued for each other target, the replicas,
+ * and each replica has a thread of its own that recreates the entries in
+ * order: a file is cloned from the copy just written in the first target
+ * (FICLONE shares the blocks where the filesystem allows, copy_file_range()
+ * copies inside the kernel otherwise), so a replica costs no parsing and on
+ * a copy-on-write filesystem almost no I/O.  The queues are drained at the
+ * end of every transmission, before the first target can change again.
+ */
+
+#define FANOUT_QUEUE_MAX 4096 // jobs waiting per replica before the parser waits
+
+struct fanout_job;
+
+struct replica {
+    char *root;                    // target directory
+    pthread_t thread;
+    struct transplant_ctx *ctx;    // buffers of the thread; its path_buf names the entry of a job
+    struct fanout_job *head;       // jobs not started yet, oldest first
+    struct fanout_job *tail;
+    int queued;                    // jobs queued and not finished
+    int failed;                    // a job failed: the remaining ones are dropped
+    pthread_cond_t changed;        // signalled when jobs are queued or finished
+    struct replica *next;
+};
+
+struct fanout {
+    struct replica *replicas;      // in the order of the -p flags
+    char *source_root;             // the first target, from which files are cloned
+    int root_length;               // length of the first target in path_buf
+    int running;                   // threads started by fanout_start()
+    int stopping;
+    pthread_mutex_t lock;          // protects the queues of all the replicas
+};
+
+struct transplant_ctx;
+struct entry_times;
+
+int fanout_add(struct transplant_ctx *ctx, char *root);
+void fanout_clear(struct transplant_ctx *ctx);
+int fanout_start(struct transplant_ctx *ctx);
+int fanout_sync(struct transplant_ctx *ctx);
+int fanout_stop(struct transplant_ctx *ctx);
+
+int fanout_directory(struct transplant_ctx *ctx);
+int fanout_file(struct transplant_ctx *ctx, mode_t mode);
+int fanout_symlink(struct transplant_ctx *ctx);
+int fanout_remove(struct transplant_ctx *ctx);
+int fanout_rename(struct transplant_ctx *ctx, char *from, char *to);
+int fanout_metadata(struct transplant_ctx *ctx, int permissions, struct entry_times *times);
+int fanout_durability(struct transplant_ctx *ctx, int root);
+
+#endif /* FANOUT_H */
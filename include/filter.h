@@ -0,0 +1,31 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/*
+ * Include/exclude rules for serialization.
+ *
+ * Each rule is a shell-style glob (`*`, `?`, bracketed character classes and
+ * backslash escapes) that is compiled once, when it is added, into a small
+ * bit-parallel automaton together with a literal prefilter.  Rules are matched
+ * against a single path component (the d_name of a directory entry) in the
+ * order they were given on the command line, and the first rule that matches
+ * decides whether the entry is kept.  Entries that match no rule are kept.
+ */
+
+struct filter_rule;
+
+/*
+ * An ordered list of compiled rules.  A zero-initialized filter_set is empty.
+ */
+struct filter_set {
+    struct filter_rule *head;
+    struct filter_rule *tail;
+    int count;
+};
+
+int filter_add(struct filter_set *set, char *pattern, int include);
+int filter_excluded(struct filter_set *set, char *name);
+int filter_count(struct filter_set *set);
+void filter_clear(struct filter_set *set);
+
+#endif /* FILTER_H */
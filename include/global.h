@@ -16,20 +16,112 @@
 
 #define USAGE(program_name, retcode) do { \
 fprintf(stderr, "USAGE: %s %s\n", program_name, \
-"[-h] -s|-d [-c] [-p DIR]\n" \
+"[-h] -s|-d|-s -d [-c] [-p DIR] [-j N] [--exclude PATTERN] [--include PATTERN]\n" \
+"       [--chunk-size SIZE] [--signature | --delta SIGFILE] [--files-from LIST] [--times]\n" \
+"       [--shard FILE --shard FILE ...] [--metadata-first] [--format VERSION]\n" \
+"       [--drop-cache] [--skip-unchanged [--verify]] [--durability MODE] [--salvage]\n" \
+"       [--journal FILE [--journal-interval MS]]\n" \
+"       [--shm SOCKET [--shm-size SIZE]]\n" \
+"       [--pipeline] [--pipeline-mem SIZE] [--direct-io SIZE] [--watch [--debounce MS]]\n" \
 "   -h       Help: displays this help menu.\n" \
 "   -s       Serialize: traverse tree of files, output serialized data.\n" \
 "   -d       Deserialize: read serialized data, reconstruct tree of files.\n" \
-"            Optional additional parameter for both -s and -d:\n" \
+"   -s -d    Copy: reconstruct the tree of files of the first -p DIR under the\n" \
+"            second -p DIR, without serializing it.  File data is shared with\n" \
+"            a reflink or copied in the kernel when the filesystems allow it.\n" \
+"            Of the parameters below, only -p, -c, --exclude and --include\n" \
+"            apply.\n" \
+"            Optional additional parameters for both -s and -d:\n" \
 "               -p DIR       DIR is a pathname that specifies the source directory\n" \
 "                            for serialization or the target directory for deserialization.\n" \
 "                            If this parameter is not present, the pathname `.`\n" \
 "                            (referring to the current working directory) is assumed.\n" \
+"               --direct-io SIZE  Read or write files of at least SIZE bytes (suffix K, M\n" \
+"                            or G allowed) with O_DIRECT, bypassing the page cache.\n" \
+"               --pipeline   Write the output (-s) or read the input (-d) on a\n" \
+"                            separate thread, so that slow serialized I/O and a slow\n" \
+"                            disk overlap instead of taking turns.\n" \
+"               --pipeline-mem SIZE  Like --pipeline, with at most SIZE bytes of\n" \
+"                            buffers between the two threads (default 8M).\n" \
+"               --shm SOCKET  Exchange the serialized data with the other side\n" \
+"                            through a ring in shared memory instead of stdout and\n" \
+"                            stdin: -d listens on the Unix socket SOCKET and hands\n" \
+"                            the ring to the -s that connects to it.\n" \
+"               --watch      With -s, keep running after the tree is sent and send\n" \
+"                            what changes in it (created, modified, removed and\n" \
+"                            renamed entries) as further transmissions, until\n" \
+"                            interrupted.  With -d, keep applying them.\n" \
+"            Optional additional parameter for -s:\n" \
+"               -j N         Scan the tree with N work-stealing threads before writing\n" \
+"                            it out.  The output is the same as with a single thread.\n" \
+"               --chunk-size SIZE  Send file contents as checksummed chunks of at\n" \
+"                            most SIZE bytes (up to 64M), reading each file to its\n" \
+"                            end, so files that grow while being read are captured.\n" \
+"               --signature  Output block checksums of every file instead of its\n" \
+"                            contents: the signature of the tree, for --delta.\n" \
+"               --delta SIGFILE  Send each file that has a signature in SIGFILE as\n" \
+"                            the changes from that old version only.  Deserialize\n" \
+"                            with -c over the old tree to apply them.\n" \
+"               --times      Also send the access and modification times of every\n" \
+"                            entry; -d restores them.\n" \
+"               --files-from LIST  Send only the entries whose pathnames, relative to\n" \
+"                            DIR and each followed by a null byte, are in the file\n" \
+"                            LIST, without walking the rest of the tree.  Listed\n" \
+"                            directories are sent whole; listed entries that do not\n" \
+"                            exist are removed by -d -c (-d alone refuses to).\n" \
+"               --shard FILE  May be repeated: split the tree by subtree and size\n" \
+"                            into one transmission per FILE (/dev/fd/N for an open\n" \
+"                            descriptor), all written at once and nothing to stdout.\n" \
+"                            The shards can be restored concurrently into the same\n" \
+"                            DIR with -d -c.\n" \
+"               --metadata-first  Send every directory and entry with its size\n" \
+"                            first and the contents of the files after them, so\n" \
+"                            that -d creates and preallocates the whole tree while\n" \
+"                            the contents arrive, and stops early if it cannot.\n" \
+"               --format VERSION  1 (the default) or 2: a compact version of the\n" \
+"                            format, with the headers of records encoded as varints and\n" \
+"                            names sharing their prefix with the previous entry, for\n" \
+"                            trees of many small files.  -d reads either version.\n" \
+"               --debounce MS  With --watch, send changes once the tree has been\n" \
+"                            quiet for MS milliseconds (default 100).\n" \
+"            Optional additional parameters for -s (may be repeated):\n" \
+"               --exclude PATTERN  Skip entries whose name matches the glob PATTERN\n" \
+"                            (`*', `?', `[...]').  Excluded directories are never opened.\n" \
+"               --include PATTERN  Keep entries whose name matches PATTERN.  Rules are\n" \
+"                            tried in the order given and the first match decides;\n" \
+"                            entries matching no rule are kept.\n" \
 "            Optional additional parameter for -d:\n" \
+"               -p DIR       May be repeated: the input is parsed once and the tree\n" \
+"                            is restored into every DIR, the second and later ones\n" \
+"                            cloned from the first on threads of their own.\n" \
 "               -c           ``clobber'': the program will overwrite existing files,\n" \
 "                            rather than terminating with an error, and it will ignore\n" \
 "                            errors that result when attempts is made to create directories\n" \
-"                            that already exist.\n"); \
+"                            that already exist.\n" \
+"               --drop-cache Write restored data back and drop it from the page cache\n" \
+"                            as the restore proceeds, so that large restores do not\n" \
+"                            evict the working set of other programs.\n" \
+"               --skip-unchanged  With -c, leave an existing file as it is when\n" \
+"                            it has the size and (with -s --times) the modification\n" \
+"                            time of the one in the input, instead of rewriting it.\n" \
+"               --verify     With --skip-unchanged, compare the contents of such\n" \
+"                            files and rewrite only the ones that differ.\n" \
+"               --durability MODE  How restored files are made to survive a crash:\n" \
+"                            none (default) leaves them to the kernel, batched syncs\n" \
+"                            the filesystem once at the end, per-file syncs each one\n" \
+"                            under a temporary name and renames it into place.\n" \
+"               --salvage    Go on past the parts of a damaged input (version 1 of\n" \
+"                            the format) from the next intact record, reporting\n" \
+"                            each part skipped, instead of stopping at the first.\n" \
+"               --journal FILE  Every few seconds, sync what has been restored\n" \
+"                            and record how far the input has been read in FILE.\n" \
+"                            If the restore does not finish, running it again with\n" \
+"                            the same FILE and input continues from there (the\n" \
+"                            input is seeked, or read up to there from a pipe).\n" \
+"                            FILE is removed once the restore succeeds.\n" \
+"               --journal-interval MS  Time between two records in the journal\n" \
+"                            (default 5000).\n" \
+"               --shm-size SIZE  With --shm, size of the ring (default 64M).\n"); \
 exit(retcode); \
 } while(0)
 
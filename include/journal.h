@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Checkpoint journal of a restore (-d --journal FILE).
+ *
+ * Every few seconds (--journal-interval), between two entries of a directory, what
+ * has been restored so far is synced to disk and a checkpoint is appended to
+ * the journal, which is then fdatasync()ed:
+ *
+ *   magic 0C 0D ED 4A, input size (8 bytes, 0 if unknown), offset in the
+ *   serialized data (8), depth (4), length of the current directory relative
+ *   to the root (4) and the directory, then for each depth from 0 to depth
+ *   the metadata deferred for the directory (permissions (4), has times (1),
+ *   atime and mtime as 8 bytes of seconds and 4 of nanoseconds), and an
+ *   FNV-1a hash of all the above (8)
+ *
+ * A restore started with the journal of one that died moves to the last
+ * complete checkpoint: it seeks a file, and reads and drops the data before
+ * the checkpoint from a pipe, so that the sender simply starts over.  It
+ * then reloads the directory stack and continues with clobbering, since the
+ * entries after the checkpoint may exist already.  The journal is removed
+ * when the restore succeeds.
+ */
+
+#define JOURNAL_INTERVAL_MS 5000 // default time between two checkpoints
+
+struct journal {
+    char *path;
+    int fd;
+    uint64_t input_size;       // of the input, if it is a file (0 otherwise)
+    int root_length;           // length of the target directory in path_buf
+    int root_fd;               // the target directory, for syncfs()
+    int interval_ms;           // minimum time between two checkpoints
+    struct timespec last;      // when the last checkpoint was written
+};
+
+struct transplant_ctx;
+
+int journal_resume(struct transplant_ctx *ctx);
+int journal_checkpoint(struct transplant_ctx *ctx, int depth);
+int journal_finish(struct transplant_ctx *ctx, int ret);
+void journal_free(struct transplant_ctx *ctx);
+
+#endif /* JOURNAL_H */
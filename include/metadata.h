@@ -0,0 +1,53 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * Metadata of restored entries.
+ *
+ * With --times, serialize precedes every DIRECTORY_ENTRY with a record of
+ * the access and modification times of the entry:
+ *
+ *   TIMES (type 14): header, then the access time and the modification time,
+ *                    each as 8 bytes of seconds and 4 bytes of nanoseconds
+ *
+ * Deserialize gives a file its permissions as it creates it and its times
+ * through the descriptor it wrote it with.  A directory is only given its
+ * permissions and times at its END_OF_DIRECTORY, once everything in it has
+ * been written: a read-only directory can then be restored, and creating its
+ * entries does not change its modification time afterwards.
+ */
+
+#define TIMES_TYPE 14
+#define TIMES_RECORD_SIZE (16 + 24)
+
+/*
+ * Access and modification times, in the order utimensat() and futimens() take them.
+ */
+struct entry_times {
+    struct timespec atime;
+    struct timespec mtime;
+};
+
+/*
+ * What is applied to a directory at its END_OF_DIRECTORY.
+ */
+struct dir_metadata {
+    int permissions;            // to be set with chmod(), -1 if mkdir() already gave the right ones
+    int has_times;
+    struct entry_times times;
+};
+
+struct transplant_ctx;
+struct stat;
+
+mode_t metadata_creation_mask();
+int metadata_write_times(struct transplant_ctx *ctx, int depth, struct stat *stat_buf);
+int deserialize_times(struct transplant_ctx *ctx, int depth);
+struct dir_metadata *metadata_slot(struct transplant_ctx *ctx, int depth);
+int metadata_defer_directory(struct transplant_ctx *ctx, int depth, mode_t mode, int existed, struct entry_times *times);
+int metadata_finish_directory(struct transplant_ctx *ctx, int depth);
+
+#endif /* METADATA_H */
@@ -0,0 +1,46 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ring.h"
+#include "transplant.h"
+
+/*
+ * Pipelined I/O.
+ *
+ * In pipelined mode a dedicated thread talks to the source (deserialization)
+ * or the sink (serialization) of the context while the main thread parses
+ * records and writes files, or walks the tree and reads files, so that slow
+ * serialized I/O and a slow disk overlap instead of taking turns.  The two
+ * threads exchange PIPELINE_SLOT_SIZE buffers through an SPSC ring sized from
+ * the pipeline_mem setting of the context, which caps the memory used.
+ */
+
+#define PIPELINE_SLOT_SIZE (256 * 1024)
+#define PIPELINE_DEFAULT_MEM (8 * 1024 * 1024)
+
+struct transplant_ctx;
+
+struct pipeline {
+    struct spsc_ring ring;
+    pthread_t thread;
+    transplant_read_fn read;   // the source the context had before the pipeline started
+    void *read_arg;
+    struct ring_slot *current; // slot the consumer is reading from, NULL between slots
+    int done;                  // the end-of-stream slot has been consumed
+    int error;                 // the source failed, set before the end-of-stream slot is published
+
+    transplant_write_fn write; // the sink the context had before the pipeline started
+    void *write_arg;
+    struct ring_slot *filling; // slot the producer is writing to, NULL between slots
+    atomic_int write_failed;   // set by the output thread, which then only drains the ring
+};
+
+struct pipeline *pipeline_start_input(struct transplant_ctx *ctx);
+int pipeline_stop_input(struct transplant_ctx *ctx, struct pipeline *pipe);
+struct pipeline *pipeline_start_output(struct transplant_ctx *ctx);
+int pipeline_stop_output(struct transplant_ctx *ctx, struct pipeline *pipe);
+
+#endif /* PIPELINE_H */
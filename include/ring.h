@@ -0,0 +1,51 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Single-producer/single-consumer ring of large buffers.
+ *
+ * The producer fills the slot at tail and publishes it; the consumer drains
+ * the slot at head and releases it.  Each counter is only ever written by one
+ * side, so no lock is taken: a slot changes hands with an atomic store of the
+ * counter, which also orders the accesses to its contents, as in shm.c.  A
+ * side only sleeps, on a futex, when the ring is full or empty: it raises its
+ * waiting flag, checks the other counter again and sleeps while the flag is
+ * up, and the other side clears the flag and wakes it after moving its
+ * counter.
+ *
+ * A slot published with len == 0 marks the end of the stream.  A consumer
+ * that gives up early calls ring_stop() instead: a producer waiting for a
+ * free slot then gets none, rather than sleeping forever on a futex, which
+ * pthread_cancel() cannot interrupt.
+ */
+
+struct ring_slot {
+    char *data;       // slot_size bytes
+    size_t len;       // bytes of data in the slot
+    size_t pos;       // bytes already consumed, for the consumer's use
+};
+
+struct spsc_ring {
+    struct ring_slot *slots;
+    int count;
+    size_t slot_size;
+    _Atomic uint64_t head;              // slots consumed, only written by the consumer
+    _Atomic uint64_t tail;              // slots filled, only written by the producer
+    _Atomic uint32_t producer_waiting;  // futex word: the ring was full
+    _Atomic uint32_t consumer_waiting;  // futex word: the ring was empty
+    _Atomic int stop;                   // set by ring_stop(): the producer gets no more slots
+};
+
+int ring_init(struct spsc_ring *ring, int count, size_t slot_size);
+void ring_destroy(struct spsc_ring *ring);
+struct ring_slot *ring_produce_begin(struct spsc_ring *ring);
+void ring_produce_end(struct spsc_ring *ring);
+struct ring_slot *ring_consume_begin(struct spsc_ring *ring);
+void ring_consume_end(struct spsc_ring *ring);
+void ring_stop(struct spsc_ring *ring);
+
+#endif /* RING_H */
@@ -0,0 +1,54 @@
+#ifndef SALVAGE_H
+#define SALVAGE_H
+
+#include <stddef.h>
+#include <limits.h>
+
+/*
+ * Restoring what can be restored from a damaged transmission (-d --salvage).
+ *
+ * Without it, the first record that cannot be parsed or restored ends the
+ * restore.  With it, the input is scanned for the next record a restore can
+ * go on from instead: the magic bytes 0x0C 0x0D 0xED are searched 32 bytes at
+ * a time with AVX2 where the processor has it, 16 at a time with SSE2
+ * otherwise, and a byte at a time on other processors, and each occurrence
+ * is taken only if it looks like the header of one of the following records,
+ * and but for END_OF_TRANSMISSION, the magic bytes of another record follow it:
+ *
+ *   END_OF_TRANSMISSION      at depth 0, of size 16
+ *   END_OF_DIRECTORY         at a depth from 1 to the current one, of size 16
+ *   DIRECTORY_ENTRY          at such a depth, with the type bits of a file, a
+ *                            directory or a symbolic link and a name with
+ *                            neither '/' nor '\0' in it
+ *   TIMES                    at such a depth, of size TIMES_RECORD_SIZE
+ *
+ * The directories deeper than the record found are finished as if their
+ * END_OF_DIRECTORY had been read, and the restore goes on from the record.
+ *
+ * The scan starts right after the last record that was parsed, which for an
+ * entry of a file is before its contents: when those are shorter than their
+ * size says, the records they ran into are found again.  A file given as
+ * input is seeked back to there; from any other source (a pipe, --pipeline)
+ * the bytes read since the last record parsed are kept, up to
+ * SALVAGE_KEEP_MAX of them, and read again.  A memory source is all in the
+ * input buffer already.  Every region skipped is reported on stderr, and so
+ * is, at the end, how many regions were gone past, how many bytes skipped
+ * and how many entries left damaged.
+ * Version 2 of the format has no magic bytes to search for and cannot be
+ * salvaged.
+ */
+
+/* Bytes of a candidate that must be in the buffer to check it: the largest DIRECTORY_ENTRY and the next magic bytes. */
+#define SALVAGE_LOOKAHEAD (16 + 12 + NAME_MAX + 3)
+
+/* Most bytes kept from a source that cannot seek; a scan from further back starts at the oldest one kept. */
+#define SALVAGE_KEEP_MAX (64 * 1024 * 1024)
+
+struct transplant_ctx;
+
+size_t salvage_find_magic(const char *data, size_t length);
+int salvage_start_input(struct transplant_ctx *ctx);
+void salvage_stop_input(struct transplant_ctx *ctx);
+int salvage_resync(struct transplant_ctx *ctx, int depth);
+
+#endif /* SALVAGE_H */
@@ -0,0 +1,55 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "metadata.h"
+
+/*
+ * Parallel metadata scan for serialization.
+ *
+ * The scan phase walks the tree under path_buf with a pool of worker threads.
+ * Each worker owns a deque of directories still to be read: it pushes the
+ * subdirectories it discovers onto the bottom of its own deque and pops from
+ * the bottom, while idle workers steal from the top of other workers' deques.
+ * Every directory is read into an in-memory list of entries, in readdir order.
+ * The emit phase then writes the records from these lists on a single thread,
+ * in exactly the nested depth-first order produced by serialize_directory().
+ */
+
+struct scan_dir;
+
+/*
+ * One entry of a scanned directory.  Only the metadata that appears in the
+ * serialized stream is kept, so that very large trees fit in memory.
+ */
+struct scan_entry {
+    char *name;            // the d_name of the entry
+    uint32_t mode;         // st_mode as returned by lstat()
+    uint64_t size;         // st_size, or the length of the target for a link
+    struct entry_times times; // st_atim and st_mtim, for --times
+    char *link_target;     // target of a symbolic link, NULL otherwise
+    struct scan_dir *dir;  // contents of a subdirectory, NULL otherwise
+};
+
+/*
+ * The contents of one directory.
+ */
+struct scan_dir {
+    char *path;                  // pathname used to open the directory
+    struct scan_entry *entries;  // entries in readdir order
+    int count;
+    int capacity;
+    int error;                   // nonzero if the directory could not be read
+};
+
+struct transplant_ctx;
+struct stat;
+
+struct scan_dir *scan_tree(struct transplant_ctx *ctx, char *path, int threads);
+int scan_entry_add(struct scan_dir *dir, char *name, struct stat *stat_buf, uint64_t size, char *link_target);
+struct scan_dir *scan_dir_new(char *path);
+void scan_free(struct scan_dir *dir);
+int serialize_scanned_directory(struct transplant_ctx *ctx, struct scan_dir *dir, int depth);
+
+#endif /* SCAN_H */
@@ -0,0 +1,40 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+/*
+ * Sharded serialization (-s --shard FILE --shard FILE ...).
+ *
+ * The tree is scanned first and cut into units: the entries of the root, and
+ * in place of every directory heavier than half a shard, its own entries,
+ * down as far as needed.  The units are dealt out heaviest first, each to the
+ * shard with the least weight so far, and every shard is then written on a
+ * thread of its own as a complete transmission with its units and the
+ * directories that lead to them only (see changes.h).
+ *
+ * A shard can thus be deserialized by itself, and all of them at the same
+ * time into the same target with -c: a directory that leads to units of
+ * several shards is created by whichever restore gets there first.  Such a
+ * directory is sent writable by its owner, so that one restore does not make
+ * it read-only while another one still has entries to create in it.
+ */
+
+#define SHARD_ENTRY_WEIGHT 4096 // creating an entry costs about as much as sending this many bytes
+
+/*
+ * One output of sharded serialization, in the order of the --shard flags.
+ */
+struct shard {
+    char *path;             // file to write the shard to, NULL to write to fd
+    int fd;
+    struct shard *next;
+};
+
+struct transplant_ctx;
+
+int shard_add(struct transplant_ctx *ctx, char *path, int fd);
+void shard_clear(struct transplant_ctx *ctx);
+int shard_serialize(struct transplant_ctx *ctx);
+
+#endif /* SHARD_H */
@@ -0,0 +1,81 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "transplant.h"
+
+/*
+ * Shared-memory transport between a serializing and a deserializing process
+ * on the same host (-s --shm SOCKET, -d --shm SOCKET).
+ *
+ * The deserializing side creates a memfd holding a header page and a ring
+ * of --shm-size bytes, listens on the Unix socket SOCKET and hands the memfd
+ * to the serializing side, which connects to it, with SCM_RIGHTS.  The socket
+ * only needs to be reachable by both, so a volume shared by two containers
+ * will do.  Serialized data then goes through the ring instead of a pipe:
+ * each side maps the ring twice in a row, so that any run of bytes in it is
+ * contiguous and is copied in with one memcpy() and out with another, with
+ * no system call while the ring is neither full nor empty.  File contents
+ * skip even these copies: they are read from the file straight into the
+ * ring, and written to the restored file straight from it.
+ *
+ * Both byte counters only ever grow and each is written by one side.  A side
+ * that finds the ring full (or empty) raises its waiting flag and sleeps on
+ * it with a futex; the other side clears the flag and wakes it after moving
+ * its counter.  Sleeps end every SHM_WAIT_MS to check that the other process
+ * is still connected.
+ */
+
+#define SHM_MAGIC         0x0C0DED53
+#define SHM_HEADER_SIZE   4096
+#define SHM_DEFAULT_SIZE  (64 * 1024 * 1024)
+#define SHM_MAX_SIZE      (1ULL << 34)
+#define SHM_WAIT_MS       100   // longest sleep before checking on the other process
+#define SHM_CONNECT_MS    10000 // how long the serializing side waits for the socket to appear
+
+#define SHM_OPEN   0
+#define SHM_DONE   1 // everything has been written
+#define SHM_FAILED 2 // serialization failed: the data ends early
+
+/*
+ * The header page of the memfd.  The counters of the two sides are kept on
+ * cache lines of their own.
+ */
+struct shm_header {
+    uint32_t magic;
+    uint64_t capacity;                                   // bytes in the ring, a power of two
+    _Atomic uint32_t state;                              // SHM_OPEN, SHM_DONE or SHM_FAILED
+    _Alignas(64) _Atomic uint64_t tail;                  // bytes written, by the serializing side
+    _Atomic uint32_t reader_waiting;                     // futex: the reader sleeps until data arrives
+    _Alignas(64) _Atomic uint64_t head;                  // bytes read, by the deserializing side
+    _Atomic uint32_t writer_waiting;                     // futex: the writer sleeps until room is made
+};
+
+/*
+ * One end of the transport, in place of the source or sink of a context
+ * while it is used.
+ */
+struct shm_transport {
+    struct shm_header *header;
+    char *data;                    // the ring, mapped twice in a row
+    uint64_t capacity;
+    int socket;                    // connection to the other process
+    transplant_read_fn read;       // the source the context had before
+    void *read_arg;
+    transplant_write_fn write;     // the sink the context had before
+    void *write_arg;
+};
+
+struct transplant_ctx;
+
+struct shm_transport *shm_start_input(struct transplant_ctx *ctx);
+int shm_stop_input(struct transplant_ctx *ctx, struct shm_transport *shm);
+struct shm_transport *shm_start_output(struct transplant_ctx *ctx);
+int shm_stop_output(struct transplant_ctx *ctx, struct shm_transport *shm, int failed);
+char *shm_input_block(struct transplant_ctx *ctx, size_t want, size_t *got);
+void shm_input_done(struct transplant_ctx *ctx, size_t got);
+char *shm_output_block(struct transplant_ctx *ctx, size_t *room);
+void shm_output_done(struct transplant_ctx *ctx, size_t count);
+
+#endif /* SHM_H */
@@ -0,0 +1,53 @@
+#ifndef SKELETON_H
+#define SKELETON_H
+
+#include <stdint.h>
+#include "metadata.h"
+
+/*
+ * Metadata-first layout (-s --metadata-first).
+ *
+ * The tree is scanned first and the transmission then carries it in two
+ * sections instead of interleaving entries and contents:
+ *
+ *   SKELETON (type 15): header at depth 1, then the number of files and the
+ *                       number of bytes of their contents, 8 bytes each
+ *   the metadata section: START_OF_DIRECTORY ... END_OF_DIRECTORY at depth 1,
+ *                       with every DIRECTORY_ENTRY (and TIMES and SYMLINK_TARGET
+ *                       record), but no FILE_DATA after the entries of files
+ *   the data section:   one FILE_DATA record per file, in the same order, at
+ *                       the depth of its DIRECTORY_ENTRY
+ *
+ * Deserialize reads the whole metadata section first and checks at once that
+ * the target has room for the contents.  A thread of its own then creates the
+ * skeleton (every directory, every file preallocated to its size, every
+ * symbolic link) while the contents are read and written into the files it
+ * has created so far: a missing permission or a full disk stops the restore
+ * before the data that would have come first is even read.  Directories are
+ * given their permissions and times once all the contents are written.
+ */
+
+#define SKELETON_TYPE 15
+#define SKELETON_RECORD_SIZE (16 + 16)
+
+/*
+ * One entry of the skeleton, in the order of the metadata section.
+ */
+struct skeleton_entry {
+    char *path;                 // pathname of the entry in the target
+    uint32_t mode;
+    uint64_t size;              // st_size: the contents that follow for a file
+    int depth;                  // of its DIRECTORY_ENTRY
+    int has_times;
+    struct entry_times times;
+    char *link_target;          // target of a symbolic link, NULL otherwise
+    int existed;                // a directory or file that was already there (-c)
+    char *temp;                 // per-file durability: the name of a file until its contents are written
+};
+
+struct transplant_ctx;
+
+int skeleton_serialize(struct transplant_ctx *ctx);
+int skeleton_deserialize(struct transplant_ctx *ctx);
+
+#endif /* SKELETON_H */
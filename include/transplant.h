@@ -0,0 +1,105 @@
+#ifndef TRANSPLANT_H
+#define TRANSPLANT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * libtransplant: serialize and deserialize trees of files and directories.
+ *
+ * All the state of a transfer is held in a struct transplant_ctx, so any
+ * number of transfers can run at the same time, on different threads of the
+ * same process.  Serialized data is written to a sink and read from a source,
+ * both given as callbacks; transplant_fd_write() and transplant_fd_read() are
+ * provided for the common case of a file descriptor.
+ *
+ * A context must not be used by two threads at once.  In pipelined mode
+ * (transplant_set_pipeline()) the sink and source callbacks are called from a
+ * thread of their own.  The input thread is cancelled if deserialization stops before the end of the
+ * input; the callback must then only block in cancellation points such as read().
+ */
+
+/* Option bits, as in the global_options variable of the command line program. */
+#define TRANSPLANT_HELP        (1 << 0)
+#define TRANSPLANT_SERIALIZE   (1 << 1)
+#define TRANSPLANT_DESERIALIZE (1 << 2)
+#define TRANSPLANT_CLOBBER     (1 << 3) // overwrite existing files, reuse existing directories
+#define TRANSPLANT_DROP_CACHE  (1 << 4) // drop restored data from the page cache as it is written
+#define TRANSPLANT_SIGNATURE   (1 << 5) // serialize block signatures of files instead of their contents
+#define TRANSPLANT_WATCH       (1 << 6) // keep following changes (see transplant_watch())
+#define TRANSPLANT_TIMES       (1 << 7) // serialize the access and modification times of entries
+#define TRANSPLANT_SKIP_UNCHANGED (1 << 8) // with CLOBBER, do not rewrite files of the same size and modification time
+#define TRANSPLANT_VERIFY      (1 << 9) // with SKIP_UNCHANGED, compare the contents of such files instead
+#define TRANSPLANT_METADATA_FIRST (1 << 10) // serialize every entry before the contents of any file
+#define TRANSPLANT_FORMAT_V2   (1 << 11) // serialize in version 2 of the wire format, with compact headers
+#define TRANSPLANT_SALVAGE     (1 << 12) // go on from the next intact record of a damaged transmission (see salvage.h)
+
+/* Durability of restored files (transplant_set_durability()). */
+#define TRANSPLANT_DURABILITY_NONE     0 // left to the kernel to write back
+#define TRANSPLANT_DURABILITY_BATCHED  1 // one syncfs() per transmission
+#define TRANSPLANT_DURABILITY_PER_FILE 2 // each file fsync()ed under a temporary name and renamed into place
+
+/*
+ * Read up to count bytes of serialized data into buf.
+ * Returns the number of bytes read, 0 at end of input, or -1 on error.
+ */
+typedef ssize_t (*transplant_read_fn)(void *arg, void *buf, size_t count);
+
+/*
+ * Write up to count bytes of serialized data from buf.
+ * Returns the number of bytes written (at least 1), or -1 on error.
+ */
+typedef ssize_t (*transplant_write_fn)(void *arg, const void *buf, size_t count);
+
+struct transplant_ctx;
+
+struct transplant_ctx *transplant_new();
+void transplant_free(struct transplant_ctx *ctx);
+
+int transplant_set_path(struct transplant_ctx *ctx, char *path);
+void transplant_set_options(struct transplant_ctx *ctx, int options);
+int transplant_set_threads(struct transplant_ctx *ctx, int threads);
+void transplant_set_direct_io(struct transplant_ctx *ctx, uint64_t min_size);
+int transplant_add_filter(struct transplant_ctx *ctx, char *pattern, int include);
+void transplant_set_pipeline(struct transplant_ctx *ctx, size_t memory);
+int transplant_set_chunk_size(struct transplant_ctx *ctx, size_t size);
+int transplant_set_delta_base(struct transplant_ctx *ctx, char *signature_path);
+int transplant_set_debounce(struct transplant_ctx *ctx, int milliseconds);
+int transplant_set_files_from(struct transplant_ctx *ctx, char *list_path);
+int transplant_add_target(struct transplant_ctx *ctx, char *path);
+int transplant_add_shard(struct transplant_ctx *ctx, char *path, int fd);
+int transplant_set_shm(struct transplant_ctx *ctx, char *socket_path, size_t size);
+int transplant_set_durability(struct transplant_ctx *ctx, int durability);
+int transplant_set_journal(struct transplant_ctx *ctx, char *path, int interval_ms);
+void transplant_set_source(struct transplant_ctx *ctx, transplant_read_fn read, void *arg);
+void transplant_set_sink(struct transplant_ctx *ctx, transplant_write_fn write, void *arg);
+
+int transplant_serialize(struct transplant_ctx *ctx);
+int transplant_deserialize(struct transplant_ctx *ctx);
+int transplant_copy(struct transplant_ctx *ctx, char *target);
+int transplant_watch(struct transplant_ctx *ctx, volatile int *stop);
+
+/* Callbacks for a file descriptor; arg is the descriptor cast with (void *)(intptr_t)fd. */
+ssize_t transplant_fd_read(void *arg, void *buf, size_t count);
+ssize_t transplant_fd_write(void *arg, const void *buf, size_t count);
+
+/*
+ * Memory endpoints.  A transplant_buffer is a growable arena that a context
+ * can serialize into; memory is allocated in chunks of increasing size, never
+ * per record.  transplant_set_memory_source() deserializes from a region of
+ * memory in place, e.g. the one returned by transplant_buffer_data().
+ */
+struct transplant_buffer;
+
+struct transplant_buffer *transplant_buffer_new();
+void transplant_buffer_free(struct transplant_buffer *buffer);
+void transplant_buffer_reset(struct transplant_buffer *buffer);
+size_t transplant_buffer_length(struct transplant_buffer *buffer);
+size_t transplant_buffer_read(struct transplant_buffer *buffer, size_t offset, void *dest, size_t count);
+char *transplant_buffer_data(struct transplant_buffer *buffer);
+ssize_t transplant_buffer_write(void *arg, const void *buf, size_t count);
+
+void transplant_set_memory_sink(struct transplant_ctx *ctx, struct transplant_buffer *buffer);
+void transplant_set_memory_source(struct transplant_ctx *ctx, const void *data, size_t length);
+
+#endif /* TRANSPLANT_H */
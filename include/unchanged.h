@@ -0,0 +1,24 @@
+#ifndef UNCHANGED_H
+#define UNCHANGED_H
+
+#include <stdint.h>
+
+/*
+ * Re-applying a stream over a tree that is mostly up to date (-d -c
+ * --skip-unchanged).
+ *
+ * A file whose FILE_DATA payload has the size of the existing file, and whose
+ * TIMES record (if any) has its modification time, is taken to be unchanged:
+ * its payload is skipped without being written, seeked over when the input
+ * is a file.  Only its permissions are corrected if they differ; its access
+ * time is left as it is, since every read of the file changes it.  Without --times the check is on the size alone; --verify then
+ * compares the payload with the file instead, and rewrites the file from the
+ * first block that differs.
+ */
+
+struct transplant_ctx;
+struct entry_times;
+
+int unchanged_file(struct transplant_ctx *ctx, uint64_t size, int permissions, struct entry_times *times);
+
+#endif /* UNCHANGED_H */
@@ -0,0 +1,43 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+
+/*
+ * Continuous replication (--watch).
+ *
+ * After the initial full transmission, serialize keeps the tree under inotify
+ * watches and, once the changes have been quiet for a debounce window (or
+ * after WATCH_MAX_DELAY_FACTOR windows of continuous change), writes one more
+ * transmission holding only what changed.  Such a transmission is an ordinary
+ * nested stream that contains only the directories leading to the changed
+ * entries, in which created and modified entries are sent in full and two
+ * more kinds of record can appear in place of a DIRECTORY_ENTRY:
+ *
+ *   REMOVE (type 12): header, then the name of an entry of the current
+ *                     directory that is to be removed, with all its contents
+ *   RENAME (type 13): header, then the old and the new path of an entry,
+ *                     relative to the root, separated by a null byte; only
+ *                     at depth 1, before any other entry of the root
+ *
+ * Deserialize with --watch applies transmissions until end of input, the
+ * first one as usual and the following ones as if -c had been given.  Without
+ * -c, a REMOVE or RENAME record is refused like any other record that would
+ * change an existing entry.
+ */
+
+#define REMOVE_TYPE 12
+#define RENAME_TYPE 13
+
+#define WATCH_DEFAULT_DEBOUNCE_MS 100
+#define WATCH_MAX_DELAY_FACTOR 10
+#define WATCH_CHUNK_SIZE (1024 * 1024) // files in change sets are chunked: they may be changing as they are read
+
+struct transplant_ctx;
+
+int deserialize_remove(struct transplant_ctx *ctx, int depth);
+int deserialize_rename(struct transplant_ctx *ctx, int depth);
+int watch_remove_tree(struct transplant_ctx *ctx);
+int watch_apply_rename(struct transplant_ctx *ctx, char *from, char *to);
+
+#endif /* WATCH_H */
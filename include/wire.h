@@ -0,0 +1,48 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+
+/*
+ * Versions of the wire format (-s --format 1|2).
+ *
+ * Version 1 is the format of the assignment: every record starts with the
+ * magic bytes 0x0C 0x0D 0xED, the type, the depth as 4 bytes and the size as
+ * 8 bytes, and a DIRECTORY_ENTRY carries 12 bytes of metadata before the name.
+ *
+ * Version 2 is for trees of many small files, where those 28 bytes weigh as
+ * much as the contents.  Only the START_OF_TRANSMISSION record keeps the
+ * version 1 header, with a size of 17 and one byte of payload: the version.
+ * Every record after it, up to and including END_OF_TRANSMISSION, starts with
+ * three varints (7 bits per byte, least significant first, high bit set on
+ * all bytes but the last):
+ *
+ *   type, the depth minus the depth of the previous record (zigzag encoded:
+ *   0, -1, 1, -2 ... as 0, 1, 2, 3 ...), the size of the payload
+ *
+ * and the payload of a DIRECTORY_ENTRY is the mode and the size as varints,
+ * then the number of leading bytes the name shares with the name of the
+ * previous entry of the same directory, as a varint, then the rest of the
+ * name.  Every other payload is the same as in version 1.
+ *
+ * Deserialize tells the versions apart by the size of START_OF_TRANSMISSION.
+ * Records read with check_while_condition() have their size read with
+ * wire_read_size() in either version; the size it gives includes 16 bytes of
+ * header, as in version 1.  Signatures are only written in version 1, as
+ * --delta reads them back, and a version 2 transmission cannot be journaled.
+ */
+
+#define WIRE_V1 1
+#define WIRE_V2 2
+#define WIRE_START_SIZE (16 + 1) // START_OF_TRANSMISSION of version 2, with the version
+
+struct transplant_ctx;
+
+int wire_write_start(struct transplant_ctx *ctx);
+int wire_write_header(struct transplant_ctx *ctx, int type, int depth, uint64_t size);
+int wire_write_entry(struct transplant_ctx *ctx, int depth, char *name, uint32_t mode, uint64_t size);
+int wire_read_header(struct transplant_ctx *ctx, int depth);
+int wire_read_size(struct transplant_ctx *ctx, uint64_t *size);
+int wire_read_entry(struct transplant_ctx *ctx, int depth, uint32_t *mode, uint64_t *size);
+
+#endif /* WIRE_H */
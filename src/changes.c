@@ -0,0 +1,350 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "changes.h"
+#include "watch.h"
+#include "filter.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  Free a node, its siblings after it and everything below them.
+ */
+void change_free(struct change_node *node) {
+    while (node) {
+        struct change_node *next = node->next;
+        change_free(node->children);
+        free(node->name);
+        free(node);
+        node = next;
+    }
+}
+
+/*
+ * @brief  Follow the first length bytes of a relative path down from a node.
+ * @param create  Nonzero to create the nodes that are missing.
+ * @return The node of the path, or NULL if it is missing (or out of memory).
+ */
+struct change_node *change_walk(struct change_node *node, char *rel, int length, int create) {
+    char *end = rel + length;
+    while (node && rel < end) {
+        char *segment_end = rel;
+        while (segment_end < end && *segment_end != '/') segment_end++;
+        struct change_node *child = node->children;
+        for (; child; child = child->next) {
+            char *a = child->name, *b = rel;
+            while (b < segment_end && *a == *b) {
+                a++;
+                b++;
+            }
+            if (b == segment_end && *a == '\0') break;
+        }
+        if (!child && create) {
+            child = calloc(1, sizeof(struct change_node));
+            if (!child || !(child->name = malloc(segment_end - rel + 1))) {
+                free(child);
+                fprintf(stderr, "ERROR: Out of memory recording a path. \n");
+                return NULL;
+            }
+            tp_copy(child->name, rel, segment_end - rel);
+            *(child->name + (segment_end - rel)) = '\0';
+            child->next = node->children;
+            node->children = child;
+        }
+        node = child;
+        rel = segment_end < end ? segment_end + 1 : end;
+    }
+    return node;
+}
+
+/*
+ * Offset of the last '/' in a relative path, 0 if there is none.
+ */
+static int last_slash(char *rel) {
+    int slash = 0;
+    for (char *p = rel; *p != '\0'; p++) {
+        if (*p == '/') slash = p - rel;
+    }
+    return slash;
+}
+
+/*
+ * @brief  Add the flags to the node of a relative path, creating it if needed.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int change_mark(struct change_node *root, char *rel, int flags) {
+    struct change_node *node = change_walk(root, rel, len_string(rel), 1);
+    if (!node) return -1;
+    node->flags |= flags;
+    return 0;
+}
+
+/*
+ * @brief  Take the node of a relative path, with everything below it, out of the tree.
+ * @return The node, or NULL if the tree has no node for the path.
+ */
+struct change_node *change_detach(struct change_node *root, char *rel) {
+    int slash = last_slash(rel);
+    struct change_node *parent = change_walk(root, rel, slash, 0);
+    char *name = rel + slash + (slash > 0);
+    if (!parent) return NULL;
+    for (struct change_node **link = &parent->children; *link; link = &(*link)->next) {
+        char *a = (*link)->name, *b = name;
+        while (*a != '\0' && *a == *b) {
+            a++;
+            b++;
+        }
+        if (*a == *b) {
+            struct change_node *node = *link;
+            *link = node->next;
+            node->next = NULL;
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * @brief  Put a detached node back at a relative path, which must not have a
+ * node already.  The node is renamed after the last component of the path.
+ * @return 0 in case of success, -1 if memory is exhausted (the node is freed).
+ */
+int change_attach(struct change_node *root, char *rel, struct change_node *node) {
+    int slash = last_slash(rel);
+    struct change_node *parent = change_walk(root, rel, slash, 1);
+    char *name = rel + slash + (slash > 0);
+    char *copy = malloc(len_string(name) + 1);
+    if (!parent || !copy) {
+        free(copy);
+        change_free(node);
+        return -1;
+    }
+    tp_copy(copy, name, len_string(name) + 1);
+    free(node->name);
+    node->name = copy;
+    node->next = parent->children;
+    parent->children = node;
+    return 0;
+}
+
+static int write_remove(struct transplant_ctx *ctx, int depth, char *name) {
+    int length = len_string(name);
+    if (tp_write_record_header(ctx, REMOVE_TYPE, depth, 16 + length) == -1) return -1;
+    return tp_write(ctx, name, length);
+}
+
+/*
+ * Send the entry named by path_buf as it is now, for its node.
+ */
+static int emit_entry(struct transplant_ctx *ctx, struct change_node *node, int depth) {
+    struct stat stat_buf;
+    int gone = lstat(ctx->path_buf, &stat_buf) == -1;
+    if (gone && errno != ENOENT && errno != ENOTDIR) {
+        fprintf(stderr, "ERROR: Failed to retrieve metadata of component. \n");
+        return -1;
+    }
+    if (!gone && S_ISREG(stat_buf.st_mode)) { // make sure it can still be read before announcing it
+        int fd = open(ctx->path_buf, O_RDONLY);
+        gone = fd == -1 && errno == ENOENT;
+        if (fd != -1) close(fd);
+    }
+    if (gone) {
+        return (node->flags & CHANGE_ENTRY) ? write_remove(ctx, depth, node->name) : 0;
+    }
+    if (!(node->flags & CHANGE_ENTRY) && !S_ISDIR(stat_buf.st_mode)) {
+        return 0;
+    }
+    if ((node->flags & CHANGE_REPLACE) && write_remove(ctx, depth, node->name) == -1) {
+        return -1;
+    }
+
+    if (S_ISDIR(stat_buf.st_mode)) {
+        if (node->flags & CHANGE_WRITABLE) stat_buf.st_mode |= S_IRWXU;
+        if (tp_write_directory_entry(ctx, depth, node->name, &stat_buf) == -1) return -1;
+        if (node->flags & CHANGE_TREE) {
+            return tp_serialize_directory(ctx, depth + 1);
+        }
+        if (tp_write_record_header(ctx, 2, depth + 1, 16) == -1 || // START_OF_DIRECTORY
+            change_emit(ctx, node, depth + 1) == -1 ||
+            tp_write_record_header(ctx, 3, depth + 1, 16) == -1) { // END_OF_DIRECTORY
+            return -1;
+        }
+        return 0;
+    } else if (S_ISREG(stat_buf.st_mode)) {
+        if (tp_write_directory_entry(ctx, depth, node->name, &stat_buf) == -1) return -1;
+        return tp_serialize_file(ctx, depth, stat_buf.st_size);
+    } else if (S_ISLNK(stat_buf.st_mode)) {
+        ssize_t link_length = readlink(ctx->path_buf, ctx->link_buf, PATH_MAX - 1);
+        if (link_length == -1) {
+            fprintf(stderr, "ERROR: Failed to read the target of symbolic link. \n");
+            return -1;
+        }
+        *(ctx->link_buf + link_length) = '\0';
+        stat_buf.st_size = link_length;
+        if (tp_write_directory_entry(ctx, depth, node->name, &stat_buf) == -1) return -1;
+        return tp_serialize_symlink(ctx, depth, link_length);
+    }
+    fprintf(stderr, "WARNING: Skipping %s - not a regular file, directory or symbolic link. \n", ctx->path_buf);
+    return 0;
+}
+
+/*
+ * @brief  Write the records for the entries below a node, as they are now.
+ * @details  path_buf must name the directory of the node.  Directories that
+ * only lead to marked entries are sent as a DIRECTORY_ENTRY with just these
+ * entries between START_OF_DIRECTORY and END_OF_DIRECTORY, marked entries
+ * that no longer exist as REMOVE records.  The START_OF_DIRECTORY and
+ * END_OF_DIRECTORY records of the node itself are left to the caller.
+ *
+ * @param depth  The depth of the entries of the node.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int change_emit(struct transplant_ctx *ctx, struct change_node *root, int depth) {
+    for (struct change_node *child = root->children; child; child = child->next) {
+        if (tp_path_push(ctx, child->name) == -1) return -1;
+        int ret = emit_entry(ctx, child, depth);
+        tp_path_pop(ctx);
+        if (ret == -1) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the whole list file into a buffer with a null byte after the last entry.
+ */
+static char *read_list(char *path, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open the list of files %s. \n", path);
+        return NULL;
+    }
+    size_t capacity = 64 * 1024, used = 0;
+    char *list = malloc(capacity + 1);
+    while (list) {
+        if (used == capacity) {
+            char *bigger = realloc(list, capacity * 2 + 1);
+            if (!bigger) break;
+            list = bigger;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, list + used, capacity - used);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            fprintf(stderr, "ERROR: Failed to read the list of files %s. \n", path);
+            free(list);
+            close(fd);
+            return NULL;
+        }
+        if (n == 0) {
+            close(fd);
+            *(list + used) = '\0';
+            *length = used;
+            return list;
+        }
+        used += n;
+    }
+    free(list);
+    close(fd);
+    fprintf(stderr, "ERROR: Out of memory reading the list of files %s. \n", path);
+    return NULL;
+}
+
+/*
+ * Rewrite one path of the list in place without empty and "." components.
+ * Returns its new length, or -1 if it is absolute or goes up with "..".
+ */
+static int normalize(char *path) {
+    if (*path == '/') return -1;
+    char *in = path, *out = path;
+    while (*in != '\0') {
+        char *end = in;
+        while (*end != '\0' && *end != '/') end++;
+        long length = end - in;
+        if (length == 2 && *in == '.' && *(in + 1) == '.') return -1;
+        if (length > 0 && !(length == 1 && *in == '.')) {
+            if (out != path) *out++ = '/';
+            for (char *p = in; p < end; p++) *out++ = *p;
+        }
+        in = *end == '/' ? end + 1 : end;
+    }
+    *out = '\0';
+    return out - path;
+}
+
+/*
+ * Whether a component of a normalized path is excluded by the filter rules.
+ */
+static int path_excluded(struct transplant_ctx *ctx, char *path) {
+    int excluded = 0;
+    for (char *component = path; *component != '\0' && !excluded; ) {
+        char *end = component;
+        while (*end != '\0' && *end != '/') end++;
+        char saved = *end;
+        *end = '\0';
+        excluded = filter_excluded(&ctx->filters, component);
+        *end = saved;
+        component = saved == '/' ? end + 1 : end;
+    }
+    return excluded;
+}
+
+/*
+ * @brief  Serialize only the entries named in the list of files of the context.
+ * @details  The list holds pathnames relative to path_buf, each followed by a
+ * null byte (as written by find -print0 or git diff -z --name-only).  Only the
+ * directories that lead to the listed entries are visited: the records are
+ * those of the root directory, from START_OF_DIRECTORY to END_OF_DIRECTORY,
+ * with nothing else in them.  A listed directory is sent with all its
+ * contents, and a listed entry that does not exist as a REMOVE record.
+ * Deserializing with -c applies the deletions; without it, a REMOVE record
+ * is refused, so a mistyped name cannot delete anything by accident.
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int serialize_file_list(struct transplant_ctx *ctx) {
+    size_t length;
+    char *list = read_list(ctx->files_from, &length);
+    if (!list) {
+        return -1;
+    }
+    struct change_node root = {0};
+    int whole_tree = 0, ret = 0;
+    for (char *entry = list, *next; entry < list + length && ret == 0; entry = next) {
+        next = entry + len_string(entry) + 1;
+        if (*entry == '\0') {
+            continue;
+        }
+        int path_length = normalize(entry);
+        if (path_length == -1) {
+            fprintf(stderr, "ERROR: Listed path %s is not relative to the directory being serialized. \n", entry);
+            ret = -1;
+        } else if (path_length == 0) {
+            whole_tree = 1;
+        } else if (path_length >= PATH_MAX - ctx->path_length - 1) {
+            fprintf(stderr, "ERROR: Listed path %s is too long. \n", entry);
+            ret = -1;
+        } else if (!path_excluded(ctx, entry)) {
+            ret = change_mark(&root, entry, CHANGE_ENTRY | CHANGE_TREE);
+        }
+    }
+    free(list);
+
+    if (ret == 0 && whole_tree) { // "." names the root itself
+        ret = tp_serialize_directory(ctx, 1);
+    } else if (ret == 0) {
+        if (tp_write_record_header(ctx, 2, 1, 16) == -1 || // START_OF_DIRECTORY
+            change_emit(ctx, &root, 1) == -1 ||
+            tp_write_record_header(ctx, 3, 1, 16) == -1) { // END_OF_DIRECTORY
+            ret = -1;
+        }
+    }
+    change_free(root.children);
+    return ret;
+}
@@ -0,0 +1,259 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "chunk.h"
+#include "wire.h"
+#include "durability.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+static uint32_t *crc_table; // 256 entries, built once for the whole process
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init() {
+    crc_table = malloc(256 * sizeof(uint32_t));
+    if (!crc_table) return;
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        *(crc_table + n) = c;
+    }
+}
+
+/*
+ * @brief  Update a CRC-32 (the one of zlib and Ethernet) with length bytes.
+ * @param crc  0 to start, or the value returned for the preceding bytes.
+ * @return The CRC-32 of all the bytes so far.
+ */
+uint32_t chunk_crc32(uint32_t crc, const char *data, size_t length) {
+    pthread_once(&crc_once, crc_table_init);
+    crc = ~crc;
+    if (!crc_table) { // out of memory for the table: do it the slow way
+        for (const char *p = data; p < data + length; p++) {
+            crc ^= (unsigned char)*p;
+            for (int k = 0; k < 8; k++) crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+        }
+        return ~crc;
+    }
+    for (const char *p = data; p < data + length; p++) {
+        crc = *(crc_table + ((crc ^ (unsigned char)*p) & 0xFF)) ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static int put_u64(struct transplant_ctx *ctx, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        if (tp_putc(ctx, (value >> (i * 8)) & 0xFF) == EOF) return -1;
+    }
+    return 0;
+}
+
+static int get_u64(struct transplant_ctx *ctx, uint64_t *value) {
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        *value = (*value << 8) | byte;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Serialize the contents of the file named by path_buf as FILE_CHUNK
+ * records of up to chunk_size bytes and a FILE_END record.
+ * @details  The file is read until end of file, whatever its size was when
+ * its DIRECTORY_ENTRY was written.
+ *
+ * @param depth  The value to be used in the depth field of the records.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int serialize_file_chunks(struct transplant_ctx *ctx, int depth) {
+    if (!ctx->chunk_buf) {
+        ctx->chunk_buf = malloc(ctx->chunk_size);
+        if (!ctx->chunk_buf) {
+            fprintf(stderr, "ERROR: Out of memory allocating the chunk buffer. \n");
+            return -1;
+        }
+    }
+    int fd = open(ctx->path_buf, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open  file, not a file. \n");
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    int eof = 0;
+    while (!eof) {
+        size_t filled = 0;
+        while (filled < ctx->chunk_size) {
+            ssize_t n = read(fd, ctx->chunk_buf + filled, ctx->chunk_size - filled);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) {
+                close(fd);
+                fprintf(stderr, "ERROR: I/O error occurred.\n");
+                return -1;
+            }
+            if (n == 0) {
+                eof = 1;
+                break;
+            }
+            filled += n;
+        }
+        if (filled == 0) break;
+
+        if (tp_write_record_header(ctx, FILE_CHUNK_TYPE, depth, CHUNK_HEADER_SIZE + filled) == -1 ||
+            put_u64(ctx, offset) == -1) {
+            close(fd);
+            return -1;
+        }
+        uint32_t crc = chunk_crc32(0, ctx->chunk_buf, filled);
+        for (int i = 3; i >= 0; i--) {
+            if (tp_putc(ctx, (crc >> (i * 8)) & 0xFF) == EOF) {
+                close(fd);
+                return -1;
+            }
+        }
+        if (tp_write(ctx, ctx->chunk_buf, filled) == -1) {
+            close(fd);
+            return -1;
+        }
+        offset += filled;
+    }
+
+    if (close(fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to close file. \n");
+        return -1;
+    }
+    if (tp_write_record_header(ctx, FILE_END_TYPE, depth, 16 + 8) == -1 || put_u64(ctx, offset) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write length bytes of a FILE_CHUNK payload, read from the source, at offset
+ * in fd.  Returns the CRC-32 of the bytes, through crc, and 0 or -1.
+ */
+static int restore_chunk(struct transplant_ctx *ctx, int fd, uint64_t offset, uint64_t length, uint32_t *crc) {
+    *crc = 0;
+    while (length > 0) {
+        size_t want = length < DATA_BUF_SIZE ? length : DATA_BUF_SIZE;
+        if (tp_read(ctx, ctx->data_buf, want) == -1) {
+            fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read file contents in deserialize file. \n");
+            return -1;
+        }
+        *crc = chunk_crc32(*crc, ctx->data_buf, want);
+        for (char *out = ctx->data_buf; out < ctx->data_buf + want; ) {
+            ssize_t n = pwrite(fd, out, ctx->data_buf + want - out, offset);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "ERROR: Failed to write file contents in deserialize file. \n");
+                return -1;
+            }
+            out += n;
+            offset += n;
+        }
+        length -= want;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Deserialize the chunked contents of the file named by path_buf.
+ * @details  This function is called by deserialize_file() once it has read the
+ * magic bytes and the type of the first record that follows the DIRECTORY_ENTRY
+ * of the file, and found it to be FILE_CHUNK or FILE_END.  It reads records up
+ * to and including the FILE_END record.  The file is created with
+ * tp_create_file(), so it is left to the caller to finish it with
+ * durability_close(); on error it is abandoned with durability_abandon().
+ *
+ * @param depth  The value of the depth field that is expected in the records.
+ * @param type  The type of the first record.
+ * @param permissions  The permissions of the file, as for tp_create_file().
+ * @return The descriptor of the file, written in full, or -1 on error.
+ */
+int deserialize_file_chunks(struct transplant_ctx *ctx, int depth, int type, int permissions) {
+    if (ctx->wire_version != WIRE_V2) { // the depth was read with the header in version 2
+        int depth_parsed = 0;
+        for (int i = 0; i < 4; i++) {
+            int byte = debug_getchar(ctx);
+            if (byte == EOF) {
+                fprintf(stderr, "ERROR: Unexpected EOF character when reading depth of file. \n");
+                return -1;
+            }
+            depth_parsed = (depth_parsed << 8) | byte;
+        }
+        if (depth_parsed != depth) {
+            fprintf(stderr, "ERROR: Depth parsed is not as expected. \n");
+            return -1;
+        }
+    }
+
+    int fd = tp_create_file(ctx, permissions);
+    if (fd == -1) {
+        return -1;
+    }
+    while (type == FILE_CHUNK_TYPE) {
+        uint64_t size, offset;
+        if (wire_read_size(ctx, &size) == -1 || get_u64(ctx, &offset) == -1) {
+            durability_abandon(ctx, fd);
+            fprintf(stderr, "ERROR: Unexpected EOF character when reading FILE CHUNK record. \n");
+            return -1;
+        }
+        uint32_t expected = 0;
+        for (int i = 0; i < 4; i++) {
+            int byte = debug_getchar(ctx);
+            if (byte == EOF) {
+                durability_abandon(ctx, fd);
+                fprintf(stderr, "ERROR: Unexpected EOF character when reading FILE CHUNK record. \n");
+                return -1;
+            }
+            expected = (expected << 8) | byte;
+        }
+        if (size < CHUNK_HEADER_SIZE || size - CHUNK_HEADER_SIZE > CHUNK_MAX_SIZE) {
+            durability_abandon(ctx, fd);
+            fprintf(stderr, "ERROR: Invalid size of FILE CHUNK record. \n");
+            return -1;
+        }
+        uint32_t crc;
+        if (restore_chunk(ctx, fd, offset, size - CHUNK_HEADER_SIZE, &crc) == -1) {
+            durability_abandon(ctx, fd);
+            return -1;
+        }
+        if (crc != expected) {
+            durability_abandon(ctx, fd);
+            fprintf(stderr, "ERROR: Checksum mismatch in chunk at offset %lu of %s. \n", (unsigned long)offset, ctx->path_buf);
+            return -1;
+        }
+        type = check_while_condition(ctx, depth);
+    }
+    if (type != FILE_END_TYPE) {
+        durability_abandon(ctx, fd);
+        fprintf(stderr, "ERROR: Expected FILE END record after the chunks of a file. \n");
+        return -1;
+    }
+
+    uint64_t size, length;
+    if (wire_read_size(ctx, &size) == -1 || size != 16 + 8 || get_u64(ctx, &length) == -1) {
+        durability_abandon(ctx, fd);
+        fprintf(stderr, "ERROR: Invalid FILE END record. \n");
+        return -1;
+    }
+    if (ftruncate(fd, length) == -1) { // also gives the file its length if the last bytes were never written
+        durability_abandon(ctx, fd);
+        fprintf(stderr, "ERROR: Failed to set the length of the file in deserialize file. \n");
+        return -1;
+    }
+    return fd;
+}
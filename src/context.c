@@ -0,0 +1,487 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "transplant.h"
+#include "chunk.h"
+#include "delta.h"
+#include "watch.h"
+#include "fanout.h"
+#include "journal.h"
+#include "shard.h"
+#include "shm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  Initialize a context with default settings.
+ * @details  The four working buffers are taken from the arguments, or allocated
+ * if an argument is NULL (all of them must then be NULL).  The source and sink
+ * are the standard input and output.
+ *
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int tp_ctx_init(struct transplant_ctx *ctx, char *path_storage, char *name_storage,
+                char *link_storage, char *data_storage) {
+    *ctx = (struct transplant_ctx){0};
+    ctx->owns_buffers = (path_storage == NULL);
+    ctx->path_buf = path_storage ? path_storage : malloc(PATH_MAX);
+    ctx->name_buf = name_storage ? name_storage : malloc(NAME_MAX);
+    ctx->link_buf = link_storage ? link_storage : malloc(PATH_MAX);
+    ctx->data_buf = data_storage ? data_storage : malloc(DATA_BUF_SIZE);
+    ctx->in_buf = ctx->in_storage = malloc(IO_BUF_SIZE);
+    ctx->out_buf = malloc(IO_BUF_SIZE);
+    if (!ctx->path_buf || !ctx->name_buf || !ctx->link_buf || !ctx->data_buf || !ctx->in_buf || !ctx->out_buf) {
+        fprintf(stderr, "ERROR: Out of memory creating transplant context. \n");
+        tp_ctx_destroy(ctx);
+        return -1;
+    }
+    *ctx->path_buf = '\0';
+    *ctx->name_buf = '\0';
+    ctx->read = transplant_fd_read;
+    ctx->read_arg = (void *)(intptr_t)STDIN_FILENO;
+    ctx->write = transplant_fd_write;
+    ctx->write_arg = (void *)(intptr_t)STDOUT_FILENO;
+    ctx->scan_threads = 1;
+    ctx->watch_debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS;
+    return 0;
+}
+
+/*
+ * @brief  Release everything held by a context, but not the context itself.
+ */
+void tp_ctx_destroy(struct transplant_ctx *ctx) {
+    if (ctx->owns_buffers) {
+        free(ctx->path_buf);
+        free(ctx->name_buf);
+        free(ctx->link_buf);
+        free(ctx->data_buf);
+    }
+    free(ctx->in_storage);
+    free(ctx->out_buf);
+    free(ctx->direct_buf);
+    free(ctx->chunk_buf);
+    free(ctx->compare_buf);
+    free(ctx->temp_path);
+    signature_free(ctx->signatures);
+    ctx->signatures = NULL;
+    free(ctx->files_from);
+    ctx->files_from = NULL;
+    free(ctx->shm_path);
+    ctx->shm_path = NULL;
+    fanout_clear(ctx);
+    journal_free(ctx);
+    shard_clear(ctx);
+    free(ctx->dir_metadata);
+    ctx->dir_metadata = NULL;
+    ctx->dir_metadata_count = 0;
+    free(ctx->wire_names);
+    ctx->wire_names = NULL;
+    ctx->wire_names_count = 0;
+    filter_clear(&ctx->filters);
+    ctx->path_buf = ctx->name_buf = ctx->link_buf = ctx->data_buf = NULL;
+    ctx->in_buf = ctx->in_storage = ctx->out_buf = ctx->direct_buf = ctx->chunk_buf = ctx->compare_buf = ctx->temp_path = NULL;
+}
+
+/*
+ * @brief  Refill the input buffer from the source.
+ * @return The next byte of input, or EOF at end of input or on error.
+ */
+int tp_fill(struct transplant_ctx *ctx) {
+    ssize_t n;
+    ctx->in_base += ctx->in_len;
+    do {
+        n = ctx->read(ctx->read_arg, ctx->in_buf, IO_BUF_SIZE);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        ctx->in_pos = ctx->in_len = 0;
+        return EOF;
+    }
+    ctx->in_len = n;
+    ctx->in_pos = 1;
+    return (unsigned char)*ctx->in_buf;
+}
+
+/*
+ * @brief  Read exactly count bytes of serialized data into buf.
+ * @details  Whatever is left in the input buffer is used first; large reads then
+ * go straight from the source into buf.
+ * @return 0 in case of success, -1 if the input ends early or an error occurs.
+ */
+int tp_read(struct transplant_ctx *ctx, char *buf, size_t count) {
+    size_t buffered = ctx->in_len - ctx->in_pos;
+    if (buffered >= count) {
+        tp_copy(buf, ctx->in_buf + ctx->in_pos, count);
+        ctx->in_pos += count;
+        return 0;
+    }
+    tp_copy(buf, ctx->in_buf + ctx->in_pos, buffered);
+    ctx->in_base += ctx->in_len;
+    ctx->in_pos = ctx->in_len = 0;
+    buf += buffered;
+    count -= buffered;
+
+    while (count >= IO_BUF_SIZE) { // no point staging large reads through in_buf
+        ssize_t n = ctx->read(ctx->read_arg, buf, count);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        ctx->in_base += n;
+        buf += n;
+        count -= n;
+    }
+    while (count > 0) {
+        if (tp_fill(ctx) == EOF) return -1;
+        ctx->in_pos = 0;
+        size_t take = ctx->in_len < count ? ctx->in_len : count;
+        tp_copy(buf, ctx->in_buf, take);
+        ctx->in_pos = take;
+        buf += take;
+        count -= take;
+    }
+    return 0;
+}
+
+static int sink_all(struct transplant_ctx *ctx, char *buf, size_t count) {
+    while (count > 0) {
+        ssize_t n = ctx->write(ctx->write_arg, buf, count);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "ERROR: Failed to write serialized data. \n");
+            return -1;
+        }
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Hand everything in the output buffer to the sink.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int tp_flush(struct transplant_ctx *ctx) {
+    size_t count = ctx->out_len;
+    ctx->out_len = 0;
+    return sink_all(ctx, ctx->out_buf, count);
+}
+
+/*
+ * @brief  Write count bytes of serialized data from buf.
+ * @details  Small writes are collected in the output buffer; large ones are
+ * given to the sink directly once the buffer has been flushed.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int tp_write(struct transplant_ctx *ctx, char *buf, size_t count) {
+    if (count <= IO_BUF_SIZE - ctx->out_len) {
+        tp_copy(ctx->out_buf + ctx->out_len, buf, count);
+        ctx->out_len += count;
+        return 0;
+    }
+    if (tp_flush(ctx) == -1) return -1;
+    if (count < IO_BUF_SIZE) {
+        tp_copy(ctx->out_buf, buf, count);
+        ctx->out_len = count;
+        return 0;
+    }
+    return sink_all(ctx, buf, count);
+}
+
+/*
+ * @brief  Consume count bytes of serialized data without copying them anywhere.
+ * @details  Whatever is left in the input buffer is dropped first.  The rest is
+ * seeked over when the source is a file descriptor that allows it (a file, not
+ * a pipe), and read into data_buf and discarded otherwise.
+ * @return 0 in case of success, -1 if the input ends early or an error occurs.
+ */
+int tp_skip(struct transplant_ctx *ctx, uint64_t count) {
+    size_t buffered = ctx->in_len - ctx->in_pos;
+    if (buffered >= count) {
+        ctx->in_pos += count;
+        return 0;
+    }
+    ctx->in_base += ctx->in_len;
+    ctx->in_pos = ctx->in_len = 0;
+    count -= buffered;
+    if (ctx->read == transplant_fd_read && count <= INT64_MAX) {
+        int fd = (int)(intptr_t)ctx->read_arg;
+        off_t here = lseek(fd, 0, SEEK_CUR);
+        struct stat stat_buf;
+        // Past the end the next read would only find end of file, so an input cut short is still detected there
+        if (here != -1 && fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) &&
+            (uint64_t)(stat_buf.st_size - here) >= count) {
+            if (lseek(fd, count, SEEK_CUR) == -1) return -1;
+            ctx->in_base += count;
+            return 0;
+        }
+    }
+    while (count > 0) {
+        size_t take = count < DATA_BUF_SIZE ? count : DATA_BUF_SIZE;
+        if (tp_read(ctx, ctx->data_buf, take) == -1) return -1;
+        count -= take;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Read callback for a file descriptor.
+ */
+ssize_t transplant_fd_read(void *arg, void *buf, size_t count) {
+    return read((int)(intptr_t)arg, buf, count);
+}
+
+/*
+ * @brief  Write callback for a file descriptor.
+ */
+ssize_t transplant_fd_write(void *arg, const void *buf, size_t count) {
+    return write((int)(intptr_t)arg, buf, count);
+}
+
+/*
+ * @brief  Create a context for one transfer.
+ * @details  The context starts out with no options set, the current working
+ * directory as its path, one scan thread, no filters, direct I/O disabled, and
+ * the standard input and output as source and sink.
+ * @return The new context, or NULL if memory is exhausted.
+ */
+struct transplant_ctx *transplant_new() {
+    struct transplant_ctx *ctx = malloc(sizeof(struct transplant_ctx));
+    if (!ctx) return NULL;
+    if (tp_ctx_init(ctx, NULL, NULL, NULL, NULL) == -1) {
+        free(ctx);
+        return NULL;
+    }
+    tp_path_init(ctx, ".");
+    return ctx;
+}
+
+/*
+ * @brief  Destroy a context created by transplant_new().
+ */
+void transplant_free(struct transplant_ctx *ctx) {
+    if (!ctx) return;
+    tp_ctx_destroy(ctx);
+    free(ctx);
+}
+
+/*
+ * @brief  Set the directory to serialize from or deserialize into.
+ * @return 0 in case of success, -1 if the path is too long.
+ */
+int transplant_set_path(struct transplant_ctx *ctx, char *path) {
+    return tp_path_init(ctx, path);
+}
+
+/*
+ * @brief  Set the TRANSPLANT_* option bits.
+ */
+void transplant_set_options(struct transplant_ctx *ctx, int options) {
+    ctx->options = options;
+}
+
+/*
+ * @brief  Set the number of threads used to scan the tree during serialization.
+ * @return 0 in case of success, -1 if the number is out of range.
+ */
+int transplant_set_threads(struct transplant_ctx *ctx, int threads) {
+    if (threads < 1 || threads > 1024) {
+        fprintf(stderr, "ERROR: Number of scan threads must be between 1 and 1024. \n");
+        return -1;
+    }
+    ctx->scan_threads = threads;
+    return 0;
+}
+
+/*
+ * @brief  Use O_DIRECT for files of at least min_size bytes (0 disables it).
+ */
+void transplant_set_direct_io(struct transplant_ctx *ctx, uint64_t min_size) {
+    ctx->direct_io_min_size = min_size;
+}
+
+/*
+ * @brief  Move the source (during deserialization) or the sink (during
+ * serialization) to a thread of its own, with about memory bytes of buffers
+ * between it and the main thread; 0 turns pipelining off.
+ */
+void transplant_set_pipeline(struct transplant_ctx *ctx, size_t memory) {
+    ctx->pipeline_mem = memory;
+}
+
+/*
+ * @brief  Send file contents as FILE_CHUNK records of size bytes; 0 selects
+ * the plain FILE_DATA record.
+ * @return 0 in case of success, -1 if the size is out of range.
+ */
+int transplant_set_chunk_size(struct transplant_ctx *ctx, size_t size) {
+    if (size > CHUNK_MAX_SIZE) {
+        fprintf(stderr, "ERROR: Chunk size must be at most %d bytes. \n", CHUNK_MAX_SIZE);
+        return -1;
+    }
+    free(ctx->chunk_buf);
+    ctx->chunk_buf = NULL;
+    ctx->chunk_size = size;
+    return 0;
+}
+
+/*
+ * @brief  Send files that exist in an older version of the tree as deltas
+ * against it, given the signature of that version written with
+ * TRANSPLANT_SIGNATURE; NULL sends whole files again.
+ * @return 0 in case of success, -1 if the signature cannot be loaded.
+ */
+int transplant_set_delta_base(struct transplant_ctx *ctx, char *signature_path) {
+    struct signature_set *signatures = NULL;
+    if (signature_path && !(signatures = signature_load(signature_path))) {
+        return -1;
+    }
+    signature_free(ctx->signatures);
+    ctx->signatures = signatures;
+    return 0;
+}
+
+/*
+ * @brief  Serialize only the entries named in a file, each followed by a null
+ * byte, instead of walking the whole tree; NULL walks the tree again.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int transplant_set_files_from(struct transplant_ctx *ctx, char *list_path) {
+    char *copy = NULL;
+    if (list_path) {
+        copy = malloc(len_string(list_path) + 1);
+        if (!copy) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return -1;
+        }
+        tp_copy(copy, list_path, len_string(list_path) + 1);
+    }
+    free(ctx->files_from);
+    ctx->files_from = copy;
+    return 0;
+}
+
+/*
+ * @brief  Exchange serialized data with the other process through a ring in
+ * shared memory handed over on the Unix socket at socket_path, instead of the
+ * source or sink; NULL goes back to them.
+ * @details  The deserializing side listens on the socket and creates a ring of
+ * size bytes (rounded up to a power of two, SHM_DEFAULT_SIZE if 0); the
+ * serializing side connects to it and size is ignored.  See shm.h.
+ * @return 0 in case of success, -1 if the size is out of range or memory is exhausted.
+ */
+int transplant_set_shm(struct transplant_ctx *ctx, char *socket_path, size_t size) {
+    if (size > SHM_MAX_SIZE) {
+        fprintf(stderr, "ERROR: Shared ring must be at most 16G. \n");
+        return -1;
+    }
+    char *copy = NULL;
+    if (socket_path) {
+        copy = malloc(len_string(socket_path) + 1);
+        if (!copy) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return -1;
+        }
+        tp_copy(copy, socket_path, len_string(socket_path) + 1);
+    }
+    free(ctx->shm_path);
+    ctx->shm_path = copy;
+    ctx->shm_size = size ? size : SHM_DEFAULT_SIZE;
+    return 0;
+}
+
+/*
+ * @brief  Add a directory to deserialize into, besides the path of the context.
+ * @details  The stream is parsed once; everything restored into the path of
+ * the context is then cloned into each added directory on a thread of its own.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int transplant_add_target(struct transplant_ctx *ctx, char *path) {
+    return fanout_add(ctx, path);
+}
+
+/*
+ * @brief  Write serialization to several outputs instead of the sink: the file
+ * at path, or the descriptor fd if path is NULL, as one more shard.
+ * @details  Each shard is a complete transmission with part of the tree, and
+ * the shards are written at the same time; see shard.h.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int transplant_add_shard(struct transplant_ctx *ctx, char *path, int fd) {
+    return shard_add(ctx, path, fd);
+}
+
+/*
+ * @brief  Set how restored files are made to survive a crash, one of the
+ * TRANSPLANT_DURABILITY_* values; see durability.h.
+ * @return 0 in case of success, -1 if the value is unknown.
+ */
+int transplant_set_durability(struct transplant_ctx *ctx, int durability) {
+    if (durability != TRANSPLANT_DURABILITY_NONE && durability != TRANSPLANT_DURABILITY_BATCHED &&
+        durability != TRANSPLANT_DURABILITY_PER_FILE) {
+        fprintf(stderr, "ERROR: Unknown durability mode. \n");
+        return -1;
+    }
+    ctx->durability = durability;
+    return 0;
+}
+
+/*
+ * @brief  Set how long the tree must stay unchanged before transplant_watch()
+ * writes the changes made to it.
+ * @return 0 in case of success, -1 if the time is out of range.
+ */
+int transplant_set_debounce(struct transplant_ctx *ctx, int milliseconds) {
+    if (milliseconds < 1 || milliseconds > 60 * 60 * 1000) {
+        fprintf(stderr, "ERROR: Debounce time must be between 1 ms and one hour. \n");
+        return -1;
+    }
+    ctx->watch_debounce_ms = milliseconds;
+    return 0;
+}
+
+/*
+ * @brief  Append an --exclude (include == 0) or --include rule.
+ * @return 0 in case of success, -1 if the pattern is invalid.
+ */
+int transplant_add_filter(struct transplant_ctx *ctx, char *pattern, int include) {
+    return filter_add(&ctx->filters, pattern, include);
+}
+
+/*
+ * @brief  Set the callback from which deserialization reads.
+ */
+void transplant_set_source(struct transplant_ctx *ctx, transplant_read_fn read, void *arg) {
+    ctx->read = read;
+    ctx->read_arg = arg;
+    ctx->in_buf = ctx->in_storage;
+    ctx->in_pos = ctx->in_len = 0;
+}
+
+/*
+ * @brief  Set the callback to which serialization writes.
+ */
+void transplant_set_sink(struct transplant_ctx *ctx, transplant_write_fn write, void *arg) {
+    ctx->write = write;
+    ctx->write_arg = arg;
+}
+
+/*
+ * @brief  Serialize the tree below the path of the context to its sink.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_serialize(struct transplant_ctx *ctx) {
+    return tp_serialize(ctx);
+}
+
+/*
+ * @brief  Deserialize from the source of the context into its path.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_deserialize(struct transplant_ctx *ctx) {
+    return tp_deserialize(ctx);
+}
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE // copy_file_range
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "transplant.h"
+#include "durability.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h> // FICLONE
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * Local copy mode (-s -d).
+ *
+ * The tree is walked like serialize_directory() does and recreated directly,
+ * with the same result as piping serialize() into deserialize() but without
+ * encoding and decoding every byte.  Two contexts are used, one per side, so
+ * that both pathnames are maintained by path_push() and path_pop().  File data
+ * is moved by the cheapest means the filesystems allow: a reflink (FICLONE)
+ * shares the blocks without copying them, copy_file_range() copies inside the
+ * kernel, and read()/write() through data_buf is the last resort.
+ */
+
+/*
+ * @brief  Move size bytes from in to out, both at offset 0.
+ * @details  buf is DATA_BUF_SIZE bytes for the read()/write() fallback; name
+ * is the pathname of in, for error messages.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int tp_copy_file_data(int in, int out, uint64_t size, char *buf, char *name) {
+    if (size > 0 && ioctl(out, FICLONE, in) == 0) {
+        return 0; // same filesystem with reflink support: no data is copied at all
+    }
+
+    uint64_t copied = 0;
+    while (copied < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, size - copied, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (copied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                break; // not possible between these files: copy through user space
+            }
+            fprintf(stderr, "ERROR: Failed to copy the contents of %s. \n", name);
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "ERROR: Unexpected EOF. \n");
+            return -1; // file shrank since it was stat'ed
+        }
+        copied += n;
+    }
+
+    while (copied < size) {
+        size_t want = size - copied < DATA_BUF_SIZE ? size - copied : DATA_BUF_SIZE;
+        ssize_t got = read(in, buf, want);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) {
+            fprintf(stderr, got == 0 ? "ERROR: Unexpected EOF. \n" : "ERROR: I/O error occurred.\n");
+            return -1;
+        }
+        for (char *p = buf; p < buf + got; ) {
+            ssize_t n = write(out, p, buf + got - p);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "ERROR: Failed to write the contents of a copied file. \n");
+                return -1;
+            }
+            p += n;
+        }
+        copied += got;
+    }
+    return 0;
+}
+
+/*
+ * Copy the regular file named by the path of src to the path of dst.
+ */
+static int copy_regular_file(struct transplant_ctx *src, struct transplant_ctx *dst, struct stat *stat_buf) {
+    int in = open(src->path_buf, O_RDONLY);
+    if (in == -1) {
+        fprintf(stderr, "ERROR: Failed to open  file, not a file. \n");
+        return -1;
+    }
+    int out = tp_create_file(dst, stat_buf->st_mode & 0777); // O_EXCL, or with clobber a read-only file made writable
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    int ret = tp_copy_file_data(in, out, stat_buf->st_size, src->data_buf, src->path_buf);
+    close(in);
+    if (ret == -1) {
+        durability_abandon(dst, out);
+        return -1;
+    }
+    return durability_close(dst, out);
+}
+
+/*
+ * Recreate the symbolic link named by the path of src at the path of dst.
+ */
+static int copy_symlink(struct transplant_ctx *src, struct transplant_ctx *dst, int dir_fd, char *name) {
+    ssize_t link_length = readlinkat(dir_fd, name, src->link_buf, PATH_MAX - 1);
+    if (link_length == -1) {
+        fprintf(stderr, "ERROR: Failed to read the target of symbolic link. \n");
+        return -1;
+    }
+    *(src->link_buf + link_length) = '\0';
+    if (symlinkat(src->link_buf, AT_FDCWD, dst->path_buf) == -1) {
+        if (errno != EEXIST || !(dst->options & TRANSPLANT_CLOBBER)) {
+            fprintf(stderr, "ERROR: Failed to create symbolic link (it may already exist and the clobber flag was not passed). \n");
+            return -1;
+        }
+        if (unlink(dst->path_buf) == -1 || symlinkat(src->link_buf, AT_FDCWD, dst->path_buf) == -1) {
+            fprintf(stderr, "ERROR: Failed to replace existing entry with symbolic link. \n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Create the directory named by the path of dst; with clobber, an existing
+ * directory is used as it is.
+ */
+static int make_directory(struct transplant_ctx *dst) {
+    if (mkdir(dst->path_buf, 0777) == 0) {
+        return 0;
+    }
+    if (errno == EEXIST && (dst->options & TRANSPLANT_CLOBBER)) {
+        struct stat stat_buf;
+        if (stat(dst->path_buf, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode)) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "ERROR: Failed to make new directory %s (it may already exist and the clobber flag was not passed). \n", dst->path_buf);
+    return -1;
+}
+
+static int copy_directory(struct transplant_ctx *src, struct transplant_ctx *dst, struct stat *root);
+
+/*
+ * Copy one entry of the directory open as dir, whose name has been pushed on
+ * both paths.
+ */
+static int copy_entry(struct transplant_ctx *src, struct transplant_ctx *dst, struct stat *root, DIR *dir, char *name) {
+    struct stat stat_buf;
+    if (lstat(src->path_buf, &stat_buf) == -1) { // lstat so that symbolic links are not followed
+        fprintf(stderr, "ERROR: Failed to retrieve metadata of component. \n");
+        return -1;
+    }
+    if (S_ISDIR(stat_buf.st_mode)) {
+        if (stat_buf.st_dev == root->st_dev && stat_buf.st_ino == root->st_ino) {
+            return 0; // the destination itself, when it lies inside the source: do not copy it into itself
+        }
+        if (make_directory(dst) == -1) {
+            return -1;
+        }
+        return copy_directory(src, dst, root);
+    } else if (S_ISREG(stat_buf.st_mode)) {
+        return copy_regular_file(src, dst, &stat_buf);
+    } else if (S_ISLNK(stat_buf.st_mode)) {
+        return copy_symlink(src, dst, dirfd(dir), name);
+    }
+    fprintf(stderr, "WARNING: Skipping %s - not a regular file, directory or symbolic link. \n", src->path_buf);
+    return 0;
+}
+
+/*
+ * Copy the contents of the directory named by the path of src into the
+ * existing directory named by the path of dst.  root is the metadata of the
+ * top-level destination directory.
+ */
+static int copy_directory(struct transplant_ctx *src, struct transplant_ctx *dst, struct stat *root) {
+    DIR *dir = opendir(src->path_buf);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Failed to open directory %s. \n", src->path_buf);
+        return -1;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        // Skip "." and ".."
+        if (*(de->d_name) == '.' && (*(de->d_name + 1) == '\0' || (*(de->d_name + 1) == '.' && *(de->d_name + 2) == '\0'))) {
+            continue;
+        }
+        if (filter_excluded(&src->filters, de->d_name)) {
+            continue;
+        }
+        if (tp_path_push(src, de->d_name) == -1) {
+            closedir(dir);
+            return -1;
+        }
+        if (tp_path_push(dst, de->d_name) == -1) {
+            tp_path_pop(src);
+            closedir(dir);
+            return -1;
+        }
+        int ret = copy_entry(src, dst, root, dir, de->d_name);
+        tp_path_pop(dst);
+        tp_path_pop(src);
+        if (ret == -1) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    if (closedir(dir) == -1) {
+        fprintf(stderr, "ERROR: Failed to close directory. \n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Copy the tree below the path of a context into another directory.
+ * @details  The result is the same as serializing with ctx and deserializing
+ * the output into target, with the filter rules and the clobber option of
+ * ctx; the target directory is created if it does not exist.
+ *
+ * @param ctx  The context whose path names the source directory.
+ * @param target  The pathname of the destination directory.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int transplant_copy(struct transplant_ctx *ctx, char *target) {
+    struct transplant_ctx dst;
+    if (tp_ctx_init(&dst, NULL, NULL, NULL, NULL) == -1) {
+        return -1;
+    }
+    dst.options = ctx->options;
+    int ret = -1;
+    struct stat root;
+    if (tp_path_init(&dst, target) == 0) {
+        if (mkdir(dst.path_buf, 0777) == -1 && errno != EEXIST) {
+            fprintf(stderr, "ERROR: Failed to create target directory %s. \n", dst.path_buf);
+        } else if (stat(dst.path_buf, &root) == -1 || !S_ISDIR(root.st_mode)) {
+            fprintf(stderr, "ERROR: Target %s is not a directory. \n", dst.path_buf);
+        } else {
+            ret = copy_directory(ctx, &dst, &root);
+        }
+    }
+    tp_ctx_destroy(&dst);
+    return ret;
+}
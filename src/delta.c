@@ -0,0 +1,720 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "chunk.h"
+#include "delta.h"
+#include "wire.h"
+#include "durability.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  Choose the block size of the signature of a file.
+ * @details  About the square root of the size, as rsync does, so that the
+ * signature and the expected literal data grow alike; rounded to a multiple
+ * of 1K and kept between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK.
+ */
+uint32_t delta_block_size(uint64_t file_size) {
+    uint64_t block = 1;
+    while (block * block < file_size) block <<= 1;
+    block = (block + 1023) & ~(uint64_t)1023;
+    if (block < DELTA_MIN_BLOCK) block = DELTA_MIN_BLOCK;
+    if (block > DELTA_MAX_BLOCK) block = DELTA_MAX_BLOCK;
+    return block;
+}
+
+/*
+ * Rolling checksum of rsync: a is the sum of the bytes and b the sum of the
+ * running values of a, both modulo 2^16.  Either can be updated in constant
+ * time when the window slides by one byte.
+ */
+static uint32_t weak_sum(const unsigned char *data, size_t length) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += *(data + i);
+        b += (length - i) * *(data + i);
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+static uint32_t weak_roll(uint32_t weak, size_t length, unsigned char out, unsigned char in) {
+    uint32_t a = weak & 0xFFFF, b = weak >> 16;
+    a = (a - out + in) & 0xFFFF;
+    b = (b - length * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * Strong hash of a block: MurmurHash3 x64 128, seed 0.  Not cryptographic,
+ * but with the weak checksum in front a false match needs a collision of
+ * both on the same block, which is what rsync relies on too.
+ */
+static void strong_hash(const unsigned char *data, size_t length, uint64_t *out1, uint64_t *out2) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+    size_t blocks = length / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        __builtin_memcpy(&k1, data + i * 16, 8);
+        __builtin_memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    const unsigned char *tail = data + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = length & 15; i > 8; i--) k2 ^= (uint64_t)*(tail + i - 1) << ((i - 9) * 8);
+    if ((length & 15) > 8) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (size_t i = (length & 15) < 8 ? (length & 15) : 8; i > 0; i--) k1 ^= (uint64_t)*(tail + i - 1) << ((i - 1) * 8);
+    if ((length & 15) > 0) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= length; h2 ^= length;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    *out1 = h1;
+    *out2 = h2;
+}
+
+static int put_u64(struct transplant_ctx *ctx, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        if (tp_putc(ctx, (value >> (i * 8)) & 0xFF) == EOF) return -1;
+    }
+    return 0;
+}
+
+static int put_u32(struct transplant_ctx *ctx, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        if (tp_putc(ctx, (value >> (i * 8)) & 0xFF) == EOF) return -1;
+    }
+    return 0;
+}
+
+static int get_u64(struct transplant_ctx *ctx, uint64_t *value) {
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        *value = (*value << 8) | byte;
+    }
+    return 0;
+}
+
+static int get_u32(struct transplant_ctx *ctx, uint32_t *value) {
+    uint64_t wide = 0;
+    for (int i = 0; i < 4; i++) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        wide = (wide << 8) | byte;
+    }
+    *value = wide;
+    return 0;
+}
+
+/*
+ * @brief  Serialize the signature of the file named by path_buf as a single
+ * SIGNATURE record, in place of its contents.
+ *
+ * @param depth  The value to be used in the depth field of the record.
+ * @param size  The size of the file, from its DIRECTORY_ENTRY.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int serialize_file_signature(struct transplant_ctx *ctx, int depth, uint64_t size) {
+    uint32_t block_size = delta_block_size(size);
+    uint64_t count = (size + block_size - 1) / block_size;
+    int fd = open(ctx->path_buf, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open  file, not a file. \n");
+        return -1;
+    }
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    if (tp_write_record_header(ctx, SIGNATURE_TYPE, depth, 16 + 12 + count * 20) == -1 ||
+        put_u32(ctx, block_size) == -1 || put_u64(ctx, size) == -1) {
+        close(fd);
+        return -1;
+    }
+    for (uint64_t offset = 0; offset < size; offset += block_size) {
+        size_t want = size - offset < block_size ? size - offset : block_size;
+        size_t got = 0;
+        while (got < want) { // DATA_BUF_SIZE is at least DELTA_MAX_BLOCK
+            ssize_t n = read(fd, ctx->data_buf + got, want - got);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                close(fd);
+                fprintf(stderr, n == 0 ? "ERROR: Unexpected EOF. \n" : "ERROR: I/O error occurred.\n");
+                return -1;
+            }
+            got += n;
+        }
+        uint64_t strong1, strong2;
+        strong_hash((unsigned char *)ctx->data_buf, want, &strong1, &strong2);
+        if (put_u32(ctx, weak_sum((unsigned char *)ctx->data_buf, want)) == -1 ||
+            put_u64(ctx, strong1) == -1 || put_u64(ctx, strong2) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (close(fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to close file. \n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * State of the delta encoder for one file: the pending copy is extended as
+ * long as matches are consecutive in the old file.
+ */
+struct delta_out {
+    struct transplant_ctx *ctx;
+    int depth;
+    uint64_t copy_offset;
+    uint64_t copy_length;
+};
+
+static int flush_copy(struct delta_out *out) {
+    if (out->copy_length == 0) return 0;
+    if (tp_write_record_header(out->ctx, DELTA_COPY_TYPE, out->depth, 16 + 16) == -1 ||
+        put_u64(out->ctx, out->copy_offset) == -1 || put_u64(out->ctx, out->copy_length) == -1) {
+        return -1;
+    }
+    out->copy_length = 0;
+    return 0;
+}
+
+static int emit_copy(struct delta_out *out, uint64_t offset, uint64_t length) {
+    if (out->copy_length > 0 && out->copy_offset + out->copy_length == offset) {
+        out->copy_length += length;
+        return 0;
+    }
+    if (flush_copy(out) == -1) return -1;
+    out->copy_offset = offset;
+    out->copy_length = length;
+    return 0;
+}
+
+static int emit_literal(struct delta_out *out, char *data, size_t length) {
+    if (length == 0) return 0;
+    if (flush_copy(out) == -1) return -1;
+    if (tp_write_record_header(out->ctx, DELTA_LITERAL_TYPE, out->depth, 16 + length) == -1) return -1;
+    return tp_write(out->ctx, data, length);
+}
+
+/*
+ * Hash table from weak checksums to the full blocks of a signature, chained
+ * through an array of next indices (-1 ends a chain).
+ */
+struct weak_index {
+    int64_t *heads;
+    int64_t *next;
+    uint64_t mask;
+};
+
+static int weak_index_build(struct weak_index *index, struct file_sig *sig) {
+    uint64_t full = sig->file_size / sig->block_size;
+    uint64_t buckets = 1;
+    while (buckets < full * 2) buckets <<= 1;
+    index->mask = buckets - 1;
+    index->heads = malloc(buckets * sizeof(int64_t));
+    index->next = malloc((full ? full : 1) * sizeof(int64_t));
+    if (!index->heads || !index->next) {
+        free(index->heads);
+        free(index->next);
+        fprintf(stderr, "ERROR: Out of memory indexing the signature of %s. \n", sig->path);
+        return -1;
+    }
+    for (uint64_t i = 0; i < buckets; i++) *(index->heads + i) = -1;
+    for (uint64_t i = full; i > 0; i--) { // insert backwards so that chains are in file order
+        struct block_sig *block = sig->blocks + i - 1;
+        int64_t *head = index->heads + ((block->weak * 0x9E3779B1u) & index->mask);
+        *(index->next + i - 1) = *head;
+        *head = i - 1;
+    }
+    return 0;
+}
+
+/*
+ * Find a full block of the old file equal to the length bytes at data.
+ * Returns its index, or -1.
+ */
+static int64_t weak_index_find(struct weak_index *index, struct file_sig *sig, uint32_t weak,
+                               const unsigned char *data, size_t length) {
+    int hashed = 0;
+    uint64_t strong1 = 0, strong2 = 0;
+    for (int64_t i = *(index->heads + ((weak * 0x9E3779B1u) & index->mask)); i != -1; i = *(index->next + i)) {
+        struct block_sig *block = sig->blocks + i;
+        if (block->weak != weak) continue;
+        if (!hashed) { // only hash the window when the cheap checksum agrees
+            strong_hash(data, length, &strong1, &strong2);
+            hashed = 1;
+        }
+        if (block->strong1 == strong1 && block->strong2 == strong2) return i;
+    }
+    return -1;
+}
+
+/*
+ * @brief  Serialize the file named by path_buf as a delta against the old
+ * version described by sig.
+ * @details  A window of one block slides over the file; wherever its weak
+ * checksum and then its strong hash match a block of the old file, a copy of
+ * that block is sent, otherwise the first byte of the window becomes literal
+ * data.  The file is read until end of file, through a buffer that holds the
+ * pending literal data and the window.
+ *
+ * @param depth  The value to be used in the depth field of the records.
+ * @param sig  The signature of the old version of the file.
+ * @param size  The size of the file, from its DIRECTORY_ENTRY.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int serialize_file_delta(struct transplant_ctx *ctx, int depth, struct file_sig *sig, uint64_t size) {
+    size_t block = sig->block_size;
+    size_t capacity = DELTA_LITERAL_MAX + 2 * DELTA_MAX_BLOCK;
+    unsigned char *buf = malloc(capacity);
+    struct weak_index index;
+    if (!buf || weak_index_build(&index, sig) == -1) {
+        free(buf);
+        fprintf(stderr, "ERROR: Out of memory computing the delta of %s. \n", ctx->path_buf);
+        return -1;
+    }
+    int fd = open(ctx->path_buf, O_RDONLY);
+    if (fd == -1) {
+        free(buf);
+        free(index.heads);
+        free(index.next);
+        fprintf(stderr, "ERROR: Failed to open  file, not a file. \n");
+        return -1;
+    }
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+    struct delta_out out = { ctx, depth, 0, 0 };
+    size_t lit = 0, pos = 0, filled = 0; // buf holds the file from offset base; literal data is lit..pos
+    uint64_t base = 0;
+    int eof = 0, have_weak = 0, ret = 0;
+    uint32_t weak = 0;
+    while (ret == 0) {
+        if (pos + block > filled && !eof) { // slide the pending data to the front and read more
+            __builtin_memmove(buf, buf + lit, filled - lit);
+            base += lit;
+            pos -= lit;
+            filled -= lit;
+            lit = 0;
+            ssize_t n = read(fd, buf + filled, capacity - filled);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) {
+                fprintf(stderr, "ERROR: I/O error occurred.\n");
+                ret = -1;
+                break;
+            }
+            if (n == 0) eof = 1;
+            filled += n;
+            continue;
+        }
+        if (pos + block > filled) break; // less than a block left
+
+        if (!have_weak) {
+            weak = weak_sum(buf + pos, block);
+            have_weak = 1;
+        }
+        int64_t match = weak_index_find(&index, sig, weak, buf + pos, block);
+        if (match != -1) {
+            if (emit_literal(&out, (char *)buf + lit, pos - lit) == -1 ||
+                emit_copy(&out, (uint64_t)match * block, block) == -1) {
+                ret = -1;
+                break;
+            }
+            pos += block;
+            lit = pos;
+            have_weak = 0;
+            continue;
+        }
+        if (pos + block < filled) {
+            weak = weak_roll(weak, block, *(buf + pos), *(buf + pos + block));
+        } else {
+            have_weak = 0; // the next byte has not been read yet
+        }
+        pos++;
+        if (pos - lit >= DELTA_LITERAL_MAX) {
+            ret = emit_literal(&out, (char *)buf + lit, pos - lit);
+            lit = pos;
+        }
+    }
+
+    if (ret == 0) {
+        // The tail is shorter than a block: it can still be the short last block of the old file
+        size_t tail = filled - pos;
+        uint64_t last = sig->count ? (sig->count - 1) * (uint64_t)block : 0;
+        struct block_sig *last_sig = sig->count ? sig->blocks + sig->count - 1 : NULL;
+        uint64_t strong1, strong2;
+        if (tail > 0 && last_sig && sig->file_size - last == tail && last_sig->weak == weak_sum(buf + pos, tail)) {
+            strong_hash(buf + pos, tail, &strong1, &strong2);
+            if (strong1 == last_sig->strong1 && strong2 == last_sig->strong2) {
+                ret = emit_literal(&out, (char *)buf + lit, pos - lit);
+                if (ret == 0) ret = emit_copy(&out, last, tail);
+                lit = pos = filled;
+            }
+        }
+        if (ret == 0) ret = emit_literal(&out, (char *)buf + lit, filled - lit);
+        if (ret == 0) ret = flush_copy(&out);
+        if (ret == 0 && (tp_write_record_header(ctx, FILE_END_TYPE, depth, 16 + 8) == -1 || put_u64(ctx, base + filled) == -1)) {
+            ret = -1;
+        }
+    }
+    free(buf);
+    free(index.heads);
+    free(index.next);
+    if (close(fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to close file. \n");
+        return -1;
+    }
+    return ret;
+}
+
+static int write_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            fprintf(stderr, "ERROR: Failed to write file contents in deserialize file. \n");
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/*
+ * Apply the delta records of one file, the first of type type, writing the
+ * new version to out.  Returns 0 or -1.
+ */
+static int apply_delta(struct transplant_ctx *ctx, int depth, int type, int old, int out) {
+    uint64_t written = 0;
+    while (type == DELTA_COPY_TYPE || type == DELTA_LITERAL_TYPE) {
+        uint64_t size;
+        if (wire_read_size(ctx, &size) == -1 || size < 16) {
+            fprintf(stderr, "ERROR: Invalid size of delta record. \n");
+            return -1;
+        }
+        if (type == DELTA_COPY_TYPE) {
+            uint64_t offset, length;
+            if (size != 32 || get_u64(ctx, &offset) == -1 || get_u64(ctx, &length) == -1) {
+                fprintf(stderr, "ERROR: Invalid DELTA COPY record. \n");
+                return -1;
+            }
+            while (length > 0) {
+                size_t want = length < DATA_BUF_SIZE ? length : DATA_BUF_SIZE;
+                ssize_t n = pread(old, ctx->data_buf, want, offset);
+                if (n == -1 && errno == EINTR) continue;
+                if (n <= 0) {
+                    fprintf(stderr, "ERROR: The existing copy of %s does not match the signature the delta was made against. \n", ctx->path_buf);
+                    return -1;
+                }
+                if (write_all(out, ctx->data_buf, n) == -1) return -1;
+                offset += n;
+                length -= n;
+                written += n;
+            }
+        } else {
+            uint64_t length = size - 16;
+            while (length > 0) {
+                size_t want = length < DATA_BUF_SIZE ? length : DATA_BUF_SIZE;
+                if (tp_read(ctx, ctx->data_buf, want) == -1) {
+                    fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read file contents in deserialize file. \n");
+                    return -1;
+                }
+                if (write_all(out, ctx->data_buf, want) == -1) return -1;
+                length -= want;
+                written += want;
+            }
+        }
+        type = check_while_condition(ctx, depth);
+    }
+
+    uint64_t size, length;
+    if (type != FILE_END_TYPE || wire_read_size(ctx, &size) == -1 || size != 16 + 8 || get_u64(ctx, &length) == -1) {
+        fprintf(stderr, "ERROR: Expected FILE END record after the delta of a file. \n");
+        return -1;
+    }
+    if (length != written) {
+        fprintf(stderr, "ERROR: Delta of %s rebuilt %lu bytes instead of %lu. \n", ctx->path_buf,
+                (unsigned long)written, (unsigned long)length);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Rebuild the file named by path_buf from its existing old version and
+ * the delta records that follow.
+ * @details  This function is called by deserialize_file() once it has read the
+ * magic bytes and the type of the first record of the delta.  The new version
+ * is written under a temporary name from durability_temp_path() next to the
+ * old one, so the old version is never modified while it is being read, and
+ * left to the caller to finish with durability_close(), which renames it over
+ * the old one; on error it is abandoned with durability_abandon().
+ *
+ * @param depth  The value of the depth field that is expected in the records.
+ * @param type  The type of the first record.
+ * @param permissions  The permissions of the file, or -1 to leave them as
+ * open() sets them.
+ * @return The descriptor of the new version, written in full, or -1 on error.
+ */
+int deserialize_file_delta(struct transplant_ctx *ctx, int depth, int type, int permissions) {
+    if (ctx->wire_version != WIRE_V2) { // the depth was read with the header in version 2
+        int depth_parsed = 0;
+        for (int i = 0; i < 4; i++) {
+            int byte = debug_getchar(ctx);
+            if (byte == EOF) {
+                fprintf(stderr, "ERROR: Unexpected EOF character when reading depth of file. \n");
+                return -1;
+            }
+            depth_parsed = (depth_parsed << 8) | byte;
+        }
+        if (depth_parsed != depth) {
+            fprintf(stderr, "ERROR: Depth parsed is not as expected. \n");
+            return -1;
+        }
+    }
+
+    int old = open(ctx->path_buf, O_RDONLY);
+    if (old == -1) {
+        fprintf(stderr, "ERROR: %s was sent as a delta but there is no old version to apply it to. \n", ctx->path_buf);
+        return -1;
+    }
+    if (!(ctx->options & TRANSPLANT_CLOBBER)) { // the old version is replaced
+        close(old);
+        fprintf(stderr, "ERROR: File already exists but clobber flag not passed so cannot overwrite file. \n");
+        return -1;
+    }
+    char *name = durability_temp_path(ctx);
+    int out = name ? open(name, O_WRONLY | O_CREAT | O_EXCL, permissions == -1 ? 0666 : permissions) : -1;
+    if (out == -1) {
+        close(old);
+        if (name) fprintf(stderr, "ERROR: Failed to create file %s. \n", name);
+        return -1;
+    }
+    int ret = apply_delta(ctx, depth, type, old, out);
+    close(old);
+    if (ret == 0 && permissions != -1 && fchmod(out, permissions) != 0) { // the creation mask may have taken some away
+        fprintf(stderr, "ERROR: Permissions of file written not correct. \n");
+        ret = -1;
+    }
+    if (ret == -1) {
+        durability_abandon(ctx, out);
+        return -1;
+    }
+    return out;
+}
+
+static uint64_t path_hash(char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    for (char *p = path; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int path_equal(char *a, char *b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+/*
+ * @brief  Look up the signature of a file by its path relative to the root.
+ * @return The signature, or NULL if the old tree had no such regular file.
+ */
+struct file_sig *signature_find(struct signature_set *set, char *path) {
+    for (struct file_sig *sig = *(set->buckets + (path_hash(path) & (set->bucket_count - 1))); sig; sig = sig->next) {
+        if (path_equal(sig->path, path)) return sig;
+    }
+    return NULL;
+}
+
+/*
+ * @brief  Free a set of signatures.
+ */
+void signature_free(struct signature_set *set) {
+    if (!set) return;
+    for (size_t i = 0; i < set->bucket_count; i++) {
+        struct file_sig *sig = *(set->buckets + i);
+        while (sig) {
+            struct file_sig *next = sig->next;
+            free(sig->path);
+            free(sig->blocks);
+            free(sig);
+            sig = next;
+        }
+    }
+    free(set->buckets);
+    free(set);
+}
+
+/*
+ * Read the payload of a SIGNATURE record for the file at path and add it to set.
+ */
+static int signature_read(struct transplant_ctx *ctx, struct signature_set *set, char *path, int path_length) {
+    uint64_t size;
+    struct file_sig *sig = calloc(1, sizeof(struct file_sig));
+    if (!sig) return -1;
+    if (get_u64(ctx, &size) == -1 || get_u32(ctx, &sig->block_size) == -1 || get_u64(ctx, &sig->file_size) == -1 ||
+        sig->block_size < DELTA_MIN_BLOCK || sig->block_size > DELTA_MAX_BLOCK) {
+        free(sig);
+        fprintf(stderr, "ERROR: Invalid SIGNATURE record. \n");
+        return -1;
+    }
+    sig->count = (sig->file_size + sig->block_size - 1) / sig->block_size;
+    if (size != 16 + 12 + sig->count * 20) {
+        free(sig);
+        fprintf(stderr, "ERROR: Invalid size of SIGNATURE record. \n");
+        return -1;
+    }
+    sig->path = malloc(path_length + 1);
+    sig->blocks = malloc((sig->count ? sig->count : 1) * sizeof(struct block_sig));
+    if (!sig->path || !sig->blocks) {
+        free(sig->path);
+        free(sig->blocks);
+        free(sig);
+        fprintf(stderr, "ERROR: Out of memory loading signature. \n");
+        return -1;
+    }
+    tp_copy(sig->path, path, path_length + 1);
+    for (struct block_sig *block = sig->blocks; block < sig->blocks + sig->count; block++) {
+        if (get_u32(ctx, &block->weak) == -1 || get_u64(ctx, &block->strong1) == -1 || get_u64(ctx, &block->strong2) == -1) {
+            free(sig->path);
+            free(sig->blocks);
+            free(sig);
+            fprintf(stderr, "ERROR: Unexpected EOF reading SIGNATURE record. \n");
+            return -1;
+        }
+    }
+    struct file_sig **bucket = set->buckets + (path_hash(path) & (set->bucket_count - 1));
+    sig->next = *bucket;
+    *bucket = sig;
+    set->file_count++;
+    return 0;
+}
+
+/*
+ * Skip the rest of a record whose size field has not been read yet.
+ */
+static int skip_record(struct transplant_ctx *ctx) {
+    uint64_t size;
+    if (get_u64(ctx, &size) == -1 || size < 16) return -1;
+    for (uint64_t left = size - 16; left > 0; ) {
+        size_t want = left < DATA_BUF_SIZE ? left : DATA_BUF_SIZE;
+        if (tp_read(ctx, ctx->data_buf, want) == -1) return -1;
+        left -= want;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Load the signatures of a tree from a file written by --signature.
+ * @details  The records are walked like deserialize() does, keeping track of
+ * the relative path of every entry, but nothing is created.
+ *
+ * @param path  The pathname of the signature file.
+ * @return The signatures, or NULL if the file cannot be read or is malformed.
+ */
+struct signature_set *signature_load(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open signature file %s. \n", path);
+        return NULL;
+    }
+    struct transplant_ctx ctx;
+    struct signature_set *set = calloc(1, sizeof(struct signature_set));
+    if (!set || tp_ctx_init(&ctx, NULL, NULL, NULL, NULL) == -1) {
+        free(set);
+        close(fd);
+        return NULL;
+    }
+    set->bucket_count = 1024;
+    set->buckets = calloc(set->bucket_count, sizeof(struct file_sig *));
+    transplant_set_source(&ctx, transplant_fd_read, (void *)(intptr_t)fd);
+
+    // path_buf holds the relative path of the current entry; prefix_length(d) is
+    // the length of the path of the directory whose entries are at depth d
+    int *prefix_length = malloc(PATH_MAX / 2 * sizeof(int));
+    char *rel = ctx.path_buf;
+    int length = 0;
+    *rel = '\0';
+    int ret = (set->buckets && prefix_length) ? 0 : -1;
+    int done = 0;
+    while (ret == 0 && !done) {
+        int magic1 = tp_getc(&ctx), magic2 = tp_getc(&ctx), magic3 = tp_getc(&ctx);
+        int type = tp_getc(&ctx);
+        uint32_t depth;
+        if (magic1 != 0x0C || magic2 != 0x0D || magic3 != 0xED || type == EOF || get_u32(&ctx, &depth) == -1 ||
+            depth >= PATH_MAX / 2) {
+            fprintf(stderr, "ERROR: Malformed record in signature file %s. \n", path);
+            ret = -1;
+            break;
+        }
+        if (type == 2) { // START_OF_DIRECTORY: entries at this depth are below the current path
+            *(prefix_length + depth) = depth > 1 ? length : 0;
+            ret = skip_record(&ctx);
+        } else if (type == 4) { // DIRECTORY_ENTRY: the relative path of the entry
+            uint64_t size;
+            if (depth == 0 || get_u64(&ctx, &size) == -1 || size < 28 || size - 28 >= NAME_MAX ||
+                tp_read(&ctx, ctx.name_buf, 12) == -1) {
+                ret = -1;
+                break;
+            }
+            length = *(prefix_length + depth);
+            if (length > 0 && length < PATH_MAX - 1) *(rel + length++) = '/';
+            if (length + (size - 28) >= PATH_MAX || tp_read(&ctx, rel + length, size - 28) == -1) {
+                ret = -1;
+                break;
+            }
+            length += size - 28;
+            *(rel + length) = '\0';
+        } else if (type == SIGNATURE_TYPE) {
+            ret = signature_read(&ctx, set, rel, length);
+        } else if (type == 1) { // END_OF_TRANSMISSION
+            done = 1;
+        } else {
+            ret = skip_record(&ctx);
+        }
+    }
+    if (ret == -1) {
+        fprintf(stderr, "ERROR: Failed to load signature file %s. \n", path);
+    }
+    free(prefix_length);
+    tp_ctx_destroy(&ctx);
+    close(fd);
+    if (ret == -1) {
+        signature_free(set);
+        return NULL;
+    }
+    return set;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "global.h"
+#include "debug.h"
+#include "directio.h"
+#include "context.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+// DIRECT_IO_BUF_SIZE bytes aligned to DIRECT_IO_ALIGN, kept for the lifetime of the context
+static char *get_direct_buf(struct transplant_ctx *ctx) {
+    if (!ctx->direct_buf && posix_memalign((void **)&ctx->direct_buf, DIRECT_IO_ALIGN, DIRECT_IO_BUF_SIZE) != 0) {
+        ctx->direct_buf = NULL;
+        fprintf(stderr, "ERROR: Failed to allocate aligned buffer for direct I/O. \n");
+    }
+    return ctx->direct_buf;
+}
+
+/*
+ * @brief  Copy the contents of the file named by path_buf to the sink of the context,
+ * reading it with O_DIRECT.
+ * @details  This function is called by serialize_file() after the FILE_DATA header
+ * has been written.  Reads are always a whole number of aligned blocks; the last
+ * one simply comes back short at end of file, so the unaligned tail needs no
+ * special treatment on this side.
+ *
+ * @param size  The number of bytes of data in the file to be serialized.
+ * @return 0 in case of success, -1 in case of an error, or 1 if the filesystem
+ * does not support O_DIRECT, in which case nothing has been written and the
+ * caller should copy the file through the page cache instead.
+ */
+int serialize_file_direct(struct transplant_ctx *ctx, uint64_t size) {
+    char *buf = get_direct_buf(ctx);
+    if (!buf) return -1;
+    int fd = open(ctx->path_buf, O_RDONLY | O_DIRECT);
+    if (fd == -1) {
+        if (errno == EINVAL) return 1; // e.g. tmpfs
+        fprintf(stderr, "ERROR: Failed to open  file, not a file. \n");
+        return -1;
+    }
+
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        ssize_t n = read(fd, buf, DIRECT_IO_BUF_SIZE);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            close(fd);
+            fprintf(stderr, "ERROR: I/O error occurred.\n");
+            return -1;
+        }
+        if (n == 0) {
+            close(fd);
+            fprintf(stderr, "ERROR: Unexpected EOF. \n");
+            return -1; // file shrank since it was stat'ed
+        }
+        size_t take = (uint64_t)n < remaining ? (size_t)n : (size_t)remaining; // ignore bytes appended since
+        if (tp_write(ctx, buf, take) == -1) {
+            close(fd);
+            return -1;
+        }
+        remaining -= take;
+    }
+
+    if (close(fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to close file. \n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Copy the payload of a FILE_DATA record from the source of the context into
+ * a file opened with O_DIRECT.
+ * @details  Whole aligned blocks are written directly.  A final partial block
+ * cannot be written with O_DIRECT, so O_DIRECT is switched off on the
+ * descriptor for the tail, which then goes through the page cache.
+ *
+ * @param fd  A descriptor for the file, opened for writing with O_DIRECT.
+ * @param size  The number of bytes in the payload.
+ * @return 0 in case of success, -1 in case of an error.
+ */
+int deserialize_file_direct(struct transplant_ctx *ctx, int fd, uint64_t size) {
+    char *buf = get_direct_buf(ctx);
+    if (!buf) return -1;
+
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        size_t want = remaining < DIRECT_IO_BUF_SIZE ? (size_t)remaining : DIRECT_IO_BUF_SIZE;
+        if (tp_read(ctx, buf, want) == -1) {
+            fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read file contents in deserialize file. \n");
+            return -1;
+        }
+        size_t aligned = want & ~((size_t)DIRECT_IO_ALIGN - 1);
+        if (aligned < want) { // the unaligned tail: leave direct mode for the rest of the file
+            int flags = fcntl(fd, F_GETFL);
+            if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+                fprintf(stderr, "ERROR: Failed to leave direct I/O mode for the tail of the file. \n");
+                return -1;
+            }
+        }
+        for (char *out = buf; out < buf + want; ) {
+            ssize_t n = write(fd, out, buf + want - out);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "ERROR: Failed to write file contents in deserialize file. \n");
+                return -1;
+            }
+            out += n;
+        }
+        remaining -= want;
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE // syncfs(), renameat2()
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "durability.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  The TRANSPLANT_DURABILITY_* value of a --durability argument.
+ * @return The value, or -1 if the name is not one of none, batched and per-file.
+ */
+int durability_parse(char *name) {
+    if (arg_equals(name, "none")) return TRANSPLANT_DURABILITY_NONE;
+    if (arg_equals(name, "batched")) return TRANSPLANT_DURABILITY_BATCHED;
+    if (arg_equals(name, "per-file")) return TRANSPLANT_DURABILITY_PER_FILE;
+    return -1;
+}
+
+/*
+ * Write into temp (PATH_MAX bytes) a name in the directory of path for a
+ * new version of it, unique to the process and the context.
+ */
+static int temp_name(struct transplant_ctx *ctx, char *temp, char *path, int path_length) {
+    char *name = path + path_length;
+    while (name > path && *(name - 1) != '/') name--;
+    int prefix = name - path;
+    tp_copy(temp, path, prefix);
+    int length = snprintf(temp + prefix, PATH_MAX - prefix, ".transplant-%d-%u", (int)getpid(), ctx->temp_count++);
+    if (length < 0 || length >= PATH_MAX - prefix) {
+        fprintf(stderr, "ERROR: Path of the temporary file for %s is too long. \n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  A name for a new version of the file named by path_buf, in the
+ * same directory, that durability_close() renames to path_buf.
+ * @details  The name is unique to the process and the file, in temp_path,
+ * and is to be created with O_EXCL: an entry of the same name is never
+ * overwritten.
+ * @return The pathname, or NULL on error.
+ */
+char *durability_temp_path(struct transplant_ctx *ctx) {
+    if (!ctx->temp_path && !(ctx->temp_path = malloc(PATH_MAX))) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return NULL;
+    }
+    if (temp_name(ctx, ctx->temp_path, ctx->path_buf, ctx->path_length) == -1) {
+        return NULL;
+    }
+    ctx->temp_open = 1;
+    return ctx->temp_path;
+}
+
+/*
+ * @brief  Like durability_temp_path(), for a file named by path rather than
+ * path_buf, to be finished with durability_close_path().
+ * @return The pathname, to be freed by the caller, or NULL on error.
+ */
+char *durability_temp_name(struct transplant_ctx *ctx, char *path) {
+    char *temp = malloc(PATH_MAX);
+    if (!temp) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return NULL;
+    }
+    if (temp_name(ctx, temp, path, len_string(path)) == -1) {
+        free(temp);
+        return NULL;
+    }
+    return temp;
+}
+
+/*
+ * @brief  The pathname under which the file named by path_buf is to be written.
+ * @details  path_buf itself, except in per-file mode: then a name from
+ * durability_temp_path().
+ * @return The pathname, or NULL on error.
+ */
+char *durability_create_path(struct transplant_ctx *ctx) {
+    ctx->temp_open = 0;
+    if (ctx->durability != TRANSPLANT_DURABILITY_PER_FILE) {
+        return ctx->path_buf;
+    }
+    return durability_temp_path(ctx);
+}
+
+/*
+ * Rename temp to path, without replacing an existing entry unless the
+ * clobber bit is set.
+ */
+static int install(struct transplant_ctx *ctx, char *temp, char *path) {
+    if (ctx->options & TRANSPLANT_CLOBBER) {
+        if (renameat(AT_FDCWD, temp, AT_FDCWD, path) == 0) return 0;
+    } else {
+        int ret = renameat2(AT_FDCWD, temp, AT_FDCWD, path, RENAME_NOREPLACE);
+        if (ret == -1 && errno == EINVAL) { // the filesystem cannot check for us
+            struct stat stat_buf;
+            if (lstat(path, &stat_buf) == 0) errno = EEXIST;
+            else ret = renameat(AT_FDCWD, temp, AT_FDCWD, path);
+        }
+        if (ret == 0) return 0;
+    }
+    if (errno == EEXIST) {
+        fprintf(stderr, "ERROR: File already exists but clobber flag not passed so cannot overwrite file. \n");
+    } else {
+        fprintf(stderr, "ERROR: Failed to rename the restored file into place at %s. \n", path);
+    }
+    return -1;
+}
+
+/*
+ * @brief  Close the file open as fd, written in full, and name it path.
+ * @details  In per-file mode the file is synced first.  A file written
+ * under the temporary name temp is then renamed to path, or removed on
+ * error.
+ * @param temp  The name the file was created under, or NULL if it is path.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int durability_close_path(struct transplant_ctx *ctx, int fd, char *temp, char *path) {
+    int ret = 0;
+    if (ctx->durability == TRANSPLANT_DURABILITY_PER_FILE && fsync(fd) == -1) { // batched: left to syncfs()
+        fprintf(stderr, "ERROR: Failed to sync %s. \n", path);
+        ret = -1;
+    }
+    if (close(fd) == -1) {
+        fprintf(stderr, "ERROR: File failed to close in deserialize file. \n");
+        ret = -1;
+    }
+    if (temp) {
+        if (ret == 0) ret = install(ctx, temp, path);
+        if (ret == -1) unlink(temp);
+    }
+    return ret;
+}
+
+/*
+ * @brief  Close a file opened under durability_create_path() or
+ * durability_temp_path() and written in full, as durability_close_path()
+ * does for path_buf.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int durability_close(struct transplant_ctx *ctx, int fd) {
+    char *temp = ctx->temp_open ? ctx->temp_path : NULL;
+    ctx->temp_open = 0;
+    return durability_close_path(ctx, fd, temp, ctx->path_buf);
+}
+
+/*
+ * @brief  Close a file opened under durability_create_path() or
+ * durability_temp_path() after an error; a partial file under a temporary
+ * name is removed and path_buf is left as it was.
+ */
+void durability_abandon(struct transplant_ctx *ctx, int fd) {
+    close(fd);
+    if (ctx->temp_open) {
+        ctx->temp_open = 0;
+        unlink(ctx->temp_path);
+    }
+}
+
+/*
+ * @brief  At the END_OF_DIRECTORY of the directory named by path_buf, make
+ * what was restored in it durable: its entries in per-file mode, the whole
+ * filesystem for the root in batched mode.
+ * @param root  Nonzero for the root of the transmission.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int durability_directory(struct transplant_ctx *ctx, int root) {
+    if (ctx->durability == TRANSPLANT_DURABILITY_NONE || (ctx->durability == TRANSPLANT_DURABILITY_BATCHED && !root)) {
+        return 0;
+    }
+    int fd = open(ctx->path_buf, O_RDONLY | O_DIRECTORY);
+    int ret = fd == -1 ? -1 : ctx->durability == TRANSPLANT_DURABILITY_BATCHED ? syncfs(fd) : fsync(fd);
+    if (ret == -1) {
+        fprintf(stderr, "ERROR: Failed to sync %s. \n", ctx->path_buf);
+    }
+    if (fd != -1) close(fd);
+    return ret;
+}
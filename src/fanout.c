@@ -0,0 +1,446 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "fanout.h"
+#include "watch.h"
+#include "metadata.h"
+#include "durability.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#define JOB_DIRECTORY 1
+#define JOB_FILE      2
+#define JOB_SYMLINK   3
+#define JOB_REMOVE    4
+#define JOB_RENAME    5
+#define JOB_METADATA  6
+#define JOB_SYNC      7
+
+/*
+ * An entry of the first target to be recreated in a replica.  The strings
+ * are stored after the structure, in the same allocation.
+ */
+struct fanout_job {
+    int kind;                   // JOB_*
+    int permissions;            // JOB_FILE, JOB_METADATA: permissions to set, -1 for none; JOB_SYNC: 1 for the root
+    int has_times;              // JOB_METADATA: times to set
+    struct entry_times times;
+    int clobber;                // TRANSPLANT_CLOBBER was set when the job was queued
+    char *path;                 // relative to the roots; JOB_RENAME: the old path
+    char *other;                // JOB_SYMLINK: target of the link; JOB_RENAME: the new path
+    struct fanout_job *next;
+};
+
+/*
+ * Pathname of the entry of path_buf relative to the first target.
+ */
+static char *relative_path(struct transplant_ctx *ctx) {
+    char *rel = ctx->path_buf + ctx->fanout->root_length;
+    return *rel == '/' ? rel + 1 : rel;
+}
+
+/*
+ * Store root, '/' and rel in buf, which has room for PATH_MAX bytes.
+ * Returns the length, or -1 if the pathname is too long.
+ */
+static int join(char *buf, char *root, char *rel) {
+    int root_length = len_string(root), rel_length = len_string(rel);
+    if (root_length + 1 + rel_length >= PATH_MAX) {
+        fprintf(stderr, "ERROR: Path %s/%s is too long. \n", root, rel);
+        return -1;
+    }
+    tp_copy(buf, root, root_length);
+    *(buf + root_length) = '/';
+    tp_copy(buf + root_length + 1, rel, rel_length + 1);
+    return root_length + 1 + rel_length;
+}
+
+static int replicate_directory(struct replica *replica, struct fanout_job *job) {
+    char *path = replica->ctx->path_buf;
+    if (mkdir(path, 0777) == 0) {
+        return 0;
+    }
+    struct stat stat_buf;
+    if (errno == EEXIST && job->clobber && stat(path, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode)) {
+        return 0;
+    }
+    fprintf(stderr, "ERROR: Failed to make new directory %s (it may already exist and the clobber flag was not passed). \n", path);
+    return -1;
+}
+
+static int replicate_file(struct fanout *fanout, struct replica *replica, struct fanout_job *job) {
+    struct transplant_ctx *rctx = replica->ctx;
+    if (join(rctx->link_buf, fanout->source_root, job->path) == -1) {
+        return -1;
+    }
+    int in = open(rctx->link_buf, O_RDONLY);
+    struct stat stat_buf;
+    if (in == -1 || fstat(in, &stat_buf) == -1) {
+        if (in != -1) close(in);
+        fprintf(stderr, "ERROR: Failed to open %s to replicate it. \n", rctx->link_buf);
+        return -1;
+    }
+    rctx->options = job->clobber ? TRANSPLANT_CLOBBER : 0; // whether the file may replace an existing one
+    int out = tp_create_file(rctx, job->permissions); // as in the first target, read-only files included
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    int ret = tp_copy_file_data(in, out, stat_buf.st_size, rctx->data_buf, rctx->link_buf);
+    close(in);
+    if (ret == -1) {
+        durability_abandon(rctx, out);
+        return -1;
+    }
+    return durability_close(rctx, out);
+}
+
+static int replicate_metadata(struct replica *replica, struct fanout_job *job) {
+    char *path = replica->ctx->path_buf;
+    if (job->has_times && utimensat(AT_FDCWD, path, (struct timespec *)&job->times, AT_SYMLINK_NOFOLLOW) == -1) {
+        fprintf(stderr, "ERROR: Failed to set the times of %s. \n", path);
+        return -1;
+    }
+    if (job->permissions != -1 && chmod(path, job->permissions) == -1) {
+        fprintf(stderr, "ERROR: Failed to set the permissions of %s. \n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int replicate_symlink(struct replica *replica, struct fanout_job *job) {
+    char *path = replica->ctx->path_buf;
+    if (symlinkat(job->other, AT_FDCWD, path) == 0) {
+        return 0;
+    }
+    if (errno == EEXIST && job->clobber && unlink(path) == 0 && symlinkat(job->other, AT_FDCWD, path) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "ERROR: Failed to create symbolic link %s (it may already exist and the clobber flag was not passed). \n", path);
+    return -1;
+}
+
+/*
+ * Apply one job to a replica, on its thread.
+ */
+static int run_job(struct fanout *fanout, struct replica *replica, struct fanout_job *job) {
+    struct transplant_ctx *rctx = replica->ctx;
+    if (job->kind == JOB_RENAME) {
+        return tp_path_init(rctx, replica->root) == -1 ? -1 : watch_apply_rename(rctx, job->path, job->other);
+    }
+    int length = join(rctx->path_buf, replica->root, job->path);
+    if (length == -1) {
+        return -1;
+    }
+    rctx->path_length = length;
+    if (job->kind == JOB_DIRECTORY) {
+        return replicate_directory(replica, job);
+    } else if (job->kind == JOB_FILE) {
+        return replicate_file(fanout, replica, job);
+    } else if (job->kind == JOB_SYMLINK) {
+        return replicate_symlink(replica, job);
+    } else if (job->kind == JOB_METADATA) {
+        return replicate_metadata(replica, job);
+    } else if (job->kind == JOB_SYNC) {
+        return durability_directory(rctx, job->permissions);
+    }
+    if (watch_remove_tree(rctx) == -1) {
+        fprintf(stderr, "ERROR: Failed to remove %s. \n", rctx->path_buf);
+        return -1;
+    }
+    return 0;
+}
+
+struct replica_arg {
+    struct fanout *fanout;
+    struct replica *replica;
+};
+
+/*
+ * Body of the thread of a replica: run its jobs in order until fanout_stop().
+ * After a failure the remaining jobs are only dropped.
+ */
+static void *replica_main(void *arg) {
+    struct replica_arg *args = arg;
+    struct fanout *fanout = args->fanout;
+    struct replica *replica = args->replica;
+    free(args);
+    pthread_mutex_lock(&fanout->lock);
+    while (1) {
+        while (!replica->head && !fanout->stopping) {
+            pthread_cond_wait(&replica->changed, &fanout->lock);
+        }
+        struct fanout_job *job = replica->head;
+        if (!job) {
+            break;
+        }
+        replica->head = job->next;
+        if (!replica->head) replica->tail = NULL;
+        int failed = replica->failed;
+        pthread_mutex_unlock(&fanout->lock);
+
+        int ret = failed ? -1 : run_job(fanout, replica, job);
+        free(job);
+
+        pthread_mutex_lock(&fanout->lock);
+        if (ret == -1) replica->failed = 1;
+        replica->queued--;
+        pthread_cond_broadcast(&replica->changed);
+    }
+    pthread_mutex_unlock(&fanout->lock);
+    return NULL;
+}
+
+/*
+ * Queue a job for every replica.  Returns 0 in case of success, -1 if a
+ * replica has failed or memory is exhausted.
+ */
+static int queue_job(struct transplant_ctx *ctx, int kind, int permissions, struct entry_times *times, char *path, char *other) {
+    struct fanout *fanout = ctx->fanout;
+    if (!fanout->running) {
+        return 0;
+    }
+    int path_length = len_string(path), other_length = other ? len_string(other) : 0;
+    int ret = 0;
+    pthread_mutex_lock(&fanout->lock);
+    for (struct replica *replica = fanout->replicas; replica && ret == 0; replica = replica->next) {
+        while (replica->queued >= FANOUT_QUEUE_MAX && !replica->failed) {
+            pthread_cond_wait(&replica->changed, &fanout->lock);
+        }
+        struct fanout_job *job = malloc(sizeof(struct fanout_job) + path_length + other_length + 2);
+        if (replica->failed || !job) { // a failed replica is reported by fanout_sync()
+            free(job);
+            if (!replica->failed) fprintf(stderr, "ERROR: Out of memory. \n");
+            ret = -1;
+            break;
+        }
+        job->kind = kind;
+        job->permissions = permissions;
+        job->has_times = times != NULL;
+        if (times) job->times = *times;
+        job->clobber = (ctx->options & TRANSPLANT_CLOBBER) != 0;
+        job->path = (char *)(job + 1);
+        tp_copy(job->path, path, path_length + 1);
+        job->other = job->path + path_length + 1;
+        if (other) tp_copy(job->other, other, other_length + 1);
+        job->next = NULL;
+        if (replica->tail) replica->tail->next = job;
+        else replica->head = job;
+        replica->tail = job;
+        replica->queued++;
+        pthread_cond_broadcast(&replica->changed);
+    }
+    pthread_mutex_unlock(&fanout->lock);
+    return ret;
+}
+
+/*
+ * @brief  Create the directory named by path_buf, which the first target now
+ * has, in the replicas.
+ */
+int fanout_directory(struct transplant_ctx *ctx) {
+    return queue_job(ctx, JOB_DIRECTORY, -1, NULL, relative_path(ctx), NULL);
+}
+
+/*
+ * @brief  Copy the file named by path_buf, just written in the first target
+ * and given its permissions, to the replicas.
+ */
+int fanout_file(struct transplant_ctx *ctx, mode_t mode) {
+    return queue_job(ctx, JOB_FILE, mode & 0777, NULL, relative_path(ctx), NULL);
+}
+
+/*
+ * @brief  Create the symbolic link named by path_buf, whose target is in
+ * link_buf, in the replicas.
+ */
+int fanout_symlink(struct transplant_ctx *ctx) {
+    return queue_job(ctx, JOB_SYMLINK, -1, NULL, relative_path(ctx), ctx->link_buf);
+}
+
+/*
+ * @brief  Remove the entry named by path_buf from the replicas, with all its contents.
+ */
+int fanout_remove(struct transplant_ctx *ctx) {
+    return queue_job(ctx, JOB_REMOVE, -1, NULL, relative_path(ctx), NULL);
+}
+
+/*
+ * @brief  Apply a RENAME record to the replicas.
+ * @param from  The old path, relative to the root.
+ * @param to  The new path, relative to the root.
+ */
+int fanout_rename(struct transplant_ctx *ctx, char *from, char *to) {
+    return queue_job(ctx, JOB_RENAME, -1, NULL, from, to);
+}
+
+/*
+ * @brief  Give the entry named by path_buf in the replicas the permissions
+ * (-1: leave them) and the times (NULL: leave them) it now has in the first target.
+ */
+int fanout_metadata(struct transplant_ctx *ctx, int permissions, struct entry_times *times) {
+    return queue_job(ctx, JOB_METADATA, permissions, times, relative_path(ctx), NULL);
+}
+
+/*
+ * @brief  Make the directory named by path_buf durable in the replicas, as
+ * durability_directory() does in the first target, once they have caught up.
+ */
+int fanout_durability(struct transplant_ctx *ctx, int root) {
+    if (ctx->durability == TRANSPLANT_DURABILITY_NONE || (ctx->durability == TRANSPLANT_DURABILITY_BATCHED && !root)) {
+        return 0;
+    }
+    return queue_job(ctx, JOB_SYNC, root, NULL, relative_path(ctx), NULL);
+}
+
+/*
+ * @brief  Add a directory to deserialize into, besides the path of the context.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int fanout_add(struct transplant_ctx *ctx, char *root) {
+    if (!ctx->fanout) {
+        struct fanout *fanout = calloc(1, sizeof(struct fanout));
+        if (!fanout) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return -1;
+        }
+        pthread_mutex_init(&fanout->lock, NULL);
+        ctx->fanout = fanout;
+    }
+    struct replica *replica = calloc(1, sizeof(struct replica));
+    char *copy = malloc(len_string(root) + 1);
+    if (!replica || !copy) {
+        free(replica);
+        free(copy);
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    tp_copy(copy, root, len_string(root) + 1);
+    replica->root = copy;
+    pthread_cond_init(&replica->changed, NULL);
+    struct replica **link = &ctx->fanout->replicas;
+    while (*link) link = &(*link)->next;
+    *link = replica;
+    return 0;
+}
+
+/*
+ * @brief  Forget the replicas of a context, which must not be running.
+ */
+void fanout_clear(struct transplant_ctx *ctx) {
+    struct fanout *fanout = ctx->fanout;
+    if (!fanout) {
+        return;
+    }
+    while (fanout->replicas) {
+        struct replica *replica = fanout->replicas;
+        fanout->replicas = replica->next;
+        pthread_cond_destroy(&replica->changed);
+        free(replica->root);
+        free(replica);
+    }
+    pthread_mutex_destroy(&fanout->lock);
+    free(fanout->source_root);
+    free(fanout);
+    ctx->fanout = NULL;
+}
+
+/*
+ * @brief  Start the threads of the replicas.
+ * @details  path_buf must name the first target; the entries queued later are
+ * taken relative to it.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int fanout_start(struct transplant_ctx *ctx) {
+    struct fanout *fanout = ctx->fanout;
+    if (!fanout || fanout->running) {
+        return 0;
+    }
+    free(fanout->source_root);
+    fanout->source_root = malloc(ctx->path_length + 1);
+    if (!fanout->source_root) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    tp_copy(fanout->source_root, ctx->path_buf, ctx->path_length + 1);
+    fanout->root_length = ctx->path_length;
+    fanout->stopping = 0;
+    fanout->running = 1;
+    for (struct replica *replica = fanout->replicas; replica; replica = replica->next) {
+        struct replica_arg *args = malloc(sizeof(struct replica_arg));
+        replica->ctx = transplant_new();
+        if (replica->ctx) replica->ctx->durability = ctx->durability;
+        replica->head = replica->tail = NULL;
+        replica->queued = replica->failed = 0;
+        if (args) {
+            args->fanout = fanout;
+            args->replica = replica;
+        }
+        if (!args || !replica->ctx || pthread_create(&replica->thread, NULL, replica_main, args) != 0) {
+            free(args);
+            transplant_free(replica->ctx);
+            replica->ctx = NULL;
+            fprintf(stderr, "ERROR: Failed to start the thread of replica %s. \n", replica->root);
+            fanout_stop(ctx);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Wait until the replicas have caught up with the first target.
+ * @return 0 in case of success, -1 if a replica has failed.
+ */
+int fanout_sync(struct transplant_ctx *ctx) {
+    struct fanout *fanout = ctx->fanout;
+    if (!fanout || !fanout->running) {
+        return 0;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&fanout->lock);
+    for (struct replica *replica = fanout->replicas; replica; replica = replica->next) {
+        while (replica->queued > 0) {
+            pthread_cond_wait(&replica->changed, &fanout->lock);
+        }
+        if (replica->failed) {
+            fprintf(stderr, "ERROR: Failed to replicate into %s. \n", replica->root);
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&fanout->lock);
+    return ret;
+}
+
+/*
+ * @brief  Wait for the replicas to catch up, then stop their threads.
+ * @return 0 in case of success, -1 if a replica has failed.
+ */
+int fanout_stop(struct transplant_ctx *ctx) {
+    struct fanout *fanout = ctx->fanout;
+    if (!fanout || !fanout->running) {
+        return 0;
+    }
+    int ret = fanout_sync(ctx);
+    pthread_mutex_lock(&fanout->lock);
+    fanout->stopping = 1;
+    for (struct replica *replica = fanout->replicas; replica; replica = replica->next) {
+        pthread_cond_broadcast(&replica->changed);
+    }
+    pthread_mutex_unlock(&fanout->lock);
+    for (struct replica *replica = fanout->replicas; replica && replica->ctx; replica = replica->next) {
+        pthread_join(replica->thread, NULL);
+        transplant_free(replica->ctx);
+        replica->ctx = NULL;
+    }
+    fanout->running = 0;
+    return ret;
+}
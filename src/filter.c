@@ -0,0 +1,254 @@
+#include "filter.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * A compiled glob is a sequence of at most MAX_GLOB_TOKENS tokens, each of which
+ * is either a `*` or a set of bytes that it consumes (a literal, `?` or a class).
+ * Matching runs the pattern as a Shift-And automaton: bit i of the state word is
+ * set when the first i tokens have matched a prefix of the name, so every byte
+ * of the name costs one table lookup, two shifts and a few masks, with no
+ * backtracking however many stars the pattern contains.
+ */
+#define MAX_GLOB_TOKENS 63
+
+#define CLASS_OPEN 0x5B  // left square bracket, opens a character class
+#define CLASS_CLOSE 0x5D // right square bracket, closes a character class
+
+struct filter_rule {
+    int include;          // 1 for --include, 0 for --exclude
+    uint64_t *accept;     // 256 masks: bit i is set if token i consumes that byte
+    uint64_t star_mask;   // bits of the tokens that are `*`
+    uint64_t final_bit;   // bit of the accepting state
+    char *literal;        // longest literal run that every match must contain
+    int literal_length;
+    int exact;            // pattern has no wildcards: just compare with literal
+    struct filter_rule *next;
+};
+
+/*
+ * Check whether byte c belongs to the class whose text runs from start (just
+ * after the opening bracket and any negation) up to, not including, end.
+ */
+static int class_contains(char *start, char *end, unsigned char c) {
+    char *p = start;
+    while (p < end) {
+        unsigned char low = *p;
+        if (low == '\\' && p + 1 < end) low = *++p;
+        unsigned char high = low;
+        if (p + 2 < end && *(p + 1) == '-') { // range such as a-z
+            p += 2;
+            high = *p;
+            if (high == '\\' && p + 1 < end) high = *++p;
+        }
+        if (c >= low && c <= high) return 1;
+        p++;
+    }
+    return 0;
+}
+
+static uint64_t closure(struct filter_rule *rule, uint64_t state) {
+    // a star may match the empty string, so reaching it also reaches the next token
+    // (runs of stars are collapsed at compile time so one step is enough)
+    return state | ((state & rule->star_mask) << 1);
+}
+
+static int contains_literal(char *name, char *literal, int literal_length) {
+    for (char *start = name; *start != '\0'; start++) {
+        if (*start != *literal) continue; // cheap first byte check before comparing the rest
+        int i = 1;
+        while (i < literal_length && *(start + i) == *(literal + i)) i++;
+        if (i == literal_length) return 1;
+    }
+    return 0;
+}
+
+static int rule_matches(struct filter_rule *rule, char *name) {
+    if (rule->exact) { // plain names such as .git or node_modules
+        char *a = name, *b = rule->literal;
+        while (*a != '\0' && *a == *b) {
+            a++;
+            b++;
+        }
+        return *a == *b;
+    }
+    if (rule->literal_length > 0 && !contains_literal(name, rule->literal, rule->literal_length)) {
+        return 0; // prefilter: the name lacks a run of bytes that any match needs
+    }
+
+    uint64_t state = closure(rule, 1);
+    for (unsigned char *c = (unsigned char *)name; *c != '\0'; c++) {
+        state = ((state & *(rule->accept + *c)) << 1) | (state & rule->star_mask);
+        state = closure(rule, state);
+        if (state == 0) return 0; // no partial match survives
+    }
+    return (state & rule->final_bit) != 0;
+}
+
+static void free_rule(struct filter_rule *rule) {
+    free(rule->accept);
+    free(rule->literal);
+    free(rule);
+}
+
+/*
+ * @brief  Compile a glob pattern and append it to a list of filter rules.
+ * @details  The pattern is matched against single path components, so it may
+ * not contain the path separator '/'.  Supported syntax is `*` (any run of
+ * bytes), `?` (any single byte), bracketed classes with ranges and `!` or `^`
+ * negation, and backslash to escape the next byte.
+ *
+ * @param set  The list of rules to append to.
+ * @param pattern  The glob pattern, as given on the command line.
+ * @param include  Nonzero if entries matching the pattern are to be kept,
+ * zero if they are to be skipped.
+ * @return 0 in case of success, -1 if the pattern is invalid or too long.
+ */
+int filter_add(struct filter_set *set, char *pattern, int include) {
+    struct filter_rule *rule = calloc(1, sizeof(struct filter_rule));
+    int pattern_length = 0;
+    while (*(pattern + pattern_length) != '\0') pattern_length++;
+    char *run = malloc(pattern_length + 1); // literal run currently being collected
+    if (rule) {
+        rule->accept = calloc(256, sizeof(uint64_t));
+        rule->literal = malloc(pattern_length + 1);
+    }
+    if (!rule || !run || !rule->accept || !rule->literal) {
+        fprintf(stderr, "ERROR: Out of memory compiling filter pattern. \n");
+        free(run);
+        if (rule) free_rule(rule);
+        return -1;
+    }
+    rule->include = include;
+    rule->exact = 1;
+
+    int tokens = 0;
+    int run_length = 0;
+    int last_was_star = 0;
+    char *p = pattern;
+    while (*p != '\0') {
+        if (tokens >= MAX_GLOB_TOKENS) {
+            fprintf(stderr, "ERROR: Filter pattern %s is too long (at most %d tokens). \n", pattern, MAX_GLOB_TOKENS);
+            free(run);
+            free_rule(rule);
+            return -1;
+        }
+        if (*p == '/') {
+            fprintf(stderr, "ERROR: Filter pattern %s may not contain '/', patterns match single names. \n", pattern);
+            free(run);
+            free_rule(rule);
+            return -1;
+        }
+        uint64_t bit = (uint64_t)1 << tokens;
+        int literal = -1; // byte consumed by this token if it is a literal
+        if (*p == '*') {
+            p++;
+            rule->exact = 0;
+            if (last_was_star) continue; // ** is the same as *
+            rule->star_mask |= bit;
+            last_was_star = 1;
+        } else if (*p == '?') {
+            p++;
+            rule->exact = 0;
+            for (int c = 0; c < 256; c++) *(rule->accept + c) |= bit;
+            last_was_star = 0;
+        } else if (*p == CLASS_OPEN) {
+            char *start = p + 1;
+            int negate = (*start == '!' || *start == '^');
+            if (negate) start++;
+            char *end = start;
+            if (*end == CLASS_CLOSE) end++; // a leading close bracket is a member
+            while (*end != '\0' && *end != CLASS_CLOSE) {
+                if (*end == '\\' && *(end + 1) != '\0') end++;
+                end++;
+            }
+            if (*end == '\0') {
+                fprintf(stderr, "ERROR: Unterminated character class in filter pattern %s. \n", pattern);
+                free(run);
+                free_rule(rule);
+                return -1;
+            }
+            for (int c = 0; c < 256; c++) {
+                if (class_contains(start, end, c) != negate) *(rule->accept + c) |= bit;
+            }
+            p = end + 1;
+            rule->exact = 0;
+            last_was_star = 0;
+        } else {
+            if (*p == '\\' && *(p + 1) != '\0') p++;
+            literal = (unsigned char)*p++;
+            *(rule->accept + literal) |= bit;
+            last_was_star = 0;
+        }
+
+        if (literal != -1) {
+            *(run + run_length++) = literal;
+        } else {
+            run_length = 0; // a wildcard ends the literal run
+        }
+        if (run_length > rule->literal_length) { // keep the longest run for the prefilter
+            for (int i = 0; i < run_length; i++) *(rule->literal + i) = *(run + i);
+            rule->literal_length = run_length;
+        }
+        tokens++;
+    }
+    *(rule->literal + rule->literal_length) = '\0';
+    rule->final_bit = (uint64_t)1 << tokens;
+    free(run);
+
+    if (set->tail) {
+        set->tail->next = rule;
+    } else {
+        set->head = rule;
+    }
+    set->tail = rule;
+    set->count++;
+    return 0;
+}
+
+/*
+ * @brief  Decide whether a directory entry is to be left out of serialization.
+ * @details  The rules are tried in the order in which they were added and the
+ * first one that matches decides; an entry that matches no rule is kept.  This
+ * is meant to be called with d_name before the entry is stat'ed or opened, so
+ * that nothing below an excluded directory is ever touched.
+ *
+ * @param set  The list of rules to apply.
+ * @param name  A single path component.
+ * @return 1 if the entry is to be skipped, 0 if it is to be serialized.
+ */
+int filter_excluded(struct filter_set *set, char *name) {
+    for (struct filter_rule *rule = set->head; rule != NULL; rule = rule->next) {
+        if (rule_matches(rule, name)) {
+            debug("%s matched %s rule", name, rule->include ? "include" : "exclude");
+            return !rule->include;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Return the number of rules in a list.
+ */
+int filter_count(struct filter_set *set) {
+    return set->count;
+}
+
+/*
+ * @brief  Discard all the rules in a list, leaving it empty.
+ */
+void filter_clear(struct filter_set *set) {
+    while (set->head) {
+        struct filter_rule *next = set->head->next;
+        free_rule(set->head);
+        set->head = next;
+    }
+    set->tail = NULL;
+    set->count = 0;
+}
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE // syncfs()
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "journal.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#define JOURNAL_HEADER_SIZE (4 + 8 + 8 + 4 + 4)
+#define JOURNAL_SLOT_SIZE   (4 + 1 + 24)
+
+static uint64_t fnv1a(unsigned char *p, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char *end = p + length; p < end; p++) {
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static unsigned char *put(unsigned char *p, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        *p++ = (value >> (i * 8)) & 0xFF;
+    }
+    return p;
+}
+
+static uint64_t get(unsigned char **p, int count) {
+    uint64_t value = 0;
+    for (int i = 0; i < count; i++) {
+        value = (value << 8) | *(*p)++;
+    }
+    return value;
+}
+
+/*
+ * @brief  Write a journal to the file at path during the next deserialization,
+ * with a checkpoint every interval_ms milliseconds at most (NULL: no journal).
+ * @details  A journal left in the file by a restore that did not finish is
+ * resumed from; see journal.h.
+ * @return 0 in case of success, -1 if the interval is negative or memory is exhausted.
+ */
+int transplant_set_journal(struct transplant_ctx *ctx, char *path, int interval_ms) {
+    journal_free(ctx);
+    if (!path) {
+        return 0;
+    }
+    if (interval_ms < 0) {
+        fprintf(stderr, "ERROR: The checkpoint interval cannot be negative. \n");
+        return -1;
+    }
+    int length = len_string(path);
+    struct journal *journal = calloc(1, sizeof(struct journal) + length + 1);
+    if (!journal) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    journal->path = (char *)(journal + 1);
+    tp_copy(journal->path, path, length + 1);
+    journal->fd = journal->root_fd = -1;
+    journal->interval_ms = interval_ms;
+    ctx->journal = journal;
+    return 0;
+}
+
+/*
+ * @brief  Forget the journal of a context.
+ */
+void journal_free(struct transplant_ctx *ctx) {
+    if (!ctx->journal) {
+        return;
+    }
+    if (ctx->journal->fd != -1) close(ctx->journal->fd);
+    if (ctx->journal->root_fd != -1) close(ctx->journal->root_fd);
+    free(ctx->journal);
+    ctx->journal = NULL;
+}
+
+/*
+ * Find the last checkpoint in the size bytes of journal data whose hash is
+ * right; a checkpoint cut short by a crash ends the journal.  Returns it, or
+ * NULL if there is none.
+ */
+static unsigned char *last_checkpoint(unsigned char *data, size_t size) {
+    unsigned char *last = NULL, *p = data, *end = data + size;
+    while (end - p >= JOURNAL_HEADER_SIZE + 8) {
+        unsigned char *record = p;
+        if (get(&p, 4) != 0x0C0DED4A) break;
+        p += 16;
+        uint64_t depth = get(&p, 4), rel_length = get(&p, 4);
+        if (depth >= PATH_MAX || rel_length >= PATH_MAX ||
+            (uint64_t)(end - p) < rel_length + (depth + 1) * JOURNAL_SLOT_SIZE + 8) break;
+        p += rel_length + (depth + 1) * JOURNAL_SLOT_SIZE;
+        uint64_t hash = fnv1a(record, p - record);
+        if (get(&p, 8) != hash) break;
+        last = record;
+    }
+    return last;
+}
+
+/*
+ * Go to the checkpoint: the input, path_buf and the deferred metadata of the
+ * directories.  Returns the depth of the checkpoint, or -1 on error.
+ */
+static int restore_checkpoint(struct transplant_ctx *ctx, unsigned char *p) {
+    struct journal *journal = ctx->journal;
+    p += 4;
+    uint64_t input_size = get(&p, 8), offset = get(&p, 8);
+    int depth = get(&p, 4), rel_length = get(&p, 4);
+    if (input_size && journal->input_size && input_size != journal->input_size) {
+        fprintf(stderr, "ERROR: The journal %s is not for this input. \n", journal->path);
+        return -1;
+    }
+    if (journal->root_length + 1 + rel_length >= PATH_MAX) {
+        fprintf(stderr, "ERROR: Path in the journal %s is too long. \n", journal->path);
+        return -1;
+    }
+    if (rel_length > 0) {
+        *(ctx->path_buf + journal->root_length) = '/';
+        tp_copy(ctx->path_buf + journal->root_length + 1, p, rel_length);
+        ctx->path_length = journal->root_length + 1 + rel_length;
+        *(ctx->path_buf + ctx->path_length) = '\0';
+        p += rel_length;
+    }
+    for (int d = 0; d <= depth; d++) {
+        struct dir_metadata *slot = metadata_slot(ctx, d);
+        if (!slot) return -1;
+        slot->permissions = (int32_t)get(&p, 4);
+        slot->has_times = get(&p, 1);
+        slot->times.atime.tv_sec = get(&p, 8);
+        slot->times.atime.tv_nsec = get(&p, 4);
+        slot->times.mtime.tv_sec = get(&p, 8);
+        slot->times.mtime.tv_nsec = get(&p, 4);
+    }
+    // a file is seeked, data from a pipe is read and dropped: the sender starts over
+    if (tp_skip(ctx, offset) == -1) {
+        fprintf(stderr, "ERROR: The input ends before the checkpoint in the journal %s. \n", journal->path);
+        return -1;
+    }
+    ctx->options |= TRANSPLANT_CLOBBER; // what was restored after the checkpoint is there already
+    return depth;
+}
+
+/*
+ * @brief  Open the journal at the start of a deserialization, and resume from
+ * its last checkpoint if it has one.
+ * @details  path_buf must name the target directory.
+ * @return The depth to resume at, 0 to start from the beginning of the input,
+ * or -1 on error.
+ */
+int journal_resume(struct transplant_ctx *ctx) {
+    struct journal *journal = ctx->journal;
+    if (ctx->fanout || (ctx->options & TRANSPLANT_WATCH)) {
+        fprintf(stderr, "ERROR: A journal cannot be kept with several targets or --watch. \n");
+        return -1;
+    }
+    journal->root_length = ctx->path_length;
+    clock_gettime(CLOCK_MONOTONIC, &journal->last);
+    struct stat stat_buf;
+    journal->input_size = 0;
+    if (ctx->in_buf != ctx->in_storage) { // memory source
+        journal->input_size = ctx->in_len;
+    } else if (ctx->read == transplant_fd_read && fstat((int)(intptr_t)ctx->read_arg, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+        journal->input_size = stat_buf.st_size;
+    }
+    journal->root_fd = open(ctx->path_buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (journal->root_fd == -1 || journal->fd == -1 || fstat(journal->fd, &stat_buf) == -1) {
+        fprintf(stderr, "ERROR: Failed to open the journal %s. \n", journal->path);
+        return -1;
+    }
+    if (stat_buf.st_size == 0) {
+        return 0;
+    }
+    unsigned char *data = malloc(stat_buf.st_size);
+    if (!data) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    ssize_t n = pread(journal->fd, data, stat_buf.st_size, 0);
+    if (n != stat_buf.st_size) {
+        free(data);
+        fprintf(stderr, "ERROR: Failed to read the journal %s. \n", journal->path);
+        return -1;
+    }
+    unsigned char *checkpoint = last_checkpoint(data, n);
+    int depth = checkpoint ? restore_checkpoint(ctx, checkpoint) : 0;
+    free(data);
+    if (depth == 0 && ftruncate(journal->fd, 0) == -1) { // nothing usable: start a new journal
+        fprintf(stderr, "ERROR: Failed to reset the journal %s. \n", journal->path);
+        return -1;
+    }
+    return depth;
+}
+
+/*
+ * @brief  Write a checkpoint if the last one is old enough.
+ * @details  Called between two entries of the directory named by path_buf,
+ * whose entries are at the given depth.  Everything restored so far is synced
+ * first, so that the checkpoint never claims more than the disk has.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int journal_checkpoint(struct transplant_ctx *ctx, int depth) {
+    struct journal *journal = ctx->journal;
+    if (!journal || ctx->entry_has_times) { // the times read belong to the next entry
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - journal->last.tv_sec) * 1000 + (now.tv_nsec - journal->last.tv_nsec) / 1000000 < journal->interval_ms) {
+        return 0;
+    }
+    journal->last = now;
+    int rel_length = ctx->path_length - journal->root_length;
+    char *rel = ctx->path_buf + journal->root_length;
+    if (rel_length > 0) { // skip the separator
+        rel++;
+        rel_length--;
+    }
+    size_t size = JOURNAL_HEADER_SIZE + rel_length + (depth + 1) * JOURNAL_SLOT_SIZE + 8;
+    unsigned char *record = malloc(size);
+    if (!record) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    unsigned char *p = put(record, 0x0C0DED4A, 4);
+    p = put(p, journal->input_size, 8);
+    p = put(p, tp_offset(ctx), 8);
+    p = put(p, depth, 4);
+    p = put(p, rel_length, 4);
+    tp_copy(p, rel, rel_length);
+    p += rel_length;
+    for (int d = 0; d <= depth; d++) {
+        struct dir_metadata unset = {-1, 0, {{0, 0}, {0, 0}}};
+        struct dir_metadata *slot = d < ctx->dir_metadata_count ? ctx->dir_metadata + d : &unset;
+        p = put(p, (uint32_t)slot->permissions, 4);
+        p = put(p, slot->has_times, 1);
+        p = put(p, slot->times.atime.tv_sec, 8);
+        p = put(p, slot->times.atime.tv_nsec, 4);
+        p = put(p, slot->times.mtime.tv_sec, 8);
+        p = put(p, slot->times.mtime.tv_nsec, 4);
+    }
+    p = put(p, fnv1a(record, p - record), 8);
+    int ret = 0;
+    if (syncfs(journal->root_fd) == -1 || write(journal->fd, record, size) != (ssize_t)size || fdatasync(journal->fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to write a checkpoint to the journal %s. \n", journal->path);
+        ret = -1;
+    }
+    free(record);
+    return ret;
+}
+
+/*
+ * @brief  Close the journal at the end of a deserialization, and remove it if
+ * the deserialization succeeded.
+ * @param ret  The result of the deserialization.
+ * @return ret, or -1 if the journal cannot be removed.
+ */
+int journal_finish(struct transplant_ctx *ctx, int ret) {
+    struct journal *journal = ctx->journal;
+    if (journal->fd != -1) close(journal->fd);
+    if (journal->root_fd != -1) close(journal->root_fd);
+    journal->fd = journal->root_fd = -1;
+    if (ret == 0 && unlink(journal->path) == -1 && errno != ENOENT) {
+        fprintf(stderr, "ERROR: Failed to remove the journal %s. \n", journal->path);
+        return -1;
+    }
+    return ret;
+}
@@ -0,0 +1,124 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "legacy.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * The interface declared in global.h and legacy.h, kept for the command line
+ * program and the tests.  Each function runs on a single context whose buffers
+ * are the global variables path_buf and name_buf, and link_buf and data_buf
+ * below (global.h has no room for them), and which reads
+ * from the standard input and writes to the standard output.  global_options
+ * and path_length are copied into the context on the way in and path_length
+ * is copied back on the way out, so the globals always describe its state.
+ */
+
+static struct transplant_ctx global_ctx;
+static int global_ctx_ready;
+static char *link_buf; // target of the current symbolic link (PATH_MAX bytes)
+static char *data_buf; // file contents in transit (DATA_BUF_SIZE bytes)
+
+/*
+ * @brief  Return the context behind the global variables, synchronized with them.
+ */
+struct transplant_ctx *global_context() {
+    if (!global_ctx_ready) {
+        link_buf = malloc(PATH_MAX);
+        data_buf = malloc(DATA_BUF_SIZE);
+        if (!link_buf || !data_buf || tp_ctx_init(&global_ctx, path_buf, name_buf, link_buf, data_buf) == -1) {
+            exit(EXIT_FAILURE); // nothing sensible can be done without the I/O buffers
+        }
+        global_ctx_ready = 1;
+    }
+    global_ctx.options = global_options;
+    global_ctx.path_length = path_length;
+    return &global_ctx;
+}
+
+static int sync_globals(int ret) {
+    path_length = global_ctx.path_length;
+    return ret;
+}
+
+int path_init(char *name) {
+    return sync_globals(tp_path_init(global_context(), name));
+}
+
+int path_push(char *name) {
+    return sync_globals(tp_path_push(global_context(), name));
+}
+
+int path_pop() {
+    return sync_globals(tp_path_pop(global_context()));
+}
+
+int deserialize_directory(int depth) {
+    return sync_globals(tp_deserialize_directory(global_context(), depth));
+}
+
+int deserialize_file(int depth) {
+    return sync_globals(tp_deserialize_file(global_context(), depth));
+}
+
+int deserialize_symlink(int depth) {
+    return sync_globals(tp_deserialize_symlink(global_context(), depth));
+}
+
+int serialize_directory(int depth) {
+    struct transplant_ctx *ctx = global_context();
+    int ret = tp_serialize_directory(ctx, depth);
+    if (tp_flush(ctx) == -1) ret = -1; // the caller expects the records to be on stdout on return
+    return sync_globals(ret);
+}
+
+int serialize_file(int depth, off_t size) {
+    struct transplant_ctx *ctx = global_context();
+    int ret = tp_serialize_file(ctx, depth, size);
+    if (tp_flush(ctx) == -1) ret = -1;
+    return sync_globals(ret);
+}
+
+int serialize_symlink(int depth, off_t size) {
+    struct transplant_ctx *ctx = global_context();
+    int ret = tp_serialize_symlink(ctx, depth, size);
+    if (tp_flush(ctx) == -1) ret = -1;
+    return sync_globals(ret);
+}
+
+int serialize() {
+    return sync_globals(tp_serialize(global_context()));
+}
+
+int deserialize() {
+    return sync_globals(tp_deserialize(global_context()));
+}
+
+static volatile int watch_stop;
+
+static void stop_watching(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+/*
+ * Until SIGINT or SIGTERM, which end the output after a complete transmission.
+ */
+int watch_tree() {
+    struct sigaction action = {0};
+    action.sa_handler = stop_watching;
+    sigaction(SIGINT, &action, NULL); // no SA_RESTART: the wait for changes is interrupted
+    sigaction(SIGTERM, &action, NULL);
+    return sync_globals(transplant_watch(global_context(), &watch_stop));
+}
+
+int copy_tree() {
+    struct transplant_ctx *ctx = global_context();
+    return sync_globals(transplant_copy(ctx, ctx->copy_target));
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "global.h"
+#include "legacy.h"
 #include "debug.h"
 
 #ifdef _STRING_H
@@ -75,6 +76,26 @@ int main(int argc, char **argv) {
     // above checks the length of name_buf with pointer arithmetic, if empty current working directory is set to path_buf
     // else the passed in component is made as path for path_buf
 
+    // Check for -s and -d flags together (copy mode)
+    if((global_options & 0x6) == 0x6) {
+        if(copy_tree() == -1) {
+            fflush(stdout);
+            fprintf(stderr, "ERROR: Copy failed. \n");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // Check for -s flag with --watch (serialization that keeps following changes)
+    if((global_options & 0x42) == 0x42) { // 0x40 represents the watch flag
+        if(watch_tree() == -1) {
+            fflush(stdout);
+            fprintf(stderr, "ERROR: Watch failed. \n");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
     // Check for -s flag (serialization)
     if(global_options & 0x2) { // 0x2 represents the serialization flag - i think it's the same as 1<<1
         // Call serialize function - check the return statement of the function call
@@ -0,0 +1,216 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "transplant.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * In-memory sink and source.
+ *
+ * A transplant_buffer is an arena: a list of chunks that only ever grows at
+ * the end.  Each chunk is twice the size of the one before it (up to
+ * MEMORY_CHUNK_MAX), so a transfer of n bytes costs O(log n) allocations no
+ * matter how many records it contains, and nothing is ever moved.  Resetting
+ * a buffer keeps its chunks for the next transfer.
+ */
+
+#define MEMORY_CHUNK_MIN (64 * 1024)
+#define MEMORY_CHUNK_MAX (64 * 1024 * 1024)
+
+struct memory_chunk {
+    struct memory_chunk *next;
+    size_t capacity;
+    size_t used;
+    // capacity bytes of data follow the header
+};
+
+struct transplant_buffer {
+    struct memory_chunk *head;
+    struct memory_chunk *current;  // chunk being filled; those before it are full
+    size_t length;
+};
+
+static char *chunk_data(struct memory_chunk *chunk) {
+    return (char *)(chunk + 1);
+}
+
+/*
+ * @brief  Create an empty memory buffer.
+ * @return The new buffer, or NULL if memory is exhausted.
+ */
+struct transplant_buffer *transplant_buffer_new() {
+    return calloc(1, sizeof(struct transplant_buffer));
+}
+
+/*
+ * @brief  Destroy a memory buffer and everything written to it.
+ */
+void transplant_buffer_free(struct transplant_buffer *buffer) {
+    if (!buffer) return;
+    struct memory_chunk *chunk = buffer->head;
+    while (chunk) {
+        struct memory_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(buffer);
+}
+
+/*
+ * @brief  Empty a memory buffer, keeping its memory for reuse.
+ */
+void transplant_buffer_reset(struct transplant_buffer *buffer) {
+    for (struct memory_chunk *chunk = buffer->head; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    buffer->current = buffer->head;
+    buffer->length = 0;
+}
+
+/*
+ * @brief  Return the number of bytes written to a memory buffer.
+ */
+size_t transplant_buffer_length(struct transplant_buffer *buffer) {
+    return buffer->length;
+}
+
+/*
+ * Make room in the current chunk, moving on to the next chunk or allocating a
+ * new one.  Returns the chunk to write to, or NULL if memory is exhausted.
+ */
+static struct memory_chunk *buffer_room(struct transplant_buffer *buffer) {
+    struct memory_chunk *chunk = buffer->current;
+    if (chunk && chunk->used < chunk->capacity) {
+        return chunk;
+    }
+    if (chunk && chunk->next) { // reuse a chunk kept by transplant_buffer_reset()
+        buffer->current = chunk->next;
+        return buffer->current;
+    }
+    size_t capacity = chunk ? chunk->capacity * 2 : MEMORY_CHUNK_MIN;
+    if (capacity > MEMORY_CHUNK_MAX) capacity = MEMORY_CHUNK_MAX;
+    struct memory_chunk *fresh = malloc(sizeof(struct memory_chunk) + capacity);
+    if (!fresh) {
+        fprintf(stderr, "ERROR: Out of memory writing to memory buffer. \n");
+        return NULL;
+    }
+    fresh->next = NULL;
+    fresh->capacity = capacity;
+    fresh->used = 0;
+    if (chunk) {
+        chunk->next = fresh;
+    } else {
+        buffer->head = fresh;
+    }
+    buffer->current = fresh;
+    return fresh;
+}
+
+/*
+ * @brief  Write callback that appends to a memory buffer; arg is the buffer.
+ * @return count, or -1 if memory is exhausted.
+ */
+ssize_t transplant_buffer_write(void *arg, const void *buf, size_t count) {
+    struct transplant_buffer *buffer = arg;
+    const char *src = buf;
+    size_t remaining = count;
+    while (remaining > 0) {
+        struct memory_chunk *chunk = buffer_room(buffer);
+        if (!chunk) return -1;
+        size_t take = chunk->capacity - chunk->used;
+        if (take > remaining) take = remaining;
+        tp_copy(chunk_data(chunk) + chunk->used, src, take);
+        chunk->used += take;
+        src += take;
+        remaining -= take;
+    }
+    buffer->length += count;
+    return count;
+}
+
+/*
+ * @brief  Copy bytes out of a memory buffer.
+ * @param offset  Position of the first byte to copy.
+ * @param dest  Where to copy to.
+ * @param count  The largest number of bytes to copy.
+ * @return The number of bytes copied, less than count only at the end of the buffer.
+ */
+size_t transplant_buffer_read(struct transplant_buffer *buffer, size_t offset, void *dest, size_t count) {
+    char *out = dest;
+    size_t copied = 0;
+    for (struct memory_chunk *chunk = buffer->head; chunk && copied < count; chunk = chunk->next) {
+        if (offset >= chunk->used) {
+            offset -= chunk->used;
+            continue;
+        }
+        size_t take = chunk->used - offset;
+        if (take > count - copied) take = count - copied;
+        tp_copy(out + copied, chunk_data(chunk) + offset, take);
+        copied += take;
+        offset = 0;
+    }
+    return copied;
+}
+
+/*
+ * @brief  Return the contents of a memory buffer as one contiguous region.
+ * @details  If the data spans several chunks they are merged into one, which
+ * stays valid until the buffer is written to, reset or freed.
+ * @return A pointer to the transplant_buffer_length() bytes of data, or NULL if
+ * memory is exhausted.
+ */
+char *transplant_buffer_data(struct transplant_buffer *buffer) {
+    if (!buffer->head) {
+        if (!buffer_room(buffer)) return NULL;
+    }
+    if (buffer->head->used == buffer->length) {
+        return chunk_data(buffer->head);
+    }
+    struct memory_chunk *merged = malloc(sizeof(struct memory_chunk) + buffer->length);
+    if (!merged) {
+        fprintf(stderr, "ERROR: Out of memory merging memory buffer. \n");
+        return NULL;
+    }
+    merged->next = NULL;
+    merged->capacity = buffer->length;
+    merged->used = transplant_buffer_read(buffer, 0, chunk_data(merged), buffer->length);
+    struct memory_chunk *chunk = buffer->head;
+    while (chunk) {
+        struct memory_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    buffer->head = buffer->current = merged;
+    return chunk_data(merged);
+}
+
+static ssize_t memory_source_end(void *arg, void *buf, size_t count) {
+    return 0; // everything was in the region handed to transplant_set_memory_source()
+}
+
+/*
+ * @brief  Make a context deserialize from a region of memory.
+ * @details  The region is parsed in place, without being copied into the input
+ * buffer of the context; it must stay valid until deserialization is over.
+ */
+void transplant_set_memory_source(struct transplant_ctx *ctx, const void *data, size_t length) {
+    ctx->read = memory_source_end;
+    ctx->read_arg = NULL;
+    ctx->in_buf = (char *)data;
+    ctx->in_base = 0;
+    ctx->in_pos = 0;
+    ctx->in_len = length;
+}
+
+/*
+ * @brief  Make a context serialize into a memory buffer, after what it already holds.
+ */
+void transplant_set_memory_sink(struct transplant_ctx *ctx, struct transplant_buffer *buffer) {
+    transplant_set_sink(ctx, transplant_buffer_write, buffer);
+}
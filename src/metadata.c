@@ -0,0 +1,179 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "metadata.h"
+#include "fanout.h"
+#include "wire.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+static pthread_once_t creation_mask_once = PTHREAD_ONCE_INIT;
+static mode_t creation_mask = 0777;
+
+static void read_creation_mask() {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (!status) return;
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, status) != -1) {
+        char *p = line, *key = "Umask:";
+        while (*key != '\0' && *p == *key) {
+            p++;
+            key++;
+        }
+        if (*key == '\0') {
+            char *end;
+            long mask = strtol(p, &end, 8);
+            if (end != p) creation_mask = mask & 0777;
+            break;
+        }
+    }
+    free(line);
+    fclose(status);
+}
+
+/*
+ * @brief  The file creation mask of the process.
+ * @details  It is read once from /proc without changing it: umask() can only
+ * be read by setting it, which would race with the other threads.  0777 if
+ * it cannot be read, so that permissions are then always set explicitly.
+ */
+mode_t metadata_creation_mask() {
+    pthread_once(&creation_mask_once, read_creation_mask);
+    return creation_mask;
+}
+
+static int put_bytes(struct transplant_ctx *ctx, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if (tp_putc(ctx, (value >> (i * 8)) & 0xFF) == EOF) return -1;
+    }
+    return 0;
+}
+
+static int get_bytes(struct transplant_ctx *ctx, uint64_t *value, int count) {
+    *value = 0;
+    for (int i = 0; i < count; i++) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        *value = (*value << 8) | byte;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write the TIMES record of an entry, before its DIRECTORY_ENTRY.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int metadata_write_times(struct transplant_ctx *ctx, int depth, struct stat *stat_buf) {
+    if (tp_write_record_header(ctx, TIMES_TYPE, depth, TIMES_RECORD_SIZE) == -1 ||
+        put_bytes(ctx, stat_buf->st_atim.tv_sec, 8) == -1 || put_bytes(ctx, stat_buf->st_atim.tv_nsec, 4) == -1 ||
+        put_bytes(ctx, stat_buf->st_mtim.tv_sec, 8) == -1 || put_bytes(ctx, stat_buf->st_mtim.tv_nsec, 4) == -1) {
+        fprintf(stderr, "ERROR: Failed to write the times of %s. \n", ctx->path_buf);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Read a TIMES record whose type and depth have been read.
+ * @details  The times are kept in the context for the DIRECTORY_ENTRY that follows.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int deserialize_times(struct transplant_ctx *ctx, int depth) {
+    uint64_t size, atime, atime_nsec, mtime, mtime_nsec;
+    if (wire_read_size(ctx, &size) == -1 || size != TIMES_RECORD_SIZE ||
+        get_bytes(ctx, &atime, 8) == -1 || get_bytes(ctx, &atime_nsec, 4) == -1 ||
+        get_bytes(ctx, &mtime, 8) == -1 || get_bytes(ctx, &mtime_nsec, 4) == -1 ||
+        atime_nsec >= 1000000000 || mtime_nsec >= 1000000000) {
+        fprintf(stderr, "ERROR: Invalid TIMES record. \n");
+        return -1;
+    }
+    ctx->entry_times.atime.tv_sec = (time_t)atime;
+    ctx->entry_times.atime.tv_nsec = atime_nsec;
+    ctx->entry_times.mtime.tv_sec = (time_t)mtime;
+    ctx->entry_times.mtime.tv_nsec = mtime_nsec;
+    ctx->entry_has_times = 1;
+    return 0;
+}
+
+/*
+ * @brief  The slot of the directory whose entries are at the given depth,
+ * made room for if needed.
+ * @return The slot, or NULL if memory is exhausted.
+ */
+struct dir_metadata *metadata_slot(struct transplant_ctx *ctx, int depth) {
+    if (depth >= ctx->dir_metadata_count) {
+        int count = depth * 2 + 8;
+        struct dir_metadata *bigger = realloc(ctx->dir_metadata, count * sizeof(struct dir_metadata));
+        if (!bigger) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return NULL;
+        }
+        for (struct dir_metadata *slot = bigger + ctx->dir_metadata_count; slot < bigger + count; slot++) {
+            slot->permissions = -1;
+            slot->has_times = 0;
+        }
+        ctx->dir_metadata = bigger;
+        ctx->dir_metadata_count = count;
+    }
+    return ctx->dir_metadata + depth;
+}
+
+/*
+ * @brief  Remember what to apply to the directory named by path_buf once
+ * everything in it has been restored.
+ * @param depth  The depth of the entries of the directory.
+ * @param mode  The mode from its DIRECTORY_ENTRY.
+ * @param existed  Nonzero if the directory was not created by mkdir() but reused.
+ * @param times  Its times, or NULL.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int metadata_defer_directory(struct transplant_ctx *ctx, int depth, mode_t mode, int existed, struct entry_times *times) {
+    struct dir_metadata *slot = metadata_slot(ctx, depth);
+    if (!slot) {
+        return -1;
+    }
+    int permissions = mode & 0777;
+    // mkdir(path, 0777) gave the directory all permissions but those of the creation mask
+    slot->permissions = (existed || permissions != (0777 & ~metadata_creation_mask())) ? permissions : -1;
+    slot->has_times = times != NULL;
+    if (times) slot->times = *times;
+    return 0;
+}
+
+/*
+ * @brief  Apply what metadata_defer_directory() remembered to the directory
+ * named by path_buf, at its END_OF_DIRECTORY.
+ * @param depth  The depth of the END_OF_DIRECTORY record.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int metadata_finish_directory(struct transplant_ctx *ctx, int depth) {
+    if (depth >= ctx->dir_metadata_count) {
+        return 0;
+    }
+    struct dir_metadata *slot = ctx->dir_metadata + depth;
+    int permissions = slot->permissions, has_times = slot->has_times;
+    slot->permissions = -1;
+    slot->has_times = 0;
+    if (has_times && utimensat(AT_FDCWD, ctx->path_buf, (struct timespec *)&slot->times, 0) == -1) {
+        fprintf(stderr, "ERROR: Failed to set the times of directory %s. \n", ctx->path_buf);
+        return -1;
+    }
+    if (permissions != -1 && chmod(ctx->path_buf, permissions) == -1) {
+        fprintf(stderr, "ERROR: Permissions of directory not set correctly. \n");
+        return -1;
+    }
+    if (ctx->fanout && (permissions != -1 || has_times)) {
+        return fanout_metadata(ctx, permissions, has_times ? &slot->times : NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "pipeline.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+static int ring_slots(struct transplant_ctx *ctx) {
+    size_t count = ctx->pipeline_mem / PIPELINE_SLOT_SIZE;
+    return count < 2 ? 2 : count; // double buffering at the very least
+}
+
+/*
+ * Body of the input thread: fill slots from the original source until it is
+ * exhausted.  Each slot is handed over as soon as a read returns, whatever
+ * its size: holding on to it for more data could block on the source while
+ * the parser waits for bytes that have already arrived.
+ */
+static void *input_main(void *arg) {
+    struct pipeline *pipe = arg;
+    while (1) {
+        struct ring_slot *slot = ring_produce_begin(&pipe->ring);
+        if (!slot) {
+            return NULL; // the parser stopped early
+        }
+        ssize_t n;
+        do {
+            n = pipe->read(pipe->read_arg, slot->data, pipe->ring.slot_size);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            pipe->error = (n == -1);
+            ring_produce_end(&pipe->ring); // empty slot: end of stream
+            return NULL;
+        }
+        slot->len = n;
+        ring_produce_end(&pipe->ring);
+    }
+}
+
+/*
+ * Read callback installed on the context while the input thread runs.
+ */
+static ssize_t pipeline_read(void *arg, void *buf, size_t count) {
+    struct pipeline *pipe = arg;
+    if (pipe->done) {
+        return pipe->error ? -1 : 0;
+    }
+    if (!pipe->current) {
+        pipe->current = ring_consume_begin(&pipe->ring);
+    }
+    struct ring_slot *slot = pipe->current;
+    if (slot->len == 0) {
+        pipe->done = 1;
+        pipe->current = NULL;
+        ring_consume_end(&pipe->ring);
+        return pipe->error ? -1 : 0;
+    }
+    size_t take = slot->len - slot->pos;
+    if (take > count) take = count;
+    tp_copy(buf, slot->data + slot->pos, take);
+    slot->pos += take;
+    if (slot->pos == slot->len) {
+        pipe->current = NULL;
+        ring_consume_end(&pipe->ring);
+    }
+    return take;
+}
+
+/*
+ * @brief  Start an input thread reading ahead from the source of a context.
+ * @details  The source of the context is replaced by the pipeline until
+ * pipeline_stop_input() is called.  Bytes already in the input buffer of the
+ * context are consumed first, as usual.
+ * @return The pipeline, or NULL if it could not be started.
+ */
+struct pipeline *pipeline_start_input(struct transplant_ctx *ctx) {
+    struct pipeline *pipe = calloc(1, sizeof(struct pipeline));
+    if (!pipe) {
+        fprintf(stderr, "ERROR: Out of memory starting the input pipeline. \n");
+        return NULL;
+    }
+    if (ring_init(&pipe->ring, ring_slots(ctx), PIPELINE_SLOT_SIZE) == -1) {
+        free(pipe);
+        return NULL;
+    }
+    pipe->read = ctx->read;
+    pipe->read_arg = ctx->read_arg;
+    if (pthread_create(&pipe->thread, NULL, input_main, pipe) != 0) {
+        fprintf(stderr, "ERROR: Failed to start the input thread. \n");
+        ring_destroy(&pipe->ring);
+        free(pipe);
+        return NULL;
+    }
+    ctx->read = pipeline_read;
+    ctx->read_arg = pipe;
+    return pipe;
+}
+
+/*
+ * @brief  Stop the input thread and give the context its original source back.
+ * @details  If the parser stopped before the end of the input, the input thread
+ * may be waiting for a free slot or blocked reading the source.  The ring is
+ * stopped for the first case, as a futex wait is not a cancellation point, and
+ * the thread is cancelled for the second, read() being one.  Whatever it had
+ * read ahead is discarded.
+ * @return 0 in case of success, -1 if the source reported an error.
+ */
+int pipeline_stop_input(struct transplant_ctx *ctx, struct pipeline *pipe) {
+    if (!pipe->done) {
+        ring_stop(&pipe->ring);
+        pthread_cancel(pipe->thread);
+    }
+    pthread_join(pipe->thread, NULL);
+    ctx->read = pipe->read;
+    ctx->read_arg = pipe->read_arg;
+    int ret = (pipe->done && pipe->error) ? -1 : 0;
+    ring_destroy(&pipe->ring);
+    free(pipe);
+    return ret;
+}
+
+/*
+ * Body of the output thread: write out slots until the end-of-stream slot.
+ * After a failure it keeps releasing slots, so the producer never waits for
+ * room that would not come, until the producer notices and stops.
+ */
+static void *output_main(void *arg) {
+    struct pipeline *pipe = arg;
+    while (1) {
+        struct ring_slot *slot = ring_consume_begin(&pipe->ring);
+        if (slot->len == 0) {
+            ring_consume_end(&pipe->ring);
+            return NULL;
+        }
+        char *out = slot->data;
+        while (out < slot->data + slot->len && !atomic_load(&pipe->write_failed)) {
+            ssize_t n = pipe->write(pipe->write_arg, out, slot->data + slot->len - out);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                fprintf(stderr, "ERROR: Failed to write serialized data. \n");
+                atomic_store(&pipe->write_failed, 1);
+                break;
+            }
+            out += n;
+        }
+        ring_consume_end(&pipe->ring);
+    }
+}
+
+/*
+ * Write callback installed on the context while the output thread runs.
+ * Data is collected into whole slots, so the output thread writes in large
+ * blocks however the serializer happens to flush.
+ */
+static ssize_t pipeline_write(void *arg, const void *buf, size_t count) {
+    struct pipeline *pipe = arg;
+    const char *src = buf;
+    size_t remaining = count;
+    while (remaining > 0) {
+        if (atomic_load(&pipe->write_failed)) {
+            return -1;
+        }
+        if (!pipe->filling) {
+            pipe->filling = ring_produce_begin(&pipe->ring);
+        }
+        struct ring_slot *slot = pipe->filling;
+        size_t take = pipe->ring.slot_size - slot->len;
+        if (take > remaining) take = remaining;
+        tp_copy(slot->data + slot->len, src, take);
+        slot->len += take;
+        src += take;
+        remaining -= take;
+        if (slot->len == pipe->ring.slot_size) {
+            pipe->filling = NULL;
+            ring_produce_end(&pipe->ring);
+        }
+    }
+    return count;
+}
+
+/*
+ * @brief  Start an output thread writing to the sink of a context.
+ * @details  The sink of the context is replaced by the pipeline until
+ * pipeline_stop_output() is called.
+ * @return The pipeline, or NULL if it could not be started.
+ */
+struct pipeline *pipeline_start_output(struct transplant_ctx *ctx) {
+    struct pipeline *pipe = calloc(1, sizeof(struct pipeline));
+    if (!pipe) {
+        fprintf(stderr, "ERROR: Out of memory starting the output pipeline. \n");
+        return NULL;
+    }
+    if (ring_init(&pipe->ring, ring_slots(ctx), PIPELINE_SLOT_SIZE) == -1) {
+        free(pipe);
+        return NULL;
+    }
+    atomic_init(&pipe->write_failed, 0);
+    pipe->write = ctx->write;
+    pipe->write_arg = ctx->write_arg;
+    if (pthread_create(&pipe->thread, NULL, output_main, pipe) != 0) {
+        fprintf(stderr, "ERROR: Failed to start the output thread. \n");
+        ring_destroy(&pipe->ring);
+        free(pipe);
+        return NULL;
+    }
+    ctx->write = pipeline_write;
+    ctx->write_arg = pipe;
+    return pipe;
+}
+
+/*
+ * @brief  Wait for the output thread to write out everything handed to the
+ * pipeline, then give the context its original sink back.
+ * @return 0 in case of success, -1 if the sink reported an error.
+ */
+int pipeline_stop_output(struct transplant_ctx *ctx, struct pipeline *pipe) {
+    if (pipe->filling) { // the last partial slot
+        ring_produce_end(&pipe->ring);
+        pipe->filling = NULL;
+    }
+    ring_produce_begin(&pipe->ring); // empty slot: end of stream
+    ring_produce_end(&pipe->ring);
+    pthread_join(pipe->thread, NULL);
+    ctx->write = pipe->write;
+    ctx->write_arg = pipe->write_arg;
+    int ret = atomic_load(&pipe->write_failed) ? -1 : 0;
+    ring_destroy(&pipe->ring);
+    free(pipe);
+    return ret;
+}
@@ -0,0 +1,128 @@
+#include "global.h"
+#include "debug.h"
+#include "ring.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  Allocate a ring of count slots of slot_size bytes each, all free.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int ring_init(struct spsc_ring *ring, int count, size_t slot_size) {
+    ring->slots = calloc(count, sizeof(struct ring_slot));
+    if (!ring->slots) {
+        fprintf(stderr, "ERROR: Out of memory allocating pipeline buffers. \n");
+        return -1;
+    }
+    ring->count = count;
+    ring->slot_size = slot_size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->producer_waiting, 0);
+    atomic_init(&ring->consumer_waiting, 0);
+    atomic_init(&ring->stop, 0);
+    for (struct ring_slot *slot = ring->slots; slot < ring->slots + count; slot++) {
+        slot->data = malloc(slot_size);
+        if (!slot->data) {
+            fprintf(stderr, "ERROR: Out of memory allocating pipeline buffers. \n");
+            ring_destroy(ring);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Free the slots of a ring.  Neither side may be using it any more.
+ */
+void ring_destroy(struct spsc_ring *ring) {
+    if (!ring->slots) return;
+    for (struct ring_slot *slot = ring->slots; slot < ring->slots + ring->count; slot++) {
+        free(slot->data);
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/*
+ * Sleep until the other side moves the counter at other away from seen, or
+ * until ring_stop() is called.  The flag is raised before the counter and the
+ * stop flag are checked again, so a move or a stop made after the check finds
+ * it raised and wakes the sleeper.
+ */
+static void ring_wait(struct spsc_ring *ring, _Atomic uint32_t *waiting, _Atomic uint64_t *other, uint64_t seen) {
+    while (atomic_load(other) == seen && !atomic_load(&ring->stop)) {
+        atomic_store(waiting, 1);
+        if (atomic_load(other) != seen || atomic_load(&ring->stop)) {
+            atomic_store(waiting, 0);
+            break;
+        }
+        syscall(SYS_futex, (uint32_t *)waiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0); // EINTR and EAGAIN: check again
+    }
+}
+
+static void ring_wake(_Atomic uint32_t *waiting) {
+    if (atomic_exchange(waiting, 0)) {
+        syscall(SYS_futex, (uint32_t *)waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * @brief  Wait for a free slot and return it to the producer, emptied.
+ * @return The slot, or NULL once ring_stop() has been called.
+ */
+struct ring_slot *ring_produce_begin(struct spsc_ring *ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load(&ring->head);
+    if (tail - head == (uint64_t)ring->count) { // full: wait for the consumer to release one
+        ring_wait(ring, &ring->producer_waiting, &ring->head, head);
+    }
+    if (atomic_load(&ring->stop)) {
+        return NULL;
+    }
+    struct ring_slot *slot = ring->slots + tail % ring->count;
+    slot->len = slot->pos = 0;
+    return slot;
+}
+
+/*
+ * @brief  Hand the slot returned by ring_produce_begin() to the consumer.
+ */
+void ring_produce_end(struct spsc_ring *ring) {
+    atomic_store(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1);
+    ring_wake(&ring->consumer_waiting);
+}
+
+/*
+ * @brief  Wait for a filled slot and return it to the consumer.
+ */
+struct ring_slot *ring_consume_begin(struct spsc_ring *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_wait(ring, &ring->consumer_waiting, &ring->tail, head); // empty while the tail is at the head
+    return ring->slots + head % ring->count;
+}
+
+/*
+ * @brief  Give the slot returned by ring_consume_begin() back to the producer.
+ */
+void ring_consume_end(struct spsc_ring *ring) {
+    atomic_store(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1);
+    ring_wake(&ring->producer_waiting);
+}
+
+/*
+ * @brief  Tell the producer that the consumer is gone: a producer waiting for
+ * a free slot is woken, and ring_produce_begin() returns NULL from now on.
+ */
+void ring_stop(struct spsc_ring *ring) {
+    atomic_store(&ring->stop, 1);
+    ring_wake(&ring->producer_waiting);
+}
@@ -0,0 +1,374 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "metadata.h"
+#include "durability.h"
+#include "wire.h"
+#include "salvage.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+static size_t find_magic_scalar(const unsigned char *data, size_t i, size_t length) {
+    for (; i + 3 <= length; i++) {
+        if (*(data + i) == 0x0C && *(data + i + 1) == 0x0D && *(data + i + 2) == 0xED) return i;
+    }
+    return length;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Compare 32 positions at once: the bytes at i, i + 1 and i + 2 of each are
+ * loaded as three vectors shifted by one byte.
+ */
+__attribute__((target("avx2")))
+static size_t find_magic_avx2(const unsigned char *data, size_t length) {
+    const __m256i first = _mm256_set1_epi8(0x0C), second = _mm256_set1_epi8(0x0D), third = _mm256_set1_epi8((char)0xED);
+    size_t i = 0;
+    for (; i + 2 + 32 <= length; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), second);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 2)), third);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return find_magic_scalar(data, i, length);
+}
+
+__attribute__((target("sse2")))
+static size_t find_magic_sse2(const unsigned char *data, size_t length) {
+    const __m128i first = _mm_set1_epi8(0x0C), second = _mm_set1_epi8(0x0D), third = _mm_set1_epi8((char)0xED);
+    size_t i = 0;
+    for (; i + 2 + 16 <= length; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), second);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 2)), third);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return find_magic_scalar(data, i, length);
+}
+#endif
+
+/*
+ * @brief  Find the first occurrence of the magic bytes 0x0C 0x0D 0xED.
+ * @return Its offset in data, or length if there is none.
+ */
+size_t salvage_find_magic(const char *data, size_t length) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int avx2 = -1; // whether the processor has it, once asked
+    if (avx2 == -1) {
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (avx2) return find_magic_avx2((const unsigned char *)data, length);
+    if (__builtin_cpu_supports("sse2")) return find_magic_sse2((const unsigned char *)data, length);
+#endif
+    return find_magic_scalar((const unsigned char *)data, 0, length);
+}
+
+/*
+ * A source that cannot seek, read through salvage_read() with --salvage:
+ * the bytes read from it since salvage_mark are kept, so that a scan can
+ * start there even when they have left the input buffer, or never were in
+ * it (tp_read() reads large payloads straight into their destination).
+ */
+struct salvage_input {
+    struct transplant_ctx *ctx;
+    transplant_read_fn read;    // the source the context had before
+    void *read_arg;
+    char *kept;
+    size_t length;              // bytes kept
+    size_t capacity;
+    uint64_t base;              // offset in the input of the first byte kept
+    size_t replay;              // next byte kept to be read again, length if none is
+};
+
+static ssize_t salvage_read(void *arg, void *buf, size_t count) {
+    struct salvage_input *input = arg;
+    if (input->replay < input->length) {
+        size_t take = input->length - input->replay < count ? input->length - input->replay : count;
+        tp_copy(buf, input->kept + input->replay, take);
+        input->replay += take;
+        return take;
+    }
+    ssize_t n = input->read(input->read_arg, buf, count);
+    if (n <= 0) {
+        return n;
+    }
+    // Only what follows the last record parsed may be scanned again, and at most SALVAGE_KEEP_MAX bytes of it
+    uint64_t end = input->base + input->length + n, first = input->ctx->salvage_mark;
+    if (first < input->base) {
+        first = input->base;
+    }
+    if (end - first > SALVAGE_KEEP_MAX) {
+        first = end - SALVAGE_KEEP_MAX;
+    }
+    char *from = buf;
+    size_t keep = n;
+    if (first >= input->base + input->length) { // nothing kept is needed any more
+        from += first - (input->base + input->length);
+        keep -= first - (input->base + input->length);
+        input->length = 0;
+    } else if (first > input->base) {
+        __builtin_memmove(input->kept, input->kept + (first - input->base), input->length - (first - input->base));
+        input->length -= first - input->base;
+    }
+    input->base = first;
+    if (input->length + keep > input->capacity) {
+        size_t capacity = input->capacity ? input->capacity : IO_BUF_SIZE;
+        while (capacity < input->length + keep) capacity *= 2;
+        char *bigger = realloc(input->kept, capacity);
+        if (!bigger) {
+            fprintf(stderr, "ERROR: Out of memory keeping the input for --salvage. \n");
+            errno = ENOMEM;
+            return -1;
+        }
+        input->kept = bigger;
+        input->capacity = capacity;
+    }
+    tp_copy(input->kept + input->length, from, keep);
+    input->length += keep;
+    input->replay = input->length;
+    return n;
+}
+
+/*
+ * Whether the source of the context is a file that can be seeked.
+ */
+static int seekable(struct transplant_ctx *ctx) {
+    struct stat stat_buf;
+    return ctx->read == transplant_fd_read && fstat((int)(intptr_t)ctx->read_arg, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+}
+
+/*
+ * @brief  With --salvage, make sure a scan can go back to salvage_mark: a
+ * source that cannot seek is replaced by one that keeps what it reads until
+ * salvage_stop_input() is called.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int salvage_start_input(struct transplant_ctx *ctx) {
+    if (!(ctx->options & TRANSPLANT_SALVAGE) || ctx->in_buf != ctx->in_storage || seekable(ctx)) {
+        return 0; // nothing to keep for a memory source or a file
+    }
+    struct salvage_input *input = calloc(1, sizeof(struct salvage_input));
+    if (!input) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    input->ctx = ctx;
+    input->read = ctx->read;
+    input->read_arg = ctx->read_arg;
+    input->base = ctx->in_base + ctx->in_len; // the offset of the next byte read
+    ctx->read = salvage_read;
+    ctx->read_arg = input;
+    ctx->salvage_input = input;
+    return 0;
+}
+
+/*
+ * @brief  Give the context the source it had before salvage_start_input().
+ */
+void salvage_stop_input(struct transplant_ctx *ctx) {
+    struct salvage_input *input = ctx->salvage_input;
+    if (!input) {
+        return;
+    }
+    ctx->read = input->read;
+    ctx->read_arg = input->read_arg;
+    ctx->salvage_input = NULL;
+    free(input->kept);
+    free(input);
+}
+
+/*
+ * Read the input again from salvage_mark, which is no longer in the input
+ * buffer: seek back in a file, or replay the bytes kept from another source,
+ * from the oldest one if the mark is older.  Returns the offset the input is
+ * read again from, or in_base if it cannot be.
+ */
+static uint64_t rewind_to_mark(struct transplant_ctx *ctx) {
+    uint64_t mark = ctx->salvage_mark, next = ctx->in_base + ctx->in_len; // the offset of the next byte read
+    struct salvage_input *input = ctx->salvage_input;
+    if (input && ctx->read == salvage_read) {
+        if (mark < input->base) {
+            mark = input->base;
+        }
+        if (mark >= ctx->in_base) {
+            return ctx->in_base;
+        }
+        input->replay = mark - input->base;
+    } else if (!seekable(ctx) || lseek((int)(intptr_t)ctx->read_arg, -(off_t)(next - mark), SEEK_CUR) == -1) {
+        return ctx->in_base;
+    }
+    ctx->in_base = mark;
+    ctx->in_len = 0;
+    return mark;
+}
+
+/*
+ * Have at least need bytes after in_pos in the input buffer, if the input
+ * has that many left, by moving the unread bytes to its start and reading
+ * more after them.  Returns the number of bytes after in_pos.
+ */
+static size_t window(struct transplant_ctx *ctx, size_t need) {
+    if (ctx->in_len - ctx->in_pos >= need || ctx->in_buf != ctx->in_storage) { // a memory source is all there already
+        return ctx->in_len - ctx->in_pos;
+    }
+    size_t have = ctx->in_len - ctx->in_pos;
+    __builtin_memmove(ctx->in_buf, ctx->in_buf + ctx->in_pos, have);
+    ctx->in_base += ctx->in_pos;
+    ctx->in_pos = 0;
+    ctx->in_len = have;
+    while (ctx->in_len < need) {
+        ssize_t n = ctx->read(ctx->read_arg, ctx->in_buf + ctx->in_len, IO_BUF_SIZE - ctx->in_len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        ctx->in_len += n;
+    }
+    return ctx->in_len - ctx->in_pos;
+}
+
+static uint64_t get_be(const unsigned char *p, int count) {
+    uint64_t value = 0;
+    for (int i = 0; i < count; i++) value = (value << 8) | *(p + i);
+    return value;
+}
+
+static int is_magic(const unsigned char *p) {
+    return *p == 0x0C && *(p + 1) == 0x0D && *(p + 2) == 0xED;
+}
+
+/*
+ * Whether the have bytes at p, which start with the magic bytes, are a record
+ * the restore of the directory at depth can go on from, followed by the magic
+ * bytes of the next record.  Returns the depth of the record, or -1.
+ */
+static int candidate(const unsigned char *p, size_t have, int depth) {
+    if (have < 16) {
+        return -1;
+    }
+    int type = *(p + 3);
+    uint64_t record_depth = get_be(p + 4, 4), size = get_be(p + 8, 8);
+    if (type == 1) { // END_OF_TRANSMISSION: nothing follows it
+        return record_depth == 0 && size == 16 ? 0 : -1;
+    }
+    if (record_depth < 1 || record_depth > (uint64_t)depth || size < 16 || size > have - 3) { // the names of deeper directories are lost
+        return -1;
+    }
+    if (!is_magic(p + size)) {
+        return -1;
+    }
+    if (type == 3) { // END_OF_DIRECTORY
+        return size == 16 ? record_depth : -1;
+    }
+    if (type == TIMES_TYPE) {
+        return size == TIMES_RECORD_SIZE ? record_depth : -1;
+    }
+    if (type != 4 || size <= 16 + 12 || size - 16 - 12 >= NAME_MAX) { // DIRECTORY_ENTRY
+        return -1;
+    }
+    uint64_t mode = get_be(p + 16, 4);
+    if ((mode & ~(uint64_t)(S_IFMT | 07777)) || !(S_ISREG(mode) || S_ISDIR(mode) || S_ISLNK(mode))) {
+        return -1;
+    }
+    const unsigned char *name = p + 16 + 12, *end = p + size;
+    for (const unsigned char *c = name; c < end; c++) {
+        if (*c == '/' || *c == '\0') return -1;
+    }
+    if (*name == '.' && (end - name == 1 || (end - name == 2 && *(name + 1) == '.'))) {
+        return -1;
+    }
+    return record_depth;
+}
+
+/*
+ * Finish the directories whose entries are at depth down to resume + 1, as
+ * their END_OF_DIRECTORY records would have.
+ */
+static int finish_directories(struct transplant_ctx *ctx, int depth, int resume) {
+    for (int level = depth; level > resume; level--) {
+        if (metadata_finish_directory(ctx, level) == -1 || durability_directory(ctx, level == 1) == -1) {
+            return -1;
+        }
+        if (tp_path_pop(ctx) == -1) {
+            fprintf(stderr, "ERROR: Failed to pop the directory off path_buf while salvaging. \n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Find the record a damaged transmission can be restored on from.
+ * @details  This function is called with --salvage where the record after
+ * the last one parsed, in the directory whose entries are at depth, could
+ * not be restored.  The input is scanned from that last record for the next
+ * record described in salvage.h, and left positioned at it, with the
+ * directories deeper than it finished and popped off path_buf.
+ *
+ * @param depth  The depth of the entries of the directory being restored.
+ * @return The depth of the record found, 0 for END_OF_TRANSMISSION, or -1 if
+ * there is none before the end of the input.
+ */
+int salvage_resync(struct transplant_ctx *ctx, int depth) {
+    if (ctx->wire_version == WIRE_V2) {
+        fprintf(stderr, "ERROR: A transmission in version 2 of the format cannot be salvaged. \n");
+        return -1;
+    }
+    uint64_t failed = tp_offset(ctx);
+    if (ctx->salvage_mark >= ctx->in_base) { // back to the last record parsed, in the buffer if it still is
+        ctx->in_pos = ctx->salvage_mark - ctx->in_base;
+    } else {
+        uint64_t from = rewind_to_mark(ctx);
+        if (from > ctx->salvage_mark) {
+            fprintf(stderr, "WARNING: Damaged input in %s: the bytes from %lu to %lu are no longer available and are not scanned. \n",
+                    ctx->path_buf, (unsigned long)ctx->salvage_mark, (unsigned long)from);
+        }
+        ctx->in_pos = 0;
+    }
+
+    for (;;) {
+        size_t have = window(ctx, IO_BUF_SIZE);
+        size_t found = salvage_find_magic(ctx->in_buf + ctx->in_pos, have);
+        if (found == have) {
+            if (have < IO_BUF_SIZE || ctx->in_buf != ctx->in_storage) break; // the end of the input
+            ctx->in_pos += have - 2; // the last two bytes may start magic bytes
+            continue;
+        }
+        ctx->in_pos += found;
+        have = window(ctx, SALVAGE_LOOKAHEAD);
+        int resume = candidate((const unsigned char *)ctx->in_buf + ctx->in_pos, have, depth);
+        if (resume == -1) {
+            ctx->in_pos++;
+            continue;
+        }
+
+        uint64_t at = tp_offset(ctx);
+        if (at >= failed) {
+            fprintf(stderr, "WARNING: Damaged input in %s: skipped bytes %lu to %lu. \n", ctx->path_buf,
+                    (unsigned long)failed, (unsigned long)at);
+            ctx->salvage_skipped += at - failed;
+        } else {
+            fprintf(stderr, "WARNING: Damaged input in %s: the entry %s ran into the record at %lu and is damaged. \n",
+                    ctx->path_buf, ctx->name_buf, (unsigned long)at);
+            ctx->salvage_damaged++;
+        }
+        ctx->salvage_regions++;
+        ctx->salvage_mark = at + 1; // should this record fail too, the next scan starts after it
+        return finish_directories(ctx, depth, resume) == -1 ? -1 : resume;
+    }
+
+    fprintf(stderr, "ERROR: Damaged input in %s: no record to go on from after %lu. \n", ctx->path_buf, (unsigned long)failed);
+    finish_directories(ctx, depth, 0); // what was restored still gets the permissions and times of its directories
+    return -1;
+}
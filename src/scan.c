@@ -0,0 +1,438 @@
+#include "global.h"
+#include "debug.h"
+#include "filter.h"
+#include "scan.h"
+#include "context.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * A deque of directories waiting to be read.  The owning worker pushes and pops
+ * at the bottom (so it keeps working depth-first on what it just discovered),
+ * thieves take from the top (the oldest, and usually largest, subtrees).
+ * Each deque has its own lock, so contention only occurs on a steal.
+ */
+struct scan_deque {
+    pthread_mutex_t lock;
+    struct scan_dir **tasks; // circular buffer
+    int top;                 // position of the oldest task
+    int count;
+    int capacity;
+};
+
+struct scan_pool;
+
+struct scan_worker {
+    pthread_t thread;
+    int id;
+    struct scan_pool *pool;
+    struct scan_deque deque;
+    char *link_scratch;      // PATH_MAX bytes for readlinkat()
+};
+
+struct scan_pool {
+    struct scan_worker *workers;
+    int count;
+    atomic_long pending;     // directories pushed but not yet completely read
+    atomic_long queued;      // directories sitting in some deque
+    atomic_int failed;
+    struct filter_set *filters; // rules of the context being serialized, read-only during the scan
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+static int deque_push(struct scan_deque *deque, struct scan_dir *dir) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) { // grow, unrolling the circular buffer
+        int capacity = deque->capacity ? deque->capacity * 2 : 64;
+        struct scan_dir **tasks = malloc(capacity * sizeof(struct scan_dir *));
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (int i = 0; i < deque->count; i++) {
+            *(tasks + i) = *(deque->tasks + (deque->top + i) % deque->capacity);
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+    *(deque->tasks + (deque->top + deque->count) % deque->capacity) = dir;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static struct scan_dir *deque_pop_bottom(struct scan_deque *deque) {
+    struct scan_dir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        dir = *(deque->tasks + (deque->top + deque->count) % deque->capacity);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+static struct scan_dir *deque_steal_top(struct scan_deque *deque) {
+    struct scan_dir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        dir = *(deque->tasks + deque->top);
+        deque->top = (deque->top + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+/*
+ * @brief  Allocate an empty directory listing.
+ * @param path  The pathname of the directory, which is copied.
+ * @return The new listing, or NULL if memory is exhausted.
+ */
+struct scan_dir *scan_dir_new(char *path) {
+    struct scan_dir *dir = calloc(1, sizeof(struct scan_dir));
+    if (!dir) return NULL;
+    int length = len_string(path);
+    dir->path = malloc(length + 1);
+    if (!dir->path) {
+        free(dir);
+        return NULL;
+    }
+    for (int i = 0; i <= length; i++) *(dir->path + i) = *(path + i);
+    return dir;
+}
+
+/*
+ * @brief  Append an entry to a directory listing, with the metadata of stat_buf.
+ * @details  The name and link target are copied; the caller attaches the
+ * listing of a subdirectory by setting the dir field of the new entry, which
+ * is the last one in the listing.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int scan_entry_add(struct scan_dir *dir, char *name, struct stat *stat_buf, uint64_t size, char *link_target) {
+    if (dir->count == dir->capacity) {
+        int capacity = dir->capacity ? dir->capacity * 2 : 16;
+        struct scan_entry *entries = realloc(dir->entries, capacity * sizeof(struct scan_entry));
+        if (!entries) return -1;
+        dir->entries = entries;
+        dir->capacity = capacity;
+    }
+    struct scan_entry *entry = dir->entries + dir->count;
+    int length = len_string(name);
+    entry->name = malloc(length + 1);
+    if (!entry->name) return -1;
+    for (int i = 0; i <= length; i++) *(entry->name + i) = *(name + i);
+    entry->mode = stat_buf->st_mode;
+    entry->size = size;
+    entry->times.atime = stat_buf->st_atim;
+    entry->times.mtime = stat_buf->st_mtim;
+    entry->link_target = NULL;
+    entry->dir = NULL;
+    if (link_target) {
+        entry->link_target = malloc(size + 1);
+        if (!entry->link_target) {
+            free(entry->name);
+            return -1;
+        }
+        for (uint64_t i = 0; i <= size; i++) *(entry->link_target + i) = *(link_target + i);
+    }
+    dir->count++;
+    return 0;
+}
+
+/*
+ * @brief  Free a directory listing together with all the listings below it.
+ */
+void scan_free(struct scan_dir *dir) {
+    if (!dir) return;
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        free(entry->name);
+        free(entry->link_target);
+        scan_free(entry->dir);
+    }
+    free(dir->entries);
+    free(dir->path);
+    free(dir);
+}
+
+/*
+ * Build the pathname of a child of dir, with the same rules as path_push().
+ */
+static char *child_path(struct scan_dir *dir, char *name) {
+    int dir_length = len_string(dir->path);
+    int name_length = len_string(name);
+    int slash = (dir_length > 0 && *(dir->path + dir_length - 1) != '/');
+    if (dir_length + slash + name_length >= PATH_MAX) {
+        fprintf(stderr, "ERROR: Path of %s/%s exceeds PATH_MAX. \n", dir->path, name);
+        return NULL;
+    }
+    char *path = malloc(dir_length + slash + name_length + 1);
+    if (!path) return NULL;
+    char *dest = path;
+    for (char *p = dir->path; *p != '\0'; p++) *dest++ = *p;
+    if (slash) *dest++ = '/';
+    for (char *p = name; *p != '\0'; p++) *dest++ = *p;
+    *dest = '\0';
+    return path;
+}
+
+static void pool_wake(struct scan_pool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void pool_fail(struct scan_pool *pool, struct scan_dir *dir) {
+    dir->error = 1;
+    atomic_store(&pool->failed, 1);
+}
+
+/*
+ * Read one directory into its listing, queueing its subdirectories on the
+ * worker's own deque.  The entries are looked up relative to the open
+ * directory (fstatat, readlinkat), so the full path is only resolved once.
+ */
+static void scan_directory(struct scan_worker *worker, struct scan_dir *dir) {
+    struct scan_pool *pool = worker->pool;
+    DIR *stream = opendir(dir->path);
+    if (!stream) {
+        fprintf(stderr, "ERROR: Failed to open directory %s. \n", dir->path);
+        pool_fail(pool, dir);
+        return;
+    }
+    int fd = dirfd(stream);
+    struct dirent *de;
+    struct stat stat_buf;
+    while ((de = readdir(stream)) != NULL && !atomic_load(&pool->failed)) {
+        // Skip "." and ".."
+        if (*(de->d_name) == '.' && (*(de->d_name + 1) == '\0' || (*(de->d_name + 1) == '.' && *(de->d_name + 2) == '\0'))) {
+            continue;
+        }
+        if (filter_excluded(pool->filters, de->d_name)) {
+            continue;
+        }
+        if (fstatat(fd, de->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1) {
+            fprintf(stderr, "ERROR: Failed to retrieve metadata of %s/%s. \n", dir->path, de->d_name);
+            pool_fail(pool, dir);
+            break;
+        }
+
+        if (S_ISDIR(stat_buf.st_mode)) {
+            char *path = child_path(dir, de->d_name);
+            struct scan_dir *child = path ? scan_dir_new(path) : NULL;
+            free(path);
+            if (!child || scan_entry_add(dir, de->d_name, &stat_buf, stat_buf.st_size, NULL) == -1) {
+                scan_free(child);
+                pool_fail(pool, dir);
+                break;
+            }
+            (dir->entries + dir->count - 1)->dir = child;
+            atomic_fetch_add(&pool->pending, 1);
+            atomic_fetch_add(&pool->queued, 1); // count it first so a thief can never drive this negative
+            if (deque_push(&worker->deque, child) == -1) {
+                atomic_fetch_sub(&pool->queued, 1);
+                atomic_fetch_sub(&pool->pending, 1);
+                pool_fail(pool, dir);
+                break;
+            }
+            pool_wake(pool);
+        } else if (S_ISREG(stat_buf.st_mode)) {
+            if (scan_entry_add(dir, de->d_name, &stat_buf, stat_buf.st_size, NULL) == -1) {
+                pool_fail(pool, dir);
+                break;
+            }
+        } else if (S_ISLNK(stat_buf.st_mode)) {
+            ssize_t link_length = readlinkat(fd, de->d_name, worker->link_scratch, PATH_MAX - 1);
+            if (link_length == -1) {
+                fprintf(stderr, "ERROR: Failed to read the target of symbolic link %s/%s. \n", dir->path, de->d_name);
+                pool_fail(pool, dir);
+                break;
+            }
+            *(worker->link_scratch + link_length) = '\0';
+            if (scan_entry_add(dir, de->d_name, &stat_buf, link_length, worker->link_scratch) == -1) {
+                pool_fail(pool, dir);
+                break;
+            }
+        } else { // Sockets, FIFOs and device nodes have no content that can be transplanted
+            fprintf(stderr, "WARNING: Skipping %s/%s - not a regular file, directory or symbolic link. \n", dir->path, de->d_name);
+        }
+    }
+    closedir(stream);
+}
+
+static struct scan_dir *find_work(struct scan_worker *worker) {
+    struct scan_dir *dir = deque_pop_bottom(&worker->deque);
+    // Own deque is empty: try to steal, starting with the next worker along
+    for (int i = 1; !dir && i < worker->pool->count; i++) {
+        struct scan_worker *victim = worker->pool->workers + (worker->id + i) % worker->pool->count;
+        dir = deque_steal_top(&victim->deque);
+    }
+    if (dir) atomic_fetch_sub(&worker->pool->queued, 1);
+    return dir;
+}
+
+static void *scan_worker_main(void *arg) {
+    struct scan_worker *worker = arg;
+    struct scan_pool *pool = worker->pool;
+    while (1) {
+        struct scan_dir *dir = find_work(worker);
+        if (dir) {
+            if (!atomic_load(&pool->failed)) scan_directory(worker, dir);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pool_wake(pool); // that was the last directory: release the idle workers
+            }
+            continue;
+        }
+        // Nothing to do right now: sleep until a directory is queued or the scan is over
+        pthread_mutex_lock(&pool->idle_lock);
+        while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (atomic_load(&pool->pending) == 0) break;
+    }
+    return NULL;
+}
+
+/*
+ * @brief  Read the whole tree below a directory into memory using a pool of
+ * work-stealing threads.
+ * @details  Filter rules are applied to every name before it is looked up, as
+ * in serialize_directory().  Sockets, FIFOs and device nodes are skipped.
+ *
+ * @param ctx  The context whose filter rules apply.
+ * @param path  The pathname of the directory at the root of the tree.
+ * @param threads  The number of worker threads to use.
+ * @return The listing of the root directory, or NULL if any directory or entry
+ * could not be read.
+ */
+struct scan_dir *scan_tree(struct transplant_ctx *ctx, char *path, int threads) {
+    struct scan_dir *root = scan_dir_new(path);
+    struct scan_pool pool;
+    pool.workers = calloc(threads, sizeof(struct scan_worker));
+    if (!root || !pool.workers) {
+        fprintf(stderr, "ERROR: Out of memory starting the directory scan. \n");
+        scan_free(root);
+        free(pool.workers);
+        return NULL;
+    }
+    pool.count = threads;
+    pool.filters = &ctx->filters;
+    atomic_init(&pool.pending, 1);
+    atomic_init(&pool.queued, 1);
+    atomic_init(&pool.failed, 0);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+
+    int started = 0;
+    for (struct scan_worker *worker = pool.workers; worker < pool.workers + threads; worker++) {
+        worker->id = worker - pool.workers;
+        worker->pool = &pool;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->link_scratch = malloc(PATH_MAX);
+        if (!worker->link_scratch) atomic_store(&pool.failed, 1);
+    }
+    deque_push(&pool.workers->deque, root);
+    for (struct scan_worker *worker = pool.workers; worker < pool.workers + threads; worker++) {
+        if (pthread_create(&worker->thread, NULL, scan_worker_main, worker) != 0) {
+            fprintf(stderr, "ERROR: Failed to start scan thread. \n");
+            atomic_store(&pool.failed, 1);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) scan_worker_main(pool.workers); // drain the root ourselves
+    for (struct scan_worker *worker = pool.workers; worker < pool.workers + started; worker++) {
+        pthread_join(worker->thread, NULL);
+    }
+
+    for (struct scan_worker *worker = pool.workers; worker < pool.workers + threads; worker++) {
+        pthread_mutex_destroy(&worker->deque.lock);
+        free(worker->deque.tasks);
+        free(worker->link_scratch);
+    }
+    free(pool.workers);
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+
+    if (atomic_load(&pool.failed)) {
+        scan_free(root);
+        return NULL;
+    }
+    return root;
+}
+
+/*
+ * @brief  Serialize a scanned directory as a sequence of records written to the
+ * sink of the context.
+ * @details  This function assumes that path_buf contains the name of the
+ * directory whose listing is given.  It writes the same records, in the same
+ * order, as serialize_directory() would for a tree with the same contents, but
+ * takes the names and metadata from the listing instead of the filesystem; only
+ * file contents are read.  Listings of subdirectories are freed once written.
+ *
+ * @param dir  The listing of the directory.
+ * @param depth  The value of the depth field for the START_OF_DIRECTORY,
+ * DIRECTORY_ENTRY and END_OF_DIRECTORY records of this directory.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int serialize_scanned_directory(struct transplant_ctx *ctx, struct scan_dir *dir, int depth) {
+    if (tp_write_record_header(ctx, 2, depth, 16) == -1) { // START_OF_DIRECTORY = 2
+        return -1;
+    }
+
+    struct stat stat_buf;
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        if (tp_path_push(ctx, entry->name) == -1) {
+            fprintf(stderr, "ERROR: Failed to push component onto path_buf. \n");
+            return -1;
+        }
+        stat_buf.st_mode = entry->mode;
+        stat_buf.st_size = entry->size;
+        stat_buf.st_atim = entry->times.atime;
+        stat_buf.st_mtim = entry->times.mtime;
+        if (tp_write_directory_entry(ctx, depth, entry->name, &stat_buf) == -1) {
+            return -1;
+        }
+
+        int ret = 0;
+        if (entry->dir) {
+            ret = serialize_scanned_directory(ctx, entry->dir, depth + 1);
+            scan_free(entry->dir); // no longer needed, keep the footprint shrinking as we go
+            entry->dir = NULL;
+        } else if (S_ISREG(entry->mode)) {
+            ret = tp_serialize_file(ctx, depth, entry->size);
+        } else if (S_ISLNK(entry->mode)) {
+            for (uint64_t i = 0; i <= entry->size; i++) *(ctx->link_buf + i) = *(entry->link_target + i);
+            ret = tp_serialize_symlink(ctx, depth, entry->size);
+        }
+        if (ret == -1) {
+            tp_path_pop(ctx);
+            return -1;
+        }
+
+        if (tp_path_pop(ctx) == -1) {
+            fprintf(stderr, "ERROR: Failed to pop component off path_buf. \n");
+            return -1;
+        }
+    }
+
+    if (tp_write_record_header(ctx, 3, depth, 16) == -1) { // END_OF_DIRECTORY = 3
+        return -1;
+    }
+    return 0;
+}
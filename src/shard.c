@@ -0,0 +1,317 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "shard.h"
+#include "scan.h"
+#include "changes.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * An entry sent whole by one shard.
+ */
+struct shard_unit {
+    char *rel;              // pathname relative to the root
+    uint64_t weight;
+};
+
+struct unit_list {
+    struct shard_unit *units;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * A shard being written, and the thread that writes it.
+ */
+struct shard_writer {
+    struct transplant_ctx *parent;
+    struct shard *shard;
+    struct change_node root;    // the units of the shard
+    uint64_t weight;
+    pthread_t thread;
+    int ret;
+};
+
+/*
+ * @brief  Add an output to sharded serialization: the file at path, created
+ * or truncated, or the descriptor fd if path is NULL.
+ * @return 0 in case of success, -1 if memory is exhausted.
+ */
+int shard_add(struct transplant_ctx *ctx, char *path, int fd) {
+    struct shard *shard = calloc(1, sizeof(struct shard));
+    char *copy = path ? malloc(len_string(path) + 1) : NULL;
+    if (!shard || (path && !copy)) {
+        free(shard);
+        free(copy);
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    if (path) tp_copy(copy, path, len_string(path) + 1);
+    shard->path = copy;
+    shard->fd = fd;
+    struct shard **link = &ctx->shards;
+    while (*link) link = &(*link)->next;
+    *link = shard;
+    return 0;
+}
+
+/*
+ * @brief  Forget the outputs of sharded serialization: the tree is written to
+ * the sink of the context again.
+ */
+void shard_clear(struct transplant_ctx *ctx) {
+    while (ctx->shards) {
+        struct shard *next = ctx->shards->next;
+        free(ctx->shards->path);
+        free(ctx->shards);
+        ctx->shards = next;
+    }
+}
+
+static uint64_t tree_weight(struct scan_dir *dir);
+
+/*
+ * What sending an entry costs: its records, its contents and its creation.
+ */
+static uint64_t entry_weight(struct scan_entry *entry) {
+    uint64_t weight = SHARD_ENTRY_WEIGHT + 16 + 12 + len_string(entry->name);
+    if (S_ISREG(entry->mode) || S_ISLNK(entry->mode)) {
+        weight += 16 + entry->size;
+    }
+    if (entry->dir) {
+        weight += tree_weight(entry->dir);
+    }
+    return weight;
+}
+
+static uint64_t tree_weight(struct scan_dir *dir) {
+    uint64_t weight = 32; // START_OF_DIRECTORY and END_OF_DIRECTORY
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        weight += entry_weight(entry);
+    }
+    return weight;
+}
+
+static int add_unit(struct unit_list *list, char *rel, int length, uint64_t weight) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        struct shard_unit *bigger = realloc(list->units, capacity * sizeof(struct shard_unit));
+        if (!bigger) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return -1;
+        }
+        list->units = bigger;
+        list->capacity = capacity;
+    }
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    tp_copy(copy, rel, length + 1);
+    (list->units + list->count)->rel = copy;
+    (list->units + list->count)->weight = weight;
+    list->count++;
+    return 0;
+}
+
+/*
+ * @brief  Cut the entries of a scanned directory into units of at most limit,
+ * as far as directories allow.
+ * @param rel  The pathname of the directory relative to the root, length bytes
+ * long, with room for max bytes in all.
+ * @return 0 in case of success, -1 otherwise.
+ */
+static int collect_units(struct unit_list *list, struct scan_dir *dir, char *rel, int length, int max, uint64_t limit) {
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        int name_length = len_string(entry->name);
+        int entry_length = length + (length > 0) + name_length;
+        if (entry_length >= max) {
+            fprintf(stderr, "ERROR: Pathname of %s is too long. \n", entry->name);
+            return -1;
+        }
+        if (length > 0) *(rel + length) = '/';
+        tp_copy(rel + entry_length - name_length, entry->name, name_length + 1);
+        uint64_t weight = entry_weight(entry);
+        int ret = (entry->dir && entry->dir->count > 0 && weight > limit) ?
+            collect_units(list, entry->dir, rel, entry_length, max, limit) :
+            add_unit(list, rel, entry_length, weight);
+        *(rel + length) = '\0';
+        if (ret == -1) return -1;
+    }
+    return 0;
+}
+
+static int heavier_first(const void *a, const void *b) {
+    uint64_t x = ((const struct shard_unit *)a)->weight, y = ((const struct shard_unit *)b)->weight;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * @brief  Mark the directories of a shard that only lead to its units and that
+ * other shards send as well.
+ * @param rel  Pathname of the node relative to the root, length bytes long.
+ */
+static void mark_shared(struct shard_writer *writers, int count, struct shard_writer *self,
+                        struct change_node *node, char *rel, int length) {
+    for (struct change_node *child = node->children; child; child = child->next) {
+        if (child->flags & CHANGE_ENTRY) {
+            continue;
+        }
+        int name_length = len_string(child->name);
+        int child_length = length + (length > 0) + name_length;
+        if (length > 0) *(rel + length) = '/';
+        tp_copy(rel + child_length - name_length, child->name, name_length + 1);
+        for (struct shard_writer *other = writers; other < writers + count; other++) {
+            if (other != self && change_walk(&other->root, rel, child_length, 0)) {
+                child->flags |= CHANGE_WRITABLE;
+                break;
+            }
+        }
+        mark_shared(writers, count, self, child, rel, child_length);
+        *(rel + length) = '\0';
+    }
+}
+
+/*
+ * Write one shard as a transmission of its own, with a context of its own.
+ */
+static int write_shard(struct shard_writer *writer) {
+    struct transplant_ctx *parent = writer->parent;
+    struct shard *shard = writer->shard;
+    struct transplant_ctx *ctx = transplant_new();
+    int fd = shard->path ? open(shard->path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : shard->fd;
+    if (!ctx || fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open shard %s. \n", shard->path ? shard->path : "descriptor");
+        transplant_free(ctx);
+        return -1;
+    }
+    tp_copy(ctx->path_buf, parent->path_buf, parent->path_length + 1);
+    ctx->path_length = parent->path_length;
+    ctx->options = parent->options;
+    ctx->direct_io_min_size = parent->direct_io_min_size;
+    ctx->pipeline_mem = parent->pipeline_mem;
+    ctx->chunk_size = parent->chunk_size;
+    ctx->filters = parent->filters; // only read while serializing, so the threads share them
+    ctx->selection = &writer->root;
+    transplant_set_sink(ctx, transplant_fd_write, (void *)(intptr_t)fd);
+
+    int ret = tp_serialize(ctx);
+    if (ret == -1) {
+        fprintf(stderr, "ERROR: Failed to write shard %s. \n", shard->path ? shard->path : "descriptor");
+    }
+    ctx->filters = (struct filter_set){0};
+    transplant_free(ctx);
+    if (shard->path && close(fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to close shard %s. \n", shard->path);
+        ret = -1;
+    }
+    return ret;
+}
+
+static void *writer_main(void *arg) {
+    struct shard_writer *writer = arg;
+    writer->ret = write_shard(writer);
+    return NULL;
+}
+
+/*
+ * Deal the units out to the shards, heaviest first, each to the lightest shard.
+ */
+static int deal_units(struct unit_list *list, struct shard_writer *writers, int count) {
+    qsort(list->units, list->count, sizeof(struct shard_unit), heavier_first);
+    for (struct shard_unit *unit = list->units; unit < list->units + list->count; unit++) {
+        struct shard_writer *lightest = writers;
+        for (struct shard_writer *writer = writers + 1; writer < writers + count; writer++) {
+            if (writer->weight < lightest->weight) lightest = writer;
+        }
+        if (change_mark(&lightest->root, unit->rel, CHANGE_ENTRY | CHANGE_TREE) == -1) {
+            return -1;
+        }
+        lightest->weight += unit->weight;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Serialize the tree below path_buf as one transmission per shard of
+ * the context, written at the same time; see shard.h.
+ * @return 0 in case of success, -1 if any shard could not be written.
+ */
+int shard_serialize(struct transplant_ctx *ctx) {
+    if (ctx->files_from || ctx->signatures || (ctx->options & (TRANSPLANT_SIGNATURE | TRANSPLANT_WATCH))) {
+        fprintf(stderr, "ERROR: Shards cannot be written with a list of files, signatures, deltas or watching. \n");
+        return -1;
+    }
+    int count = 0;
+    for (struct shard *shard = ctx->shards; shard; shard = shard->next) count++;
+
+    struct scan_dir *tree = scan_tree(ctx, ctx->path_buf, ctx->scan_threads);
+    if (!tree) {
+        return -1;
+    }
+    struct unit_list list = {0};
+    struct shard_writer *writers = calloc(count, sizeof(struct shard_writer));
+    int max = PATH_MAX - ctx->path_length - 1;
+    char *rel = malloc(max);
+    // Units of half a shard at most can be dealt out evenly; a single shard needs no cutting
+    uint64_t limit = count > 1 ? tree_weight(tree) / (2 * count) : UINT64_MAX;
+    int ret = -1;
+    if (!writers || !rel) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+    } else {
+        *rel = '\0';
+        ret = collect_units(&list, tree, rel, 0, max, limit);
+    }
+    scan_free(tree);
+
+    if (ret == 0) {
+        struct shard *shard = ctx->shards;
+        for (struct shard_writer *writer = writers; writer < writers + count; writer++, shard = shard->next) {
+            writer->parent = ctx;
+            writer->shard = shard;
+        }
+        ret = deal_units(&list, writers, count);
+    }
+    if (ret == 0) {
+        for (struct shard_writer *writer = writers; writer < writers + count; writer++) {
+            mark_shared(writers, count, writer, &writer->root, rel, 0);
+        }
+        int started = 0;
+        for (struct shard_writer *writer = writers; writer < writers + count; writer++, started++) {
+            if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+                fprintf(stderr, "ERROR: Failed to start the thread of a shard. \n");
+                ret = -1;
+                break;
+            }
+        }
+        for (struct shard_writer *writer = writers; writer < writers + started; writer++) {
+            pthread_join(writer->thread, NULL);
+            if (writer->ret == -1) ret = -1;
+        }
+    }
+
+    for (struct shard_unit *unit = list.units; unit < list.units + list.count; unit++) {
+        free(unit->rel);
+    }
+    free(list.units);
+    if (writers) {
+        for (struct shard_writer *writer = writers; writer < writers + count; writer++) {
+            change_free(writer->root.children);
+        }
+    }
+    free(writers);
+    free(rel);
+    return ret;
+}
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE // memfd_create()
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "shm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#define SHM_SOCKET_PATH_MAX 108 // size of sun_path in struct sockaddr_un
+
+static void futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * @brief  Sleep on a waiting flag while it is raised, for SHM_WAIT_MS at most.
+ * @return 0, or -1 if the sleep timed out and the other process has gone away.
+ */
+static int wait_flag(struct shm_transport *shm, _Atomic uint32_t *word) {
+    struct timespec timeout = {0, SHM_WAIT_MS * 1000000L};
+    if (syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, 1, &timeout, NULL, 0) == -1 && errno == ETIMEDOUT) {
+        // nothing is ever sent on the socket after the memfd: anything readable is the end of it
+        struct pollfd pfd = {.fd = shm->socket, .events = POLLIN};
+        if (poll(&pfd, 1, 0) > 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Wait until the ring holds data for the reader.
+ * @return The number of bytes available, 0 once the writer is done and the
+ * ring is empty, or -1 if the writer failed or went away.
+ */
+static int64_t wait_data(struct shm_transport *shm, uint64_t head) {
+    struct shm_header *header = shm->header;
+    for (;;) {
+        uint64_t available = atomic_load(&header->tail) - head;
+        if (available > 0) {
+            return available;
+        }
+        uint32_t state = atomic_load(&header->state);
+        if (state != SHM_OPEN) {
+            if (atomic_load(&header->tail) != head) continue; // written just before the end
+            if (state == SHM_DONE) return 0;
+            errno = EIO;
+            return -1;
+        }
+        atomic_store(&header->reader_waiting, 1);
+        if (atomic_load(&header->tail) != head || atomic_load(&header->state) != SHM_OPEN) {
+            atomic_store(&header->reader_waiting, 0);
+            continue;
+        }
+        if (wait_flag(shm, &header->reader_waiting) == -1 && atomic_load(&header->state) == SHM_OPEN) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+}
+
+/*
+ * Hand count bytes read from the ring back to the writer.
+ */
+static void release_data(struct shm_transport *shm, uint64_t head, size_t count) {
+    struct shm_header *header = shm->header;
+    atomic_store(&header->head, head + count);
+    if (atomic_exchange(&header->writer_waiting, 0)) futex_wake(&header->writer_waiting);
+}
+
+/*
+ * @brief  Wait until the ring has room for the writer.
+ * @return The number of bytes of room, or -1 if the reader went away.
+ */
+static int64_t wait_room(struct shm_transport *shm, uint64_t tail) {
+    struct shm_header *header = shm->header;
+    for (;;) {
+        uint64_t room = shm->capacity - (tail - atomic_load(&header->head));
+        if (room > 0) {
+            return room;
+        }
+        atomic_store(&header->writer_waiting, 1);
+        if (shm->capacity - (tail - atomic_load(&header->head)) > 0) {
+            atomic_store(&header->writer_waiting, 0);
+            continue;
+        }
+        if (wait_flag(shm, &header->writer_waiting) == -1) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+}
+
+/*
+ * Publish count bytes written into the ring to the reader.
+ */
+static void publish_data(struct shm_transport *shm, uint64_t tail, size_t count) {
+    struct shm_header *header = shm->header;
+    atomic_store(&header->tail, tail + count);
+    if (atomic_exchange(&header->reader_waiting, 0)) futex_wake(&header->reader_waiting);
+}
+
+/*
+ * @brief  Read callback of the deserializing side; arg is the transport.
+ * @return The number of bytes read, 0 at the end of the data, or -1 if the
+ * writer failed or went away.
+ */
+static ssize_t shm_read(void *arg, void *buf, size_t count) {
+    struct shm_transport *shm = arg;
+    uint64_t head = atomic_load_explicit(&shm->header->head, memory_order_relaxed); // only this side moves it
+    int64_t available = wait_data(shm, head);
+    if (available <= 0) {
+        return available;
+    }
+    size_t n = (uint64_t)available < count ? (size_t)available : count;
+    tp_copy(buf, shm->data + (head & (shm->capacity - 1)), n);
+    release_data(shm, head, n);
+    return n;
+}
+
+/*
+ * @brief  Write callback of the serializing side; arg is the transport.
+ * @return The number of bytes written, as many as there is room for, or -1 if
+ * the reader went away while the ring was full.
+ */
+static ssize_t shm_write(void *arg, const void *buf, size_t count) {
+    struct shm_transport *shm = arg;
+    uint64_t tail = atomic_load_explicit(&shm->header->tail, memory_order_relaxed); // only this side moves it
+    int64_t room = wait_room(shm, tail);
+    if (room == -1) {
+        return -1;
+    }
+    size_t n = (uint64_t)room < count ? (size_t)room : count;
+    tp_copy(shm->data + (tail & (shm->capacity - 1)), buf, n);
+    publish_data(shm, tail, n);
+    return n;
+}
+
+/*
+ * @brief  Where the next bytes of file contents can be read from, in the ring
+ * itself, so that they are written to the file without another copy.
+ * @details  Only when the source of the context is a ring and nothing is left
+ * in its input buffer; shm_input_done() must follow before the next read.
+ * @param want  The largest number of bytes wanted.
+ * @param got  Set to the number of bytes at the returned address.
+ * @return The bytes, or NULL to read them with tp_read() instead (which also
+ * reports the end of the data or an error).
+ */
+char *shm_input_block(struct transplant_ctx *ctx, size_t want, size_t *got) {
+    if (ctx->read != shm_read || ctx->in_pos != ctx->in_len) {
+        return NULL;
+    }
+    struct shm_transport *shm = ctx->read_arg;
+    uint64_t head = atomic_load_explicit(&shm->header->head, memory_order_relaxed);
+    int64_t available = wait_data(shm, head);
+    if (available <= 0) {
+        return NULL;
+    }
+    *got = (uint64_t)available < want ? (size_t)available : want;
+    return shm->data + (head & (shm->capacity - 1));
+}
+
+/*
+ * @brief  Release the bytes returned by shm_input_block() to the writer.
+ */
+void shm_input_done(struct transplant_ctx *ctx, size_t got) {
+    struct shm_transport *shm = ctx->read_arg;
+    release_data(shm, atomic_load_explicit(&shm->header->head, memory_order_relaxed), got);
+    ctx->in_base += got;
+}
+
+/*
+ * @brief  Where the next bytes of file contents can be put, in the ring
+ * itself, so that they are read from the file without another copy.
+ * @details  Only when the sink of the context is a ring; whatever is in the
+ * output buffer is written out first.  shm_output_done() must follow before
+ * the next write.
+ * @param room  Set to the number of bytes that fit at the returned address.
+ * @return The address, or NULL to write with tp_write() instead.
+ */
+char *shm_output_block(struct transplant_ctx *ctx, size_t *room) {
+    if (ctx->write != shm_write || tp_flush(ctx) == -1) {
+        return NULL;
+    }
+    struct shm_transport *shm = ctx->write_arg;
+    uint64_t tail = atomic_load_explicit(&shm->header->tail, memory_order_relaxed);
+    int64_t available = wait_room(shm, tail);
+    if (available == -1) {
+        return NULL; // tp_write() fails the same way
+    }
+    *room = available;
+    return shm->data + (tail & (shm->capacity - 1));
+}
+
+/*
+ * @brief  Publish count bytes put at the address from shm_output_block().
+ */
+void shm_output_done(struct transplant_ctx *ctx, size_t count) {
+    struct shm_transport *shm = ctx->write_arg;
+    publish_data(shm, atomic_load_explicit(&shm->header->tail, memory_order_relaxed), count);
+}
+
+/*
+ * Map the ring of a memfd twice in a row, so that it wraps around contiguously.
+ */
+static char *map_ring(int fd, uint64_t capacity) {
+    char *base = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, SHM_HEADER_SIZE) == MAP_FAILED ||
+        mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, SHM_HEADER_SIZE) == MAP_FAILED) {
+        munmap(base, 2 * capacity);
+        return NULL;
+    }
+    return base;
+}
+
+static void unmap(struct shm_transport *shm) {
+    if (shm->data) munmap(shm->data, 2 * shm->capacity);
+    if (shm->header) munmap(shm->header, SHM_HEADER_SIZE);
+    if (shm->socket != -1) close(shm->socket);
+    free(shm);
+}
+
+/*
+ * @brief  Fill in the address of a Unix socket.
+ * @details  <sys/un.h> pulls in <string.h>, so the struct sockaddr_un is laid
+ * out by hand in a struct sockaddr_storage: the family, then the path.
+ * @return 0 in case of success, -1 if the path does not fit.
+ */
+static int socket_address(char *path, struct sockaddr_storage *addr) {
+    *addr = (struct sockaddr_storage){.ss_family = AF_UNIX};
+    int length = len_string(path);
+    if (length >= SHM_SOCKET_PATH_MAX) {
+        fprintf(stderr, "ERROR: Socket path %s is too long. \n", path);
+        return -1;
+    }
+    tp_copy((char *)addr + sizeof(sa_family_t), path, length + 1);
+    return 0;
+}
+
+/*
+ * Send a descriptor over a connected Unix socket, with one byte of data.
+ */
+static int send_fd(int socket, int fd) {
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct cmsghdr *control = calloc(1, CMSG_SPACE(sizeof(int)));
+    if (!control) return -1;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int))};
+    control->cmsg_level = SOL_SOCKET;
+    control->cmsg_type = SCM_RIGHTS;
+    control->cmsg_len = CMSG_LEN(sizeof(int));
+    tp_copy(CMSG_DATA(control), &fd, sizeof(int));
+    ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    free(control);
+    return n == 1 ? 0 : -1;
+}
+
+/*
+ * Receive the descriptor sent by send_fd(); -1 if there is none.
+ */
+static int receive_fd(int socket) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct cmsghdr *control = calloc(1, CMSG_SPACE(sizeof(int)));
+    if (!control) return -1;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int))};
+    int fd = -1;
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) == 1 && CMSG_FIRSTHDR(&msg) &&
+        control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_RIGHTS) {
+        tp_copy(&fd, CMSG_DATA(control), sizeof(int));
+    }
+    free(control);
+    return fd;
+}
+
+/*
+ * @brief  Create the ring, wait for the serializing side on the socket of the
+ * context and read from the ring from then on.
+ * @return The transport, to be given to shm_stop_input(), or NULL on error.
+ */
+struct shm_transport *shm_start_input(struct transplant_ctx *ctx) {
+    struct sockaddr_storage addr;
+    if (socket_address(ctx->shm_path, &addr) == -1) {
+        return NULL;
+    }
+    struct shm_transport *shm = calloc(1, sizeof(struct shm_transport));
+    if (!shm) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return NULL;
+    }
+    shm->socket = -1;
+    uint64_t capacity = 64 * 1024;
+    while (capacity < ctx->shm_size) capacity *= 2;
+    int fd = memfd_create("transplant-shm", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, SHM_HEADER_SIZE + capacity) == -1 ||
+        (shm->header = mmap(NULL, SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        !(shm->data = map_ring(fd, capacity))) {
+        fprintf(stderr, "ERROR: Failed to create a shared ring of %llu bytes. \n", (unsigned long long)capacity);
+        if (shm->header == MAP_FAILED) shm->header = NULL;
+        if (fd != -1) close(fd);
+        unmap(shm);
+        return NULL;
+    }
+    shm->capacity = capacity;
+    shm->header->magic = SHM_MAGIC;
+    shm->header->capacity = capacity;
+
+    // A socket left behind by an earlier run is in the way of bind()
+    struct stat stat_buf;
+    if (lstat(ctx->shm_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode)) unlink(ctx->shm_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(sa_family_t) + SHM_SOCKET_PATH_MAX) == -1 || listen(listener, 1) == -1) {
+        fprintf(stderr, "ERROR: Failed to listen on socket %s. \n", ctx->shm_path);
+        if (listener != -1) close(listener);
+        close(fd);
+        unmap(shm);
+        return NULL;
+    }
+    do {
+        shm->socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    } while (shm->socket == -1 && errno == EINTR);
+    unlink(ctx->shm_path); // one transfer per socket
+    close(listener);
+    if (shm->socket == -1 || send_fd(shm->socket, fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to hand the shared ring over on socket %s. \n", ctx->shm_path);
+        close(fd);
+        unmap(shm);
+        return NULL;
+    }
+    close(fd); // the mappings keep the memory
+    shm->read = ctx->read;
+    shm->read_arg = ctx->read_arg;
+    transplant_set_source(ctx, shm_read, shm);
+    return shm;
+}
+
+/*
+ * @brief  Give the context its source back and let the serializing side go.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int shm_stop_input(struct transplant_ctx *ctx, struct shm_transport *shm) {
+    transplant_set_source(ctx, shm->read, shm->read_arg);
+    unmap(shm); // closing the socket tells a waiting writer that nobody reads any more
+    return 0;
+}
+
+/*
+ * @brief  Connect to the deserializing side on the socket of the context and
+ * write to the ring it hands over from then on.
+ * @return The transport, to be given to shm_stop_output(), or NULL on error.
+ */
+struct shm_transport *shm_start_output(struct transplant_ctx *ctx) {
+    struct sockaddr_storage addr;
+    if (socket_address(ctx->shm_path, &addr) == -1) {
+        return NULL;
+    }
+    struct shm_transport *shm = calloc(1, sizeof(struct shm_transport));
+    if (!shm || (shm->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        fprintf(stderr, "ERROR: Failed to create a socket. \n");
+        free(shm);
+        return NULL;
+    }
+    // The deserializing side may not be listening yet
+    struct timespec pause = {0, 10 * 1000000L};
+    int waited = 0;
+    while (connect(shm->socket, (struct sockaddr *)&addr, sizeof(sa_family_t) + SHM_SOCKET_PATH_MAX) == -1) {
+        if ((errno != ENOENT && errno != ECONNREFUSED && errno != EINTR) || waited >= SHM_CONNECT_MS) {
+            fprintf(stderr, "ERROR: Failed to connect to socket %s. \n", ctx->shm_path);
+            unmap(shm);
+            return NULL;
+        }
+        nanosleep(&pause, NULL);
+        waited += 10;
+    }
+    int fd = receive_fd(shm->socket);
+    struct stat stat_buf;
+    if (fd == -1 || fstat(fd, &stat_buf) == -1 ||
+        (shm->header = mmap(NULL, SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to receive the shared ring on socket %s. \n", ctx->shm_path);
+        shm->header = NULL;
+        if (fd != -1) close(fd);
+        unmap(shm);
+        return NULL;
+    }
+    uint64_t capacity = shm->header->capacity;
+    if (shm->header->magic != SHM_MAGIC || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        (uint64_t)stat_buf.st_size != SHM_HEADER_SIZE + capacity || !(shm->data = map_ring(fd, capacity))) {
+        fprintf(stderr, "ERROR: Invalid shared ring received on socket %s. \n", ctx->shm_path);
+        close(fd);
+        unmap(shm);
+        return NULL;
+    }
+    close(fd);
+    shm->capacity = capacity;
+    shm->write = ctx->write;
+    shm->write_arg = ctx->write_arg;
+    transplant_set_sink(ctx, shm_write, shm);
+    return shm;
+}
+
+/*
+ * @brief  Tell the deserializing side that the data ends here, and give the
+ * context its sink back.
+ * @param failed  Nonzero if serialization failed, so that the reader fails too.
+ * @return 0 in case of success, -1 if the reader went away before reading everything.
+ */
+int shm_stop_output(struct transplant_ctx *ctx, struct shm_transport *shm, int failed) {
+    struct shm_header *header = shm->header;
+    atomic_store(&header->state, failed ? SHM_FAILED : SHM_DONE);
+    if (atomic_exchange(&header->reader_waiting, 0)) futex_wake(&header->reader_waiting);
+    int ret = 0;
+    struct pollfd pfd = {.fd = shm->socket, .events = POLLIN};
+    if (!failed && poll(&pfd, 1, 0) > 0 && atomic_load(&header->head) != atomic_load(&header->tail)) {
+        fprintf(stderr, "ERROR: The reader of the shared ring went away. \n");
+        ret = -1;
+    }
+    transplant_set_sink(ctx, shm->write, shm->write_arg);
+    unmap(shm);
+    return ret;
+}
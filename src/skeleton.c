@@ -0,0 +1,544 @@
+#define _GNU_SOURCE // fallocate(), sync_file_range()
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "skeleton.h"
+#include "scan.h"
+#include "metadata.h"
+#include "shm.h"
+#include "durability.h"
+#include "wire.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+/*
+ * The skeleton being restored, and the thread that creates it.
+ */
+struct skeleton {
+    struct transplant_ctx *ctx;
+    struct skeleton_entry *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t files;             // from the SKELETON record
+    uint64_t bytes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t created;             // entries created so far, under lock
+    int failed;                 // the thread could not create an entry
+    int stop;                   // the restore failed: the thread stops
+    pthread_t thread;
+};
+
+static int put_number(struct transplant_ctx *ctx, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if (tp_putc(ctx, (value >> (i * 8)) & 0xFF) == EOF) return -1;
+    }
+    return 0;
+}
+
+static int get_number(struct transplant_ctx *ctx, uint64_t *value, int count) {
+    *value = 0;
+    for (int i = 0; i < count; i++) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        *value = (*value << 8) | byte;
+    }
+    return 0;
+}
+
+static void count_files(struct scan_dir *dir, uint64_t *files, uint64_t *bytes) {
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        if (entry->dir) {
+            count_files(entry->dir, files, bytes);
+        } else if (S_ISREG(entry->mode)) {
+            (*files)++;
+            *bytes += entry->size;
+        }
+    }
+}
+
+/*
+ * Write the records of a scanned directory, as serialize_scanned_directory()
+ * does, without the contents of its files.
+ */
+static int write_metadata(struct transplant_ctx *ctx, struct scan_dir *dir, int depth) {
+    if (tp_write_record_header(ctx, 2, depth, 16) == -1) { // START_OF_DIRECTORY = 2
+        return -1;
+    }
+    struct stat stat_buf;
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        if (tp_path_push(ctx, entry->name) == -1) {
+            fprintf(stderr, "ERROR: Failed to push component onto path_buf. \n");
+            return -1;
+        }
+        stat_buf.st_mode = entry->mode;
+        stat_buf.st_size = entry->size;
+        stat_buf.st_atim = entry->times.atime;
+        stat_buf.st_mtim = entry->times.mtime;
+        int ret = tp_write_directory_entry(ctx, depth, entry->name, &stat_buf);
+        if (ret == 0 && entry->dir) {
+            ret = write_metadata(ctx, entry->dir, depth + 1);
+        } else if (ret == 0 && S_ISLNK(entry->mode)) {
+            tp_copy(ctx->link_buf, entry->link_target, entry->size + 1);
+            ret = tp_serialize_symlink(ctx, depth, entry->size);
+        }
+        if (tp_path_pop(ctx) == -1 || ret == -1) {
+            return -1;
+        }
+    }
+    return tp_write_record_header(ctx, 3, depth, 16); // END_OF_DIRECTORY = 3
+}
+
+/*
+ * Write the contents of the files of a scanned directory, in the same order.
+ */
+static int write_data(struct transplant_ctx *ctx, struct scan_dir *dir, int depth) {
+    for (struct scan_entry *entry = dir->entries; entry < dir->entries + dir->count; entry++) {
+        if (!entry->dir && !S_ISREG(entry->mode)) {
+            continue;
+        }
+        if (tp_path_push(ctx, entry->name) == -1) {
+            fprintf(stderr, "ERROR: Failed to push component onto path_buf. \n");
+            return -1;
+        }
+        int ret = entry->dir ? write_data(ctx, entry->dir, depth + 1) : tp_serialize_file(ctx, depth, entry->size);
+        if (tp_path_pop(ctx) == -1 || ret == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write the tree below path_buf in the metadata-first layout, between
+ * the START_OF_TRANSMISSION and END_OF_TRANSMISSION records; see skeleton.h.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int skeleton_serialize(struct transplant_ctx *ctx) {
+    if (ctx->files_from || ctx->signatures || ctx->selection || ctx->chunk_size || (ctx->options & (TRANSPLANT_SIGNATURE | TRANSPLANT_WATCH))) {
+        fprintf(stderr, "ERROR: The metadata-first layout cannot be written with a list of files, signatures, deltas, shards, chunks or watching. \n");
+        return -1;
+    }
+    struct scan_dir *tree = scan_tree(ctx, ctx->path_buf, ctx->scan_threads);
+    if (!tree) {
+        return -1;
+    }
+    uint64_t files = 0, bytes = 0;
+    count_files(tree, &files, &bytes);
+    int ret = 0;
+    if (tp_write_record_header(ctx, SKELETON_TYPE, 1, SKELETON_RECORD_SIZE) == -1 ||
+        put_number(ctx, files, 8) == -1 || put_number(ctx, bytes, 8) == -1) {
+        fprintf(stderr, "ERROR: Failed to write the SKELETON record. \n");
+        ret = -1;
+    }
+    if (ret == 0) ret = write_metadata(ctx, tree, 1);
+    if (ret == 0) ret = write_data(ctx, tree, 1);
+    scan_free(tree);
+    return ret;
+}
+
+static struct skeleton_entry *add_entry(struct skeleton *sk) {
+    if (sk->count == sk->capacity) {
+        size_t capacity = sk->capacity ? sk->capacity * 2 : 256;
+        struct skeleton_entry *bigger = realloc(sk->entries, capacity * sizeof(struct skeleton_entry));
+        if (!bigger) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return NULL;
+        }
+        sk->entries = bigger;
+        sk->capacity = capacity;
+    }
+    struct skeleton_entry *entry = sk->entries + sk->count;
+    *entry = (struct skeleton_entry){0};
+    entry->path = malloc(sk->ctx->path_length + 1);
+    if (!entry->path) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return NULL;
+    }
+    tp_copy(entry->path, sk->ctx->path_buf, sk->ctx->path_length + 1);
+    sk->count++;
+    return entry;
+}
+
+/*
+ * Read a START_OF_DIRECTORY or END_OF_DIRECTORY record whose type and depth have been read.
+ */
+static int read_marker(struct transplant_ctx *ctx) {
+    uint64_t size;
+    if (wire_read_size(ctx, &size) == -1 || size != 16) {
+        fprintf(stderr, "ERROR: Invalid directory record in the metadata section. \n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the target of a symbolic link from its SYMLINK_TARGET record into a new string.
+ */
+static char *read_link_target(struct transplant_ctx *ctx, int depth) {
+    uint64_t size;
+    if (check_while_condition(ctx, depth) != 6 || wire_read_size(ctx, &size) == -1 || size <= 16 || size - 16 >= PATH_MAX) {
+        fprintf(stderr, "ERROR: Invalid SYMLINK TARGET record in the metadata section. \n");
+        return NULL;
+    }
+    char *target = malloc(size - 16 + 1);
+    if (!target || tp_read(ctx, target, size - 16) == -1) {
+        fprintf(stderr, "ERROR: Failed to read the target of symbolic link %s. \n", ctx->path_buf);
+        free(target);
+        return NULL;
+    }
+    *(target + (size - 16)) = '\0';
+    return target;
+}
+
+/*
+ * @brief  Read the whole metadata section into the entries of the skeleton,
+ * with their pathnames below path_buf.
+ * @return 0 in case of success, -1 otherwise.
+ */
+static int read_metadata(struct transplant_ctx *ctx, struct skeleton *sk) {
+    if (check_while_condition(ctx, 1) != 2 || read_marker(ctx) == -1) { // START_OF_DIRECTORY
+        fprintf(stderr, "ERROR: The metadata section does not begin with a START OF DIRECTORY record. \n");
+        return -1;
+    }
+    uint64_t files = 0, bytes = 0;
+    int depth = 1;
+    while (depth > 0) {
+        int type = check_while_condition(ctx, depth);
+        if (type == TIMES_TYPE) {
+            if (deserialize_times(ctx, depth) == -1) return -1;
+            continue;
+        }
+        if (type == 3) { // END_OF_DIRECTORY: the root stays on path_buf for the end of the restore
+            if (read_marker(ctx) == -1 || (depth > 1 && tp_path_pop(ctx) == -1)) return -1;
+            depth--;
+            continue;
+        }
+        if (type != 4) {
+            fprintf(stderr, "ERROR: Unexpected record type in the metadata section. \n");
+            return -1;
+        }
+        uint32_t mode;
+        uint64_t entry_size;
+        if (wire_read_entry(ctx, depth, &mode, &entry_size) == -1 || tp_path_push(ctx, ctx->name_buf) == -1) {
+            return -1;
+        }
+        struct skeleton_entry *entry = add_entry(sk);
+        if (!entry) {
+            return -1;
+        }
+        entry->mode = mode;
+        entry->size = entry_size;
+        entry->depth = depth;
+        entry->has_times = ctx->entry_has_times;
+        entry->times = ctx->entry_times;
+        ctx->entry_has_times = 0;
+
+        if (S_ISDIR(mode)) {
+            if (check_while_condition(ctx, depth + 1) != 2 || read_marker(ctx) == -1) {
+                fprintf(stderr, "ERROR: Expected a START OF DIRECTORY record after the entry of directory %s. \n", ctx->path_buf);
+                return -1;
+            }
+            depth++;
+            continue;
+        }
+        if (S_ISREG(mode)) {
+            files++;
+            bytes += entry_size;
+        } else if (!S_ISLNK(mode) || !(entry->link_target = read_link_target(ctx, depth))) {
+            if (!S_ISLNK(mode)) fprintf(stderr, "ERROR: Unexpected error - not a file or a directory. \n");
+            return -1;
+        }
+        if (tp_path_pop(ctx) == -1) {
+            return -1;
+        }
+    }
+    if (files != sk->files || bytes != sk->bytes) {
+        fprintf(stderr, "ERROR: The metadata section does not match its SKELETON record. \n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Create one entry of the skeleton, on the thread of the skeleton.  A file is
+ * created writable and given its permissions once its contents are written.
+ */
+static int build_entry(struct skeleton *sk, struct skeleton_entry *entry) {
+    int clobber = sk->ctx->options & TRANSPLANT_CLOBBER;
+    if (S_ISDIR(entry->mode)) {
+        if (mkdir(entry->path, 0777) == -1) {
+            struct stat stat_buf;
+            if (errno != EEXIST || !clobber) {
+                fprintf(stderr, "ERROR: Failed to make directory %s (it may already exist and the clobber flag was not passed). \n", entry->path);
+                return -1;
+            }
+            if (stat(entry->path, &stat_buf) == -1 || !S_ISDIR(stat_buf.st_mode)) {
+                fprintf(stderr, "ERROR: %s exists and is not a directory. \n", entry->path);
+                return -1;
+            }
+            entry->existed = 1;
+        }
+        return 0;
+    }
+    if (S_ISLNK(entry->mode)) {
+        if (symlinkat(entry->link_target, AT_FDCWD, entry->path) == -1 &&
+            (errno != EEXIST || !clobber || unlink(entry->path) == -1 || symlinkat(entry->link_target, AT_FDCWD, entry->path) == -1)) {
+            fprintf(stderr, "ERROR: Failed to create symbolic link %s (it may already exist and the clobber flag was not passed). \n", entry->path);
+            return -1;
+        }
+        if (entry->has_times && utimensat(AT_FDCWD, entry->path, (struct timespec *)&entry->times, AT_SYMLINK_NOFOLLOW) == -1) {
+            fprintf(stderr, "ERROR: Failed to set the times of symbolic link %s. \n", entry->path);
+            return -1;
+        }
+        return 0;
+    }
+    char *name = entry->path;
+    if (sk->ctx->durability == TRANSPLANT_DURABILITY_PER_FILE) { // renamed into place once its contents are written
+        struct stat stat_buf;
+        if (!clobber && lstat(entry->path, &stat_buf) == 0) { // off the path of the data, so fail now rather than at the rename
+            fprintf(stderr, "ERROR: File %s already exists but clobber flag not passed so cannot overwrite file. \n", entry->path);
+            return -1;
+        }
+        if (!(entry->temp = durability_temp_name(sk->ctx, entry->path))) {
+            return -1;
+        }
+        name = entry->temp;
+    }
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, (entry->mode & 0777) | S_IWUSR);
+    if (fd == -1 && errno == EEXIST && clobber && !entry->temp) {
+        entry->existed = 1;
+        fd = open(entry->path, O_WRONLY | O_TRUNC);
+        if (fd == -1 && errno == EACCES && chmod(entry->path, 0600) == 0) {
+            fd = open(entry->path, O_WRONLY | O_TRUNC); // a read-only file, given its permissions again later
+        }
+    }
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create file %s (it may already exist and the clobber flag was not passed). \n", entry->path);
+        return -1;
+    }
+    // Off the path of the data, so every file is preallocated whatever its size.  Only a full disk is an error
+    if (entry->size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, entry->size) == -1 && errno == ENOSPC) {
+        close(fd);
+        fprintf(stderr, "ERROR: Not enough space to restore file %s of %lu bytes. \n", entry->path, (unsigned long)entry->size);
+        return -1;
+    }
+    if (close(fd) == -1) {
+        fprintf(stderr, "ERROR: Failed to close file %s. \n", entry->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void *build_main(void *arg) {
+    struct skeleton *sk = arg;
+    for (struct skeleton_entry *entry = sk->entries; entry < sk->entries + sk->count; entry++) {
+        pthread_mutex_lock(&sk->lock);
+        int stop = sk->stop;
+        pthread_mutex_unlock(&sk->lock);
+        int ret = stop ? -1 : build_entry(sk, entry);
+        pthread_mutex_lock(&sk->lock);
+        if (ret == -1) sk->failed = 1;
+        else sk->created++;
+        pthread_cond_broadcast(&sk->cond);
+        pthread_mutex_unlock(&sk->lock);
+        if (ret == -1) break;
+    }
+    return NULL;
+}
+
+/*
+ * Wait until the thread of the skeleton has created the entry.
+ */
+static int wait_created(struct skeleton *sk, struct skeleton_entry *entry) {
+    size_t index = entry - sk->entries;
+    pthread_mutex_lock(&sk->lock);
+    while (sk->created <= index && !sk->failed) {
+        pthread_cond_wait(&sk->cond, &sk->lock);
+    }
+    int failed = sk->failed;
+    pthread_mutex_unlock(&sk->lock);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Write the contents of a file of the skeleton from its FILE_DATA record,
+ * then give the file its permissions and times, and in per-file durability
+ * mode rename it into place.
+ */
+static int write_file(struct transplant_ctx *ctx, struct skeleton_entry *entry) {
+    uint64_t size;
+    if (check_while_condition(ctx, entry->depth) != 5 || wire_read_size(ctx, &size) == -1 || size != entry->size + 16) {
+        fprintf(stderr, "ERROR: Expected the FILE DATA record of %s in the data section. \n", entry->path);
+        return -1;
+    }
+    int fd = open(entry->temp ? entry->temp : entry->path, O_WRONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open file %s. \n", entry->path);
+        return -1;
+    }
+    uint64_t written = 0;
+    int ret = 0;
+    while (ret == 0 && written < entry->size) {
+        size_t want = entry->size - written < DATA_BUF_SIZE ? entry->size - written : DATA_BUF_SIZE;
+        size_t got = want;
+        char *block = shm_input_block(ctx, entry->size - written, &got); // straight from the shared ring (--shm)
+        if (!block) {
+            block = ctx->data_buf;
+            got = want;
+            if (tp_read(ctx, ctx->data_buf, want) == -1) {
+                fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read the contents of %s. \n", entry->path);
+                ret = -1;
+                break;
+            }
+        }
+        for (char *out = block; ret == 0 && out < block + got; ) {
+            ssize_t n = write(fd, out, block + got - out);
+            if (n == -1 && errno != EINTR) {
+                fprintf(stderr, "ERROR: Failed to write the contents of %s. \n", entry->path);
+                ret = -1;
+            }
+            if (n > 0) out += n;
+        }
+        if (block != ctx->data_buf) {
+            shm_input_done(ctx, got);
+        }
+        written += got;
+    }
+    int permissions = entry->mode & 0777;
+    if (ret == 0 && (entry->existed || !(permissions & S_IWUSR) || (permissions & metadata_creation_mask())) &&
+        fchmod(fd, permissions) == -1) {
+        fprintf(stderr, "ERROR: Permissions of file written not correct. \n");
+        ret = -1;
+    }
+    if (ret == 0 && entry->has_times && futimens(fd, (struct timespec *)&entry->times) == -1) {
+        fprintf(stderr, "ERROR: Failed to set the times of %s. \n", entry->path);
+        ret = -1;
+    }
+    if (ret == 0 && (ctx->options & TRANSPLANT_DROP_CACHE)) {
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (ret == -1) {
+        close(fd); // a temporary file is removed with the entries
+        return -1;
+    }
+    ret = durability_close_path(ctx, fd, entry->temp, entry->path);
+    free(entry->temp);
+    entry->temp = NULL;
+    return ret;
+}
+
+/*
+ * Give the directories their permissions and times, the deepest first, once
+ * nothing more is created in them.
+ */
+static int finish_directories(struct transplant_ctx *ctx, struct skeleton *sk) {
+    for (struct skeleton_entry *entry = sk->entries + sk->count; entry > sk->entries; ) {
+        entry--;
+        if (!S_ISDIR(entry->mode)) {
+            continue;
+        }
+        int permissions = entry->mode & 0777;
+        if (entry->has_times && utimensat(AT_FDCWD, entry->path, (struct timespec *)&entry->times, 0) == -1) {
+            fprintf(stderr, "ERROR: Failed to set the times of directory %s. \n", entry->path);
+            return -1;
+        }
+        if ((entry->existed || permissions != (0777 & ~metadata_creation_mask())) && chmod(entry->path, permissions) == -1) {
+            fprintf(stderr, "ERROR: Permissions of directory not set correctly. \n");
+            return -1;
+        }
+        if (ctx->durability == TRANSPLANT_DURABILITY_PER_FILE) {
+            int fd = open(entry->path, O_RDONLY | O_DIRECTORY);
+            if (fd == -1 || fsync(fd) == -1) {
+                if (fd != -1) close(fd);
+                fprintf(stderr, "ERROR: Failed to sync %s. \n", entry->path);
+                return -1;
+            }
+            close(fd);
+        }
+    }
+    return durability_directory(ctx, 1);
+}
+
+/*
+ * @brief  Restore a transmission in the metadata-first layout into path_buf,
+ * once its SKELETON record has been read up to its size; see skeleton.h.
+ * @details  Everything up to the END_OF_TRANSMISSION record is read, and the
+ * root is popped off path_buf as at the END_OF_DIRECTORY of the root.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int skeleton_deserialize(struct transplant_ctx *ctx) {
+    uint64_t size;
+    struct skeleton sk = {0};
+    sk.ctx = ctx;
+    if (wire_read_size(ctx, &size) == -1 || size != SKELETON_RECORD_SIZE ||
+        get_number(ctx, &sk.files, 8) == -1 || get_number(ctx, &sk.bytes, 8) == -1) {
+        fprintf(stderr, "ERROR: Invalid SKELETON record. \n");
+        return -1;
+    }
+    if (ctx->journal || ctx->fanout || (ctx->options & TRANSPLANT_SKIP_UNCHANGED)) {
+        fprintf(stderr, "ERROR: A metadata-first transmission cannot be restored with --journal, several -p flags or --skip-unchanged. \n");
+        return -1;
+    }
+    struct statvfs fs;
+    if (!(ctx->options & TRANSPLANT_CLOBBER) && statvfs(ctx->path_buf, &fs) == 0 &&
+        (uint64_t)fs.f_bavail * fs.f_frsize < sk.bytes) { // what -c replaces may make room, so only a new tree is checked
+        fprintf(stderr, "ERROR: Not enough space to restore %lu bytes into %s. \n", (unsigned long)sk.bytes, ctx->path_buf);
+        return -1;
+    }
+
+    int ret = read_metadata(ctx, &sk);
+    int started = 0;
+    if (ret == 0) {
+        pthread_mutex_init(&sk.lock, NULL);
+        pthread_cond_init(&sk.cond, NULL);
+        if (pthread_create(&sk.thread, NULL, build_main, &sk) != 0) {
+            fprintf(stderr, "ERROR: Failed to start the thread of the skeleton. \n");
+            ret = -1;
+        } else {
+            started = 1;
+        }
+    }
+    for (struct skeleton_entry *entry = sk.entries; ret == 0 && entry < sk.entries + sk.count; entry++) {
+        if (S_ISREG(entry->mode)) {
+            ret = wait_created(&sk, entry) == -1 ? -1 : write_file(ctx, entry);
+        }
+    }
+    if (started) {
+        pthread_mutex_lock(&sk.lock);
+        sk.stop = ret == -1; // otherwise the entries after the last file are still to be created
+        pthread_mutex_unlock(&sk.lock);
+        pthread_join(sk.thread, NULL);
+        if (sk.failed) ret = -1;
+        pthread_mutex_destroy(&sk.lock);
+        pthread_cond_destroy(&sk.cond);
+    }
+    if (ret == 0) ret = finish_directories(ctx, &sk);
+    if (ret == 0 && tp_path_pop(ctx) == -1) {
+        fprintf(stderr, "ERROR: Failed to pop the directory off path_buf at the end of the metadata-first transmission. \n");
+        ret = -1;
+    }
+
+    for (struct skeleton_entry *entry = sk.entries; entry < sk.entries + sk.count; entry++) {
+        if (entry->temp) { // created, but the restore failed before its contents were written
+            unlink(entry->temp);
+            free(entry->temp);
+        }
+        free(entry->path);
+        free(entry->link_target);
+    }
+    free(sk.entries);
+    return ret;
+}
@@ -1,11 +1,32 @@
+#define _GNU_SOURCE // fallocate(), sync_file_range(), O_DIRECT
 #include "global.h"
 #include "debug.h"
+#include "filter.h"
+#include "scan.h"
+#include "directio.h"
+#include "context.h"
+#include "pipeline.h"
+#include "chunk.h"
+#include "delta.h"
+#include "watch.h"
+#include "changes.h"
+#include "fanout.h"
+#include "metadata.h"
+#include "unchanged.h"
+#include "durability.h"
+#include "journal.h"
+#include "shard.h"
+#include "shm.h"
+#include "skeleton.h"
+#include "wire.h"
+#include "salvage.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -19,6 +40,18 @@
 #error "Do not #include <ctype.h>. You will get a ZERO."
 #endif
 
+/*
+ * Files smaller than this are restored without fallocate()/posix_fadvise(): for them
+ * the extra system calls cost more than the fragmentation they would avoid.
+ */
+#define PREALLOCATE_MIN_SIZE (64 * 1024)
+
+/*
+ * With --drop-cache, restored data is written back and dropped from the page cache
+ * in windows of this many bytes.
+ */
+#define DROP_CACHE_WINDOW (8 * 1024 * 1024)
+
 /*
  * You may modify this file and/or move the functions contained here
  * to other source files (except for main.c) as you wish.
@@ -49,10 +82,10 @@
  * @param  Pathname to be copied into path_buf.
  * @return 0 on success, -1 in case of error
  */
-int path_init(char *name) {
+int tp_path_init(struct transplant_ctx *ctx, char *name) {
     // Pointers for the current position in path_buf and the end of the buffer
-    char *path_end = path_buf + PATH_MAX - 1;
-    char *dest = path_buf; // pointer to path_buf
+    char *path_end = ctx->path_buf + PATH_MAX - 1;
+    char *dest = ctx->path_buf; // pointer to path_buf
 
     // Copy the string to path_buf, including the null terminator until hit the end of name or path_buf
     // Try and increase optimality by checking for overflow while copying (don't calculate length of name upfront)
@@ -69,7 +102,7 @@ int path_init(char *name) {
     *dest = '\0'; // Add the null terminator
 
     // Calculate the length of the path in path_buf (excluding the null terminator)
-    path_length = dest - path_buf; // Update path_length
+    ctx->path_length = dest - ctx->path_buf; // Update path_length
     return 0;
 }
 
@@ -86,9 +119,9 @@ int path_init(char *name) {
  * not contain any occurrences of the path separator character '/'.
  * @return 0 in case of success, -1 otherwise.
  */
-int path_push(char *name) {
+int tp_path_push(struct transplant_ctx *ctx, char *name) {
     // Pointers for the current position in path_buf and the end of the buffer
-    char *path_end = path_buf + PATH_MAX - 1;
+    char *path_end = ctx->path_buf + PATH_MAX - 1;
 
     // Calculate the length of the new component
     // and check for the parameter specification
@@ -105,16 +138,16 @@ int path_push(char *name) {
     }
 
     // Ensure there's enough space to add '/' and the new component
-    if (path_length + 1 + name_length >= PATH_MAX) {
+    if (ctx->path_length + 1 + name_length >= PATH_MAX) {
         fprintf(stderr, "ERROR: path_push failed - not enough space to append '/' and the new component. \n");
         return -1; // Not enough space
     }
 
     // Move to the end of the current path
-    char *dest = path_buf + path_length;
+    char *dest = ctx->path_buf + ctx->path_length;
 
     // Check if the current path already ends with a '/'
-    if (path_length > 0 && *(dest - 1) != '/') { // avoid reduntantly adding another '/'
+    if (ctx->path_length > 0 && *(dest - 1) != '/') { // avoid reduntantly adding another '/'
         // Append the '/' character if it does not already exist
         if (dest < path_end) {
             *dest++ = '/';
@@ -135,7 +168,7 @@ int path_push(char *name) {
     }
     *dest = '\0'; // Add the null terminator since includes terminating null
 
-    path_length = dest - path_buf; // Update path_length
+    ctx->path_length = dest - ctx->path_buf; // Update path_length
     return 0;
 }
 
@@ -151,32 +184,32 @@ int path_push(char *name) {
  *
  * @return 0 in case of success, -1 otherwise.
  */
-int path_pop() { // Traverse using pointer arithmetic backwards from the end, searching for the last '/'
+int tp_path_pop(struct transplant_ctx *ctx) { // Traverse using pointer arithmetic backwards from the end, searching for the last '/'
     // Ensure path_buf is not empty
-    if (path_length == 0) {
+    if (ctx->path_length == 0) {
         fprintf(stderr, "ERROR: path_pop failed because path_buf is empty and there is no component to remove. \n");
         return -1;
     }
 
     // Pointer to the end of the current path
-    char *end = path_buf + path_length - 1;
+    char *end = ctx->path_buf + ctx->path_length - 1;
 
     // Search backwards for the last '/'
     char *slash = end;
-    while (slash >= path_buf && *slash != '/') {
+    while (slash >= ctx->path_buf && *slash != '/') {
         slash--;
     }
 
     // Update path_length based on the position of the last '/'
-    if (slash >= path_buf) {
-        path_length = slash - path_buf;
+    if (slash >= ctx->path_buf) {
+        ctx->path_length = slash - ctx->path_buf;
     } else {
         // No '/' found, so clear the whole path
-        path_length = 0;
+        ctx->path_length = 0;
     }
 
     // Null-terminate the string at the new end
-    *(path_buf + path_length) = '\0';
+    *(ctx->path_buf + ctx->path_length) = '\0';
 
     return 0;
 }
@@ -193,7 +226,7 @@ int len_string(char *str) { // implementing the string length function for name
 /*
  * @brief Deserialize directory contents into an existing directory.
  * @details  This function assumes that path_buf contains the name of an existing
- * directory.  It reads (from the standard input) a sequence of DIRECTORY_ENTRY
+ * directory.  It reads (from the source of the context) a sequence of DIRECTORY_ENTRY
  * records bracketed by a START_OF_DIRECTORY and END_OF_DIRECTORY record at the
  * same depth and it recreates the entries, leaving the deserialized files and
  * directories within the directory named by path_buf.
@@ -204,15 +237,15 @@ int len_string(char *str) { // implementing the string length function for name
  * can occur, including depth fields in the records read that do not match the
  * expected value, the records to be processed to not being with START_OF_DIRECTORY
  * or end with END_OF_DIRECTORY, or an I/O error occurs either while reading
- * the records from the standard input or in creating deserialized files and
+ * the records from the source of the context or in creating deserialized files and
  * directories.
  */
-unsigned char debug_getchar() {
+int debug_getchar(struct transplant_ctx *ctx) {
     /**
     * a wrapper function for getchar() as directed by professor stark for debugging errors in reading bytes of serialized data in deserialize function
-    * functions reads a byte from the standard input and prints the byte as a hex value for debugging purposes.
+    * functions reads a byte from the source of the context and prints the byte as a hex value for debugging purposes.
     */
-    int byte = getchar();
+    int byte = tp_getc(ctx);
     /*
     if (byte != EOF) { // Just for debugging purposes
         fprintf(stderr, "byte read: %02x\n",  byte);
@@ -222,17 +255,20 @@ unsigned char debug_getchar() {
     */
     return byte;
 }
-int check_while_condition(int depth) {
+int check_while_condition(struct transplant_ctx *ctx, int depth) {
     /**
     * a function to check the while condition when recursively navigating when conducting deserialization
     * get the type of the record
     * check that the depth is correct
     * also make sure that megic bytes are consistent
     */
+    if (ctx->wire_version == WIRE_V2) { // compact headers: no magic bytes, and the size is read with them
+        return wire_read_header(ctx, depth);
+    }
     // Check the magic bytes
-    unsigned char magic1 = debug_getchar();
-    unsigned char magic2 = debug_getchar();
-    unsigned char magic3 = debug_getchar();
+    int magic1 = debug_getchar(ctx);
+    int magic2 = debug_getchar(ctx);
+    int magic3 = debug_getchar(ctx);
     if (magic1 == EOF || magic2 == EOF || magic3 == EOF) {
         fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read the magic bytes in checking the while condition to parse type. \n");
         return -1; // Check for EOF
@@ -243,7 +279,7 @@ int check_while_condition(int depth) {
     }
 
     // Check the record type
-    char type = debug_getchar(); // record type returned after deserialization
+    int type = debug_getchar(ctx); // record type returned after deserialization
     if (type == EOF) {
         fprintf(stderr, "ERROR: Unexpected EOF character read when attempting to parse type in checking of while condition. \n");
         return -1;
@@ -251,7 +287,7 @@ int check_while_condition(int depth) {
 
     int depth_parsed = 0; // depth should be at 0
     for (int i = 0; i < 4; i++) {
-        int byte = debug_getchar();
+        int byte = debug_getchar(ctx);
         if (byte == EOF) {
             fprintf(stderr, "ERROR: Unexpected EOF character read when attempting to parse depth in checking of while condition. \n");
             return -1;
@@ -265,47 +301,78 @@ int check_while_condition(int depth) {
 
     return type;
 }
-int deserialize_directory(int depth) {
+static int deserialize_file_as(struct transplant_ctx *ctx, int depth, int permissions, struct entry_times *times);
+
+/*
+ * With --drop-cache, wait until the bytes from offset start to offset end of
+ * the file are on disk, then drop them from the page cache.
+ */
+static void drop_written(int fd, uint64_t start, uint64_t end) {
+    if (end > start) { // a length of 0 would mean up to the end of the file
+        sync_file_range(fd, start, end - start, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+}
+
+/*
+ * Where the record after the last one parsed at depth cannot be restored:
+ * with --salvage, go on from the next record salvage_resync() finds, having
+ * first popped the entry the record was for off path_buf if pushed is set.
+ * Returns what tp_deserialize_directory() returns.
+ */
+static int salvage_or_fail(struct transplant_ctx *ctx, int depth, int pushed) {
+    if (!(ctx->options & TRANSPLANT_SALVAGE) || (pushed && tp_path_pop(ctx) == -1)) {
+        return -1;
+    }
+    int resume = salvage_resync(ctx, depth);
+    if (resume <= 0) {
+        return resume; // 0: the END_OF_TRANSMISSION is next, as after the END_OF_DIRECTORY of the root
+    }
+    return tp_deserialize_directory(ctx, resume);
+}
+
+int tp_deserialize_directory(struct transplant_ctx *ctx, int depth) {
     // Process records
 
     int type;
 
-    while ((type = check_while_condition(depth)) != -1) {
+    // between two records is where a checkpoint can be taken (--journal)
+    while ((!ctx->journal || journal_checkpoint(ctx, depth) == 0) && (type = check_while_condition(ctx, depth)) != -1) {
         // type 0: START_OF_TRANSMISSION (Checked before enter this fnct in deserialize())
         if (type == 2) { // START_OF_DIRECTORY
             // check matching the size (uint64_t)
-            int size = 0; // size should be 16
-            for (int i = 0; i < 8; i++) {
-                int byte = debug_getchar();
-                if (byte == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF character when checking the size of the START OF DIRECTORY record. \n");
-                    return -1;
-                }
-                size = (size << 8) | byte;
+            uint64_t size; // size should be 16
+            if (wire_read_size(ctx, &size) == -1) {
+                fprintf(stderr, "ERROR: Unexpected EOF character when checking the size of the START OF DIRECTORY record. \n");
+                return salvage_or_fail(ctx, depth, 0);
             }
             if (size != 16) {
                 fprintf(stderr, "ERROR: Size does not equal 16 of the START OF DIRECTORY record. \n");
-                return -1;
+                return salvage_or_fail(ctx, depth, 0);
             }
             continue;
         }
 
         if (type == 3) { // END_OF DIRECTORY
             // check matching the size (uint64_t)
-            int size = 0; // size should be 16
-            for (int i = 0; i < 8; i++) {
-                int byte = getchar();
-                if (byte == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF character when checking the size of the END OF DIRECTORY record. \n");
-                    return -1;
-                }
-                size = (size << 8) | byte;
+            uint64_t size; // size should be 16
+            if (wire_read_size(ctx, &size) == -1) {
+                fprintf(stderr, "ERROR: Unexpected EOF character when checking the size of the END OF DIRECTORY record. \n");
+                return salvage_or_fail(ctx, depth, 0);
             }
             if (size != 16) {
                 fprintf(stderr, "ERROR: Size does not equal 16 of the END OF DIRECTORY record. \n");
+                return salvage_or_fail(ctx, depth, 0);
+            }
+            ctx->salvage_mark = tp_offset(ctx); // where a scan for the next intact record starts (--salvage)
+            if (metadata_finish_directory(ctx, depth) == -1) { // its entries are all written now
+                return -1;
+            }
+            if (durability_directory(ctx, depth == 1) == -1 ||
+                (ctx->fanout && fanout_durability(ctx, depth == 1) == -1)) {
                 return -1;
             }
-            if (path_pop() == -1) {
+            if (tp_path_pop(ctx) == -1) {
                 fprintf(stderr, "ERROR: Failed to pop the directory off path_buf at read of END OF DIRECTORY record. \n");
                 return -1;
             }
@@ -313,139 +380,105 @@ int deserialize_directory(int depth) {
             // The above check makes sure start and end of directory come in nested pairs like parentheses
             // Recursive nature of depth popping and pushing components checks that there is a corresponding match
             // Does not allow mismatches because explicitly checks for each type and handles the corresponding depth changes
-            return deserialize_directory(depth - 1);  // reached the end of a directory so go up one level
+            return tp_deserialize_directory(ctx, depth - 1);  // reached the end of a directory so go up one level
 
         } else if (type == 4) { // DIRECTORY_ENTRY
-            // Read the size of the entry (should correspond to the name length + file metadata size)
-            int total_size = 0;
-            for (int i = 0; i < 8; i++) {
-                int byte = debug_getchar();
-                if (byte == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF character when reading the size of DIRECTORY ENTRY record. \n");
-                    return -1;
-                }
-                total_size = (total_size << 8) | byte;
-            }
-
-            int name_length = total_size - 16 - 12; // total size - header size - metadata size
-
+            // The mode and size of the entry, then its name into name_buf
             uint32_t mode;
-            for (int i = 0; i < 4; i++) {
-                // read the first 4 bytes for st_mode
-                // can't use stat() since directory path does not exist and state of filesystem unknown
-                // need correct results if a file or directory supposed to be
-                int byte = debug_getchar();
-                if (byte == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF character when reading the mode of the DIRECTORY ENTRY record. \n");
-                    return -1;
-                }
-                mode = (mode << 8) | byte;
-            }
-            // skip the next 8 bytes though to maintain pointer to read the correct bytes
-            for (int i = 0; i < 8; i++) { // skip the next 12 bytes for metadata of directory entry line
-                if (debug_getchar() == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF character when skipping bytes of DIRECTORY ENTRY. \n");
-                return -1; // just skipping read not storing
-                }
-            }
-
-            char *name_ptr = name_buf; // read the name of the component
-            while (name_ptr < name_buf + len_string(name_buf)) {
-                *name_ptr++ = '\0'; // clearing what was previously stored in name_buf
-            }
-            name_ptr = name_buf;
-            for (int i = 0; i < name_length; i++) {
-                int byte = debug_getchar();
-                if (byte == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF character when reading component name from DIRECTORY ENTRY into name_buf buffer.\n");
-                return -1; // unexpected end of file response
+            uint64_t entry_size;
+            if (wire_read_entry(ctx, depth, &mode, &entry_size) == -1) {
+                return salvage_or_fail(ctx, depth, 0);
             }
-                *name_ptr++ = (char)byte;
-            }
-            *name_ptr = '\0';
+            ctx->salvage_mark = tp_offset(ctx); // before the contents: if they are cut short, the records they run into are found again
 
-            if (path_push(name_buf) == -1) {
+            if (tp_path_push(ctx, ctx->name_buf) == -1) {
                 fprintf(stderr, "ERROR: failed to push new component DIRECTORY ENTRY onto path_buf\n");
                 return -1; // add the name of the new component
             }
 
+            // the times from a TIMES record just before this entry are for this entry only
+            struct entry_times *times = ctx->entry_has_times ? &ctx->entry_times : NULL;
+            ctx->entry_has_times = 0;
+
             if (S_ISDIR(mode)) { // DIRECTORY
-                // try and open the directory
-                struct dirent *de;
-                DIR *dir = opendir(path_buf);
-                if (dir) { // directory exists now check if the -c clobber flag is present or if it is the top level directory
-                    if (global_options & (1 << 3)) {
-                        return deserialize_directory(depth + 1); // directory already exists and c flag present; increment the depth and go level down
-                    } else { // directory exists but the -c clobber flag was not passed as well
-                        fprintf(stderr, "ERROR: The DIRECTORY ENTRY was an already existing directory, but the clobber flag was not passed so cannot recreate.\n");
-                        return -1;
-                    }
-                    if (closedir(dir) == -1) {
-                        fprintf(stderr, "ERROR: Directory failed to close. \n");
-                        return -1;
-                    }
-                } else if (ENOENT == errno) { // directory does not exist must create the directory
-                    if (mkdir(path_buf, 0777) != 0) {
-                        // This sets the permission settings for the directory
-                        // 7: owner's permissions (rwx) which has the read (4), write (2), and execute (1) permissions
+                // mkdir() itself tells whether the directory exists: no directory stream is opened to find out.
+                // The permissions and times are applied at its END_OF_DIRECTORY, after its entries are written
+                int existed = 0;
+                if (mkdir(ctx->path_buf, 0777) == -1) {
+                    struct stat stat_buf;
+                    if (errno != EEXIST) {
                         fprintf(stderr, "ERROR: Failed to make new directory at path_buf. \n");
                         return -1;
                     }
-                    struct stat stat_buf;
-                    if (stat(path_buf, &stat_buf) == -1) {
-                        fprintf(stderr, "ERROR: Failed to extract metadata of directory. \n");
+                    if (!(ctx->options & TRANSPLANT_CLOBBER)) { // directory exists but the -c clobber flag was not passed
+                        fprintf(stderr, "ERROR: The DIRECTORY ENTRY was an already existing directory, but the clobber flag was not passed so cannot recreate.\n");
                         return -1;
                     }
-                    // Check if the permissions were set correctly
-                    // chmod(path_buf, stat_buf.st_mode & 0777);
-                    if (chmod(path_buf, stat_buf.st_mode & 0777) != 0) {
-                        fprintf(stderr, "ERROR: Permissions of directory not set correctly. \n");
+                    if (stat(ctx->path_buf, &stat_buf) == -1 || !S_ISDIR(stat_buf.st_mode)) {
+                        fprintf(stderr, "ERROR: %s exists and is not a directory. \n", ctx->path_buf);
                         return -1;
                     }
-                    return deserialize_directory(depth + 1);
-                } else {
-                    fprintf(stderr, "ERROR: Unexpected erorr.\n");
-                    return -1;
+                    existed = 1;
                 }
+                if (metadata_defer_directory(ctx, depth + 1, mode, existed, times) == -1) return -1;
+                if (ctx->fanout && fanout_directory(ctx) == -1) return -1;
+                return tp_deserialize_directory(ctx, depth + 1); // increment the depth and go level down
             } else if (S_ISREG(mode)) { // FILE
-                if (deserialize_file(depth) != 0) return -1; // don't increment depth explore same level recursively
-                /*
-                struct stat stat_buf;
-                if (stat(path_buf, &stat_buf) == -1) {
-                    fprintf(stderr, "ERROR: Failed to extract metadata of file written. \n");
+                // the permissions are given to the file as it is created, the times before it is closed
+                if (deserialize_file_as(ctx, depth, mode & 0777, times) != 0) return salvage_or_fail(ctx, depth, 1); // don't increment depth explore same level recursively
+                if (ctx->fanout && fanout_file(ctx, mode) == -1) return -1;
+                if (ctx->fanout && times && fanout_metadata(ctx, -1, times) == -1) return -1;
+                if (tp_path_pop(ctx) == -1) {
+                    fprintf(stderr, "ERROR: Failed to pop component off path_buf after writing file. \n");
                     return -1;
                 }
-                // chmod(path_buf, stat_buf.st_mode & 0777);
-                */
-                if (chmod(path_buf, mode & 0777) != 0) {
-                    fprintf(stderr, "ERROR: Permissions of file written not correct. \n");
+            }
+            else if (S_ISLNK(mode)) { // SYMBOLIC LINK
+                if (tp_deserialize_symlink(ctx, depth) != 0) return salvage_or_fail(ctx, depth, 1);
+                if (times && utimensat(AT_FDCWD, ctx->path_buf, (struct timespec *)times, AT_SYMLINK_NOFOLLOW) == -1) {
+                    fprintf(stderr, "ERROR: Failed to set the times of symbolic link %s. \n", ctx->path_buf);
                     return -1;
                 }
-                if (path_pop() == -1) {
-                    fprintf(stderr, "ERROR: Failed to pop component off path_buf after writing file. \n");
+                if (ctx->fanout && fanout_symlink(ctx) == -1) return -1;
+                if (ctx->fanout && times && fanout_metadata(ctx, -1, times) == -1) return -1;
+                if (tp_path_pop(ctx) == -1) {
+                    fprintf(stderr, "ERROR: Failed to pop component off path_buf after creating symbolic link. \n");
                     return -1;
                 }
             }
-            else { // entry not a file or a directory (probably never reach)
+            else { // entry not a file, a directory or a symbolic link (probably never reach)
                 fprintf(stderr, "ERROR: Unexpected error - not a file or a directory. \n");
                 return -1;
             }
 
+        } else if (type == TIMES_TYPE) { // --times: the times of the next DIRECTORY_ENTRY
+            if (deserialize_times(ctx, depth) == -1) return salvage_or_fail(ctx, depth, 0);
+            ctx->salvage_mark = tp_offset(ctx);
+        } else if (type == REMOVE_TYPE) { // change sets of --watch: an entry that no longer exists
+            if (deserialize_remove(ctx, depth) == -1) return -1;
+        } else if (type == RENAME_TYPE) { // change sets of --watch: an entry that was renamed
+            if (deserialize_rename(ctx, depth) == -1) return -1;
+        } else if (type == SKELETON_TYPE) { // --metadata-first: the rest of the transmission is in the other layout
+            if (depth != 1) {
+                fprintf(stderr, "ERROR: SKELETON record found below the root. \n");
+                return -1;
+            }
+            return skeleton_deserialize(ctx);
         } else {  // not a type 0-5 (probably should never reach)
             fprintf(stderr, "ERROR: Unexpected record type in deserialize directory recursion. \n");
-            return -1; // Invalid type
+            return salvage_or_fail(ctx, depth, 0); // Invalid type
         }
         // type 1: END_OF_TRANSMISSION (Checked after leave this fnct in deserialize())
     }
 
-    return -1;
+    return salvage_or_fail(ctx, depth, 0);
 }
 
 /*
  * @brief Deserialize the contents of a single file.
  * @details  This function assumes that path_buf contains the name of a file
  * to be deserialized.  The file must not already exist, unless the ``clobber''
- * bit is set in the global_options variable.  It reads (from the standard input)
+ * bit is set in the options of the context.  It reads (from the source of the context)
  * a single FILE_DATA record containing the file content and it recreates the file
  * from the content.
  *
@@ -455,158 +488,448 @@ int deserialize_directory(int depth) {
  * can occur, including a depth field in the FILE_DATA record that does not match
  * the expected value, the record read is not a FILE_DATA record, the file to
  * be created already exists, or an I/O error occurs either while reading
- * the FILE_DATA record from the standard input or while re-creating the
+ * the FILE_DATA record from the source of the context or while re-creating the
  * deserialized file.
  */
-int deserialize_file(int depth) {
-    // Check if the file already exists
-    struct stat stat_buf;
-    if(stat(path_buf, &stat_buf) == 0) {
-        // The file already exists
-        if (!(global_options & (1 << 3))) {
+int tp_deserialize_file(struct transplant_ctx *ctx, int depth) {
+    return deserialize_file_as(ctx, depth, -1, NULL);
+}
+
+/*
+ * Create the file named by path_buf for writing, or truncate it if it exists
+ * and the clobber bit is set.  A new file is created with O_EXCL, so the same
+ * system call checks that it did not exist, and with its permissions, so
+ * that they need no separate chmod() unless the creation mask takes some of
+ * them away or the file already existed.  permissions is -1 to leave them as
+ * open() sets them.  In per-file durability mode the file is created under a
+ * temporary name instead (see durability.h).  Returns the descriptor, or -1
+ * on error; the file is finished with durability_close() or durability_abandon().
+ */
+int tp_create_file(struct transplant_ctx *ctx, int permissions) {
+    int existed = 0;
+    char *name = durability_create_path(ctx);
+    if (!name) {
+        return -1;
+    }
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, permissions == -1 ? 0666 : permissions);
+    if (fd == -1 && errno == EEXIST && name == ctx->path_buf) {
+        if (!(ctx->options & TRANSPLANT_CLOBBER)) {
             fprintf(stderr, "ERROR: File already exists but clobber flag not passed so cannot overwrite file. \n");
             return -1;
         }
+        existed = 1;
+        fd = open(ctx->path_buf, O_WRONLY | O_TRUNC); // truncates file and clears the contents
+        if (fd == -1 && errno == EACCES && permissions != -1 && chmod(ctx->path_buf, 0600) == 0) {
+            fd = open(ctx->path_buf, O_WRONLY | O_TRUNC); // a read-only file, given its permissions again below
+        }
     }
-
-    // at this point the file either does not exist already, or it does and has the permission to overwrite from the clobber flag
-    // STEP 1: check  the magic bytes
-    unsigned char magic1 = debug_getchar();
-    unsigned char magic2 = debug_getchar();
-    unsigned char magic3 = debug_getchar();
-    if (magic1 == EOF || magic2 == EOF || magic3 == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF character read in deserialize file. \n");
-        return -1; // Check for EOF
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create file %s. \n", ctx->path_buf);
+        return -1;
     }
-    if (magic1 != 0x0C || magic2 != 0x0D || magic3 != 0xED) {
-        fprintf(stderr, "ERROR: Magic bytes mismatched in deserialize file. \n");
-        return -1; // Magic bytes mismatch
+    if (permissions != -1) {
+        if ((existed || (permissions & metadata_creation_mask())) && fchmod(fd, permissions) != 0) {
+            durability_abandon(ctx, fd);
+            fprintf(stderr, "ERROR: Permissions of file written not correct. \n");
+            return -1;
+        }
     }
+    return fd;
+}
 
-    // STEP 2: check that the file type is FILE_DATA 5
-    unsigned char type = debug_getchar();
-    if (type != 5 || type == -1 || type == EOF) {
-        fprintf(stderr, "ERROR: Type is not 5 FILE DATA as expected in deserialize file. \n");
+/*
+ * Set the times of the file open as fd, after the last write to it.
+ */
+static int finish_file(struct transplant_ctx *ctx, int fd, struct entry_times *times) {
+    if (times && futimens(fd, (struct timespec *)times) == -1) {
+        fprintf(stderr, "ERROR: Failed to set the times of %s. \n", ctx->path_buf);
         return -1;
     }
+    return 0;
+}
 
-    // STEP 3: make sure the depth matches (uint32_t)
-    int depth_parsed = 0;
-    for (int i = 0; i < 4; i++) {
-        int byte = debug_getchar();
-        if (byte == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF character when reading depth of file. \n");
+/*
+ * tp_deserialize_file(), giving the file the permissions from its
+ * DIRECTORY_ENTRY (-1: the default of open()) and its times (NULL: none).
+ */
+static int deserialize_file_as(struct transplant_ctx *ctx, int depth, int permissions, struct entry_times *times) {
+    int type;
+    if (ctx->wire_version == WIRE_V2) { // the compact header is read whole, depth and size included
+        type = check_while_condition(ctx, depth);
+    } else {
+        // STEP 1: check  the magic bytes
+        int magic1 = debug_getchar(ctx);
+        int magic2 = debug_getchar(ctx);
+        int magic3 = debug_getchar(ctx);
+        if (magic1 == EOF || magic2 == EOF || magic3 == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF character read in deserialize file. \n");
+            return -1; // Check for EOF
+        }
+        if (magic1 != 0x0C || magic2 != 0x0D || magic3 != 0xED) {
+            fprintf(stderr, "ERROR: Magic bytes mismatched in deserialize file. \n");
+            return -1; // Magic bytes mismatch
+        }
+
+        // STEP 2: check the type: FILE_DATA 5, or the records of chunks and deltas
+        type = debug_getchar(ctx);
+    }
+    if (type == FILE_CHUNK_TYPE || type == FILE_END_TYPE) { // the contents were sent in chunks
+        int fd = deserialize_file_chunks(ctx, depth, type, permissions);
+        if (fd == -1) {
             return -1;
         }
-        depth_parsed = (depth_parsed << 8) | byte;
+        if (finish_file(ctx, fd, times) == -1) {
+            durability_abandon(ctx, fd);
+            return -1;
+        }
+        return durability_close(ctx, fd);
     }
-    if (depth_parsed != depth) {
-        fprintf(stderr, "ERROR: Depth parsed is not as expected. \n");
+    if (type == DELTA_COPY_TYPE || type == DELTA_LITERAL_TYPE) { // a delta against the existing file
+        int fd = deserialize_file_delta(ctx, depth, type, permissions);
+        if (fd == -1) {
+            return -1;
+        }
+        if (finish_file(ctx, fd, times) == -1) {
+            durability_abandon(ctx, fd);
+            return -1;
+        }
+        return durability_close(ctx, fd);
+    }
+    if (type != 5 || type == EOF) {
+        fprintf(stderr, "ERROR: Type is not 5 FILE DATA as expected in deserialize file. \n");
         return -1;
     }
 
-    // STEP 4: parse out the file size
-    // check matching the size (uint64_t)
-    uint64_t file_size = 0; // size should be 16
-    for (int i = 0; i < 8; i++) {
-        int byte = debug_getchar();
-        if (byte == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF character when reading file size. \n");
+    // STEP 3: make sure the depth matches (uint32_t), read with the header in version 2
+    if (ctx->wire_version != WIRE_V2) {
+        int depth_parsed = 0;
+        for (int i = 0; i < 4; i++) {
+            int byte = debug_getchar(ctx);
+            if (byte == EOF) {
+                fprintf(stderr, "ERROR: Unexpected EOF character when reading depth of file. \n");
+                return -1;
+            }
+            depth_parsed = (depth_parsed << 8) | byte;
+        }
+        if (depth_parsed != depth) {
+            fprintf(stderr, "ERROR: Depth parsed is not as expected. \n");
             return -1;
         }
-        file_size = (file_size << 8) | byte;
+    }
+
+    // STEP 4: parse out the file size
+    // check matching the size (uint64_t)
+    uint64_t file_size; // size should be 16
+    if (wire_read_size(ctx, &file_size) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF character when reading file size. \n");
+        return -1;
     }
     file_size = file_size - 16; // remove the constant size of the header from the file size
 
-    FILE *file = fopen(path_buf, "wb"); // truncates file and clears the contents
-    if (!file || file == NULL) {
-        fprintf(stderr, "ERROR: Not a file or file is null in deserialize file. \n");
+    if (ctx->options & TRANSPLANT_SKIP_UNCHANGED) { // leave the file alone if it already has these contents
+        int handled = unchanged_file(ctx, file_size, permissions, times);
+        if (handled != 0) {
+            return handled == 1 ? 0 : -1;
+        }
+    }
+
+    int fd = tp_create_file(ctx, permissions);
+    if (fd == -1) {
         return -1;
     }
-    // Write file contents byte-by-byte
-    for (unsigned int i = 0; i < file_size; i++) {
-        int c = debug_getchar();
-        if (c == EOF) {
-            fclose(file);
-            fprintf(stderr, "ERROR: Unexpected EOF character when attempting to write file contents byte by byte in deserialize file. \n");
-            return -1; // EOF or error during read
+    int direct = ctx->direct_io_min_size && file_size >= ctx->direct_io_min_size; // very large file: bypass the page cache
+    if (direct && fcntl(fd, F_SETFL, O_DIRECT) == -1) { // filesystem does not support O_DIRECT (e.g. tmpfs)
+        direct = 0;
+    }
+    if (file_size >= PREALLOCATE_MIN_SIZE) {
+        // The header gives the exact size, so reserve the blocks in one extent up front instead of
+        // growing the file write by write.  KEEP_SIZE so a truncated stream does not leave a file padded with zeros.
+        // Both calls are only hints: a filesystem that does not support them is not an error.
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, file_size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS) {
+            if (errno == ENOSPC) {
+                durability_abandon(ctx, fd);
+                fprintf(stderr, "ERROR: Not enough space to restore file of %lu bytes. \n", (unsigned long)file_size);
+                return -1;
+            }
+        }
+        posix_fadvise(fd, 0, file_size, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (direct) {
+        if (deserialize_file_direct(ctx, fd, file_size) == -1 || finish_file(ctx, fd, times) == -1) {
+            durability_abandon(ctx, fd);
+            return -1;
+        }
+        return durability_close(ctx, fd);
+    }
+
+    // Copy the file contents in blocks of up to DATA_BUF_SIZE bytes
+    uint64_t written = 0;
+    uint64_t started = 0; // everything below this offset has been handed to writeback
+    uint64_t dropped = 0; // and with --drop-cache, everything below this one is on disk and dropped from the page cache
+    while (written < file_size) {
+        size_t want = file_size - written < DATA_BUF_SIZE ? file_size - written : DATA_BUF_SIZE;
+        size_t got = want;
+        char *block = shm_input_block(ctx, file_size - written, &got); // straight from the shared ring (--shm)
+        if (!block) {
+            block = ctx->data_buf;
+            got = want;
+            if (tp_read(ctx, ctx->data_buf, want) == -1) {
+                durability_abandon(ctx, fd);
+                fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read file contents in deserialize file. \n");
+                return -1; // EOF or error during read
+            }
         }
-        if (fputc(c, file) == EOF) {
-            fclose(file);
-            fprintf(stderr, "ERROR: Reached the EOF when writing file.  \n");
-            return -1; // Error during write
+        for (char *out = block; out < block + got; ) {
+            ssize_t n = write(fd, out, block + got - out);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                durability_abandon(ctx, fd);
+                fprintf(stderr, "ERROR: Failed to write file contents in deserialize file. \n");
+                return -1; // Error during write
+            }
+            out += n;
+        }
+        if (block != ctx->data_buf) {
+            shm_input_done(ctx, got); // the writer may reuse that part of the ring now
+        }
+        written += got;
+
+        if (((ctx->options & TRANSPLANT_DROP_CACHE) || ctx->durability == TRANSPLANT_DURABILITY_BATCHED) &&
+            written - started >= DROP_CACHE_WINDOW) {
+            sync_file_range(fd, started, written - started, SYNC_FILE_RANGE_WRITE); // start writeback of the window just filled
+            if (ctx->options & TRANSPLANT_DROP_CACHE) {
+                // The previous window has been written back while this one was read: wait for what is left of it
+                // and drop it from the cache, so that a large restore does not evict the working set of the host
+                drop_written(fd, dropped, started);
+                dropped = started;
+            }
+            started = written; // with batched durability, syncfs() waits for the writeback
         }
     }
+    if (ctx->options & TRANSPLANT_DROP_CACHE) {
+        drop_written(fd, dropped, written);
+    }
 
-    if (fclose(file) == -1) {
-        fprintf(stderr, "ERROR: File failed to close in deserialize file. \n");
+    if (finish_file(ctx, fd, times) == -1) {
+        durability_abandon(ctx, fd);
         return -1;
     }
-    return 0; // Success
+    return durability_close(ctx, fd); // Success unless the file cannot be closed or synced
 }
 
 /*
- * @brief  Serialize the contents of a directory as a sequence of records written
- * to the standard output.
- * @details  This function assumes that path_buf contains the name of an existing
- * directory to be serialized.  It serializes the contents of that directory as a
- * sequence of records that begins with a START_OF_DIRECTORY record, ends with an
- * END_OF_DIRECTORY record, and with the intervening records all of type DIRECTORY_ENTRY.
+ * @brief Deserialize a symbolic link.
+ * @details  This function assumes that path_buf contains the name of a symbolic
+ * link to be created.  The link must not already exist, unless the ``clobber''
+ * bit is set in the options of the context, in which case the existing entry is
+ * replaced.  It reads (from the source of the context) a single SYMLINK_TARGET record and
+ * creates the link with symlinkat().  Links are not followed and no permissions
+ * are applied, because the permissions of a link are never used.
  *
- * @param depth  The value of the depth field that is expected to occur in the
- * START_OF_DIRECTORY, DIRECTORY_ENTRY, and END_OF_DIRECTORY records processed.
- * Note that this depth pertains only to the "top-level" records in the sequence:
- * DIRECTORY_ENTRY records may be recursively followed by similar sequence of
- * records describing sub-directories at a greater depth.
- * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
- * including failure to open files, failure to traverse directories, and I/O errors
- * that occur while reading file content and writing to standard output.
+ * @param depth  The value of the depth field that is expected to be found in
+ * the SYMLINK_TARGET record.
+ * @return 0 in case of success, -1 in case of an error.
  */
-int serialize_directory(int depth) {
-    // Write the START OF DIRECTORY
-    // **************WRITE THE DIRECTORY START*****************
-    // WRITE THE MAGIC BYTES
-    if (fputc(0x0C, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Reached unexpected EOF when writing magic byte 1 when writing START OF DIRECTORY.\n");
-        return -1; // Magic byte 1
+int tp_deserialize_symlink(struct transplant_ctx *ctx, int depth) {
+    int type = check_while_condition(ctx, depth);
+    if (type != 6) { // SYMLINK_TARGET
+        fprintf(stderr, "ERROR: Type is not 6 SYMLINK TARGET as expected in deserialize symlink. \n");
+        return -1;
+    }
+
+    uint64_t size;
+    if (wire_read_size(ctx, &size) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF character when reading size of SYMLINK TARGET. \n");
+        return -1;
     }
-    if (fputc(0x0D, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Reached unexpected EOF when writing magic byte 2 when writing START OF DIRECTORY.\n");
-        return -1; // Magic byte 2
+    if (size <= 16 || size - 16 >= PATH_MAX) {
+        fprintf(stderr, "ERROR: Invalid size of SYMLINK TARGET record. \n");
+        return -1;
+    }
+
+    // Read the target into link_buf
+    char *target = ctx->link_buf;
+    while (target < ctx->link_buf + (size - 16)) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF character when reading target of SYMLINK TARGET. \n");
+            return -1;
+        }
+        *target++ = (char)byte;
+    }
+    *target = '\0';
+
+    if (symlinkat(ctx->link_buf, AT_FDCWD, ctx->path_buf) == -1) {
+        if (errno != EEXIST || !(ctx->options & TRANSPLANT_CLOBBER)) {
+            fprintf(stderr, "ERROR: Failed to create symbolic link (it may already exist and the clobber flag was not passed). \n");
+            return -1;
+        }
+        // An entry is in the way and clobber was requested: replace it
+        if (unlink(ctx->path_buf) == -1 || symlinkat(ctx->link_buf, AT_FDCWD, ctx->path_buf) == -1) {
+            fprintf(stderr, "ERROR: Failed to replace existing entry with symbolic link. \n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write the header that begins every record to the sink of the context.
+ * @details  The header consists of the three magic bytes 0x0C, 0x0D, 0xED, followed
+ * by the record type, the depth as a 32-bit big-endian value and the total size of
+ * the record (header included) as a 64-bit big-endian value.  In version 2
+ * of the wire format (TRANSPLANT_FORMAT_V2), the header is the compact one
+ * of wire.h, except for START_OF_TRANSMISSION.
+ *
+ * @param type  The record type.
+ * @param depth  The value to be used in the depth field.
+ * @param size  The total size of the record, including the 16 header bytes.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int tp_write_record_header(struct transplant_ctx *ctx, unsigned char type, int depth, uint64_t size) {
+    if (type == 0) { // START_OF_TRANSMISSION: the version of the format is chosen for the whole transmission
+        ctx->wire_version = (ctx->options & TRANSPLANT_FORMAT_V2) ? WIRE_V2 : WIRE_V1;
+        if (ctx->wire_version == WIRE_V2) return wire_write_start(ctx);
+    } else if (ctx->wire_version == WIRE_V2) {
+        return wire_write_header(ctx, type, depth, size);
     }
-    if (fputc(0xED, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Reached unexpected EOF when writing magic byte 3 when writing START OF DIRECTORY. \n");
-        return -1; // Magic byte 3
+
+    // WRITE THE MAGIC BYTES - always the same for every record
+    if (tp_putc(ctx, 0x0C) == EOF || tp_putc(ctx, 0x0D) == EOF || tp_putc(ctx, 0xED) == EOF) {
+        fprintf(stderr, "ERROR: Unexpected EOF when writing magic bytes of record type %d. \n", type);
+        return -1;
     }
 
     // WRITE THE TYPE
-    unsigned char start_directory_type = 2; // START_OF_DIRECTORY = 2
-    if (fputc(start_directory_type, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Reached unexpected EOF when writing type of START OF DIRECTORY. \n");
+    if (tp_putc(ctx, type) == EOF) {
+        fprintf(stderr, "ERROR: Unexpected EOF when writing record type %d. \n", type);
         return -1;
     }
 
     // WRITE THE DEPTH: 4 bytes
-    uint32_t node_depth = (uint32_t)depth;
     for (int i = 3; i >= 0; i--) {
-        if (fputc((node_depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Reached unexpected EOF when writing depth of START OF DIRECTORY. \n");
+        if (tp_putc(ctx, ((uint32_t) depth >> (i * 8)) & 0xFF) == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF when writing depth of record type %d. \n", type);
             return -1;
         }
     }
 
     // WRITE THE SIZE: 8 bytes
-    uint64_t header_size = 16;
-    for (int i = 7; i >=0; i--) {
-        if (fputc((header_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Reached unexpected EOF when writing the size of START OF DIRECTORY. \n");
+    for (int i = 7; i >= 0; i--) {
+        if (tp_putc(ctx, (size >> (i * 8)) & 0xFF) == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF when writing size of record type %d. \n", type);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write a DIRECTORY_ENTRY record describing one component of a directory.
+ * @details  The record carries 12 bytes of metadata (the st_mode type and permission
+ * bits as 32 bits, followed by st_size as 64 bits) and then the name of the entry,
+ * without a terminating null byte.  With TRANSPLANT_TIMES it is preceded by a
+ * TIMES record; see metadata.h.  In version 2 of the wire format, the
+ * metadata and the name are compressed; see wire.h.
+ *
+ * @param depth  The value to be used in the depth field.
+ * @param name  The name of the entry (a single path component).
+ * @param stat_buf  The metadata of the entry, as returned by lstat().
+ * @return 0 in case of success, -1 otherwise.
+ */
+int tp_write_directory_entry(struct transplant_ctx *ctx, int depth, char *name, struct stat *stat_buf) {
+    if ((ctx->options & TRANSPLANT_TIMES) && metadata_write_times(ctx, depth, stat_buf) == -1) {
+        return -1; // --times: the TIMES record goes just before the entry
+    }
+    if (ctx->wire_version == WIRE_V2) {
+        return wire_write_entry(ctx, depth, name, stat_buf->st_mode & (S_IFMT | S_IRWXU | S_IRWXG | S_IRWXO), stat_buf->st_size);
+    }
+    int name_length = len_string(name);
+    uint64_t entry_size = name_length + 16 + 12; // REMEMBER the header is given as a constant size of 16 and the metadata collected above is given as a constant size of 12
+    if (tp_write_record_header(ctx, 4, depth, entry_size) == -1) { // DIRECTORY_ENTRY = 4
+        return -1;
+    }
+
+    // WRITE THE METADATA: 12 bytes
+    // Serialize the mode (file type and permissions) using masks
+    uint32_t mode = (stat_buf->st_mode & (S_IFMT | S_IRWXU | S_IRWXG | S_IRWXO));
+    for (int i = 3; i >= 0; i--) {
+        if (tp_putc(ctx, (mode >> (i * 8)) & 0xFF) == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF when writing metadata of type and permissions. \n");
+            return -1;
+        }
+    }
+
+    // Serialize the file size (st_size) as 64-bit value
+    for (int i = 7; i >= 0; i--) {
+        if (tp_putc(ctx, ((uint64_t)stat_buf->st_size >> (i * 8)) & 0xFF) == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF when writing size. \n");
+            return -1;
+        }
+    }
+
+    // WRITE THE NAME
+    for (int i = 0; i < name_length; i++) {
+        if (tp_putc(ctx, *(name + i)) == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF when writing component name. \n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Serialize the target of a symbolic link as a single SYMLINK_TARGET record
+ * written to the sink of the context.
+ * @details  This function assumes that link_buf contains the target of the link
+ * named by path_buf, as read by readlinkat().  The target is written as the payload
+ * of the record, without a terminating null byte.  The link itself is never followed.
+ *
+ * @param depth  The value to be used in the depth field of the SYMLINK_TARGET record.
+ * @param size  The number of bytes in the link target.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int tp_serialize_symlink(struct transplant_ctx *ctx, int depth, off_t size) {
+    if (tp_write_record_header(ctx, 6, depth, size + 16) == -1) { // SYMLINK_TARGET = 6
+        return -1;
+    }
+    for (char *target = ctx->link_buf; target < ctx->link_buf + size; target++) {
+        if (tp_putc(ctx, *target) == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF writing symbolic link target. \n");
             return -1;
         }
     }
+    return 0;
+}
+
+/*
+ * @brief  Serialize the contents of a directory as a sequence of records written
+ * to the sink of the context.
+ * @details  This function assumes that path_buf contains the name of an existing
+ * directory to be serialized.  It serializes the contents of that directory as a
+ * sequence of records that begins with a START_OF_DIRECTORY record, ends with an
+ * END_OF_DIRECTORY record, and with the intervening records all of type DIRECTORY_ENTRY.
+ *
+ * @param depth  The value of the depth field that is expected to occur in the
+ * START_OF_DIRECTORY, DIRECTORY_ENTRY, and END_OF_DIRECTORY records processed.
+ * Note that this depth pertains only to the "top-level" records in the sequence:
+ * DIRECTORY_ENTRY records may be recursively followed by similar sequence of
+ * records describing sub-directories at a greater depth.
+ * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
+ * including failure to open files, failure to traverse directories, and I/O errors
+ * that occur while reading file content and writing to the sink of the context.
+ */
+int tp_serialize_directory(struct transplant_ctx *ctx, int depth) {
+    // Write the START OF DIRECTORY
+    if (tp_write_record_header(ctx, 2, depth, 16) == -1) { // START_OF_DIRECTORY = 2
+        fprintf(stderr, "ERROR: Reached unexpected EOF when writing START OF DIRECTORY. \n");
+        return -1;
+    }
 
     // Open the directory
     struct dirent *de;
-    DIR *dir = opendir(path_buf);
+    DIR *dir = opendir(ctx->path_buf);
     if (!dir || dir == NULL) { // If the directory is null
         fprintf(stderr, "ERROR: Failed to open directory because not a directory or directory is null. \n");
         return -1; // Failed to open directory
@@ -620,8 +943,14 @@ int serialize_directory(int depth) {
             continue;
         }
 
+        // Apply the --exclude/--include rules to the name alone, before the entry is stat'ed or opened,
+        // so that nothing below an excluded directory is ever touched
+        if (filter_excluded(&ctx->filters, de->d_name)) {
+            continue;
+        }
+
         // Push directory entry name into path_buf using pointer arithmetic
-        if (path_push(de->d_name) == -1) {
+        if (tp_path_push(ctx, de->d_name) == -1) {
             if (closedir(dir) == -1) {
                 fprintf(stderr, "ERROR: Directory failed to close. \n");
                 return -1;
@@ -630,8 +959,8 @@ int serialize_directory(int depth) {
             return -1; // Failed to append to path_buf
         }
 
-        if (stat(path_buf, &stat_buf) == -1) {
-            if (path_pop() == -1) {
+        if (lstat(ctx->path_buf, &stat_buf) == -1) { // lstat so that symbolic links are not followed
+            if (tp_path_pop(ctx) == -1) {
                 fprintf(stderr, "ERROR: Failed to pop commponent off path_buf. \n");
                 return -1; // Failed to restore path_buf
             }// Restore path_buf
@@ -646,73 +975,13 @@ int serialize_directory(int depth) {
         // %%%%%%%%%%%RECURISVELY SERIALIZE FILE OR DIRECTORY%%%%%%%%%%%%%%%%%
         if (S_ISDIR(stat_buf.st_mode)) {
             // ^^^^^^^^^^^^^^WRITE RECORDS DIRECTORY ENTRY^^^^^^^^^^^^^
-            // WRITE THE MAGIC BYTES - always the same for every entry
-            if (fputc(0x0C, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 1 when writing DIRECTORY ENTRY - directory. \n");
-                return -1; // Magic byte 1
-            }
-            if (fputc(0x0D, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 2 when writing DIRECTORY ENTRY - directory. \n");
-                return -1; // Magic byte 2
-            }
-            if (fputc(0xED, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 3 when writing DIRECTORY ENTRY - directory. \n");
-                return -1; // Magic byte 3
-            }
-
-            // WRITE THE TYPE
-            unsigned char directory_entry_type = 4; // DIRECTORY_ENTRY = 4
-            if (fputc(directory_entry_type, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing DIRECTORY ENTRY type 4 \n");
+            if (tp_write_directory_entry(ctx, depth, de->d_name, &stat_buf) == -1) {
+                closedir(dir);
                 return -1;
             }
 
-            // WRITE THE DEPTH: 4 bytes
-            for (int i = 3; i >= 0; i--) {
-                if (fputc(((uint32_t) depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing depth. \n");
-                    return -1;
-                }
-            }
-
-            int name_length = len_string(de->d_name);
-            uint64_t entry_size = name_length + 16 + 12; // REMEMBER the header is given as a constant size of 16 and the metadata collected above is given as a constant size of 12
-            // WRITE THE SIZE: 8 bytes
-            for (int i = 7; i >=0; i--) {
-                if (fputc((entry_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing  size. \n");
-                    return -1;
-                }
-            }
-
-            // WRITE THE METADATA: 12 bytes
-            // Serialize the mode (file type and permissions) using masks
-            uint32_t mode = (stat_buf.st_mode & (S_IFMT | S_IRWXU | S_IRWXG | S_IRWXO));
-            for (int i = 3; i >= 0; i--) {
-                if (fputc((mode >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing metadata of type and permissions. \n");
-                    return -1;
-                }
-            }
-
-            // Serialize the file size (st_size) as 64-bit value
-            for (int i = 7; i >= 0; i--) {
-                if (fputc(((uint64_t)stat_buf.st_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing size. \n");
-                    return -1;
-                }
-            }
-
-            // WRITE THE NAME
-            for (int i = 0; i < len_string(de->d_name); i++) {
-                if (fputc(*(de->d_name + i), stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing component name. \n");
-                    return -1;
-                }
-            }
-
-            if (serialize_directory(depth + 1) == -1) { // IF directoryy, then increment the depth because deeper
-                if (path_pop() == -1) {
+            if (tp_serialize_directory(ctx, depth + 1) == -1) { // IF directoryy, then increment the depth because deeper
+                if (tp_path_pop(ctx) == -1) {
                     fprintf(stderr, "ERROR: Failed to pop component off path_buf. \n");
                     return -1; // Failed to restore path_buf
                 }
@@ -724,76 +993,14 @@ int serialize_directory(int depth) {
             }
         } else if (S_ISREG(stat_buf.st_mode)) {
             // ^^^^^^^^^^^^^^WRITE RECORDS DIRECTORY ENTRY^^^^^^^^^^^^^ (writing for file too, because records directory regardless of what parsed)
-            // Independent of if file or directory, record the current directory entry
-            // WRITE THE MAGIC BYTES - always the same for every entry
-            if (fputc(0x0C, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 1 when writing DIRECTORRY ENTRY - file.\n");
-                return -1; // Magic byte 1
-            }
-            if (fputc(0x0D, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 2 when writing DIRECTORY ENTRY - file. \n");
-                return -1; // Magic byte 2
-            }
-            if (fputc(0xED, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 3 when writing DIRECTORY ENTRY - file. \n");
-                return -1; // Magic byte 3
-            }
-
-            // WRITE THE TYPE
-            unsigned char directory_entry_type = 4; // DIRECTORY_ENTRY = 4
-            if (fputc(directory_entry_type, stdout) == EOF) {
-                fprintf(stderr, "ERROR: Unexpected EOF when writing type of DIRECTORY ENTRY 4. \n");
+            if (tp_write_directory_entry(ctx, depth, de->d_name, &stat_buf) == -1) {
+                closedir(dir);
                 return -1;
             }
 
-            // WRITE THE DEPTH: 4 bytes
-            for (int i = 3; i >= 0; i--) {
-                if (fputc(((uint32_t) depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing depth. \n");
-                    return -1;
-                }
-            }
-
-            int name_length = len_string(de->d_name);
-            uint64_t entry_size = name_length + 16 + 12; // REMEMBER the header is given as a constant size of 16 and the metadata collected above is given as a constant size of 12
-            // WRITE THE SIZE: 8 bytes
-            for (int i = 7; i >=0; i--) {
-                if (fputc((entry_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing. \n");
-                    return -1;
-                }
-            }
-
-            // WRITE THE METADATA: 12 bytes
-            // Serialize the mode (file type and permissions) using masks
-            uint32_t mode = (stat_buf.st_mode & (S_IFMT | S_IRWXU | S_IRWXG | S_IRWXO));
-            for (int i = 3; i >= 0; i--) {
-                if (fputc((mode >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing metadata file type and permissions. \n");
-                    return -1;
-                }
-            }
-
-            // Serialize the file size (st_size) as 64-bit value
-            for (int i = 7; i >= 0; i--) {
-                if (fputc(((uint64_t)stat_buf.st_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing size. \n");
-                    return -1;
-                }
-            }
-
-            // WRITE THE NAME
-            // write each character of the name
-            for (int i = 0; i < len_string(de->d_name); i++) {
-                if (fputc(*(de->d_name + i), stdout) == EOF) {
-                    fprintf(stderr, "ERROR: Unexpected EOF when writing component name. \n");
-                    return -1;
-                }
-            }
-
             // Serialize regular file
-            if (serialize_file(depth, stat_buf.st_size) == -1) { // ELSE IF file then keep deth the same because searching at the same level
-                if (path_pop() == -1) {
+            if (tp_serialize_file(ctx, depth, stat_buf.st_size) == -1) { // ELSE IF file then keep deth the same because searching at the same level
+                if (tp_path_pop(ctx) == -1) {
                     fprintf(stderr, "ERROR: Failed to pop component off path_buf. \n");
                     return -1; // Failed to restore path_buf
                 }
@@ -803,13 +1010,35 @@ int serialize_directory(int depth) {
                 }
                 return -1; // Failed to serialize file
             }
-        } else { // Unkown type, not a file or a directory
-            fprintf(stderr, "ERROR: Unknown type not a file or a directory.\n");
-            return -1;
+        } else if (S_ISLNK(stat_buf.st_mode)) {
+            // Symbolic links are recorded as links and never followed, so a link to a large
+            // directory (or a link cycle) costs one small record instead of a second traversal.
+            // Read the target relative to the open directory so path_buf is not looked up again
+            ssize_t link_length = readlinkat(dirfd(dir), de->d_name, ctx->link_buf, PATH_MAX - 1);
+            if (link_length == -1) {
+                tp_path_pop(ctx);
+                closedir(dir);
+                fprintf(stderr, "ERROR: Failed to read the target of symbolic link. \n");
+                return -1;
+            }
+            *(ctx->link_buf + link_length) = '\0';
+            stat_buf.st_size = link_length; // st_size is not reliable for links on every filesystem
+
+            if (tp_write_directory_entry(ctx, depth, de->d_name, &stat_buf) == -1) {
+                closedir(dir);
+                return -1;
+            }
+            if (tp_serialize_symlink(ctx, depth, link_length) == -1) {
+                tp_path_pop(ctx);
+                closedir(dir);
+                return -1; // Failed to serialize link target
+            }
+        } else { // Sockets, FIFOs and device nodes have no content that can be transplanted
+            fprintf(stderr, "WARNING: Skipping %s - not a regular file, directory or symbolic link. \n", ctx->path_buf);
         }
 
         // Pop directory entry name from path_buf using pointer arithmetic
-        if (path_pop() == -1) {
+        if (tp_path_pop(ctx) == -1) {
             fprintf(stderr, "ERROR: Failed to pop component off path_buf. \n");
             return -1; // Failed to restore path_buf
         }
@@ -822,130 +1051,92 @@ int serialize_directory(int depth) {
     }
 
     // Write the END OF DIRECTORY
-    //******************WRITE THE RECORD DIRECTORY END**********************
-    // WRITE THE MAGIC BYTES
-    if (fputc(0x0C, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 1 of END OF DIRECTORY. \n");
-        return -1; // Magic byte 1
-    }
-    if (fputc(0x0D, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 2 of END OF DIRECTORY. \n");
-        return -1; // Magic byte 2
-    }
-    if (fputc(0xED, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF when writing magic byte 3 of END OF DIRECTORY. \n");
-        return -1; // Magic byte 3
-    }
-
-    // WRITE THE TYPE
-    unsigned char end_directory_type = 3; // END_OF_DIRECTORY = 3
-    if (fputc(end_directory_type, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF when writing type 3 of END OF DIRECTORY. \n");
+    if (tp_write_record_header(ctx, 3, depth, 16) == -1) { // END_OF_DIRECTORY = 3
+        fprintf(stderr, "ERROR: Unexpected EOF when writing END OF DIRECTORY. \n");
         return -1;
     }
 
-    // WRITE THE DEPTH: 4 bytes
-    for (int i = 3; i >= 0; i--) {
-        if (fputc((node_depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing depth. \n");
-            return -1;
-        }
-    }
-
-    // WRITE THE SIZE: 8 bytes
-    for (int i = 7; i >=0; i--) {
-        if (fputc((header_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing size. \n");
-            return -1;
-        }
-    }
-
     return 0; // Success
 }
 
 /*
  * @brief  Serialize the contents of a file as a single record written to the
- * standard output.
+ * sink of the context.
  * @details  This function assumes that path_buf contains the name of an existing
  * file to be serialized.  It serializes the contents of that file as a single
- * FILE_DATA record emitted to the standard output.
+ * FILE_DATA record emitted to the sink of the context.
  *
  * @param depth  The value to be used in the depth field of the FILE_DATA record.
  * @param size  The number of bytes of data in the file to be serialized.
  * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
  * including failure to open the file, too many or not enough data bytes read
- * from the file, and I/O errors reading the file data or writing to standard output.
+ * from the file, and I/O errors reading the file data or writing to the sink of the context.
  */
-int serialize_file(int depth, off_t size) {
+int tp_serialize_file(struct transplant_ctx *ctx, int depth, off_t size) {
     if (size == -1) { // Invalid write size
         fprintf(stderr, "ERROR: Invalid negative write size. \n");
         return -1; // Can't have a negative write size
     }
-
-    // WRITE THE MAGIC BYTES - always the same for every entry
-    if (fputc(0x0C, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF writing magic byte 1. \n");
-        return -1; // Magic byte 1
+    if (ctx->options & TRANSPLANT_SIGNATURE) { // --signature: describe the file instead of sending it
+        return serialize_file_signature(ctx, depth, size);
     }
-    if (fputc(0x0D, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF writing magic byte 2. \n");
-        return -1; // Magic byte 2
+    if (ctx->signatures) { // --delta: send only what the old version lacks, if there is one
+        char *relative = ctx->path_buf + ctx->root_length;
+        while (*relative == '/') relative++;
+        struct file_sig *sig = signature_find(ctx->signatures, relative);
+        if (sig) {
+            return serialize_file_delta(ctx, depth, sig, size);
+        }
     }
-    if (fputc(0xED, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF writing magic byte 3. \n");
-        return -1; // Magic byte 3
+    if (ctx->chunk_size) { // --chunk-size: read to end of file, whatever size it has now
+        return serialize_file_chunks(ctx, depth);
     }
 
-    // WRITE THE TYPE
-    unsigned char file_data_type = 5; // FILE_DATA = 5
-    if (fputc(file_data_type, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF writing type 5 FILE DATA. \n");
+    // WRITE THE HEADER: the size of the record includes the header, given as a constant 16 bytes
+    if (tp_write_record_header(ctx, 5, depth, (uint64_t)size + 16) == -1) { // FILE_DATA = 5
+        fprintf(stderr, "ERROR: Unexpected EOF writing FILE DATA header. \n");
         return -1;
     }
 
-    // WRITE THE DEPTH: 4 bytes
-    for (int i = 3; i >= 0; i--) {
-        if (fputc(((uint32_t) depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing depth. \n");
-            return -1;
-        }
-    }
-
-    int size_total_file = size + 16; // Header size is given as a constant value
-    // WRITE THE SIZE: 8 bytes
-    for (int i = 7; i >=0; i--) {
-        if (fputc(((uint64_t) size_total_file >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing size. \n");
-            return -1;
+    //**************PROCESS THE FILE*****************
+    if (ctx->direct_io_min_size && (uint64_t)size >= ctx->direct_io_min_size) { // very large file: bypass the page cache
+        int ret = serialize_file_direct(ctx, size);
+        if (ret != 1) {
+            return ret;
         }
+        // ret == 1: O_DIRECT is not supported by this filesystem, read through the page cache instead
     }
 
-    //**************PROCESS THE FILE*****************
     // Open the file for reading
-    FILE *file = fopen(path_buf, "r");
-    if (!file) {
+    int fd = open(ctx->path_buf, O_RDONLY);
+    if (fd == -1) {
         fprintf(stderr, "ERROR: Failed to open  file, not a file. \n");
         return -1; // Failed to open the file
     }
 
-    // Read file data byte-by-byte and write to standard output
-    int c;
+    // Read file data in blocks and write them to the sink, or straight into the shared ring (--shm)
     while (size > 0) {
-        c = fgetc(file); // Read a single byte from the file
-        if (c == EOF) {
-            if (ferror(file)) {
-                fclose(file);
-                fprintf(stderr, "ERROR: I/O error occurred.\n");
-                return -1; // I/O error occurred
-            }
-            fprintf(stderr, "ERROR: Unexpected EOF. \n");
-            return -1; // Unexpected EOF
+        size_t room;
+        char *block = shm_output_block(ctx, &room);
+        size_t want = block ? room : DATA_BUF_SIZE;
+        if ((uint64_t)size < want) want = size;
+        ssize_t n = read(fd, block ? block : ctx->data_buf, want);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            fprintf(stderr, n == 0 ? "ERROR: Unexpected EOF. \n" : "ERROR: I/O error occurred.\n");
+            return -1; // the file shrank, or an I/O error occurred
+        }
+        if (block) {
+            shm_output_done(ctx, n);
+        } else if (tp_write(ctx, ctx->data_buf, n) == -1) { // Write the block to the sink
+            close(fd);
+            return -1;
         }
-        fputc(c, stdout); // Write the byte to the standard output
-        size--;
+        size -= n;
     }
 
-    if (fclose(file) == -1) {
+    if (close(fd) == -1) {
         fprintf(stderr, "ERROR: Failed to close file. \n");
         return -1; // Close the file
     }
@@ -960,183 +1151,315 @@ int serialize_file(int depth, off_t size) {
 
 /**
  * @brief Serializes a tree of files and directories, writes
- * serialized data to standard output.
+ * serialized data to the sink of the context.
  * @details This function assumes path_buf has been initialized with the pathname
  * of a directory whose contents are to be serialized.  It traverses the tree of
  * files and directories contained in this directory (not including the directory
- * itself) and it emits on the standard output a sequence of bytes from which the
+ * itself) and it emits on the sink of the context a sequence of bytes from which the
  * tree can be reconstructed.  Options that modify the behavior are obtained from
- * the global_options variable.
+ * the options of the context.  In pipelined mode the sink is written by a
+ * separate thread while the tree is walked and files are read on this one.
+ * With shards (transplant_add_shard()), the tree is split between them
+ * instead and nothing is written to the sink; see shard.h.
+ * With a shared-memory socket (transplant_set_shm()), the data goes to the
+ * ring of the deserializing process instead of the sink; see shm.h.
+ * With TRANSPLANT_METADATA_FIRST, every entry is written before the contents
+ * of any file; see skeleton.h.
  *
  * @return 0 if serialization completes without error, -1 if an error occurs.
  */
-int serialize() {
-    // Write the START OF TRANSMISSION record first
-    //**************WRITE RECORD START*********************************
-    // WRITE THE MAGIC BYTES
-    if (fputc(0x0C, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF magic byte 1 START OF TRANSMISSION. \n");
-        return -1; // Magic byte 1
+static int serialize_records(struct transplant_ctx *ctx);
+
+int tp_serialize(struct transplant_ctx *ctx) {
+    if (ctx->shards) {
+        return shard_serialize(ctx);
+    }
+    struct shm_transport *shm = NULL;
+    if (ctx->shm_path && !(shm = shm_start_output(ctx))) { // the sink becomes the shared ring
+        return -1;
     }
-    if (fputc(0x0D, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF magic byte 2 START OF TRANSMISSION. \n");
-        return -1; // Magic byte 2
+    ctx->root_length = ctx->path_length; // delta mode looks files up by their path below the root
+    int ret;
+    if (!ctx->pipeline_mem) {
+        ret = serialize_records(ctx);
+    } else {
+        struct pipeline *pipe = pipeline_start_output(ctx);
+        ret = pipe ? serialize_records(ctx) : -1;
+        if (pipe && pipeline_stop_output(ctx, pipe) == -1) {
+            ret = -1;
+        }
     }
-    if (fputc(0xED, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF magic byte 3 START OF TRANSMISSION. \n");
-        return -1; // Magic byte 3
+    if (shm && shm_stop_output(ctx, shm, ret == -1) == -1) {
+        ret = -1;
     }
+    return ret;
+}
 
-    // WRITE THE TYPE
-    unsigned char start_record_type = 0; // START_OF_TRANSMISSION
-    if (fputc(start_record_type, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF writing START OF TRANSMISSION type.\n");
+/*
+ * Write a whole transmission to the sink of the context; see tp_serialize().
+ */
+static int serialize_records(struct transplant_ctx *ctx) {
+    if ((ctx->options & TRANSPLANT_FORMAT_V2) && (ctx->options & TRANSPLANT_SIGNATURE)) {
+        fprintf(stderr, "ERROR: Signatures are only written in version 1 of the format. \n");
+        return -1;
+    }
+    // Write the START OF TRANSMISSION record first: it also gives the version of the format
+    if (tp_write_record_header(ctx, 0, 0, 16) == -1) { // START_OF_TRANSMISSION = 0
+        fprintf(stderr, "ERROR: Unexpected EOF writing START OF TRANSMISSION. \n");
         return -1;
     }
 
-    // WRITE THE DEPTH: 4 bytes
-    uint32_t start_end_depth = 0; // always 0 for the start and end
-    for (int i = 3; i >= 0; i--) {
-        if (fputc((start_end_depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing depth. \n");
+    //****************SERIALIZATION BEGIN*******************************************
+    // Start serialization of directory contents
+    if (ctx->files_from) {
+        // Only the listed entries and the directories that lead to them
+        if (serialize_file_list(ctx) == -1) {
             return -1;
         }
-    }
-
-    // WRITE THE SIZE: 8 bytes
-    uint64_t header_size = 16;
-    for (int i = 7; i >=0; i--) {
-        if (fputc((header_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing size. \n");
+    } else if (ctx->options & TRANSPLANT_METADATA_FIRST) {
+        // Every entry first, then the contents of the files
+        if (skeleton_serialize(ctx) == -1) {
             return -1;
         }
-    }
-
-    //****************SERIALIZATION BEGIN*******************************************
-    // Start serialization of directory contents
-    if (serialize_directory(1) == -1) { // in other words it returns an error at -1
+    } else if (ctx->selection) {
+        // One shard: its entries and the directories that lead to them
+        if (tp_write_record_header(ctx, 2, 1, 16) == -1 || // START_OF_DIRECTORY
+            change_emit(ctx, ctx->selection, 1) == -1 ||
+            tp_write_record_header(ctx, 3, 1, 16) == -1) { // END_OF_DIRECTORY
+            return -1;
+        }
+    } else if (ctx->scan_threads > 1) {
+        // Read all the metadata with worker threads first, then write it out on this thread
+        struct scan_dir *root = scan_tree(ctx, ctx->path_buf, ctx->scan_threads);
+        if (!root) {
+            return -1; // Error occurred while scanning the tree
+        }
+        int ret = serialize_scanned_directory(ctx, root, 1);
+        scan_free(root);
+        if (ret == -1) {
+            return -1; // Error occurred during serialization
+        }
+    } else if (tp_serialize_directory(ctx, 1) == -1) { // in other words it returns an error at -1
         return -1; // Error occurred during serialization
     }
 
     // Write the END OF TRANSMISSION record last
-    //**************WRITE RECORD END*********************************
-    // WRITE THE MAGIC BYTES
-    if (fputc(0x0C, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF magic byte 1 END OF TRANSMISSION. \n");
-        return -1; // Magic byte 1
-    }
-    if (fputc(0x0D, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF magic byte 2 END OF TRANSMISSION. \n");
-        return -1; // Magic byte 2
-    }
-    if (fputc(0xED, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF magic byte 3 END OF TRANSMISSION. \n");
-        return -1; // Magic byte 3
-    }
-
-    // WRITE THE TYPE
-    unsigned char end_record_type = 1; // END_OF_TRANSMISSION
-    if (fputc(end_record_type, stdout) == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF writing END OF TRANSMISSION type.\n");
+    if (tp_write_record_header(ctx, 1, 0, 16) == -1) { // END_OF_TRANSMISSION = 1
+        fprintf(stderr, "ERROR: Unexpected EOF writing END OF TRANSMISSION. \n");
         return -1;
     }
 
-    // WRITE THE DEPTH: 4 bytes
-    for (int i = 3; i >= 0; i--) {
-        if (fputc((start_end_depth >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing depth. \n");
-            return -1;
-        }
-    }
-
-    // WRITE THE SIZE: 8 bytes
-    for (int i = 7; i >=0; i--) {
-        if (fputc((header_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF writing size. \n");
-            return -1;
-        }
+    // Hand whatever is still buffered to the sink
+    if (tp_flush(ctx) == -1) {
+        return -1;
     }
-
     return 0; // Success
 }
 
 /**
- * @brief Reads serialized data from the standard input and reconstructs from it
+ * @brief Reads serialized data from the source of the context and reconstructs from it
  * a tree of files and directories.
  * @details  This function assumes path_buf has been initialized with the pathname
  * of a directory into which a tree of files and directories is to be placed.
  * If the directory does not already exist, it is created.  The function then reads
- * from from the standard input a sequence of bytes that represent a serialized tree
+ * from the source of the context a sequence of bytes that represent a serialized tree
  * of files and directories in the format written by serialize() and it reconstructs
  * the tree within the specified directory.  Options that modify the behavior are
- * obtained from the global_options variable.
+ * obtained from the options of the context.  In pipelined mode the source is
+ * read ahead by a separate thread while the records are parsed on this one.
+ * With TRANSPLANT_WATCH, transmissions are applied one after the other until
+ * the input ends between two of them, all but the first with clobbering.
+ * Targets added with transplant_add_target() receive everything restored
+ * into path_buf; see fanout.h.  With a journal (transplant_set_journal()),
+ * a restore that did not finish is resumed from its last checkpoint; see journal.h.
+ * With a shared-memory socket (transplant_set_shm()), the data is read from
+ * a ring shared with the serializing process instead of the source; see shm.h.
  *
  * @return 0 if deserialization completes without error, -1 if an error occurs.
  */
-int deserialize() {
-    // PROCESS THE START OF TRANSMISSION RECORD FIRST 
-    // Step 1: Validate the magic sequence: magic byte 1=0x0C, 2=0x0D, 3=0xED
-    unsigned char magic1_b = debug_getchar(); // first 3 bytes
-    unsigned char magic2_b = debug_getchar();
-    unsigned char magic3_b = debug_getchar();
-    if (magic1_b == EOF || magic2_b == EOF || magic3_b == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF reading magic bytes. \n");
-        return -1; // Check for EOF
+static int deserialize_input(struct transplant_ctx *ctx);
+static int deserialize_transmissions(struct transplant_ctx *ctx, int resume_depth);
+static int deserialize_records(struct transplant_ctx *ctx, int resume_depth);
+
+int tp_deserialize(struct transplant_ctx *ctx) {
+    if (!ctx->shm_path) {
+        return deserialize_input(ctx);
     }
-    if (magic1_b != 0x0C || magic2_b != 0x0D || magic3_b != 0xED) {
-        fprintf(stderr, "ERROR: Magic bytes not as expected. \n");
-        return -1; // Magic bytes mismatch
+    struct shm_transport *shm = shm_start_input(ctx); // the source becomes the shared ring
+    if (!shm) {
+        return -1;
     }
+    int ret = deserialize_input(ctx);
+    if (shm_stop_input(ctx, shm) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
 
-    // STEP 2: check that the type is START_OF_TRANSMISSION
-    unsigned char type_b = debug_getchar();  // 4th byte
-    if (type_b != 0 || type_b == -1 || type_b == EOF) {
-        fprintf(stderr, "ERROR: Unexpected EOF reading type of START OF TRANSMISSION. \n");
+/*
+ * Deserialize from the source of the context; see tp_deserialize().
+ */
+static int deserialize_input(struct transplant_ctx *ctx) {
+    int options = ctx->options; // resuming turns clobbering on
+    int resume_depth = ctx->journal ? journal_resume(ctx) : 0;
+    if (resume_depth == -1) {
+        ctx->options = options;
+        return journal_finish(ctx, -1);
+    }
+    if (fanout_start(ctx) == -1) { // the threads of the other targets, if any
         return -1;
     }
-    // At the start, start of transmission must be 0 type as defined by assignment
-
-    // Step 3: Validate the depth (32-bit unsigned integer in big-endian)
-    int depth = 0; // depth should be at 0 - next 4 bytes
-    for (int i = 0; i < 4; i++) {
-        int byte = debug_getchar();
-        if (byte == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF reading depth. \n");
-            return -1;
+    int ret;
+    if (!ctx->pipeline_mem || ctx->in_buf != ctx->in_storage) { // nothing to overlap for a memory source
+        ret = salvage_start_input(ctx) == -1 ? -1 : deserialize_transmissions(ctx, resume_depth);
+        salvage_stop_input(ctx);
+    } else {
+        struct pipeline *pipe = pipeline_start_input(ctx);
+        if (!pipe) {
+            fanout_stop(ctx);
+            ctx->options = options;
+            return ctx->journal ? journal_finish(ctx, -1) : -1;
+        }
+        ret = salvage_start_input(ctx) == -1 ? -1 : deserialize_transmissions(ctx, resume_depth);
+        salvage_stop_input(ctx);
+        if (pipeline_stop_input(ctx, pipe) == -1) {
+            fprintf(stderr, "ERROR: Failed to read serialized data. \n");
+            ret = -1;
         }
-        depth = (depth << 8) | byte;
     }
-    if (depth != 0) {
-        fprintf(stderr, "ERROR: Depth is not 0. \n");
+    if (fanout_stop(ctx) == -1) {
+        ret = -1;
+    }
+    if (ctx->salvage_regions) {
+        fprintf(stderr, "WARNING: Went past %u damaged regions of the input, skipping %lu bytes and leaving %u entries damaged. \n",
+                ctx->salvage_regions, (unsigned long)ctx->salvage_skipped, ctx->salvage_damaged);
+    }
+    ctx->options = options;
+    return ctx->journal ? journal_finish(ctx, ret) : ret; // the journal is removed once it is no longer needed
+}
+
+/*
+ * Parse one transmission, or with TRANSPLANT_WATCH all of them; see tp_deserialize().
+ */
+static int deserialize_transmissions(struct transplant_ctx *ctx, int resume_depth) {
+    if (!(ctx->options & TRANSPLANT_WATCH)) {
+        return deserialize_records(ctx, resume_depth);
+    }
+    // END_OF_DIRECTORY at depth 1 pops the root off path_buf, so it is put back for every transmission
+    char *root = malloc(ctx->path_length + 1);
+    if (!root) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
         return -1;
     }
+    tp_copy(root, ctx->path_buf, ctx->path_length + 1);
+    int options = ctx->options;
+    int ret = 0;
+    while (ret == 0 && tp_getc(ctx) != EOF) {
+        ctx->in_pos--; // only looking for the end of the input
+        ret = tp_path_init(ctx, root);
+        if (ret == 0) ret = deserialize_records(ctx, 0);
+        if (ret == 0) ret = fanout_sync(ctx); // the other targets must be done before the first one changes again
+        ctx->options |= TRANSPLANT_CLOBBER; // change sets update what the first transmission created
+    }
+    ctx->options = options;
+    tp_path_init(ctx, root);
+    free(root);
+    return ret;
+}
 
-    // Step 4: Validate the size (32-bit unsigned integer in big-endian)
+/*
+ * Parse a whole transmission from the source of the context; see tp_deserialize().
+ * resume_depth is 0, or the depth of the checkpoint the input has been
+ * positioned at by journal_resume().
+ */
+static int deserialize_records(struct transplant_ctx *ctx, int resume_depth) {
+    int depth = 0; // depth should be at 0 - next 4 bytes
     int size = 0; // size should be 16 - next 8 bytes
-    for (int i = 0; i < 8; i++) {
-        int byte = debug_getchar();
-        if (byte == EOF) {
-            fprintf(stderr, "ERROR: Unexpected EOF reading size. \n");
+    ctx->wire_version = WIRE_V1; // until START_OF_TRANSMISSION says otherwise
+    if (resume_depth == 0) {
+        // PROCESS THE START OF TRANSMISSION RECORD FIRST 
+        // Step 1: Validate the magic sequence: magic byte 1=0x0C, 2=0x0D, 3=0xED
+        unsigned char magic1_b = debug_getchar(ctx); // first 3 bytes
+        unsigned char magic2_b = debug_getchar(ctx);
+        unsigned char magic3_b = debug_getchar(ctx);
+        if (magic1_b == EOF || magic2_b == EOF || magic3_b == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF reading magic bytes. \n");
+            return -1; // Check for EOF
+        }
+        if (magic1_b != 0x0C || magic2_b != 0x0D || magic3_b != 0xED) {
+            fprintf(stderr, "ERROR: Magic bytes not as expected. \n");
+            return -1; // Magic bytes mismatch
+        }
+
+        // STEP 2: check that the type is START_OF_TRANSMISSION
+        unsigned char type_b = debug_getchar(ctx);  // 4th byte
+        if (type_b != 0 || type_b == -1 || type_b == EOF) {
+            fprintf(stderr, "ERROR: Unexpected EOF reading type of START OF TRANSMISSION. \n");
+            return -1;
+        }
+        // At the start, start of transmission must be 0 type as defined by assignment
+
+        // Step 3: Validate the depth (32-bit unsigned integer in big-endian)
+        for (int i = 0; i < 4; i++) {
+            int byte = debug_getchar(ctx);
+            if (byte == EOF) {
+                fprintf(stderr, "ERROR: Unexpected EOF reading depth. \n");
+                return -1;
+            }
+            depth = (depth << 8) | byte;
+        }
+        if (depth != 0) {
+            fprintf(stderr, "ERROR: Depth is not 0. \n");
+            return -1;
+        }
+
+        // Step 4: Validate the size (32-bit unsigned integer in big-endian)
+        for (int i = 0; i < 8; i++) {
+            int byte = debug_getchar(ctx);
+            if (byte == EOF) {
+                fprintf(stderr, "ERROR: Unexpected EOF reading size. \n");
+                return -1;
+            }
+            size = (size << 8) | byte;
+        }
+        if (size == WIRE_START_SIZE) { // one byte of payload: the version of the format
+            int version = debug_getchar(ctx);
+            if (version != WIRE_V2) {
+                fprintf(stderr, "ERROR: Unsupported version %d of the format. \n", version);
+                return -1;
+            }
+            if (ctx->journal) {
+                fprintf(stderr, "ERROR: A transmission in version 2 of the format cannot be restored with a journal. \n");
+                return -1;
+            }
+            ctx->wire_version = WIRE_V2;
+            ctx->wire_depth = 0;
+        } else if (size != 16) {
+            fprintf(stderr, "ERROR: Size is not 16. \n");
             return -1;
         }
-        size = (size << 8) | byte;
-    }
-    if (size != 16) {
-        fprintf(stderr, "ERROR: Size is not 16. \n");
-        return -1;
     }
+    ctx->salvage_mark = tp_offset(ctx); // a scan never goes back into an earlier transmission (--salvage)
 
     //****************************DESERIALIZATION BEGIN*************************************************
     // Start deserialization of directory contents
-    if (deserialize_directory(1) != 0) { // DOUBLE CHECK if path_buf is considered as outside of the directory strucutre
+    if (tp_deserialize_directory(ctx, resume_depth ? resume_depth : 1) != 0) { // DOUBLE CHECK if path_buf is considered as outside of the directory strucutre
         return -1; // Error occurred during deserialization (any other value that should be expected other than 0 is -1)
     }
 
     // Process the END OF TRANSMISSION record last
+    if (ctx->wire_version == WIRE_V2) {
+        uint64_t end_size;
+        if (check_while_condition(ctx, 0) != 1 || wire_read_size(ctx, &end_size) == -1 || end_size != 16) {
+            fprintf(stderr, "ERROR: Invalid END OF TRANSMISSION \n");
+            return -1;
+        }
+        return 0;
+    }
     // Step 1: Validate the magic sequence: magic byte 1=0x0C, 2=0x0D, 3=0xED
-    unsigned char magic1_f = debug_getchar();
-    unsigned char magic2_f = debug_getchar();
-    unsigned char magic3_f = debug_getchar();
+    unsigned char magic1_f = debug_getchar(ctx);
+    unsigned char magic2_f = debug_getchar(ctx);
+    unsigned char magic3_f = debug_getchar(ctx);
     if (magic1_f == EOF || magic2_f == EOF || magic3_f == EOF) {
         fprintf(stderr, "ERROR: Unexpected EOF reading magic bytes. \n");
         return -1; // Check for EOF
@@ -1147,7 +1470,7 @@ int deserialize() {
     }
 
     // STEP 2: check that the file type is END_OF_TRANSMISSION
-    unsigned char type_f = debug_getchar();
+    unsigned char type_f = debug_getchar(ctx);
     if (type_f != 1 || type_f == -1 || type_f == EOF) {
         fprintf(stderr, "ERROR: Invalid type for END OF TRANSMISSION \n");
         return -1;
@@ -1157,7 +1480,7 @@ int deserialize() {
     // Step 3: Validate the depth (32-bit unsigned integer in big-endian)
     depth = 0; // depth should be at 0
     for (int i = 0; i < 4; i++) {
-        int byte = debug_getchar();
+        int byte = debug_getchar(ctx);
         if (byte == EOF) {
             fprintf(stderr, "ERROR: Unexpected EOF reading depth.\n");
             return -1;
@@ -1172,7 +1495,7 @@ int deserialize() {
     // Step 4: Validate the size (32-bit unsigned integer in big-endian)
     size = 0; // size should be 16
     for (int i = 0; i < 8; i++) {
-        int byte = debug_getchar();
+        int byte = debug_getchar(ctx);
         if (byte == EOF) {
             fprintf(stderr, "ERROR: Unexpected EOF reading size \n");
             return -1;
@@ -1187,12 +1510,50 @@ int deserialize() {
     return 0; // Success
 }
 
+/*
+ * @brief  Compare a command line argument with the spelling of a flag.
+ * @return 1 if the two strings are identical, 0 otherwise.
+ */
+int arg_equals(char *arg, char *flag) {
+    while (*arg != '\0' && *arg == *flag) {
+        arg++;
+        flag++;
+    }
+    return *arg == *flag;
+}
+
+/*
+ * @brief  Parse a size given on the command line, such as 4096, 64K, 512M or 2G.
+ * @param text  The argument.
+ * @param size  Where to store the size, in bytes.
+ * @return 0 in case of success, -1 if the argument is not a positive size.
+ */
+static int parse_size(char *text, uint64_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        value <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value <<= 30;
+        end++;
+    }
+    if (*text < '0' || *text > '9' || *end != '\0' || value == 0) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
 /**
  * @brief Validates command line arguments passed to the program.
  * @details This function will validate all the arguments passed to the
  * program, returning 0 if validation succeeds and -1 if validation fails.
  * Upon successful return, the selected program options will be set in the
- * global variable "global_options", where they will be accessible
+ * global variable "options", where they will be accessible
  * elsewhere in the program.
  *
  * @param argc The number of arguments passed to the program from the CLI.
@@ -1200,12 +1561,32 @@ int deserialize() {
  * @return 0 if validation succeeds and -1 if validation fails.
  * Refer to the homework document for the effects of this function on
  * global variables.
- * @modifies global variable "global_options" to contain a bitmap representing
+ * @modifies global variable "options" to contain a bitmap representing
  * the selected options.
  */
 int validargs(int argc, char **argv) {
     // Initialize the provided global options to 0 (just in case)
     global_options = 0x0; // Bit representation
+    struct transplant_ctx *ctx = global_context();
+    filter_clear(&ctx->filters); // Filter rules from a previous call do not carry over
+    ctx->scan_threads = 1;
+    ctx->direct_io_min_size = 0;
+    ctx->pipeline_mem = 0;
+    ctx->copy_target = NULL;
+    ctx->chunk_size = 0;
+    transplant_set_delta_base(ctx, NULL);
+    ctx->watch_debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS;
+    transplant_set_files_from(ctx, NULL);
+    fanout_clear(ctx);
+    shard_clear(ctx);
+    transplant_set_shm(ctx, NULL, 0);
+    ctx->durability = TRANSPLANT_DURABILITY_NONE;
+    transplant_set_journal(ctx, NULL, 0);
+    int debounce_flag = 0;
+    char *journal_path = NULL;
+    long journal_interval = -1;
+    char *shm_path = NULL;
+    uint64_t shm_size = 0;
 
     // Check if no flag arguments are provided
     if (argc < 2 || argc == 1) { // argc always at least 1, because at index 1 of argv is the name of the program
@@ -1246,9 +1627,9 @@ int validargs(int argc, char **argv) {
                 fprintf(stderr, "ERROR: Duplicate -s flags passed and not as path attached to -p. \n");
                 return -1; // Cannot have two -s flags
             }
-            if (pos_flag_found) {
+            if (pos_flag_found && !(d_flag && current_arg == argv + 2)) {
                 fprintf(stderr, "ERROR: Cannot have both -s and -d flags. \n");
-                return -1; // Cannot have both -s and -d flag
+                return -1; // Cannot have both -s and -d flag, except as the pair that selects copy mode
             }
             s_flag = 1;
             global_options |= 1 << 1; // Set the serialization flag
@@ -1262,9 +1643,9 @@ int validargs(int argc, char **argv) {
                 fprintf(stderr, "ERROR: Duplicate -d flags passed and not as path attached to -p. \n");
                 return -1; // Cannot have two -d flags
             }
-            if (pos_flag_found) {
+            if (pos_flag_found && !(s_flag && current_arg == argv + 2)) {
                 fprintf(stderr, "ERROR: Cannon have both -s and -d flags. \n");
-                return -1; // Cannot have both -s and -d flag
+                return -1; // Cannot have both -s and -d flag, except as the pair that selects copy mode
             }
             d_flag = 1;
             global_options |= 1 << 2; // Set the deserialization flag
@@ -1289,6 +1670,329 @@ int validargs(int argc, char **argv) {
             continue;
         }
 
+        // Check for --drop-cache (deserialization only)
+        else if (arg_equals(arg, "--drop-cache")) {
+            if (!d_flag || s_flag) {
+                fprintf(stderr, "ERROR: --drop-cache can only be passed when -d flag alone is passed. \n");
+                return -1;
+            }
+            global_options |= 1 << 4;
+            continue;
+        }
+
+        // Check for --skip-unchanged and --verify (deserialization only, leave up to date files alone)
+        else if (arg_equals(arg, "--skip-unchanged") || arg_equals(arg, "--verify")) {
+            if (!d_flag || s_flag) {
+                fprintf(stderr, "ERROR: %s can only be passed when -d flag alone is passed. \n", arg);
+                return -1;
+            }
+            global_options |= arg_equals(arg, "--verify") ? TRANSPLANT_VERIFY : TRANSPLANT_SKIP_UNCHANGED;
+            continue;
+        }
+
+        // Check for --durability (deserialization only, how restored files survive a crash)
+        else if (arg_equals(arg, "--durability")) {
+            if (!d_flag || s_flag) {
+                fprintf(stderr, "ERROR: --durability can only be passed when -d flag alone is passed. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: none, batched or per-file must follow immediately after --durability. \n");
+                return -1;
+            }
+            int durability = durability_parse(*(++current_arg));
+            if (durability == -1 || transplant_set_durability(ctx, durability) == -1) {
+                fprintf(stderr, "ERROR: --durability expects none, batched or per-file. \n");
+                return -1;
+            }
+            continue;
+        }
+
+        // Check for --journal and --journal-interval (deserialization only, resumable restores)
+        else if (arg_equals(arg, "--journal") || arg_equals(arg, "--journal-interval")) {
+            if (!d_flag || s_flag) {
+                fprintf(stderr, "ERROR: %s can only be passed when -d flag alone is passed. \n", arg);
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: An argument must follow immediately after %s. \n", arg);
+                return -1;
+            }
+            if (arg_equals(arg, "--journal")) {
+                journal_path = *(++current_arg);
+                continue;
+            }
+            char *count = *(++current_arg);
+            char *end;
+            journal_interval = strtol(count, &end, 10);
+            if (*count == '\0' || *end != '\0' || journal_interval < 0 || journal_interval > 60 * 60 * 1000) {
+                fprintf(stderr, "ERROR: --journal-interval expects a number of milliseconds. \n");
+                return -1;
+            }
+            continue;
+        }
+
+        // Check for --salvage (deserialization only, go past damaged parts of the input)
+        else if (arg_equals(arg, "--salvage")) {
+            if (!d_flag || s_flag) {
+                fprintf(stderr, "ERROR: --salvage can only be passed when -d flag alone is passed. \n");
+                return -1;
+            }
+            global_options |= TRANSPLANT_SALVAGE;
+            continue;
+        }
+
+        // Check for --pipeline (serialized data is read or written on a thread of its own)
+        else if (arg_equals(arg, "--pipeline")) {
+            if (s_flag && d_flag) { // copy mode has no serialized data
+                fprintf(stderr, "ERROR: --pipeline cannot be passed in copy mode (-s -d). \n");
+                return -1;
+            }
+            if (!ctx->pipeline_mem) {
+                ctx->pipeline_mem = PIPELINE_DEFAULT_MEM;
+            }
+            continue;
+        }
+
+        // Check for --pipeline-mem (memory for the buffers of the pipeline, implies --pipeline)
+        else if (arg_equals(arg, "--pipeline-mem")) {
+            if (s_flag && d_flag) {
+                fprintf(stderr, "ERROR: --pipeline-mem cannot be passed in copy mode (-s -d). \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A size must follow immediately after --pipeline-mem. \n");
+                return -1;
+            }
+            uint64_t memory;
+            if (parse_size(*(++current_arg), &memory) == -1) {
+                fprintf(stderr, "ERROR: --pipeline-mem expects a positive size such as 64M. \n");
+                return -1;
+            }
+            ctx->pipeline_mem = memory;
+            continue;
+        }
+
+        // Check for --direct-io (threshold above which files bypass the page cache)
+        else if (arg_equals(arg, "--direct-io")) {
+            if (s_flag && d_flag) { // copy mode shares or copies data in the kernel
+                fprintf(stderr, "ERROR: --direct-io cannot be passed in copy mode (-s -d). \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A minimum file size must follow immediately after --direct-io. \n");
+                return -1;
+            }
+            uint64_t min_size;
+            if (parse_size(*(++current_arg), &min_size) == -1) {
+                fprintf(stderr, "ERROR: --direct-io expects a positive size such as 512M. \n");
+                return -1;
+            }
+            ctx->direct_io_min_size = min_size;
+            continue;
+        }
+
+        // Check for -j flag (number of scan threads, serialization only)
+        else if (*arg == '-' && *(arg + 1) == 'j' && *(arg + 2) == '\0') {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: -j flag can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A number of threads must follow immediately after the -j flag. \n");
+                return -1;
+            }
+            char *count = *(++current_arg);
+            char *end;
+            long threads = strtol(count, &end, 10);
+            if (*count == '\0' || *end != '\0' || threads < 1 || threads > 1024) {
+                fprintf(stderr, "ERROR: -j flag expects a number of threads between 1 and 1024. \n");
+                return -1;
+            }
+            ctx->scan_threads = threads;
+            continue;
+        }
+
+        // Check for --exclude and --include filter patterns (serialization only)
+        else if (arg_equals(arg, "--exclude") || arg_equals(arg, "--include")) {
+            if (!s_flag) {
+                fprintf(stderr, "ERROR: %s can only be passed when -s flag is also passed. \n", arg);
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A pattern must follow immediately after %s. \n", arg);
+                return -1;
+            }
+            if (filter_add(&ctx->filters, *(current_arg + 1), arg_equals(arg, "--include")) == -1) {
+                return -1; // filter_add reports what was wrong with the pattern
+            }
+            current_arg++;
+            continue;
+        }
+
+        // Check for --chunk-size (send file contents as independent chunks, serialization only)
+        else if (arg_equals(arg, "--chunk-size")) {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: --chunk-size can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A size must follow immediately after --chunk-size. \n");
+                return -1;
+            }
+            uint64_t chunk_size;
+            if (parse_size(*(++current_arg), &chunk_size) == -1 || chunk_size > CHUNK_MAX_SIZE) {
+                fprintf(stderr, "ERROR: --chunk-size expects a positive size of at most 64M. \n");
+                return -1;
+            }
+            ctx->chunk_size = chunk_size;
+            continue;
+        }
+
+        // Check for --signature (serialize block signatures instead of contents)
+        else if (arg_equals(arg, "--signature")) {
+            if (!s_flag || d_flag || ctx->signatures) {
+                fprintf(stderr, "ERROR: --signature can only be passed when -s flag alone is passed, without --delta. \n");
+                return -1;
+            }
+            global_options |= TRANSPLANT_SIGNATURE;
+            continue;
+        }
+
+        // Check for --delta (send files as deltas against the signature of an old tree)
+        else if (arg_equals(arg, "--delta")) {
+            if (!s_flag || d_flag || (global_options & TRANSPLANT_SIGNATURE) || ctx->signatures) {
+                fprintf(stderr, "ERROR: --delta can only be passed once, when -s flag alone is passed, without --signature. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A signature file must follow immediately after --delta. \n");
+                return -1;
+            }
+            if (transplant_set_delta_base(ctx, *(++current_arg)) == -1) {
+                return -1; // signature_load reports what was wrong with the file
+            }
+            continue;
+        }
+
+        // Check for --files-from (serialize only the listed entries)
+        else if (arg_equals(arg, "--files-from")) {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: --files-from can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A file must follow immediately after --files-from. \n");
+                return -1;
+            }
+            if (transplant_set_files_from(ctx, *(++current_arg)) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        // Check for --shard (split the output into several transmissions written at once)
+        else if (arg_equals(arg, "--shard")) {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: --shard can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A file must follow immediately after --shard. \n");
+                return -1;
+            }
+            if (shard_add(ctx, *(++current_arg), -1) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        // Check for --shm and --shm-size (exchange the data through shared memory instead of stdin/stdout)
+        else if (arg_equals(arg, "--shm") || arg_equals(arg, "--shm-size")) {
+            int size_flag = arg_equals(arg, "--shm-size");
+            if (s_flag == d_flag || (size_flag && !d_flag)) {
+                fprintf(stderr, "ERROR: %s can only be passed when %s flag alone is passed. \n", arg, size_flag ? "-d" : "-s or -d");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: %s must follow immediately after %s. \n", size_flag ? "A size" : "A socket path", arg);
+                return -1;
+            }
+            if (!size_flag) {
+                shm_path = *(++current_arg);
+            } else if (parse_size(*(++current_arg), &shm_size) == -1 || shm_size > SHM_MAX_SIZE) {
+                fprintf(stderr, "ERROR: --shm-size expects a positive size of at most 16G. \n");
+                return -1;
+            }
+            continue;
+        }
+
+        // Check for --times (send the access and modification times of entries)
+        else if (arg_equals(arg, "--times")) {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: --times can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            global_options |= TRANSPLANT_TIMES;
+            continue;
+        }
+
+        // Check for --metadata-first (serialization only, every entry before any contents)
+        else if (arg_equals(arg, "--metadata-first")) {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: --metadata-first can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            global_options |= TRANSPLANT_METADATA_FIRST;
+            continue;
+        }
+
+        // Check for --format (serialization only, version of the wire format)
+        else if (arg_equals(arg, "--format")) {
+            if (!s_flag || d_flag) {
+                fprintf(stderr, "ERROR: --format can only be passed when -s flag alone is passed. \n");
+                return -1;
+            }
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: 1 or 2 must follow immediately after --format. \n");
+                return -1;
+            }
+            char *version = *(++current_arg);
+            if (arg_equals(version, "2")) {
+                global_options |= TRANSPLANT_FORMAT_V2;
+            } else if (arg_equals(version, "1")) {
+                global_options &= ~TRANSPLANT_FORMAT_V2;
+            } else {
+                fprintf(stderr, "ERROR: --format expects 1 or 2. \n");
+                return -1;
+            }
+            continue;
+        }
+
+        // Check for --watch (keep streaming changes with -s, keep applying them with -d)
+        else if (arg_equals(arg, "--watch")) {
+            global_options |= TRANSPLANT_WATCH;
+            continue;
+        }
+
+        // Check for --debounce (quiet time before a change set is sent)
+        else if (arg_equals(arg, "--debounce")) {
+            if (current_arg + 1 >= argv + argc) {
+                fprintf(stderr, "ERROR: A number of milliseconds must follow immediately after --debounce. \n");
+                return -1;
+            }
+            char *count = *(++current_arg);
+            char *end;
+            long milliseconds = strtol(count, &end, 10);
+            if (*count == '\0' || *end != '\0' || milliseconds > 60 * 60 * 1000 ||
+                transplant_set_debounce(ctx, milliseconds) == -1) {
+                fprintf(stderr, "ERROR: --debounce expects a number of milliseconds. \n");
+                return -1;
+            }
+            debounce_flag = 1;
+            continue;
+        }
+
         // Check for -p flag
         else if (*arg == '-' && *(arg + 1) == 'p' && *(arg + 2) == '\0') {
             // Ensure that -p is followed by a valid directory path
@@ -1297,10 +2001,24 @@ int validargs(int argc, char **argv) {
                 return -1; // Missing directory path after -p
             }
             dir_path = *(++current_arg); // Move to the next argument for the path - the path can be a flag as specified by piazza
+            if (s_flag && d_flag && p_flag) { // copy mode: the second -p names the destination
+                if (ctx->copy_target) {
+                    fprintf(stderr, "ERROR: Copy mode takes exactly two -p flags, the source and the destination. \n");
+                    return -1;
+                }
+                ctx->copy_target = dir_path;
+                continue;
+            }
+            if (d_flag && !s_flag && p_flag) { // deserialization: every other -p names one more target
+                if (fanout_add(ctx, dir_path) == -1) {
+                    return -1;
+                }
+                continue;
+            }
             p_flag = 1;
             // Copy the directory path into name_buf
-            char *buff_ptr = name_buf;
-            while (*dir_path != '\0' && buff_ptr < name_buf + NAME_MAX - 1) {
+            char *buff_ptr = ctx->name_buf;
+            while (*dir_path != '\0' && buff_ptr < ctx->name_buf + NAME_MAX - 1) {
                 *buff_ptr++ = *dir_path++;
             }
             *buff_ptr = '\0'; // Null-terminate the path
@@ -1316,8 +2034,8 @@ int validargs(int argc, char **argv) {
     if (!p_flag) {
         dir_path = ".";
         // Copy the directory path into name_buf as the current working directory
-        char *buff_ptr = name_buf;
-        while(*dir_path != '\0' && buff_ptr < name_buf + NAME_MAX - 1) {
+        char *buff_ptr = ctx->name_buf;
+        while(*dir_path != '\0' && buff_ptr < ctx->name_buf + NAME_MAX - 1) {
             *buff_ptr++ = *dir_path++;
         }
         *buff_ptr = '\0';
@@ -1333,6 +2051,69 @@ int validargs(int argc, char **argv) {
         fprintf(stderr, "ERROR: -c flag must only be set with -d flag. \n");
         return -1; // c flag must be used with d flag
     }
+    if ((global_options & TRANSPLANT_WATCH) && ((s_flag && d_flag) || (global_options & TRANSPLANT_SIGNATURE) || ctx->files_from)) {
+        fprintf(stderr, "ERROR: --watch can only be passed with -s or -d alone, and not with --signature or --files-from. \n");
+        return -1;
+    }
+    if (ctx->shards && ((global_options & (TRANSPLANT_WATCH | TRANSPLANT_SIGNATURE)) || ctx->signatures || ctx->files_from)) {
+        fprintf(stderr, "ERROR: --shard cannot be passed with --watch, --signature, --delta or --files-from. \n");
+        return -1;
+    }
+    if ((global_options & TRANSPLANT_METADATA_FIRST) && ((global_options & (TRANSPLANT_WATCH | TRANSPLANT_SIGNATURE)) ||
+                                                          ctx->signatures || ctx->files_from || ctx->shards || ctx->chunk_size)) {
+        fprintf(stderr, "ERROR: --metadata-first cannot be passed with --watch, --signature, --delta, --files-from, --shard or --chunk-size. \n");
+        return -1;
+    }
+    if ((global_options & TRANSPLANT_FORMAT_V2) && (global_options & TRANSPLANT_SIGNATURE)) {
+        fprintf(stderr, "ERROR: --format 2 cannot be passed with --signature. \n");
+        return -1;
+    }
+    if ((global_options & TRANSPLANT_SKIP_UNCHANGED) && !c_flag) {
+        fprintf(stderr, "ERROR: --skip-unchanged can only be passed with -c. \n");
+        return -1;
+    }
+    if ((global_options & TRANSPLANT_VERIFY) && !(global_options & TRANSPLANT_SKIP_UNCHANGED)) {
+        fprintf(stderr, "ERROR: --verify can only be passed with --skip-unchanged. \n");
+        return -1;
+    }
+    if ((global_options & TRANSPLANT_TIMES) && (global_options & TRANSPLANT_SIGNATURE)) {
+        fprintf(stderr, "ERROR: --times cannot be passed with --signature. \n");
+        return -1;
+    }
+    if (journal_interval != -1 && !journal_path) {
+        fprintf(stderr, "ERROR: --journal-interval can only be passed with --journal. \n");
+        return -1;
+    }
+    if (journal_path && (ctx->fanout || (global_options & TRANSPLANT_WATCH))) {
+        fprintf(stderr, "ERROR: --journal cannot be passed with several -p flags or --watch. \n");
+        return -1;
+    }
+    if ((global_options & TRANSPLANT_SALVAGE) && (journal_path || ctx->fanout)) {
+        fprintf(stderr, "ERROR: --salvage cannot be passed with --journal or several -p flags. \n");
+        return -1;
+    }
+    if (journal_path && transplant_set_journal(ctx, journal_path, journal_interval == -1 ? JOURNAL_INTERVAL_MS : journal_interval) == -1) {
+        return -1;
+    }
+    if (shm_size && !shm_path) {
+        fprintf(stderr, "ERROR: --shm-size can only be passed with --shm. \n");
+        return -1;
+    }
+    if (shm_path && ((global_options & TRANSPLANT_WATCH) || ctx->shards)) {
+        fprintf(stderr, "ERROR: --shm cannot be passed with --watch or --shard. \n");
+        return -1;
+    }
+    if (shm_path && transplant_set_shm(ctx, shm_path, shm_size) == -1) {
+        return -1;
+    }
+    if (debounce_flag && !(s_flag && !d_flag && (global_options & TRANSPLANT_WATCH))) {
+        fprintf(stderr, "ERROR: --debounce can only be passed with -s --watch. \n");
+        return -1;
+    }
+    if (s_flag && d_flag && !ctx->copy_target) {
+        fprintf(stderr, "ERROR: Copy mode (-s -d) needs a source and a destination: -p SRC -p DEST. \n");
+        return -1;
+    }
 
     return 0; // Validation successful
 }
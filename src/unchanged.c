@@ -0,0 +1,132 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "unchanged.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+static int write_all(int fd, char *buf, size_t count, off_t offset) {
+    while (count > 0) {
+        ssize_t n = pwrite(fd, buf, count, offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        count -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t count, off_t offset) {
+    while (count > 0) {
+        ssize_t n = pread(fd, buf, count, offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        count -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Read the size bytes of payload and compare them with the file open as in,
+ * block by block.  From the first block that differs on, the blocks are
+ * written to the file instead.  Returns 1 if the file was written to, 0 if
+ * it was identical, -1 on error.
+ */
+static int verify_contents(struct transplant_ctx *ctx, int in, uint64_t size) {
+    if (!ctx->compare_buf && !(ctx->compare_buf = malloc(DATA_BUF_SIZE))) {
+        fprintf(stderr, "ERROR: Out of memory. \n");
+        return -1;
+    }
+    int out = -1;
+    for (uint64_t offset = 0; offset < size; ) {
+        size_t want = size - offset < DATA_BUF_SIZE ? size - offset : DATA_BUF_SIZE;
+        if (tp_read(ctx, ctx->data_buf, want) == -1) {
+            fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read file contents in deserialize file. \n");
+            goto fail;
+        }
+        if (out == -1) {
+            if (read_all(in, ctx->compare_buf, want, offset) == 0 &&
+                __builtin_memcmp(ctx->data_buf, ctx->compare_buf, want) == 0) {
+                offset += want;
+                continue;
+            }
+            if ((out = open(ctx->path_buf, O_WRONLY)) == -1) {
+                fprintf(stderr, "ERROR: Failed to open %s to correct it. \n", ctx->path_buf);
+                goto fail;
+            }
+        }
+        if (write_all(out, ctx->data_buf, want, offset) == -1) {
+            fprintf(stderr, "ERROR: Failed to write file contents in deserialize file. \n");
+            goto fail;
+        }
+        offset += want;
+    }
+    if (out != -1 && close(out) == -1) {
+        fprintf(stderr, "ERROR: File failed to close in deserialize file. \n");
+        return -1;
+    }
+    return out != -1;
+
+fail:
+    if (out != -1) close(out);
+    return -1;
+}
+
+/*
+ * @brief  Leave the file named by path_buf as it is if it already has the
+ * contents of the FILE_DATA record whose header has just been read.
+ * @details  If it does, the payload is consumed, and the permissions and times
+ * from the DIRECTORY_ENTRY are applied if they differ, and the times if the
+ * file was corrected.
+ * Otherwise nothing is read and the file is to be written as usual.
+ * @param size  The size of the payload.
+ * @param permissions  The permissions to give the file, or -1.
+ * @param times  The times to give the file, or NULL.
+ * @return 1 if the file was handled, 0 if it must be written, -1 on error.
+ */
+int unchanged_file(struct transplant_ctx *ctx, uint64_t size, int permissions, struct entry_times *times) {
+    struct stat stat_buf;
+    if (lstat(ctx->path_buf, &stat_buf) == -1 || !S_ISREG(stat_buf.st_mode) || (uint64_t)stat_buf.st_size != size) {
+        return 0;
+    }
+    if (times && (stat_buf.st_mtim.tv_sec != times->mtime.tv_sec || stat_buf.st_mtim.tv_nsec != times->mtime.tv_nsec)) {
+        return 0;
+    }
+    int written = 0;
+    if (ctx->options & TRANSPLANT_VERIFY) {
+        int in = open(ctx->path_buf, O_RDONLY);
+        if (in == -1) {
+            return 0; // cannot be compared: rewritten
+        }
+        posix_fadvise(in, 0, size, POSIX_FADV_SEQUENTIAL);
+        written = verify_contents(ctx, in, size);
+        close(in);
+        if (written == -1) return -1;
+    } else if (tp_skip(ctx, size) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF character when attempting to read file contents in deserialize file. \n");
+        return -1;
+    }
+    if (permissions != -1 && (int)(stat_buf.st_mode & 07777) != permissions && chmod(ctx->path_buf, permissions) == -1) {
+        fprintf(stderr, "ERROR: Permissions of file written not correct. \n");
+        return -1;
+    }
+    if (times && written && utimensat(AT_FDCWD, ctx->path_buf, (struct timespec *)times, 0) == -1) {
+        fprintf(stderr, "ERROR: Failed to set the times of %s. \n", ctx->path_buf);
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,584 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "filter.h"
+#include "changes.h"
+#include "watch.h"
+#include "fanout.h"
+#include "wire.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct rename_op {
+    char *from;                 // relative to the root
+    char *to;
+    struct rename_op *next;
+};
+
+struct watch_state {
+    int fd;                     // inotify instance
+    char **dirs;                // relative path of the directory of each watch descriptor, or NULL
+    int dir_capacity;
+    int root_wd;
+    struct change_node root;
+    struct rename_op *renames;  // in the order they happened
+    struct rename_op **renames_tail;
+    int overflow;               // events were lost: the next change set is the whole tree
+    uint32_t move_cookie;       // an IN_MOVED_FROM not paired with its IN_MOVED_TO yet (0: none)
+    char *move_from;
+    int move_is_dir;
+};
+
+static char *dup_string(char *str) {
+    int length = len_string(str);
+    char *copy = malloc(length + 1);
+    if (copy) tp_copy(copy, str, length + 1);
+    return copy;
+}
+
+static char *join_path(char *dir, char *name) {
+    int dir_length = len_string(dir), name_length = len_string(name);
+    char *path = malloc(dir_length + 1 + name_length + 1);
+    if (!path) return NULL;
+    char *p = path;
+    if (dir_length > 0) {
+        tp_copy(p, dir, dir_length);
+        p += dir_length;
+        *p++ = '/';
+    }
+    tp_copy(p, name, name_length + 1);
+    return path;
+}
+
+/*
+ * If path is prefix or lies below it, return the rest of path (empty or
+ * starting with '/'); otherwise NULL.
+ */
+static char *below(char *path, char *prefix) {
+    while (*prefix != '\0' && *path == *prefix) {
+        path++;
+        prefix++;
+    }
+    if (*prefix != '\0' || (*path != '\0' && *path != '/')) return NULL;
+    return path;
+}
+
+/*
+ * Set path_buf to the root of the tree followed by a relative path.
+ */
+static int path_set(struct transplant_ctx *ctx, char *rel) {
+    char *dest = ctx->path_buf + ctx->root_length;
+    char *end = ctx->path_buf + PATH_MAX - 1;
+    if (*rel != '\0' && ctx->root_length > 0 && *(dest - 1) != '/') *dest++ = '/';
+    while (*rel != '\0' && dest < end) *dest++ = *rel++;
+    if (*rel != '\0') {
+        fprintf(stderr, "ERROR: Path of changed entry is too long. \n");
+        return -1;
+    }
+    *dest = '\0';
+    ctx->path_length = dest - ctx->path_buf;
+    return 0;
+}
+
+static int set_dir(struct watch_state *state, int wd, char *rel) {
+    if (wd >= state->dir_capacity) {
+        int capacity = state->dir_capacity ? state->dir_capacity : 64;
+        while (capacity <= wd) capacity *= 2;
+        char **dirs = realloc(state->dirs, capacity * sizeof(char *));
+        if (!dirs) {
+            fprintf(stderr, "ERROR: Out of memory watching the tree. \n");
+            return -1;
+        }
+        for (char **p = dirs + state->dir_capacity; p < dirs + capacity; p++) *p = NULL;
+        state->dirs = dirs;
+        state->dir_capacity = capacity;
+    }
+    char *copy = dup_string(rel);
+    if (!copy) return -1;
+    free(*(state->dirs + wd));
+    *(state->dirs + wd) = copy;
+    return 0;
+}
+
+/*
+ * Watch the directory named by path_buf, whose relative path is rel, and
+ * every directory below it.
+ */
+static int add_watches(struct watch_state *state, struct transplant_ctx *ctx, char *rel) {
+    int wd = inotify_add_watch(state->fd, ctx->path_buf, WATCH_MASK);
+    if (wd == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) return 0; // already gone: the change set says so
+        fprintf(stderr, errno == ENOSPC ? "ERROR: Too many directories to watch %s (see fs.inotify.max_user_watches). \n"
+                                        : "ERROR: Failed to watch directory %s. \n", ctx->path_buf);
+        return -1;
+    }
+    if (set_dir(state, wd, rel) == -1) return -1;
+
+    DIR *dir = opendir(ctx->path_buf);
+    if (!dir) return 0;
+    struct dirent *de;
+    int ret = 0;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        if (*(de->d_name) == '.' && (*(de->d_name + 1) == '\0' || (*(de->d_name + 1) == '.' && *(de->d_name + 2) == '\0'))) {
+            continue;
+        }
+        if (filter_excluded(&ctx->filters, de->d_name) || tp_path_push(ctx, de->d_name) == -1) {
+            continue;
+        }
+        struct stat stat_buf;
+        if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN && lstat(ctx->path_buf, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode))) {
+            char *child = join_path(rel, de->d_name);
+            ret = child ? add_watches(state, ctx, child) : -1;
+            free(child);
+        }
+        tp_path_pop(ctx);
+    }
+    closedir(dir);
+    return ret;
+}
+
+/*
+ * Forget the watches of a directory that left the tree, and of its subdirectories.
+ */
+static void remove_watches(struct watch_state *state, char *rel) {
+    for (int wd = 0; wd < state->dir_capacity; wd++) {
+        char *dir = *(state->dirs + wd);
+        if (dir && wd != state->root_wd && below(dir, rel)) {
+            inotify_rm_watch(state->fd, wd);
+            free(dir);
+            *(state->dirs + wd) = NULL;
+        }
+    }
+}
+
+/*
+ * A directory was renamed inside the tree: its watches stay, their paths change.
+ */
+static int move_watches(struct watch_state *state, char *from, char *to) {
+    for (int wd = 0; wd < state->dir_capacity; wd++) {
+        char *dir = *(state->dirs + wd);
+        char *rest = dir ? below(dir, from) : NULL;
+        if (!rest || wd == state->root_wd) continue;
+        int to_length = len_string(to), rest_length = len_string(rest);
+        char *path = malloc(to_length + rest_length + 1);
+        if (!path) return -1;
+        tp_copy(path, to, to_length);
+        tp_copy(path + to_length, rest, rest_length + 1);
+        free(dir);
+        *(state->dirs + wd) = path;
+    }
+    return 0;
+}
+
+/*
+ * An IN_MOVED_FROM was not followed by its IN_MOVED_TO: the entry left the tree.
+ */
+static int finish_move(struct watch_state *state) {
+    if (!state->move_cookie) return 0;
+    int ret = change_mark(&state->root, state->move_from, CHANGE_ENTRY);
+    if (state->move_is_dir) remove_watches(state, state->move_from);
+    free(state->move_from);
+    state->move_from = NULL;
+    state->move_cookie = 0;
+    return ret;
+}
+
+/*
+ * An entry was renamed inside the tree.  The receiver renames it too, so only
+ * the changes recorded under the old name are sent, under the new one.
+ */
+static int record_rename(struct watch_state *state, char *to) {
+    char *from = state->move_from;
+    struct rename_op *op = malloc(sizeof(struct rename_op));
+    if (!op) return -1;
+    op->from = from;
+    op->to = dup_string(to);
+    op->next = NULL;
+    *state->renames_tail = op;
+    state->renames_tail = &op->next;
+    state->move_from = NULL;
+    state->move_cookie = 0;
+    if (!op->to) return -1;
+
+    struct change_node *moved = change_detach(&state->root, from);
+    change_free(change_detach(&state->root, to));
+    if (moved && change_attach(&state->root, to, moved) == -1) {
+        return -1;
+    }
+    return state->move_is_dir ? move_watches(state, from, to) : 0;
+}
+
+static int handle_event(struct watch_state *state, struct transplant_ctx *ctx, struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        state->overflow = 1;
+        return 0;
+    }
+    int pairs = (event->mask & IN_MOVED_TO) && event->cookie == state->move_cookie;
+    if (!pairs && finish_move(state) == -1) {
+        return -1;
+    }
+    if (event->wd == state->root_wd && (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) {
+        fprintf(stderr, "ERROR: The watched directory %.*s was removed or moved. \n", ctx->root_length, ctx->path_buf);
+        return -1;
+    }
+    if (event->wd < 0 || event->wd >= state->dir_capacity || !*(state->dirs + event->wd)) {
+        return 0; // a directory that has left the tree
+    }
+    if (event->mask & IN_IGNORED) {
+        free(*(state->dirs + event->wd));
+        *(state->dirs + event->wd) = NULL;
+        return 0;
+    }
+    if (event->len == 0 || filter_excluded(&ctx->filters, event->name)) {
+        return 0; // changes to a directory itself are also reported by its parent
+    }
+
+    char *rel = join_path(*(state->dirs + event->wd), event->name);
+    if (!rel) return -1;
+    int ret = 0;
+    if (event->mask & IN_MOVED_FROM) {
+        state->move_cookie = event->cookie ? event->cookie : 1;
+        state->move_from = rel;
+        state->move_is_dir = (event->mask & IN_ISDIR) != 0;
+        return 0;
+    } else if (pairs) {
+        ret = record_rename(state, rel);
+    } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        ret = change_mark(&state->root, rel, CHANGE_ENTRY | CHANGE_REPLACE | CHANGE_TREE);
+        if (ret == 0 && (event->mask & IN_ISDIR)) {
+            ret = path_set(ctx, rel);
+            if (ret == 0) ret = add_watches(state, ctx, rel);
+            path_set(ctx, "");
+        }
+    } else {
+        ret = change_mark(&state->root, rel, CHANGE_ENTRY);
+    }
+    free(rel);
+    return ret;
+}
+
+static void clear_changes(struct watch_state *state) {
+    change_free(state->root.children);
+    state->root.children = NULL;
+    state->overflow = 0;
+    while (state->renames) {
+        struct rename_op *next = state->renames->next;
+        free(state->renames->from);
+        free(state->renames->to);
+        free(state->renames);
+        state->renames = next;
+    }
+    state->renames_tail = &state->renames;
+}
+
+/*
+ * Write the change set as one transmission and start a new one.
+ */
+static int emit_changes(struct watch_state *state, struct transplant_ctx *ctx) {
+    int ret = finish_move(state);
+    if (ret == 0 && state->overflow) {
+        fprintf(stderr, "WARNING: Too many changes at once, sending the whole tree again (removals are not replicated). \n");
+        ret = tp_serialize(ctx);
+    } else if (ret == 0) {
+        ret = tp_write_record_header(ctx, 0, 0, 16); // START_OF_TRANSMISSION
+        if (ret == 0) ret = tp_write_record_header(ctx, 2, 1, 16); // START_OF_DIRECTORY
+        for (struct rename_op *op = state->renames; op && ret == 0; op = op->next) {
+            int from_length = len_string(op->from), to_length = len_string(op->to);
+            ret = tp_write_record_header(ctx, RENAME_TYPE, 1, 16 + from_length + 1 + to_length);
+            if (ret == 0) ret = tp_write(ctx, op->from, from_length + 1);
+            if (ret == 0) ret = tp_write(ctx, op->to, to_length);
+        }
+        if (ret == 0) ret = change_emit(ctx, &state->root, 1);
+        if (ret == 0) ret = tp_write_record_header(ctx, 3, 1, 16); // END_OF_DIRECTORY
+        if (ret == 0) ret = tp_write_record_header(ctx, 1, 0, 16); // END_OF_TRANSMISSION
+        if (ret == 0) ret = tp_flush(ctx);
+    }
+
+    clear_changes(state);
+    return ret;
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int watch_loop(struct watch_state *state, struct transplant_ctx *ctx, volatile int *stop) {
+    char *events = malloc(64 * 1024);
+    if (!events) return -1;
+    int debounce = ctx->watch_debounce_ms;
+    int pending = 0;
+    long first_change = 0;
+    int ret = 0;
+    while (ret == 0 && !(stop && *stop)) {
+        struct pollfd pfd = { state->fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, pending ? debounce : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ERROR: Failed to wait for changes. \n");
+            ret = -1;
+            break;
+        }
+        if (ready == 0) { // quiet for a whole debounce window
+            ret = emit_changes(state, ctx);
+            pending = 0;
+            continue;
+        }
+        ssize_t n = read(state->fd, events, 64 * 1024);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            fprintf(stderr, "ERROR: Failed to read change events. \n");
+            ret = -1;
+            break;
+        }
+        for (char *p = events; p < events + n && ret == 0; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            ret = handle_event(state, ctx, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (!pending) {
+            pending = 1;
+            first_change = now_ms();
+        }
+        if (ret == 0 && now_ms() - first_change >= (long)debounce * WATCH_MAX_DELAY_FACTOR) {
+            ret = emit_changes(state, ctx); // never quiet: do not let the replica fall behind forever
+            pending = 0;
+        }
+    }
+    if (ret == 0 && pending) {
+        ret = emit_changes(state, ctx);
+    }
+    free(events);
+    return ret;
+}
+
+/*
+ * @brief  Serialize the tree below the path of the context, then keep writing
+ * the changes made to it as further transmissions.
+ * @details  The watches are set up before the tree is first walked, so that
+ * nothing that changes during the walk is missed.  Change sets are written
+ * once no change has happened for the debounce window of the context, and
+ * file contents in them are always chunked.  A delta base only applies to the
+ * first transmission.
+ *
+ * @param stop  Watching ends, after the pending changes are written, when
+ * *stop becomes nonzero (e.g. from a signal handler); may be NULL.
+ * @return 0 if watching was stopped, -1 if an error occurs.
+ */
+int transplant_watch(struct transplant_ctx *ctx, volatile int *stop) {
+    struct watch_state state = {0};
+    state.renames_tail = &state.renames;
+    state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (state.fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create an inotify instance. \n");
+        return -1;
+    }
+    ctx->root_length = ctx->path_length;
+    int ret = add_watches(&state, ctx, "");
+    state.root_wd = -1;
+    for (int wd = 0; wd < state.dir_capacity; wd++) {
+        if (*(state.dirs + wd) && **(state.dirs + wd) == '\0') state.root_wd = wd;
+    }
+    if (ret == 0 && state.root_wd == -1) {
+        fprintf(stderr, "ERROR: Failed to watch directory %s. \n", ctx->path_buf);
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = tp_serialize(ctx);
+    }
+    transplant_set_delta_base(ctx, NULL); // the receiver has moved on from the old tree
+    if (ret == 0 && !ctx->chunk_size) {
+        ret = transplant_set_chunk_size(ctx, WATCH_CHUNK_SIZE);
+    }
+    if (ret == 0) {
+        ret = watch_loop(&state, ctx, stop);
+    }
+
+    close(state.fd);
+    for (int wd = 0; wd < state.dir_capacity; wd++) free(*(state.dirs + wd));
+    free(state.dirs);
+    free(state.move_from);
+    clear_changes(&state);
+    return ret;
+}
+
+/*
+ * Remove the entry named by path_buf, with everything below it if it is a
+ * directory.  An entry that does not exist is not an error.
+ */
+int watch_remove_tree(struct transplant_ctx *ctx) {
+    struct stat stat_buf;
+    if (lstat(ctx->path_buf, &stat_buf) == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISDIR(stat_buf.st_mode)) {
+        return unlink(ctx->path_buf);
+    }
+    DIR *dir = opendir(ctx->path_buf);
+    if (!dir) return -1;
+    struct dirent *de;
+    int ret = 0;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        if (*(de->d_name) == '.' && (*(de->d_name + 1) == '\0' || (*(de->d_name + 1) == '.' && *(de->d_name + 2) == '\0'))) {
+            continue;
+        }
+        ret = tp_path_push(ctx, de->d_name);
+        if (ret == 0) {
+            ret = watch_remove_tree(ctx);
+            tp_path_pop(ctx);
+        }
+    }
+    closedir(dir);
+    return ret == 0 ? rmdir(ctx->path_buf) : -1;
+}
+
+/*
+ * @brief  Apply a REMOVE record whose type and depth have been read.
+ * @details  The entry it names in the directory of path_buf is removed, with
+ * all its contents; it need not exist.  Like any other change to an existing
+ * entry, this requires the clobber flag.
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int deserialize_remove(struct transplant_ctx *ctx, int depth) {
+    uint64_t size;
+    if (wire_read_size(ctx, &size) == -1 || size <= 16 || size - 16 >= NAME_MAX ||
+        tp_read(ctx, ctx->name_buf, size - 16) == -1) {
+        fprintf(stderr, "ERROR: Invalid REMOVE record. \n");
+        return -1;
+    }
+    *(ctx->name_buf + (size - 16)) = '\0';
+    if (*ctx->name_buf == '.' && (*(ctx->name_buf + 1) == '\0' || (*(ctx->name_buf + 1) == '.' && *(ctx->name_buf + 2) == '\0'))) {
+        fprintf(stderr, "ERROR: Invalid name in REMOVE record. \n");
+        return -1;
+    }
+    if (!(ctx->options & TRANSPLANT_CLOBBER)) {
+        fprintf(stderr, "ERROR: A REMOVE record for %s was read, but the clobber flag was not passed so cannot remove.\n", ctx->name_buf);
+        return -1;
+    }
+    if (tp_path_push(ctx, ctx->name_buf) == -1) {
+        return -1;
+    }
+    int ret = watch_remove_tree(ctx);
+    if (ret == -1) {
+        fprintf(stderr, "ERROR: Failed to remove %s. \n", ctx->path_buf);
+    } else if (ctx->fanout) {
+        ret = fanout_remove(ctx);
+    }
+    tp_path_pop(ctx);
+    return ret;
+}
+
+/*
+ * A relative path from the stream must stay inside the tree.
+ */
+static int safe_relative_path(char *path, char *end) {
+    if (path == end || *path == '/') return 0;
+    for (char *segment = path; segment < end; ) {
+        char *segment_end = segment;
+        while (segment_end < end && *segment_end != '/') segment_end++;
+        long length = segment_end - segment;
+        if (length == 0 || (length == 1 && *segment == '.') || (length == 2 && *segment == '.' && *(segment + 1) == '.')) {
+            return 0;
+        }
+        segment = segment_end + 1;
+    }
+    return 1;
+}
+
+/*
+ * @brief  Rename an entry of the tree whose root is path_buf, as a RENAME
+ * record says; see deserialize_rename().
+ * @param from  The old path, relative to the root.
+ * @param to  The new path, relative to the root.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int watch_apply_rename(struct transplant_ctx *ctx, char *from, char *to) {
+    // The old path is built in link_buf, the new one in path_buf after the root
+    int root_length = ctx->path_length;
+    int from_length = len_string(from), to_length = len_string(to);
+    if (root_length + 1 + from_length >= PATH_MAX || root_length + 1 + to_length >= PATH_MAX) {
+        fprintf(stderr, "ERROR: Path in RENAME record is too long. \n");
+        return -1;
+    }
+    tp_copy(ctx->link_buf, ctx->path_buf, root_length);
+    *(ctx->link_buf + root_length) = '/';
+    tp_copy(ctx->link_buf + root_length + 1, from, from_length + 1);
+    *(ctx->path_buf + root_length) = '/';
+    tp_copy(ctx->path_buf + root_length + 1, to, to_length + 1);
+    ctx->path_length = root_length + 1 + to_length;
+
+    int ret = 0;
+    struct stat stat_buf;
+    if (rename(ctx->link_buf, ctx->path_buf) == -1) {
+        if (errno != ENOENT) {
+            // Something else is in the way, e.g. a directory that is not empty
+            ret = watch_remove_tree(ctx);
+            if (ret == 0) ret = rename(ctx->link_buf, ctx->path_buf);
+        } else if (lstat(ctx->link_buf, &stat_buf) == 0) {
+            // The new parent was created in the same change set, which sends it in full
+            tp_copy(ctx->path_buf + root_length + 1, from, from_length + 1);
+            ctx->path_length = root_length + 1 + from_length;
+            ret = watch_remove_tree(ctx);
+        }
+        if (ret == -1) {
+            fprintf(stderr, "ERROR: Failed to rename %s to %s. \n", from, to);
+        }
+    }
+    *(ctx->path_buf + root_length) = '\0';
+    ctx->path_length = root_length;
+    return ret;
+}
+
+/*
+ * @brief  Apply a RENAME record whose type and depth have been read.
+ * @details  path_buf must be the root of the tree.  An entry already at the
+ * new path is replaced.  If the old path does not exist, the entry was created
+ * in the same change set, and if the new parent does not, so was the parent;
+ * either way the entry is sent in full after the record, so nothing is
+ * renamed.  Like any other change to an existing entry, this requires the
+ * clobber flag.
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int deserialize_rename(struct transplant_ctx *ctx, int depth) {
+    uint64_t size;
+    if (depth != 1 || wire_read_size(ctx, &size) == -1 || size < 16 + 3 || size - 16 > 2 * PATH_MAX ||
+        tp_read(ctx, ctx->data_buf, size - 16) == -1) {
+        fprintf(stderr, "ERROR: Invalid RENAME record. \n");
+        return -1;
+    }
+    char *from = ctx->data_buf, *end = ctx->data_buf + (size - 16);
+    char *to = from;
+    while (to < end && *to != '\0') to++;
+    if (to == end || !safe_relative_path(from, to) || !safe_relative_path(to + 1, end)) {
+        fprintf(stderr, "ERROR: Invalid paths in RENAME record. \n");
+        return -1;
+    }
+    to++;
+    *end = '\0';
+    if (!(ctx->options & TRANSPLANT_CLOBBER)) {
+        fprintf(stderr, "ERROR: A RENAME record for %s was read, but the clobber flag was not passed so cannot rename.\n", from);
+        return -1;
+    }
+
+    if (watch_apply_rename(ctx, from, to) == -1) {
+        return -1;
+    }
+    return ctx->fanout ? fanout_rename(ctx, from, to) : 0;
+}
@@ -0,0 +1,249 @@
+#include "global.h"
+#include "debug.h"
+#include "context.h"
+#include "wire.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#define VARINT_MAX 10 // bytes of the longest 64-bit varint
+
+static int varint_length(uint64_t value) {
+    int length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+static int put_varint(struct transplant_ctx *ctx, uint64_t value) {
+    while (value >= 0x80) {
+        if (tp_putc(ctx, (value & 0x7F) | 0x80) == EOF) return -1;
+        value >>= 7;
+    }
+    return tp_putc(ctx, value) == EOF ? -1 : 0;
+}
+
+/*
+ * Read a varint, adding the number of bytes it took to *count.
+ */
+static int get_varint(struct transplant_ctx *ctx, uint64_t *value, uint64_t *count) {
+    *value = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        (*count)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1; // longer than any 64-bit value
+}
+
+/*
+ * Read a big-endian number of count bytes, as in version 1.
+ */
+static int get_fixed(struct transplant_ctx *ctx, uint64_t *value, int count) {
+    *value = 0;
+    for (int i = 0; i < count; i++) {
+        int byte = debug_getchar(ctx);
+        if (byte == EOF) return -1;
+        *value = (*value << 8) | byte;
+    }
+    return 0;
+}
+
+/*
+ * The name of the previous entry of the directory whose entries are at depth
+ * (NAME_MAX bytes), made room for if needed.
+ */
+static char *name_slot(struct transplant_ctx *ctx, int depth) {
+    if (depth >= ctx->wire_names_count) {
+        int count = depth * 2 + 8;
+        char *bigger = realloc(ctx->wire_names, (size_t)count * NAME_MAX);
+        if (!bigger) {
+            fprintf(stderr, "ERROR: Out of memory. \n");
+            return NULL;
+        }
+        for (int slot = ctx->wire_names_count; slot < count; slot++) {
+            *(bigger + (size_t)slot * NAME_MAX) = '\0';
+        }
+        ctx->wire_names = bigger;
+        ctx->wire_names_count = count;
+    }
+    return ctx->wire_names + (size_t)depth * NAME_MAX;
+}
+
+/*
+ * @brief  Write the START_OF_TRANSMISSION record of a version 2 transmission.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int wire_write_start(struct transplant_ctx *ctx) {
+    uint64_t size = WIRE_START_SIZE;
+    int ret = (tp_putc(ctx, 0x0C) == EOF || tp_putc(ctx, 0x0D) == EOF || tp_putc(ctx, 0xED) == EOF ||
+               tp_putc(ctx, 0) == EOF) ? -1 : 0;
+    for (int i = 0; ret == 0 && i < 4; i++) {
+        if (tp_putc(ctx, 0) == EOF) ret = -1; // depth 0
+    }
+    for (int i = 7; ret == 0 && i >= 0; i--) {
+        if (tp_putc(ctx, (size >> (i * 8)) & 0xFF) == EOF) ret = -1;
+    }
+    if (ret == -1 || tp_putc(ctx, WIRE_V2) == EOF) {
+        fprintf(stderr, "ERROR: Unexpected EOF writing START OF TRANSMISSION. \n");
+        return -1;
+    }
+    ctx->wire_depth = 0;
+    return 0;
+}
+
+/*
+ * @brief  Write the header of a record in version 2.
+ * @param size  The total size of the record, as if its header took 16 bytes.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int wire_write_header(struct transplant_ctx *ctx, int type, int depth, uint64_t size) {
+    int64_t delta = (int64_t)depth - ctx->wire_depth;
+    uint64_t zigzag = delta < 0 ? ((uint64_t)-delta << 1) - 1 : (uint64_t)delta << 1;
+    if (put_varint(ctx, type) == -1 || put_varint(ctx, zigzag) == -1 || put_varint(ctx, size - 16) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF when writing the header of record type %d. \n", type);
+        return -1;
+    }
+    ctx->wire_depth = depth;
+    if (type == 2) { // START_OF_DIRECTORY: its first entry shares nothing
+        char *slot = name_slot(ctx, depth);
+        if (!slot) return -1;
+        *slot = '\0';
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write a DIRECTORY_ENTRY record in version 2, its name compressed
+ * against the previous entry of the same directory.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int wire_write_entry(struct transplant_ctx *ctx, int depth, char *name, uint32_t mode, uint64_t size) {
+    char *slot = name_slot(ctx, depth);
+    if (!slot) {
+        return -1;
+    }
+    int name_length = len_string(name);
+    if (name_length >= NAME_MAX) {
+        fprintf(stderr, "ERROR: Name of %s is too long. \n", name);
+        return -1;
+    }
+    int prefix = 0;
+    while (prefix < name_length && *(slot + prefix) == *(name + prefix)) prefix++;
+    uint64_t payload = varint_length(mode) + varint_length(size) + varint_length(prefix) + (name_length - prefix);
+    if (wire_write_header(ctx, 4, depth, 16 + payload) == -1 ||
+        put_varint(ctx, mode) == -1 || put_varint(ctx, size) == -1 || put_varint(ctx, prefix) == -1 ||
+        tp_write(ctx, name + prefix, name_length - prefix) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF when writing the entry of %s. \n", name);
+        return -1;
+    }
+    tp_copy(slot, name, name_length + 1);
+    return 0;
+}
+
+/*
+ * @brief  Read the header of a record in version 2 (check_while_condition()).
+ * @details  The size is kept for wire_read_size().
+ * @param depth  The depth the record must have.
+ * @return The type of the record, or -1 in case of an error.
+ */
+int wire_read_header(struct transplant_ctx *ctx, int depth) {
+    uint64_t type, zigzag, payload, count = 0;
+    if (get_varint(ctx, &type, &count) == -1 || get_varint(ctx, &zigzag, &count) == -1 ||
+        get_varint(ctx, &payload, &count) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF or invalid varint when reading a record header. \n");
+        return -1;
+    }
+    int64_t delta = (zigzag & 1) ? -(int64_t)((zigzag + 1) >> 1) : (int64_t)(zigzag >> 1);
+    if (type > 0xFF || ctx->wire_depth + delta != depth) {
+        fprintf(stderr, "ERROR: The depth parsed does not match the expected depth in checking of while condition. \n");
+        return -1;
+    }
+    if (payload > UINT64_MAX - 16) {
+        fprintf(stderr, "ERROR: Invalid size of record type %d. \n", (int)type);
+        return -1;
+    }
+    ctx->wire_depth = depth;
+    ctx->record_size = payload + 16;
+    if (type == 2) { // START_OF_DIRECTORY: its first entry shares nothing
+        char *slot = name_slot(ctx, depth);
+        if (!slot) return -1;
+        *slot = '\0';
+    }
+    return type;
+}
+
+/*
+ * @brief  Read the size of a record whose header has been read with
+ * check_while_condition(): the 8 bytes that follow in version 1, the size
+ * already read in version 2.
+ * @param size  Set to the total size of the record, 16 bytes of header included.
+ * @return 0 in case of success, -1 at end of input.
+ */
+int wire_read_size(struct transplant_ctx *ctx, uint64_t *size) {
+    if (ctx->wire_version == WIRE_V2) {
+        *size = ctx->record_size;
+        return 0;
+    }
+    return get_fixed(ctx, size, 8);
+}
+
+/*
+ * @brief  Read the rest of a DIRECTORY_ENTRY record whose type and depth have
+ * been read, in either version.
+ * @details  The name is left in name_buf.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int wire_read_entry(struct transplant_ctx *ctx, int depth, uint32_t *mode, uint64_t *size) {
+    uint64_t total;
+    if (wire_read_size(ctx, &total) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF character when reading the size of DIRECTORY ENTRY record. \n");
+        return -1;
+    }
+    if (ctx->wire_version != WIRE_V2) {
+        uint64_t mode_value;
+        if (total <= 16 + 12 || total - 16 - 12 >= NAME_MAX) {
+            fprintf(stderr, "ERROR: Invalid size of DIRECTORY ENTRY record. \n");
+            return -1;
+        }
+        if (get_fixed(ctx, &mode_value, 4) == -1 || get_fixed(ctx, size, 8) == -1 ||
+            tp_read(ctx, ctx->name_buf, total - 16 - 12) == -1) {
+            fprintf(stderr, "ERROR: Unexpected EOF character when reading DIRECTORY ENTRY record. \n");
+            return -1;
+        }
+        *mode = mode_value;
+        *(ctx->name_buf + (total - 16 - 12)) = '\0';
+        return 0;
+    }
+
+    char *slot = name_slot(ctx, depth);
+    uint64_t mode_value, prefix, count = 0;
+    if (!slot || get_varint(ctx, &mode_value, &count) == -1 || get_varint(ctx, size, &count) == -1 ||
+        get_varint(ctx, &prefix, &count) == -1 || count > total - 16 || mode_value > UINT32_MAX ||
+        prefix > (uint64_t)len_string(slot)) {
+        fprintf(stderr, "ERROR: Invalid DIRECTORY ENTRY record. \n");
+        return -1;
+    }
+    uint64_t suffix = total - 16 - count;
+    if (prefix + suffix == 0 || prefix + suffix >= NAME_MAX) {
+        fprintf(stderr, "ERROR: Invalid size of DIRECTORY ENTRY record. \n");
+        return -1;
+    }
+    *mode = mode_value;
+    tp_copy(ctx->name_buf, slot, prefix);
+    if (tp_read(ctx, ctx->name_buf + prefix, suffix) == -1) {
+        fprintf(stderr, "ERROR: Unexpected EOF character when reading component name from DIRECTORY ENTRY. \n");
+        return -1;
+    }
+    *(ctx->name_buf + prefix + suffix) = '\0';
+    tp_copy(slot, ctx->name_buf, prefix + suffix + 1);
+    return 0;
+}
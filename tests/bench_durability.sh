@@ -0,0 +1,51 @@
+#!/bin/sh
+# Compare the --durability modes on a restore of many small files.
+#
+#   tests/bench_durability.sh [FILES [SIZE [DIR [RUNS]]]]
+#
+# Builds a tree of FILES files (default 1000000) of SIZE bytes (default 200),
+# 1000 to a directory, under DIR (default /tmp, which must be on the disk to
+# measure, not tmpfs), serializes it once, and restores it RUNS times (default
+# 3) in each mode.  Every restore starts from a synced filesystem.  "none+sync"
+# is a restore in mode none followed by sync(1): the cost of making it
+# durable by hand, which is what batched is to be compared with.  Prints the
+# wall time of every run in seconds.
+
+FILES=${1:-1000000}
+SIZE=${2:-200}
+DIR=${3:-/tmp}
+RUNS=${4:-3}
+BIN=$(dirname "$0")/../bin/transplant
+WORK=$DIR/transplant_bench_durability
+
+now() { date +%s.%N; }
+
+rm -rf "$WORK" && mkdir -p "$WORK/src" "$WORK/out" || exit 1
+data=$(head -c "$SIZE" /dev/zero | tr '\0' x)
+i=0
+while [ "$i" -lt "$FILES" ]; do
+    d=$WORK/src/d$((i / 1000))
+    [ -d "$d" ] || mkdir "$d"
+    printf '%s' "$data" > "$d/f$i" || { echo "cannot create the tree in $WORK" >&2; exit 1; }
+    i=$((i + 1))
+done
+"$BIN" -s -p "$WORK/src" > "$WORK/stream" || exit 1
+
+echo "files=$FILES size=$SIZE dir=$DIR"
+for mode in none none+sync batched per-file; do
+    printf '%-10s' "$mode"
+    run=0
+    while [ "$run" -lt "$RUNS" ]; do
+        rm -rf "$WORK/out" && mkdir "$WORK/out" && sync
+        start=$(now)
+        case $mode in
+            none+sync) "$BIN" -d -p "$WORK/out" --durability none < "$WORK/stream" && sync ;;
+            *)         "$BIN" -d -p "$WORK/out" --durability "$mode" < "$WORK/stream" ;;
+        esac || exit 1
+        end=$(now)
+        awk -v start="$start" -v end="$end" 'BEGIN { printf " %8.2f", end - start }'
+        run=$((run + 1))
+    done
+    echo
+done
+rm -rf "$WORK"
@@ -1,6 +1,14 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
 #include "global.h"
+#include "filter.h"
+#include "context.h"
+#include "transplant.h"
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 Test(basecode_tests_suite, validargs_help_test) {
     int argc = 2;
@@ -47,4 +55,641 @@ Test(basecode_tests_suite, help_system_test) {
     cr_assert_eq(return_code, EXIT_SUCCESS,
                  "Program exited with %d instead of EXIT_SUCCESS",
 		 return_code);
-}
\ No newline at end of file
+}
+Test(basecode_tests_suite, symlink_cycle_system_test) {
+    // a link back to the parent must be recorded as a link, not traversed
+    char *cmd = "rm -rf /tmp/transplant_symlink_in /tmp/transplant_symlink_out && "
+                "mkdir -p /tmp/transplant_symlink_in/sub /tmp/transplant_symlink_out && "
+                "ln -s .. /tmp/transplant_symlink_in/sub/loop && "
+                "bin/transplant -s -p /tmp/transplant_symlink_in | bin/transplant -d -p /tmp/transplant_symlink_out && "
+                "test \"$(readlink /tmp/transplant_symlink_out/sub/loop)\" = \"..\"";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Symbolic link was not transplanted as a link (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, validargs_filter_test) {
+    int argc = 6;
+    char *argv[] = {"bin/transplant", "-s", "--include", "keep.o", "--exclude", "*.o", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+    struct filter_set *filters = &global_context()->filters;
+    cr_assert_eq(filter_count(filters), 2, "Expected 2 filter rules. Got: %d", filter_count(filters));
+    cr_assert(filter_excluded(filters, "main.o"), "main.o should have been excluded");
+    cr_assert(!filter_excluded(filters, "keep.o"), "keep.o matched --include first and should be kept");
+    cr_assert(!filter_excluded(filters, "main.c"), "main.c matched no rule and should be kept");
+}
+
+Test(basecode_tests_suite, validargs_filter_error_test) {
+    int argc = 4;
+    char *argv[] = {"bin/transplant", "-d", "--exclude", ".git", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = -1;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+}
+
+Test(basecode_tests_suite, parallel_scan_system_test) {
+    // the parallel scan must produce exactly the bytes of the sequential walk
+    char *cmd = "bin/transplant -s -p rsrc/testdir > /tmp/transplant_scan_seq && "
+                "bin/transplant -s -j 4 -p rsrc/testdir > /tmp/transplant_scan_par && "
+                "cmp /tmp/transplant_scan_seq /tmp/transplant_scan_par";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Output of -j 4 differs from the sequential output (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, validargs_drop_cache_test) {
+    int argc = 5;
+    char *argv[] = {"bin/transplant", "-d", "-c", "--drop-cache", NULL};
+    int ret = validargs(argc - 1, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int flag = 0x10;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+    cr_assert_eq(opt & flag, flag, "Correct bit (0x10) not set for --drop-cache. Got: %x", opt);
+}
+
+Test(basecode_tests_suite, direct_io_system_test) {
+    // O_DIRECT must not change the stream, including for a file with an unaligned tail
+    char *cmd = "rm -rf /tmp/transplant_direct_in /tmp/transplant_direct_out && "
+                "mkdir -p /tmp/transplant_direct_in /tmp/transplant_direct_out && "
+                "head -c 1000003 /dev/urandom > /tmp/transplant_direct_in/data && "
+                "bin/transplant -s -p /tmp/transplant_direct_in > /tmp/transplant_direct_plain && "
+                "bin/transplant -s -p /tmp/transplant_direct_in --direct-io 4K > /tmp/transplant_direct_odirect && "
+                "cmp /tmp/transplant_direct_plain /tmp/transplant_direct_odirect && "
+                "bin/transplant -d -p /tmp/transplant_direct_out --direct-io 4K < /tmp/transplant_direct_odirect && "
+                "cmp /tmp/transplant_direct_in/data /tmp/transplant_direct_out/data";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Direct I/O changed the serialized data or the restored file (exit %d)",
+		 return_code);
+}
+
+struct test_buffer {
+    char data[1 << 20];
+    size_t length;
+    size_t position;
+};
+
+static ssize_t test_buffer_write(void *arg, const void *buf, size_t count) {
+    struct test_buffer *tb = arg;
+    if (count > sizeof(tb->data) - tb->length) return -1;
+    tp_copy(tb->data + tb->length, buf, count);
+    tb->length += count;
+    return count;
+}
+
+static ssize_t test_buffer_read(void *arg, void *buf, size_t count) {
+    struct test_buffer *tb = arg;
+    if (count > tb->length - tb->position) count = tb->length - tb->position;
+    tp_copy(buf, tb->data + tb->position, count);
+    tb->position += count;
+    return count;
+}
+
+Test(basecode_tests_suite, library_context_test) {
+    // two contexts in one process, connected through callbacks instead of stdin/stdout
+    static struct test_buffer tb;
+    cr_assert_eq(WEXITSTATUS(system("rm -rf /tmp/transplant_lib_out && mkdir -p /tmp/transplant_lib_out && "
+                                    "bin/transplant -s -p rsrc/testdir > /tmp/transplant_lib_cli")), 0);
+
+    struct transplant_ctx *out = transplant_new();
+    struct transplant_ctx *in = transplant_new();
+    cr_assert(out && in, "transplant_new() failed");
+    cr_assert_eq(transplant_set_path(out, "rsrc/testdir"), 0);
+    transplant_set_sink(out, test_buffer_write, &tb);
+    cr_assert_eq(transplant_serialize(out), 0, "transplant_serialize() failed");
+
+    cr_assert_eq(transplant_set_path(in, "/tmp/transplant_lib_out"), 0);
+    transplant_set_options(in, TRANSPLANT_DESERIALIZE | TRANSPLANT_CLOBBER);
+    transplant_set_source(in, test_buffer_read, &tb);
+    cr_assert_eq(transplant_deserialize(in), 0, "transplant_deserialize() failed");
+    transplant_free(out);
+    transplant_free(in);
+
+    FILE *f = fopen("/tmp/transplant_lib_buf", "w");
+    fwrite(tb.data, 1, tb.length, f);
+    fclose(f);
+    int return_code = WEXITSTATUS(system("cmp /tmp/transplant_lib_cli /tmp/transplant_lib_buf && "
+                                         "diff -r rsrc/testdir /tmp/transplant_lib_out"));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Library round trip differs from the command line program (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, library_memory_test) {
+    // serialize into an arena and deserialize from it in place, twice with the same buffer
+    cr_assert_eq(WEXITSTATUS(system("rm -rf /tmp/transplant_mem_out && mkdir -p /tmp/transplant_mem_out")), 0);
+    struct transplant_buffer *buffer = transplant_buffer_new();
+    cr_assert(buffer, "transplant_buffer_new() failed");
+    for (int round = 0; round < 2; round++) {
+        transplant_buffer_reset(buffer);
+        struct transplant_ctx *out = transplant_new();
+        cr_assert_eq(transplant_set_path(out, "rsrc/testdir"), 0);
+        transplant_set_memory_sink(out, buffer);
+        cr_assert_eq(transplant_serialize(out), 0, "transplant_serialize() failed");
+        transplant_free(out);
+
+        struct transplant_ctx *in = transplant_new();
+        cr_assert_eq(transplant_set_path(in, "/tmp/transplant_mem_out"), 0);
+        transplant_set_options(in, TRANSPLANT_DESERIALIZE | TRANSPLANT_CLOBBER);
+        transplant_set_memory_source(in, transplant_buffer_data(buffer), transplant_buffer_length(buffer));
+        cr_assert_eq(transplant_deserialize(in), 0, "transplant_deserialize() failed");
+        transplant_free(in);
+    }
+    transplant_buffer_free(buffer);
+
+    int return_code = WEXITSTATUS(system("diff -r rsrc/testdir /tmp/transplant_mem_out"));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Tree restored from memory differs from the original (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, pipeline_system_test) {
+    // the input thread must hand over everything, and let go of an input that stays open
+    char *cmd = "rm -rf /tmp/transplant_pipe_out && mkdir -p /tmp/transplant_pipe_out && "
+                "bin/transplant -s -p rsrc/testdir > /tmp/transplant_pipe_bin && "
+                "(cat /tmp/transplant_pipe_bin; sleep 3) | "
+                "timeout 2 bin/transplant -d -p /tmp/transplant_pipe_out --pipeline && "
+                "diff -r rsrc/testdir /tmp/transplant_pipe_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Pipelined deserialization failed or did not finish (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, pipeline_stop_system_test) {
+    // a restore that fails early must end while the input thread waits for room in a small ring
+    char *cmd = "rm -rf /tmp/transplant_pipe_big /tmp/transplant_pipe_dst && "
+                "mkdir -p /tmp/transplant_pipe_big/dir /tmp/transplant_pipe_dst/dir && "
+                "head -c 20000000 /dev/zero > /tmp/transplant_pipe_big/dir/big && "
+                "bin/transplant -s -p /tmp/transplant_pipe_big > /tmp/transplant_pipe_big_bin && "
+                "{ timeout 10 bin/transplant -d -p /tmp/transplant_pipe_dst --pipeline-mem 512K "
+                "< /tmp/transplant_pipe_big_bin 2> /dev/null; test $? -eq 1; } && "
+                "{ cat /tmp/transplant_pipe_big_bin | timeout 10 bin/transplant -d -p /tmp/transplant_pipe_dst --pipeline-mem 1M "
+                "2> /dev/null; test $? -eq 1; }";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A failed pipelined deserialization did not exit, or did not fail (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, pipeline_output_system_test) {
+    // the output thread must not change the stream, even with the smallest ring
+    char *cmd = "bin/transplant -s -p rsrc/testdir > /tmp/transplant_pipe_plain && "
+                "bin/transplant -s -p rsrc/testdir --pipeline-mem 1K > /tmp/transplant_pipe_threaded && "
+                "cmp /tmp/transplant_pipe_plain /tmp/transplant_pipe_threaded";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Output of --pipeline-mem differs from the plain output (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, copy_system_test) {
+    // copy mode must give the same tree as a serialize | deserialize pipe
+    char *cmd = "rm -rf /tmp/transplant_copy_in /tmp/transplant_copy_out /tmp/transplant_copy_piped && "
+                "cp -r rsrc/testdir /tmp/transplant_copy_in && ln -s dir/hello1 /tmp/transplant_copy_in/link && "
+                "echo read-only > /tmp/transplant_copy_in/dir/readonly && chmod 444 /tmp/transplant_copy_in/dir/readonly && "
+                "mkdir -p /tmp/transplant_copy_piped && "
+                "bin/transplant -s -p /tmp/transplant_copy_in | bin/transplant -d -p /tmp/transplant_copy_piped && "
+                "bin/transplant -s -d -p /tmp/transplant_copy_in -p /tmp/transplant_copy_out && "
+                "diff -r --no-dereference /tmp/transplant_copy_piped /tmp/transplant_copy_out && "
+                "! bin/transplant -s -d -p /tmp/transplant_copy_in -p /tmp/transplant_copy_out 2>/dev/null && "
+                "bin/transplant -s -d -c -p /tmp/transplant_copy_in -p /tmp/transplant_copy_out && "
+                "test \"$(stat -c %a /tmp/transplant_copy_out/dir/readonly)\" = 444 && "
+                "! bin/transplant -s -d -p /tmp/transplant_copy_in -p /tmp/transplant_copy_out -c --drop-cache 2>/dev/null";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Copy mode did not reproduce the tree, ignored clobber or took an option it ignores (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, chunked_system_test) {
+    // chunked contents must restore the same tree, also over a read-only file with -c, and a damaged
+    // chunk must be refused, leaving the old file in place with per-file durability
+    char *cmd = "rm -rf /tmp/transplant_chunk_in /tmp/transplant_chunk_out /tmp/transplant_chunk_bad && "
+                "mkdir -p /tmp/transplant_chunk_in /tmp/transplant_chunk_out /tmp/transplant_chunk_bad && "
+                "head -c 10000 /dev/urandom > /tmp/transplant_chunk_in/data && chmod 444 /tmp/transplant_chunk_in/data && "
+                "bin/transplant -s -p /tmp/transplant_chunk_in --chunk-size 4K > /tmp/transplant_chunk_bin && "
+                "bin/transplant -d -p /tmp/transplant_chunk_out < /tmp/transplant_chunk_bin && "
+                "! bin/transplant -d -p /tmp/transplant_chunk_out < /tmp/transplant_chunk_bin 2>/dev/null && "
+                "bin/transplant -d -c -p /tmp/transplant_chunk_out < /tmp/transplant_chunk_bin && "
+                "diff -r /tmp/transplant_chunk_in /tmp/transplant_chunk_out && "
+                "test \"$(stat -c %a /tmp/transplant_chunk_out/data)\" = 444 && "
+                "printf '\\377' | dd of=/tmp/transplant_chunk_bin bs=1 seek=200 conv=notrunc 2>/dev/null && "
+                "! bin/transplant -d -p /tmp/transplant_chunk_bad < /tmp/transplant_chunk_bin 2>/dev/null && "
+                "! bin/transplant -d -c -p /tmp/transplant_chunk_out --durability per-file < /tmp/transplant_chunk_bin 2>/dev/null && "
+                "diff -r /tmp/transplant_chunk_in /tmp/transplant_chunk_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Chunked contents were not restored or a damaged chunk was accepted (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, delta_system_test) {
+    // a delta against the signature of the old tree must rebuild the new tree and be far smaller,
+    // without touching an entry that happens to be named like a temporary file
+    char *cmd = "rm -rf /tmp/transplant_delta_old /tmp/transplant_delta_new /tmp/transplant_delta_out && "
+                "mkdir -p /tmp/transplant_delta_old && "
+                "head -c 2000000 /dev/urandom > /tmp/transplant_delta_old/image && "
+                "bin/transplant -s -p /tmp/transplant_delta_old --signature > /tmp/transplant_delta_sig && "
+                "cp -a /tmp/transplant_delta_old /tmp/transplant_delta_new && "
+                "cp -a /tmp/transplant_delta_old /tmp/transplant_delta_out && "
+                "printf 'changed' | dd of=/tmp/transplant_delta_new/image bs=1 seek=777777 conv=notrunc 2>/dev/null && "
+                "echo appended >> /tmp/transplant_delta_new/image && "
+                "bin/transplant -s -p /tmp/transplant_delta_new --delta /tmp/transplant_delta_sig > /tmp/transplant_delta_bin && "
+                "test $(stat -c %s /tmp/transplant_delta_bin) -lt 100000 && "
+                "echo decoy > /tmp/transplant_delta_out/image.transplant-delta && "
+                "bin/transplant -d -c -p /tmp/transplant_delta_out < /tmp/transplant_delta_bin && "
+                "diff -r -x image.transplant-delta /tmp/transplant_delta_new /tmp/transplant_delta_out && "
+                "test \"$(cat /tmp/transplant_delta_out/image.transplant-delta)\" = decoy";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Delta was not small or did not rebuild the new tree (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, watch_system_test) {
+    // changes made after the first transmission must reach the replica, removals and renames included
+    char *cmd = "rm -rf /tmp/transplant_watch_in /tmp/transplant_watch_out && "
+                "mkdir -p /tmp/transplant_watch_in/d /tmp/transplant_watch_out && "
+                "echo a > /tmp/transplant_watch_in/a && echo b > /tmp/transplant_watch_in/d/b && "
+                "{ { bin/transplant -s --watch --debounce 20 -p /tmp/transplant_watch_in & echo $! > /tmp/transplant_watch_pid; wait; } | "
+                "bin/transplant -d --watch -p /tmp/transplant_watch_out & } && "
+                "sleep 0.5 && echo more >> /tmp/transplant_watch_in/a && rm -r /tmp/transplant_watch_in/d && "
+                "mkdir /tmp/transplant_watch_in/e && echo c > /tmp/transplant_watch_in/e/c && "
+                "mv /tmp/transplant_watch_in/a /tmp/transplant_watch_in/e/a && sleep 0.5; "
+                "diff -r /tmp/transplant_watch_in /tmp/transplant_watch_out; status=$?; "
+                "kill -INT $(cat /tmp/transplant_watch_pid); wait; exit $status";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Changes were not replicated by --watch (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, watch_clobber_system_test) {
+    // a change set on its own renames and removes existing entries only with -c
+    char *cmd = "rm -rf /tmp/transplant_watch_in /tmp/transplant_watch_out && "
+                "mkdir -p /tmp/transplant_watch_in/d /tmp/transplant_watch_in/g /tmp/transplant_watch_out && "
+                "echo a > /tmp/transplant_watch_in/d/a && echo b > /tmp/transplant_watch_in/g/b && "
+                "bin/transplant -s -p /tmp/transplant_watch_in > /tmp/transplant_watch_first && "
+                "bin/transplant -d -p /tmp/transplant_watch_out < /tmp/transplant_watch_first && "
+                "{ bin/transplant -s --watch --debounce 20 -p /tmp/transplant_watch_in > /tmp/transplant_watch_stream & } && "
+                "sleep 0.5 && mv /tmp/transplant_watch_in/d /tmp/transplant_watch_in/e && rm -r /tmp/transplant_watch_in/g && "
+                "sleep 0.5 && kill -INT $! && wait && "
+                "tail -c +$(($(wc -c < /tmp/transplant_watch_first) + 1)) /tmp/transplant_watch_stream > /tmp/transplant_watch_change && "
+                "! bin/transplant -d -p /tmp/transplant_watch_out < /tmp/transplant_watch_change 2> /dev/null && "
+                "test -f /tmp/transplant_watch_out/d/a && test -f /tmp/transplant_watch_out/g/b && "
+                "bin/transplant -d -c -p /tmp/transplant_watch_out < /tmp/transplant_watch_change && "
+                "diff -r /tmp/transplant_watch_in /tmp/transplant_watch_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A change set renamed or removed entries without -c, or not with it (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, files_from_system_test) {
+    // only the listed entries are sent, and a listed entry that is gone is removed
+    char *cmd = "rm -rf /tmp/transplant_list_in /tmp/transplant_list_out && "
+                "mkdir -p /tmp/transplant_list_in/a/b /tmp/transplant_list_in/c /tmp/transplant_list_out && "
+                "echo 1 > /tmp/transplant_list_in/a/b/f && echo 2 > /tmp/transplant_list_in/c/g && "
+                "bin/transplant -s -p /tmp/transplant_list_in | bin/transplant -d -p /tmp/transplant_list_out && "
+                "echo 3 > /tmp/transplant_list_in/a/b/f && rm /tmp/transplant_list_in/c/g && "
+                "echo 4 > /tmp/transplant_list_in/c/h && echo 5 > /tmp/transplant_list_in/unlisted && "
+                "printf './a/b/f\\0c/g\\0c/h\\0' > /tmp/transplant_list && "
+                "bin/transplant -s -p /tmp/transplant_list_in --files-from /tmp/transplant_list | "
+                "bin/transplant -d -c -p /tmp/transplant_list_out && "
+                "rm /tmp/transplant_list_in/unlisted && diff -r /tmp/transplant_list_in /tmp/transplant_list_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The listed entries were not replicated exactly (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, files_from_clobber_system_test) {
+    // a listed name that does not exist removes an existing directory only with -c
+    char *cmd = "rm -rf /tmp/transplant_list_in /tmp/transplant_list_out && "
+                "mkdir -p /tmp/transplant_list_in /tmp/transplant_list_out/victim/sub && "
+                "echo keep > /tmp/transplant_list_out/victim/sub/f && "
+                "printf 'victim\\0' > /tmp/transplant_list && "
+                "bin/transplant -s -p /tmp/transplant_list_in --files-from /tmp/transplant_list > /tmp/transplant_list_bin && "
+                "! bin/transplant -d -p /tmp/transplant_list_out < /tmp/transplant_list_bin 2> /dev/null && "
+                "test \"$(cat /tmp/transplant_list_out/victim/sub/f)\" = keep && "
+                "bin/transplant -d -c -p /tmp/transplant_list_out < /tmp/transplant_list_bin && "
+                "test ! -e /tmp/transplant_list_out/victim";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A REMOVE record was applied without -c, or not with it (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, fanout_system_test) {
+    // one stream restored into three targets, the last two cloned from the first, and again over them
+    // with -c, read-only files included
+    char *cmd = "rm -rf /tmp/transplant_fan_in /tmp/transplant_fan1 /tmp/transplant_fan2 /tmp/transplant_fan3 && "
+                "mkdir /tmp/transplant_fan1 /tmp/transplant_fan2 /tmp/transplant_fan3 && "
+                "cp -r rsrc/testdir /tmp/transplant_fan_in && "
+                "echo read-only > /tmp/transplant_fan_in/dir/readonly && chmod 444 /tmp/transplant_fan_in/dir/readonly && "
+                "bin/transplant -s -p /tmp/transplant_fan_in > /tmp/transplant_fan_bin && "
+                "bin/transplant -d -p /tmp/transplant_fan1 -p /tmp/transplant_fan2 -p /tmp/transplant_fan3 < /tmp/transplant_fan_bin && "
+                "bin/transplant -d -c -p /tmp/transplant_fan1 -p /tmp/transplant_fan2 -p /tmp/transplant_fan3 < /tmp/transplant_fan_bin && "
+                "diff -r /tmp/transplant_fan_in /tmp/transplant_fan1 && diff -r /tmp/transplant_fan_in /tmp/transplant_fan2 && "
+                "diff -r /tmp/transplant_fan_in /tmp/transplant_fan3 && "
+                "test \"$(stat -c %a /tmp/transplant_fan3/dir/readonly)\" = 444";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The tree was not restored into every target (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, deserialize_syscall_test) {
+    // a fresh restore of small files costs open, write and close per file and one mkdir per directory
+    int dirs = 4, files_per_dir = 25;
+    cr_assert_eq(WEXITSTATUS(system("rm -rf /tmp/transplant_sys_in /tmp/transplant_sys_out && "
+                                    "mkdir -p /tmp/transplant_sys_in /tmp/transplant_sys_out && cd /tmp/transplant_sys_in && "
+                                    "for d in 1 2 3 4; do mkdir d$d; for f in $(seq 25); do "
+                                    "echo $d $f > d$d/f$f; chmod 644 d$d/f$f; done; done")), 0);
+    struct transplant_buffer *buffer = transplant_buffer_new();
+    struct transplant_ctx *out = transplant_new();
+    cr_assert_eq(transplant_set_path(out, "/tmp/transplant_sys_in"), 0);
+    transplant_set_memory_sink(out, buffer);
+    cr_assert_eq(transplant_serialize(out), 0, "transplant_serialize() failed");
+    transplant_free(out);
+
+    struct transplant_ctx *in = transplant_new();
+    cr_assert_eq(transplant_set_path(in, "/tmp/transplant_sys_out"), 0);
+    transplant_set_options(in, TRANSPLANT_DESERIALIZE);
+    transplant_set_memory_source(in, transplant_buffer_data(buffer), transplant_buffer_length(buffer));
+    pid_t child = fork();
+    if (child == 0) {
+        umask(022);
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP); // counting starts here
+        _exit(transplant_deserialize(in) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status, stops = 0;
+    waitpid(child, &status, 0);
+    while (ptrace(PTRACE_SYSCALL, child, NULL, NULL) == 0 && waitpid(child, &status, 0) == child && !WIFEXITED(status)) {
+        stops++; // one stop on entry to each system call and one on exit
+    }
+    transplant_free(in);
+    transplant_buffer_free(buffer);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "transplant_deserialize() failed");
+    cr_assert_eq(WEXITSTATUS(system("diff -r /tmp/transplant_sys_in /tmp/transplant_sys_out")), 0,
+                 "Restored tree differs from the original");
+
+    int syscalls = (stops + 1) / 2, budget = 3 * dirs * files_per_dir + dirs + 32;
+    cr_assert(syscalls <= budget, "Restore of %d files took %d system calls, more than %d",
+              dirs * files_per_dir, syscalls, budget);
+}
+
+Test(basecode_tests_suite, times_system_test) {
+    // --times restores modification times, and read-only directories get their permissions after their entries
+    char *cmd = "chmod -R u+w /tmp/transplant_times_in /tmp/transplant_times_out 2> /dev/null; "
+                "rm -rf /tmp/transplant_times_in /tmp/transplant_times_out && "
+                "mkdir -p /tmp/transplant_times_in/ro/sub /tmp/transplant_times_out && cd /tmp/transplant_times_in && "
+                "echo a > ro/f && echo b > ro/sub/g && ln -s ro/f link && chmod 444 ro/f && "
+                "touch -d '2001-02-03 04:05:06.123456789' ro/f ro/sub/g && touch -h -d '1999-01-01' link && "
+                "chmod 555 ro/sub ro && touch -d '2002-01-01' ro/sub ro && cd - > /dev/null && "
+                "bin/transplant -s -p /tmp/transplant_times_in --times | bin/transplant -d -p /tmp/transplant_times_out && "
+                "cd /tmp/transplant_times_in && find . -mindepth 1 -printf '%p %m %T@\\n' | sort > /tmp/transplant_times_a && "
+                "cd /tmp/transplant_times_out && find . -mindepth 1 -printf '%p %m %T@\\n' | sort > /tmp/transplant_times_b && "
+                "cmp /tmp/transplant_times_a /tmp/transplant_times_b";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Times or permissions were not restored (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, skip_unchanged_system_test) {
+    // --skip-unchanged leaves a file of the same size and time alone; --verify then rewrites it if it differs
+    char *cmd = "rm -rf /tmp/transplant_skip_in /tmp/transplant_skip_out && "
+                "mkdir -p /tmp/transplant_skip_in/d /tmp/transplant_skip_out && cd /tmp/transplant_skip_in && "
+                "head -c 300000 /dev/urandom > d/f && echo same > g && echo longer > h && cd - > /dev/null && "
+                "bin/transplant -s -p /tmp/transplant_skip_in --times > /tmp/transplant_skip.bin && "
+                "bin/transplant -d -p /tmp/transplant_skip_out < /tmp/transplant_skip.bin && "
+                "cd /tmp/transplant_skip_out && echo SAME > g && touch -r /tmp/transplant_skip_in/g g && "
+                "echo short > h && printf X | dd of=d/f bs=1 seek=200000 conv=notrunc 2> /dev/null && "
+                "touch -r /tmp/transplant_skip_in/d/f d/f && cd - > /dev/null && "
+                "bin/transplant -d -c --skip-unchanged -p /tmp/transplant_skip_out < /tmp/transplant_skip.bin && "
+                "grep -q SAME /tmp/transplant_skip_out/g && cmp -s /tmp/transplant_skip_in/h /tmp/transplant_skip_out/h && "
+                "! cmp -s /tmp/transplant_skip_in/d/f /tmp/transplant_skip_out/d/f && "
+                "cat /tmp/transplant_skip.bin | bin/transplant -d -c --skip-unchanged --verify -p /tmp/transplant_skip_out && "
+                "diff -r /tmp/transplant_skip_in /tmp/transplant_skip_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Unchanged files were rewritten or changed ones were not (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, durability_system_test) {
+    // every durability mode restores the same tree; per-file leaves no temporary files, even when it fails,
+    // and leaves the old files in place when a metadata-first transmission is cut short
+    char *cmd = "rm -rf /tmp/transplant_durable_in /tmp/transplant_durable_out && "
+                "mkdir -p /tmp/transplant_durable_in/d /tmp/transplant_durable_out/batched /tmp/transplant_durable_out/per-file && "
+                "cd /tmp/transplant_durable_in && echo a > d/a && head -c 300000 /dev/urandom > d/b && chmod 600 d/a && "
+                "ln -s d/a link && cd - > /dev/null && "
+                "bin/transplant -s -p /tmp/transplant_durable_in > /tmp/transplant_durable.bin && "
+                "bin/transplant -d --durability batched -p /tmp/transplant_durable_out/batched < /tmp/transplant_durable.bin && "
+                "bin/transplant -d --durability per-file -p /tmp/transplant_durable_out/per-file < /tmp/transplant_durable.bin && "
+                "diff -r /tmp/transplant_durable_in /tmp/transplant_durable_out/batched && "
+                "diff -r /tmp/transplant_durable_in /tmp/transplant_durable_out/per-file && "
+                "echo old > /tmp/transplant_durable_out/per-file/d/a && "
+                "! bin/transplant -d --durability per-file -p /tmp/transplant_durable_out/per-file < /tmp/transplant_durable.bin 2> /dev/null && "
+                "grep -q old /tmp/transplant_durable_out/per-file/d/a && "
+                "bin/transplant -d -c --durability per-file -p /tmp/transplant_durable_out/per-file < /tmp/transplant_durable.bin && "
+                "diff -r /tmp/transplant_durable_in /tmp/transplant_durable_out/per-file && "
+                "bin/transplant -s -p /tmp/transplant_durable_in --metadata-first | head -c 200000 > /tmp/transplant_durable_cut.bin && "
+                "! bin/transplant -d -c --durability per-file -p /tmp/transplant_durable_out/per-file < /tmp/transplant_durable_cut.bin 2> /dev/null && "
+                "diff -r /tmp/transplant_durable_in /tmp/transplant_durable_out/per-file && "
+                "test -z \"$(find /tmp/transplant_durable_out -name '.transplant-*')\"";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A durability mode did not restore the tree as expected (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, journal_resume_system_test) {
+    // a restore cut short resumes from its journal: the files it wrote before the checkpoint are not written again
+    char *cmd = "rm -rf /tmp/transplant_journal_in /tmp/transplant_journal_out /tmp/transplant_journal* && "
+                "mkdir -p /tmp/transplant_journal_in/a /tmp/transplant_journal_in/b /tmp/transplant_journal_out && "
+                "cd /tmp/transplant_journal_in && for f in a/1 a/2 b/3 b/4; do head -c 100000 /dev/urandom > $f; done && "
+                "bin_dir=$OLDPWD/bin && $bin_dir/transplant -s -p . > /tmp/transplant_journal.bin && "
+                "head -c 250000 /tmp/transplant_journal.bin | $bin_dir/transplant -d -p /tmp/transplant_journal_out "
+                "--journal /tmp/transplant_journal --journal-interval 0 2> /dev/null; "
+                "test -s /tmp/transplant_journal && for f in a/1 a/2 b/3 b/4; do "
+                "cmp -s $f /tmp/transplant_journal_out/$f && echo resumed >> /tmp/transplant_journal_out/$f && echo $f; "
+                "done > /tmp/transplant_journal_done && test -s /tmp/transplant_journal_done && "
+                "$bin_dir/transplant -d -p /tmp/transplant_journal_out --journal /tmp/transplant_journal < /tmp/transplant_journal.bin && "
+                "test ! -e /tmp/transplant_journal && for f in a/1 a/2 b/3 b/4; do "
+                "if grep -qx $f /tmp/transplant_journal_done; then tail -n 1 /tmp/transplant_journal_out/$f | grep -q resumed; "
+                "else cmp $f /tmp/transplant_journal_out/$f; fi || exit 1; done";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The restore was not resumed from its journal (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, shard_system_test) {
+    // the shards are complete transmissions that restore the whole tree when applied concurrently
+    char *cmd = "rm -rf /tmp/transplant_shard_in /tmp/transplant_shard_out /tmp/transplant_shard.* && "
+                "mkdir -p /tmp/transplant_shard_in/big/x /tmp/transplant_shard_in/big/y /tmp/transplant_shard_out && "
+                "cp -r rsrc/testdir /tmp/transplant_shard_in/small && "
+                "head -c 300000 /dev/urandom > /tmp/transplant_shard_in/big/x/a && "
+                "head -c 200000 /dev/urandom > /tmp/transplant_shard_in/big/y/b && "
+                "head -c 100000 /dev/urandom > /tmp/transplant_shard_in/big/c && "
+                "bin/transplant -s -p /tmp/transplant_shard_in --shard /tmp/transplant_shard.0 "
+                "--shard /tmp/transplant_shard.1 --shard /tmp/transplant_shard.2 > /tmp/transplant_shard.stdout && "
+                "test ! -s /tmp/transplant_shard.stdout && test -s /tmp/transplant_shard.0 && "
+                "test -s /tmp/transplant_shard.1 && test -s /tmp/transplant_shard.2 && "
+                "for i in 0 1 2; do bin/transplant -d -c -p /tmp/transplant_shard_out < /tmp/transplant_shard.$i & done; "
+                "wait && diff -r /tmp/transplant_shard_in /tmp/transplant_shard_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The shards did not restore the tree (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, shm_system_test) {
+    // the tree goes through a ring in shared memory smaller than the file, whichever side starts first
+    char *cmd = "rm -rf /tmp/transplant_shm_in /tmp/transplant_shm_out /tmp/transplant_shm.sock && "
+                "mkdir -p /tmp/transplant_shm_in /tmp/transplant_shm_out/a /tmp/transplant_shm_out/b && "
+                "cp -r rsrc/testdir /tmp/transplant_shm_in/small && "
+                "head -c 1000000 /dev/urandom > /tmp/transplant_shm_in/big && "
+                "{ bin/transplant -d -p /tmp/transplant_shm_out/a --shm /tmp/transplant_shm.sock --shm-size 64K & "
+                "bin/transplant -s -p /tmp/transplant_shm_in --shm /tmp/transplant_shm.sock && wait $!; } && "
+                "{ bin/transplant -s -p /tmp/transplant_shm_in --pipeline --shm /tmp/transplant_shm.sock & "
+                "sleep 0.2 && bin/transplant -d -p /tmp/transplant_shm_out/b --shm /tmp/transplant_shm.sock && wait $!; } && "
+                "diff -r /tmp/transplant_shm_in /tmp/transplant_shm_out/a && diff -r /tmp/transplant_shm_in /tmp/transplant_shm_out/b";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The tree did not go through the shared-memory ring intact (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, metadata_first_system_test) {
+    // every entry comes before the contents of any file, and the tree restored from it is the same
+    char *cmd = "rm -rf /tmp/transplant_mf_in /tmp/transplant_mf_out && "
+                "mkdir -p /tmp/transplant_mf_in /tmp/transplant_mf_out && "
+                "cp -r rsrc/testdir /tmp/transplant_mf_in/small && "
+                "head -c 300000 /dev/urandom > /tmp/transplant_mf_in/big && mkdir /tmp/transplant_mf_in/empty && "
+                "bin/transplant -s -p /tmp/transplant_mf_in --metadata-first --times -j 2 | "
+                "bin/transplant -d -p /tmp/transplant_mf_out && "
+                "diff -r /tmp/transplant_mf_in /tmp/transplant_mf_out && "
+                "test $(stat -c %Y /tmp/transplant_mf_in/small) = $(stat -c %Y /tmp/transplant_mf_out/small)";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The tree was not restored intact from the metadata-first layout (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, compact_format_system_test) {
+    // version 2 restores the same tree, in chunks too, and is smaller than version 1
+    char *cmd = "rm -rf /tmp/transplant_v2_in /tmp/transplant_v2_out /tmp/transplant_v2_chunks && "
+                "mkdir -p /tmp/transplant_v2_in /tmp/transplant_v2_out /tmp/transplant_v2_chunks && "
+                "cp -r rsrc/testdir /tmp/transplant_v2_in/small && "
+                "head -c 300000 /dev/urandom > /tmp/transplant_v2_in/big && "
+                "bin/transplant -s -p /tmp/transplant_v2_in --format 2 | bin/transplant -d -p /tmp/transplant_v2_out && "
+                "diff -r /tmp/transplant_v2_in /tmp/transplant_v2_out && "
+                "bin/transplant -s -p /tmp/transplant_v2_in --format 2 --chunk-size 65536 | "
+                "bin/transplant -d -p /tmp/transplant_v2_chunks && "
+                "diff -r /tmp/transplant_v2_in /tmp/transplant_v2_chunks && "
+                "test $(bin/transplant -s -p rsrc/testdir --format 2 | wc -c) -lt $(bin/transplant -s -p rsrc/testdir | wc -c)";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The tree was not restored intact from version 2 of the format, or it was not smaller (exit %d)",
+		 return_code);
+}
+
+Test(basecode_tests_suite, salvage_system_test) {
+    // junk in the middle of the input stops a restore, but not one with --salvage
+    char *cmd = "rm -rf /tmp/transplant_sv_in /tmp/transplant_sv_out /tmp/transplant_sv_fail /tmp/transplant_sv_bad && "
+                "mkdir -p /tmp/transplant_sv_in /tmp/transplant_sv_out /tmp/transplant_sv_fail && "
+                "cp -r rsrc/testdir /tmp/transplant_sv_in/small && "
+                "head -c 300000 /dev/urandom > /tmp/transplant_sv_in/big && "
+                "bin/transplant -s -p /tmp/transplant_sv_in > /tmp/transplant_sv_good && "
+                "head -c 32 /tmp/transplant_sv_good > /tmp/transplant_sv_bad && "
+                "head -c 100000 /dev/urandom >> /tmp/transplant_sv_bad && "
+                "tail -c +33 /tmp/transplant_sv_good >> /tmp/transplant_sv_bad && "
+                "! bin/transplant -d -p /tmp/transplant_sv_fail < /tmp/transplant_sv_bad 2> /dev/null && "
+                "bin/transplant -d -p /tmp/transplant_sv_out --salvage < /tmp/transplant_sv_bad 2> /dev/null && "
+                "diff -r /tmp/transplant_sv_in /tmp/transplant_sv_out";
+
+    int return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The tree was not restored past the damaged part of the input with --salvage (exit %d)",
+		 return_code);
+
+    // the first of two large payloads cut short runs into the second file, which is still restored from a file or a pipe
+    cmd = "rm -rf /tmp/transplant_sv_in /tmp/transplant_sv_out /tmp/transplant_sv_pipe /tmp/transplant_sv_pipeline && "
+          "mkdir -p /tmp/transplant_sv_in /tmp/transplant_sv_out /tmp/transplant_sv_pipe /tmp/transplant_sv_pipeline && "
+          "head -c 200000 /dev/urandom > /tmp/transplant_sv_in/one && "
+          "head -c 200000 /dev/urandom > /tmp/transplant_sv_in/two && "
+          "bin/transplant -s -p /tmp/transplant_sv_in > /tmp/transplant_sv_good && "
+          "head -c 100000 /tmp/transplant_sv_good > /tmp/transplant_sv_bad && "
+          "tail -c +101001 /tmp/transplant_sv_good >> /tmp/transplant_sv_bad && "
+          "bin/transplant -d -p /tmp/transplant_sv_out --salvage < /tmp/transplant_sv_bad 2> /tmp/transplant_sv_err && "
+          "grep -q 'leaving 1 entries damaged' /tmp/transplant_sv_err && "
+          "cat /tmp/transplant_sv_bad | bin/transplant -d -p /tmp/transplant_sv_pipe --salvage 2> /dev/null && "
+          "cat /tmp/transplant_sv_bad | bin/transplant -d -p /tmp/transplant_sv_pipeline --salvage --pipeline 2> /dev/null && "
+          "for out in out pipe pipeline; do "
+          "cmp -s /tmp/transplant_sv_in/one /tmp/transplant_sv_$out/one || cmp -s /tmp/transplant_sv_in/two /tmp/transplant_sv_$out/two || exit 1; "
+          "done";
+
+    return_code = WEXITSTATUS(system(cmd));
+
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The file after a large payload cut short was not restored with --salvage (exit %d)",
+		 return_code);
+}